@@ -0,0 +1,118 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// libfive
+#include <libfive/tree/tree.hpp>
+#include <libfive/tree/archive.hpp>
+
+#include "tape.hpp"
+#include "context.hpp"
+
+#include "stats.hpp"
+
+int main(int argc, char **argv)
+{
+    // Usage:
+    //  affine_tiles [--size N] [--dim 2|3] [model.frep...]
+    //
+    // Renders each model (or a pair of spheres) with a range of
+    // Context::affine_stages masks, from plain intervals (0) to affine
+    // arithmetic in every interval stage.  For each mask, prints the mean
+    // and standard deviation of the frame time, followed by the number of
+    // tiles in each stage of the last frame; the last count is the number
+    // of ambiguous tiles that need per-voxel (or per-pixel) evaluation.
+    int size = 1024;
+    int dim = 3;
+    std::vector<std::string> paths;
+    for (int i=1; i < argc; ++i) {
+        const std::string arg(argv[i]);
+        const bool has_value = i + 1 < argc;
+        if (arg == "--size" && has_value) {
+            size = std::stoi(argv[++i]);
+        } else if (arg == "--dim" && has_value) {
+            dim = std::stoi(argv[++i]);
+            if (dim != 2 && dim != 3) {
+                fprintf(stderr, "--dim must be 2 or 3\n");
+                exit(1);
+            }
+        } else if (arg.compare(0, 2, "--") == 0) {
+            fprintf(stderr, "Unknown option %s\n", arg.c_str());
+            exit(1);
+        } else {
+            paths.push_back(arg);
+        }
+    }
+
+    std::vector<std::pair<std::string, libfive::Tree>> models;
+    for (auto& p : paths) {
+        std::ifstream ifs;
+        ifs.open(p);
+        if (!ifs.is_open()) {
+            fprintf(stderr, "Could not open file %s\n", p.c_str());
+            exit(1);
+        }
+        auto a = libfive::Archive::deserialize(ifs);
+        models.push_back({p, a.shapes.front().tree});
+    }
+    if (models.empty()) {
+        auto X = libfive::Tree::X();
+        auto Y = libfive::Tree::Y();
+        auto Z = libfive::Tree::Z();
+        models.push_back({"spheres",
+            min(sqrt((X + 0.5)*(X + 0.5) + Y*Y + Z*Z) - 0.25,
+                sqrt((X - 0.5)*(X - 0.5) + Y*Y + Z*Z) - 0.25)});
+    }
+
+    // In 2D, the interval stages are 0 and 2
+    const std::vector<uint32_t> masks = (dim == 3)
+        ? std::vector<uint32_t>{0, 1, 2, 4, 6, 7}
+        : std::vector<uint32_t>{0, 1, 4, 5};
+
+    Eigen::Matrix4f T = Eigen::Matrix4f::Identity();
+    T(3,2) = 0.3f;
+    const Eigen::Matrix3f T2 = Eigen::Matrix3f::Identity();
+
+    for (auto& m : models) {
+        auto tape = mpr::Tape(m.second);
+        auto c = mpr::Context(size);
+        auto f = [&]() {
+            if (dim == 2) {
+                c.render2D(tape, T2);
+            } else {
+                c.render3D(tape, T);
+            }
+        };
+
+        std::cout << m.first << " (" << size << ", " << dim << "D)\n";
+        for (auto mask : masks) {
+            c.affine_stages = mask;
+            c.collect_stats = false;
+            std::cout << "  mask " << mask << ": ";
+            get_stats(f);
+
+            // Run one more frame with stats, so that the timing events don't
+            // affect the timings above
+            c.collect_stats = true;
+            f();
+            const auto s = c.renderStats();
+            std::cout << "    tiles " << s.tile_counts[0] << " "
+                      << s.tile_counts[1] << " " << s.tile_counts[2] << " "
+                      << s.tile_counts[3] << "\n";
+        }
+    }
+    return 0;
+}
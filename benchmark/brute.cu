@@ -153,4 +153,12 @@ int main(int argc, char **argv)
         }
         out->savePNG("out_alg_" + std::to_string(size) + ".png");
     }
+
+    std::cout << "Rendering fancy algorithm with compiled root tape\n";
+    for (int size=256; size <= 4096; size += 64) {
+        auto ctx = mpr::Context(size);
+        ctx.jit = true;
+        std::cout << size << " ";
+        get_stats([&](){ ctx.render2D(tape, Eigen::Matrix3f::Identity()); });
+    }
 }
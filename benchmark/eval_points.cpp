@@ -0,0 +1,117 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+// libfive
+#include <libfive/tree/tree.hpp>
+#include <libfive/tree/archive.hpp>
+
+#include "tape.hpp"
+#include "context.hpp"
+#include "stats.hpp"
+
+int main(int argc, char **argv)
+{
+    // Usage:
+    //  eval_points [--grid N] [--block B] [model.frep]
+    //
+    // Evaluates a model at the N^3 points of a grid filling [-1, 1]^3 (128^3
+    // by default), stored in device memory.  The grid is ordered in 4^3
+    // bricks, so that runs of 64 points are spatially coherent.  Prints the
+    // time for values alone and for values and gradients, first without
+    // pruning, then with clusters of B points (64 by default), along with
+    // the largest difference between the two sets of values.
+    int grid = 128;
+    int block = 64;
+    while (argc >= 2) {
+        const std::string arg(argv[1]);
+        if (arg == "--grid" && argc >= 3) {
+            grid = std::stoi(argv[2]);
+        } else if (arg == "--block" && argc >= 3) {
+            block = std::stoi(argv[2]);
+        } else {
+            break;
+        }
+        argv += 2;
+        argc -= 2;
+    }
+    if (grid % 4 || block < 1) {
+        fprintf(stderr, "--grid must be a multiple of 4, "
+                        "and --block must be positive\n");
+        exit(1);
+    }
+
+    libfive::Tree t = libfive::Tree::X();
+    if (argc == 2) {
+        std::ifstream ifs;
+        ifs.open(argv[1]);
+        if (ifs.is_open()) {
+            auto a = libfive::Archive::deserialize(ifs);
+            t = a.shapes.front().tree;
+        } else {
+            fprintf(stderr, "Could not open file %s\n", argv[1]);
+            exit(1);
+        }
+    } else {
+        auto X = libfive::Tree::X();
+        auto Y = libfive::Tree::Y();
+        auto Z = libfive::Tree::Z();
+        t = min(sqrt((X + 0.5)*(X + 0.5) + Y*Y + Z*Z) - 0.25,
+                sqrt((X - 0.5)*(X - 0.5) + Y*Y + Z*Z) - 0.25);
+    }
+    auto tape = mpr::Tape(t);
+
+    // Points are written in 4^3 bricks, which are themselves in X/Y/Z order
+    const size_t n = size_t(grid) * grid * grid;
+    mpr::Ptr<float3[]> pts(CUDA_MALLOC(float3, n));
+    size_t i = 0;
+    auto coord = [&](int k) { return (k + 0.5f) / grid * 2.0f - 1.0f; };
+    for (int bz=0; bz < grid; bz += 4) {
+        for (int by=0; by < grid; by += 4) {
+            for (int bx=0; bx < grid; bx += 4) {
+                for (int j=0; j < 64; ++j) {
+                    pts[i++] = make_float3(coord(bx + j % 4),
+                                           coord(by + (j / 4) % 4),
+                                           coord(bz + j / 16));
+                }
+            }
+        }
+    }
+    mpr::Ptr<float[]> out(CUDA_MALLOC(float, n));
+    mpr::Ptr<float[]> pruned(CUDA_MALLOC(float, n));
+    mpr::Ptr<float3[]> grad(CUDA_MALLOC(float3, n));
+
+    auto ctx = mpr::Context(256);
+    std::cout << "points " << n << "\n";
+    for (int b : {0, block}) {
+        ctx.point_block_size = b;
+        float* const dst = b ? pruned.get() : out.get();
+        std::cout << "block " << b << " values: ";
+        get_stats([&]() { ctx.evalPoints(tape, pts.get(), n, dst); });
+        std::cout << "block " << b << " gradients: ";
+        get_stats([&]() {
+            ctx.evalPoints(tape, pts.get(), n, dst, grad.get());
+        });
+    }
+
+    float err = 0.0f;
+    for (size_t j=0; j < n; ++j) {
+        err = std::max(err, std::abs(out[j] - pruned[j]));
+    }
+    std::cout << "max difference " << err << "\n";
+    return 0;
+}
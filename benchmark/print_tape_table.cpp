@@ -41,6 +41,20 @@ int main(int argc, char** argv)
     }
     auto r = mpr::Tape(t);
 
+    // Report how many clauses are removed by simplification, and by pruning
+    // against the default [-1, 1] render region, as LaTeX comments
+    {
+        mpr::TapeBuilder builder;
+        builder.simplify = false;
+        const auto raw = builder.build(t);
+        builder.prune = true;
+        builder.simplify = true;
+        const auto pruned = builder.build(t);
+        std::cout << "% clauses: " << raw.length - 2 << " before, "
+                  << r.length - 2 << " simplified, "
+                  << pruned.length - 2 << " pruned to [-1, 1]^3\n";
+    }
+
     for (int i=1; i < r.length - 1; ++i) {
         const auto c = r.data[i];
         std::cout << mpr::gpu_op_str(OP(&c)) << " & "
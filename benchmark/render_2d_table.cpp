@@ -12,6 +12,7 @@ Copyright (C) 2019-2020  Matt Keeter
 #include <cstdio>
 #include <chrono>
 #include <iostream>
+#include <string>
 #include <fstream>
 
 // libfive
@@ -26,6 +27,21 @@ Copyright (C) 2019-2020  Matt Keeter
 
 int main(int argc, char **argv)
 {
+    // Pass --compact to also pack each frame into a one-bit-per-pixel
+    // occupancy mask.  Either way, the time to read the output back to the
+    // host (and its size) is printed to stderr after each size.
+    bool compact = false;
+    while (argc >= 2) {
+        const std::string arg(argv[1]);
+        if (arg == "--compact") {
+            compact = true;
+        } else {
+            break;
+        }
+        argv++;
+        argc--;
+    }
+
     libfive::Tree t = libfive::Tree::X();
     if (argc == 2) {
         std::ifstream ifs;
@@ -50,9 +66,23 @@ int main(int argc, char **argv)
     const std::vector<int> sizes = {256, 512, 1024, 2048, 3072, 4096};
     for (auto size: sizes) {
         auto ctx = mpr::Context(size);
+        ctx.compact_images = compact;
         std::cout << size << " ";
         get_stats([&](){ ctx.render2D(tape, Eigen::Matrix3f::Identity()); });
 
+        const void* image = compact
+            ? static_cast<const void*>(ctx.occupancy.get())
+            : static_cast<const void*>(ctx.stages[3].filled.get());
+        const size_t bytes = compact ? size_t(size) * size / 8
+                                     : sizeof(int32_t) * size * size;
+        mpr::HostPtr<uint8_t[]> host(CUDA_MALLOC_HOST(uint8_t, bytes));
+        const auto readback = get_timing([&]() {
+            CUDA_CHECK(cudaMemcpy(host.get(), image, bytes,
+                                  cudaMemcpyDeviceToHost));
+        });
+        fprintf(stderr, "  readback: %zu bytes, %.3f ms (%.2f GB/s)\n",
+                bytes, readback.mean, bytes / readback.mean / 1e6);
+
         libfive::Heightmap out(size, size);
         uint32_t i = 0;
         for (int x=0; x < size; ++x) {
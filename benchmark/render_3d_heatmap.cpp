@@ -61,7 +61,7 @@ int main(int argc, char **argv)
     T(3,2) = 0.3f;
     auto heatmap = c.render3D_heatmap(tape, T);
 
-    if (*c.tape_index >= NUM_SUBTAPES * SUBTAPE_CHUNK_SIZE) {
+    if (c.subtapeEnd() >= c.tape_capacity()) {
         std::cerr << "Tape overflowed and wasn't pruned" << std::endl;
         exit(1);
     }
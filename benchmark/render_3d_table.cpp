@@ -13,6 +13,7 @@ Copyright (C) 2019-2020  Matt Keeter
 #include <chrono>
 #include <iostream>
 #include <fstream>
+#include <string>
 
 // libfive
 #include <libfive/tree/tree.hpp>
@@ -26,6 +27,67 @@ Copyright (C) 2019-2020  Matt Keeter
 
 int main(int argc, char **argv)
 {
+    // Pass --device-memory to allocate GPU-only buffers with cudaMalloc
+    // instead of managed memory, to compare the two policies.
+    //
+    // Pass --contiguous to write pushed subtapes as contiguous arrays,
+    // rather than as linked lists of chunks.
+    //
+    // Pass --voxel-cache to stage voxel tapes in shared memory.
+    //
+    // Pass --dedupe to share identical pushed subtapes between tiles.
+    //
+    // Pass --orbit to turn the model slightly before every frame, like a
+    // user dragging it around, and --incremental to reuse first-stage
+    // results from earlier frames.  With --incremental, the same frames are
+    // then timed again without the cache (to stderr), and --stats also
+    // compares the first stage with and without it.
+    //
+    // Pass --depth-only to only render the heightmap (without normals), to
+    // compare against a full render.
+    //
+    // Pass --stats to print a per-stage breakdown of GPU time and tile
+    // counts (to stderr) for one more frame at each size.
+    //
+    // Pass --compact to also pack depth into 16 bits per pixel.  Either way,
+    // the time to read the output (depth, plus normals unless --depth-only
+    // or --compact) back to the host is printed to stderr after each size.
+    mpr::MemoryPolicy policy = mpr::MEMORY_MANAGED;
+    bool contiguous = false;
+    int32_t voxel_cache = 0;
+    bool dedupe = false;
+    bool orbit = false;
+    bool incremental = false;
+    bool depth_only = false;
+    bool stats = false;
+    bool compact = false;
+    while (argc >= 2) {
+        const std::string arg(argv[1]);
+        if (arg == "--device-memory") {
+            policy = mpr::MEMORY_DEVICE;
+        } else if (arg == "--contiguous") {
+            contiguous = true;
+        } else if (arg == "--voxel-cache") {
+            voxel_cache = 64;
+        } else if (arg == "--dedupe") {
+            dedupe = true;
+        } else if (arg == "--orbit") {
+            orbit = true;
+        } else if (arg == "--incremental") {
+            incremental = true;
+        } else if (arg == "--depth-only") {
+            depth_only = true;
+        } else if (arg == "--stats") {
+            stats = true;
+        } else if (arg == "--compact") {
+            compact = true;
+        } else {
+            break;
+        }
+        argv++;
+        argc--;
+    }
+
     libfive::Tree t = libfive::Tree::X();
     if (argc == 2) {
         std::ifstream ifs;
@@ -51,17 +113,121 @@ int main(int argc, char **argv)
     const std::vector<int> sizes = {256, 512, 1024, 1536, 2048};
     for (auto size: sizes) {
         auto tape = mpr::Tape(t);
-        auto c = mpr::Context(size);
+        auto c = mpr::Context(size, policy);
+        c.contiguous_subtapes = contiguous;
+        c.voxel_cache_clauses = voxel_cache;
+        c.dedupe_subtapes = dedupe;
+        c.incremental = incremental;
+        c.compact_images = compact;
+        if (depth_only) {
+            c.render_flags = mpr::RENDER_DEPTH;
+        }
 
         std::cout << size << " ";
-        auto mean = get_stats([&](){ c.render3D(tape, T); });
+        Eigen::Matrix4f M = T;
+        float angle = 0.0f;
+        auto frame = [&](){
+            if (orbit) {
+                angle += 0.002f;
+                M = T;
+                M.topLeftCorner<3, 3>() =
+                    Eigen::AngleAxisf(angle, Eigen::Vector3f::UnitY()).matrix();
+            }
+            c.render3D(tape, M);
+        };
+        auto mean = get_stats(frame);
+
+        if (incremental) {
+            // Replay the same frames, then again with a full first stage
+            angle = 0.0f;
+            const Timing cached = get_timing(frame);
+            angle = 0.0f;
+            c.incremental = false;
+            const Timing full = get_timing(frame);
+            c.incremental = true;
+            fprintf(stderr, "  incremental: %.3f ms mean, %.3f ms p50, "
+                            "%.3f ms p99\n",
+                    cached.mean, cached.p50, cached.p99);
+            fprintf(stderr, "  full:        %.3f ms mean, %.3f ms p50, "
+                            "%.3f ms p99 (%.2fx)\n",
+                    full.mean, full.p50, full.p99, full.mean / cached.mean);
+        }
+
+        if (stats) {
+            c.collect_stats = true;
+            if (incremental) {
+                // One frame to fill the cache, then one which can reuse it
+                c.render3D(tape, M);
+                c.render3D(tape, M);
+                const auto cached = c.renderStats();
+                c.incremental = false;
+                c.render3D(tape, M);
+                const auto full = c.renderStats();
+                c.incremental = true;
+                fprintf(stderr, "  stage 0: %d / %d tiles reused, "
+                                "%.3f ms eval (%.3f ms without reuse)\n",
+                        cached.cache_hits, cached.tile_counts[0],
+                        cached.eval_ms[0], full.eval_ms[0]);
+                fprintf(stderr, "  frame: %.3f ms (%.3f ms without reuse)\n",
+                        cached.total_ms, full.total_ms);
+            }
+            c.render3D(tape, M);
+            const auto r = c.renderStats();
+            fprintf(stderr, "  setup: %.3f ms\n", r.setup_ms);
+            for (unsigned i=0; i < 4; ++i) {
+                fprintf(stderr, "  stage %u: %d tiles, %.3f ms eval",
+                        i, r.tile_counts[i], r.eval_ms[i]);
+                if (i < 3) {
+                    fprintf(stderr, ", %.3f ms subdivide\n",
+                            r.subdivide_ms[i]);
+                } else {
+                    fprintf(stderr, ", %.3f ms normals\n", r.normals_ms);
+                }
+            }
+            fprintf(stderr, "  total: %.3f ms\n", r.total_ms);
+            fprintf(stderr, "  subtapes: %d pushes (mean length %.1f), "
+                            "%d overflows, %d / %d clauses used\n",
+                    r.subtape_pushes, r.mean_subtape_length,
+                    r.subtape_overflows, r.tape_used, r.tape_capacity);
+            c.collect_stats = false;
+        }
+
+        {   // Time the readback of whichever encoding the output uses
+            std::vector<std::pair<const void*, size_t>> outputs;
+            const size_t pixels = size_t(size) * size;
+            if (compact) {
+                outputs.push_back({c.depth16.get(), sizeof(uint16_t) * pixels});
+            } else {
+                outputs.push_back({c.stages[3].filled.get(),
+                                   sizeof(int32_t) * pixels});
+                if (!depth_only) {
+                    outputs.push_back({c.normals.get(),
+                                       sizeof(uint32_t) * pixels});
+                }
+            }
+            size_t bytes = 0;
+            for (auto& o : outputs) {
+                bytes += o.second;
+            }
+            mpr::HostPtr<uint8_t[]> host(CUDA_MALLOC_HOST(uint8_t, bytes));
+            const auto readback = get_timing([&]() {
+                size_t offset = 0;
+                for (auto& o : outputs) {
+                    CUDA_CHECK(cudaMemcpy(host.get() + offset, o.first,
+                                          o.second, cudaMemcpyDeviceToHost));
+                    offset += o.second;
+                }
+            });
+            fprintf(stderr, "  readback: %zu bytes, %.3f ms (%.2f GB/s)\n",
+                    bytes, readback.mean, bytes / readback.mean / 1e6);
+        }
 
         libfive::Heightmap out(size, size);
         uint32_t i = 0;
         for (int x=0; x < size; ++x) {
             for (int y=0; y < size; ++y) {
                 out.depth(x, y) = c.stages[3].filled[i];
-                out.norm(x, y) = c.normals[i];
+                out.norm(x, y) = depth_only ? 0 : c.normals[i];
                 ++i;
             }
         }
@@ -0,0 +1,284 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// libfive
+#include <libfive/tree/tree.hpp>
+#include <libfive/tree/archive.hpp>
+
+#include "tape.hpp"
+#include "context.hpp"
+
+using namespace std::chrono;
+
+/*  One model in the workload, with the dimension that it's rendered in */
+struct Model {
+    std::string name;
+    int dim;
+    mpr::Tape tape;
+};
+
+/*  The contexts which are rendered by one host thread, and its results */
+struct Worker {
+    std::vector<int> contexts;
+    std::vector<double> latencies_ms;
+    int frames=0;
+};
+
+static std::string base_name(const std::string& path) {
+    const auto i = path.find_last_of('/');
+    return (i == std::string::npos) ? path : path.substr(i + 1);
+}
+
+static size_t used_device_bytes() {
+    size_t free, total;
+    CUDA_CHECK(cudaMemGetInfo(&free, &total));
+    return total - free;
+}
+
+int main(int argc, char **argv)
+{
+    // Usage:
+    //  render_concurrent [options] [--dim 2|3 model.frep...]...
+    //
+    // Renders a mixed workload with K contexts on M host threads.  Context i
+    // renders model i % (number of models), and belongs to thread i % M,
+    // which renders each of its contexts in turn until time runs out.  With
+    // no models, every context renders a pair of spheres in 3D.
+    //
+    // Options:
+    //  --contexts K    (4 by default)
+    //  --threads M     (2 by default)
+    //  --streams       gives each context its own stream, and renders with
+    //                  render2DAsync / render3DAsync in device-sizing mode,
+    //                  so that a thread enqueues a frame for every one of its
+    //                  contexts before waiting on any of them.  Otherwise,
+    //                  every frame is a blocking render on the default stream.
+    //  --share         makes every context share the first one's scratch
+    //                  space (see Context::shareScratch).  Frames must not
+    //                  overlap, so this needs --threads 1, and puts every
+    //                  context on a single stream.
+    //  --size N        image size (512 by default)
+    //  --seconds T     length of the timed run (5 by default)
+    //  --warmup N      untimed frames per context (5 by default)
+    int num_contexts = 4;
+    int num_threads = 2;
+    bool use_streams = false;
+    bool share = false;
+    int size = 512;
+    double seconds = 5;
+    int warmup = 5;
+    std::vector<Model> models;
+
+    int dim = 3;
+    for (int i=1; i < argc; ++i) {
+        const std::string arg(argv[i]);
+        const bool has_value = i + 1 < argc;
+        if (arg == "--contexts" && has_value) {
+            num_contexts = std::stoi(argv[++i]);
+        } else if (arg == "--threads" && has_value) {
+            num_threads = std::stoi(argv[++i]);
+        } else if (arg == "--streams") {
+            use_streams = true;
+        } else if (arg == "--share") {
+            share = true;
+        } else if (arg == "--size" && has_value) {
+            size = std::stoi(argv[++i]);
+        } else if (arg == "--seconds" && has_value) {
+            seconds = std::stod(argv[++i]);
+        } else if (arg == "--warmup" && has_value) {
+            warmup = std::stoi(argv[++i]);
+        } else if (arg == "--dim" && has_value) {
+            dim = std::stoi(argv[++i]);
+            if (dim != 2 && dim != 3) {
+                fprintf(stderr, "--dim must be 2 or 3\n");
+                exit(1);
+            }
+        } else if (arg.compare(0, 2, "--") == 0) {
+            fprintf(stderr, "Unknown option %s\n", arg.c_str());
+            exit(1);
+        } else {
+            std::ifstream ifs;
+            ifs.open(arg);
+            if (!ifs.is_open()) {
+                fprintf(stderr, "Could not open file %s\n", arg.c_str());
+                exit(1);
+            }
+            auto a = libfive::Archive::deserialize(ifs);
+            models.push_back(Model { base_name(arg), dim,
+                                     mpr::Tape(a.shapes.front().tree) });
+        }
+    }
+    if (num_contexts < 1 || num_threads < 1) {
+        fprintf(stderr, "--contexts and --threads must be at least 1\n");
+        exit(1);
+    }
+    num_threads = std::min(num_threads, num_contexts);
+    if (share && num_threads != 1) {
+        fprintf(stderr, "--share requires --threads 1\n");
+        exit(1);
+    }
+
+    if (models.empty()) {
+        auto X = libfive::Tree::X();
+        auto Y = libfive::Tree::Y();
+        auto Z = libfive::Tree::Z();
+        auto t = min(sqrt((X + 0.5)*(X + 0.5) + Y*Y + Z*Z) - 0.25,
+                     sqrt((X - 0.5)*(X - 0.5) + Y*Y + Z*Z) - 0.25);
+        models.push_back(Model { "spheres", 3, mpr::Tape(t) });
+    }
+
+    // Contexts (and tapes, above) are built on the main thread, then each
+    // one is only used by a single worker.
+    const size_t bytes_before = used_device_bytes();
+    std::vector<mpr::Context> contexts;
+    std::vector<mpr::Stream> streams;
+    for (int i=0; i < num_contexts; ++i) {
+        contexts.emplace_back(size);
+        contexts.back().device_sizing = use_streams;
+        if (share && i > 0) {
+            contexts.back().shareScratch(contexts.front());
+        }
+        streams.push_back((use_streams && (!share || i == 0))
+                ? mpr::makeStream() : mpr::Stream());
+    }
+
+    Eigen::Matrix4f T = Eigen::Matrix4f::Identity();
+    T(3,2) = 0.3f;
+    const Eigen::Matrix3f T2 = Eigen::Matrix3f::Identity();
+
+    // Enqueues a frame for context i, returning its event (or null, if the
+    // frame was rendered synchronously)
+    auto enqueue = [&](int i) -> cudaEvent_t {
+        mpr::Context& c = contexts[i];
+        const Model& m = models[i % models.size()];
+        const cudaStream_t stream = streams[share ? 0 : i].get();
+        if (!use_streams) {
+            if (m.dim == 2) {
+                c.render2D(m.tape, T2);
+            } else {
+                c.render3D(m.tape, T);
+            }
+            return nullptr;
+        }
+        return (m.dim == 2)
+            ? c.render2DAsync(m.tape, T2, 0.0f, stream)
+            : c.render3DAsync(m.tape, T, stream);
+    };
+
+    // Waits for context i's frame, re-rendering it if it overflowed its
+    // buffers (which are grown for the next frame, as in render3D)
+    auto finish = [&](int i, cudaEvent_t done) {
+        while (done) {
+            CUDA_CHECK(cudaEventSynchronize(done));
+            done = contexts[i].overflowed() ? enqueue(i) : nullptr;
+        }
+    };
+
+    std::vector<Worker> workers(num_threads);
+    for (int i=0; i < num_contexts; ++i) {
+        workers[i % num_threads].contexts.push_back(i);
+    }
+
+    auto work = [&](Worker& w, steady_clock::time_point deadline,
+                    bool record) {
+        std::vector<cudaEvent_t> events(w.contexts.size());
+        while (steady_clock::now() < deadline) {
+            // With streams, latency runs from when the thread started
+            // enqueueing its frames; otherwise, each frame is timed alone.
+            const auto start = steady_clock::now();
+            for (unsigned j=0; j < w.contexts.size(); ++j) {
+                const auto frame_start = steady_clock::now();
+                events[j] = enqueue(w.contexts[j]);
+                if (!use_streams && record) {
+                    w.latencies_ms.push_back(duration<double, std::milli>(
+                            steady_clock::now() - frame_start).count());
+                }
+            }
+            for (unsigned j=0; j < w.contexts.size(); ++j) {
+                finish(w.contexts[j], events[j]);
+                if (use_streams && record) {
+                    w.latencies_ms.push_back(duration<double, std::milli>(
+                            steady_clock::now() - start).count());
+                }
+            }
+            if (!record) {
+                break;
+            }
+            w.frames += w.contexts.size();
+        }
+    };
+
+    // Warm up every context (which also grows its buffers), then measure
+    // how much device memory they're holding
+    for (int k=0; k < warmup; ++k) {
+        for (auto& w : workers) {
+            work(w, steady_clock::time_point::max(), false);
+        }
+    }
+    CUDA_CHECK(cudaDeviceSynchronize());
+    const size_t bytes_after = used_device_bytes();
+
+    const auto start = steady_clock::now();
+    const auto deadline = start + duration_cast<steady_clock::duration>(
+            duration<double>(seconds));
+    std::vector<std::thread> threads;
+    for (auto& w : workers) {
+        Worker* const wp = &w;
+        threads.emplace_back([&, wp]() { work(*wp, deadline, true); });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    const double elapsed = duration<double>(steady_clock::now() - start).count();
+
+    int frames = 0;
+    std::vector<double> latencies;
+    for (auto& w : workers) {
+        frames += w.frames;
+        latencies.insert(latencies.end(), w.latencies_ms.begin(),
+                         w.latencies_ms.end());
+    }
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) {
+        if (latencies.empty()) {
+            return 0.0;
+        }
+        const size_t rank = std::ceil(p / 100.0 * latencies.size());
+        return latencies[std::max<size_t>(rank, 1) - 1];
+    };
+
+    size_t scratch = 0;
+    for (auto& c : contexts) {
+        scratch += c.scratchHighWater();
+    }
+
+    printf("contexts %d threads %d streams %d share %d size %d models %zu\n",
+           num_contexts, num_threads, use_streams, share, size,
+           models.size());
+    printf("frames %d in %f s: %f frames/s\n", frames, elapsed,
+           frames / elapsed);
+    printf("latency ms: p50 %f p90 %f p99 %f max %f\n",
+           percentile(50), percentile(90), percentile(99),
+           latencies.empty() ? 0.0 : latencies.back());
+    printf("device memory per context: %f MB (%f MB peak scratch)\n",
+           (bytes_after - bytes_before) / (1024.0 * 1024.0) / num_contexts,
+           scratch / (1024.0 * 1024.0) / num_contexts);
+    return 0;
+}
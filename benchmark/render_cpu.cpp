@@ -0,0 +1,94 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#include <cstdio>
+#include <chrono>
+#include <iostream>
+#include <fstream>
+
+// libfive
+#include <libfive/tree/tree.hpp>
+#include <libfive/tree/archive.hpp>
+#include <libfive/render/discrete/heightmap.hpp>
+
+#include "cpu_render.hpp"
+#include "tape.hpp"
+
+// Renders a model with CpuContext, which is linked against mpr_cpu and so
+// runs on machines without CUDA
+int main(int argc, char **argv)
+{
+    libfive::Tree t = libfive::Tree::X();
+    if (argc >= 2) {
+        std::ifstream ifs;
+        ifs.open(argv[1]);
+        if (ifs.is_open()) {
+            auto a = libfive::Archive::deserialize(ifs);
+            t = a.shapes.front().tree;
+        } else {
+            fprintf(stderr, "Could not open file %s\n", argv[1]);
+            exit(1);
+        }
+    } else {
+        auto X = libfive::Tree::X();
+        auto Y = libfive::Tree::Y();
+        auto Z = libfive::Tree::Z();
+        t = min(sqrt((X + 0.5)*(X + 0.5) + Y*Y + Z*Z) - 0.25,
+                sqrt((X - 0.5)*(X - 0.5) + Y*Y + Z*Z) - 0.25);
+    }
+
+    int resolution = 512;
+    if (argc >= 3) {
+        errno = 0;
+        resolution = strtol(argv[2], NULL, 10);
+        if (errno || resolution == 0) {
+            fprintf(stderr, "Could not parse resolution '%s'\n",
+                    argv[2]);
+            exit(1);
+        }
+    }
+
+    auto tape = mpr::Tape(t);
+    mpr::CpuContext c(resolution);
+    c.collect_stats = true;
+
+    Eigen::Matrix4f T = Eigen::Matrix4f::Identity();
+    T(3,2) = 0.3f;
+
+    // The first frame also builds the thread pool
+    c.render3D(tape, T);
+    for (unsigned i=0; i < 10; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        c.render3D(tape, T);
+        auto end = std::chrono::steady_clock::now();
+        printf("%f ms (%f ms evaluating)\n",
+               std::chrono::duration<double, std::milli>(end - start).count(),
+               c.stats.eval_ms[0]);
+    }
+
+    // Save the image using libfive::Heightmap
+    libfive::Heightmap out(c.image_size_px, c.image_size_px);
+    unsigned i=0;
+    for (int x=0; x < c.image_size_px; ++x) {
+        for (int y=0; y < c.image_size_px; ++y) {
+            const auto p = c.filled[3][i];
+            out.depth(x, y) = p;
+            if (p) {
+                out.norm(x, y) = c.normals[i];
+            }
+            ++i;
+        }
+    }
+    out.savePNG("out_cpu_depth.png");
+    out.saveNormalPNG("out_cpu_norm.png");
+
+    return 0;
+}
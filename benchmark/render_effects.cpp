@@ -23,6 +23,8 @@ Copyright (C) 2019-2020  Matt Keeter
 #include "tape.hpp"
 #include "effects.hpp"
 
+#include "stats.hpp"
+
 int main(int argc, char** argv)
 {
     auto X = libfive::Tree::X();
@@ -66,6 +68,16 @@ int main(int argc, char** argv)
     T(3,2) = 0.3f;
 
     ctx.render3D(tape, T);
+
+    // Time each SSAO variant, then save the reference version below
+    std::cout << "render ";
+    get_stats([&](){ ctx.render3D(tape, T); });
+    const char* names[] = {"ssao_reference", "ssao_tiled", "ssao_half"};
+    for (auto q : {mpr::SSAO_REFERENCE, mpr::SSAO_TILED, mpr::SSAO_HALF}) {
+        std::cout << names[q] << " ";
+        get_stats([&](){ effects.drawSSAO(ctx, q); });
+    }
+
     effects.drawSSAO(ctx);
 
     libfive::Heightmap out(resolution, resolution);
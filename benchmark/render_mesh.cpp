@@ -0,0 +1,102 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// libfive
+#include <libfive/tree/tree.hpp>
+#include <libfive/tree/archive.hpp>
+
+#include "tape.hpp"
+#include "context.hpp"
+#include "stats.hpp"
+
+int main(int argc, char **argv)
+{
+    // Usage:
+    //  render_mesh [--obj out.obj] [model.frep]
+    //
+    // Meshes a model (see Context::renderMesh) at a range of sizes, printing
+    // the time per mesh, then (to stderr) the number of ambiguous tiles,
+    // vertices, and triangles.  With --obj, the largest mesh is saved as a
+    // Wavefront OBJ file.
+    std::string obj;
+    if (argc >= 3 && std::string(argv[1]) == "--obj") {
+        obj = argv[2];
+        argv += 2;
+        argc -= 2;
+    }
+
+    libfive::Tree t = libfive::Tree::X();
+    if (argc == 2) {
+        std::ifstream ifs;
+        ifs.open(argv[1]);
+        if (ifs.is_open()) {
+            auto a = libfive::Archive::deserialize(ifs);
+            t = a.shapes.front().tree;
+        } else {
+            fprintf(stderr, "Could not open file %s\n", argv[1]);
+            exit(1);
+        }
+    } else {
+        auto X = libfive::Tree::X();
+        auto Y = libfive::Tree::Y();
+        auto Z = libfive::Tree::Z();
+        t = min(sqrt((X + 0.5)*(X + 0.5) + Y*Y + Z*Z) - 0.25,
+                sqrt((X - 0.5)*(X - 0.5) + Y*Y + Z*Z) - 0.25);
+    }
+    auto tape = mpr::Tape(t);
+    const Eigen::Matrix4f T = Eigen::Matrix4f::Identity();
+
+    // Mesh buffers are in managed memory, so they can be read directly
+    auto save_obj = [&](const mpr::Context& c) {
+        FILE* f = fopen(obj.c_str(), "w");
+        if (!f) {
+            fprintf(stderr, "Could not open file %s\n", obj.c_str());
+            exit(1);
+        }
+        for (int i=0; i < c.mesh_counts_host[0]; ++i) {
+            const float3 v = c.mesh_vertices[i];
+            const float3 n = c.mesh_normals[i];
+            fprintf(f, "v %f %f %f\nvn %f %f %f\n", v.x, v.y, v.z,
+                    n.x, n.y, n.z);
+        }
+        for (int i=0; i < c.mesh_counts_host[1]; ++i) {
+            const uint32_t* k = &c.mesh_indices[i * 3];
+            fprintf(f, "f %u//%u %u//%u %u//%u\n", k[0] + 1, k[0] + 1,
+                    k[1] + 1, k[1] + 1, k[2] + 1, k[2] + 1);
+        }
+        fclose(f);
+    };
+
+    const std::vector<int> sizes = {128, 256, 512, 1024};
+    for (auto size: sizes) {
+        auto c = mpr::Context(size);
+        std::cout << size << " ";
+        auto mean = get_stats([&](){ c.renderMesh(tape, T); });
+        fprintf(stderr, "  %d tiles, %d vertices, %d triangles\n",
+                c.volume_counts_host[3], c.mesh_counts_host[0],
+                c.mesh_counts_host[1]);
+
+        // Each size overwrites the file, so it ends up with the largest
+        if (!obj.empty()) {
+            save_obj(c);
+        }
+        if (mean > 750) {
+            break;
+        }
+    }
+    return 0;
+}
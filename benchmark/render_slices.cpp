@@ -0,0 +1,114 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// libfive
+#include <libfive/tree/tree.hpp>
+#include <libfive/tree/archive.hpp>
+
+#include "tape.hpp"
+#include "context.hpp"
+#include "stats.hpp"
+
+int main(int argc, char **argv)
+{
+    // Usage:
+    //  render_slices [--layers N] [--size S] [--group G] [model.frep]
+    //
+    // Renders a stack of N layers (256 by default) evenly spaced through
+    // Z = [-1, 1] at S^2 pixels (1024 by default), first with one render2D
+    // per layer, then in one render2DSlices call with groups of G layers
+    // (8 by default), printing the time for each.  Then, checks that both
+    // give the same pixels, and prints the number of mismatched pixels.
+    int layers = 256;
+    int size = 1024;
+    int group = 8;
+    while (argc >= 3) {
+        const std::string arg(argv[1]);
+        if (arg == "--layers") {
+            layers = std::stoi(argv[2]);
+        } else if (arg == "--size") {
+            size = std::stoi(argv[2]);
+        } else if (arg == "--group") {
+            group = std::stoi(argv[2]);
+        } else {
+            break;
+        }
+        argv += 2;
+        argc -= 2;
+    }
+    if (layers < 1 || size % 64 || group < 1) {
+        fprintf(stderr, "--layers and --group must be positive, "
+                        "and --size must be a multiple of 64\n");
+        exit(1);
+    }
+
+    libfive::Tree t = libfive::Tree::X();
+    if (argc == 2) {
+        std::ifstream ifs;
+        ifs.open(argv[1]);
+        if (ifs.is_open()) {
+            auto a = libfive::Archive::deserialize(ifs);
+            t = a.shapes.front().tree;
+        } else {
+            fprintf(stderr, "Could not open file %s\n", argv[1]);
+            exit(1);
+        }
+    } else {
+        auto X = libfive::Tree::X();
+        auto Y = libfive::Tree::Y();
+        auto Z = libfive::Tree::Z();
+        t = min(sqrt((X + 0.5)*(X + 0.5) + Y*Y + Z*Z) - 0.25,
+                sqrt((X - 0.5)*(X - 0.5) + Y*Y + Z*Z) - 0.25);
+    }
+    auto tape = mpr::Tape(t);
+    const Eigen::Matrix3f T = Eigen::Matrix3f::Identity();
+
+    std::vector<float> zs(layers);
+    for (int i=0; i < layers; ++i) {
+        zs[i] = (i + 0.5f) / layers * 2.0f - 1.0f;
+    }
+
+    auto c = mpr::Context(size);
+    c.slice_group = group;
+    std::cout << "layers " << layers << " size " << size
+              << " group " << group << "\n";
+    std::cout << "render2D: ";
+    get_stats([&]() {
+        for (auto z : zs) {
+            c.render2D(tape, T, z);
+        }
+    }, 2, 10);
+    std::cout << "render2DSlices: ";
+    get_stats([&]() { c.render2DSlices(tape, T, zs.data(), layers); },
+              2, 10);
+
+    // Slice bits are in managed memory, so they can be read directly
+    const int words = size * size / 32;
+    std::vector<uint32_t> bits(c.slice_bits.get(),
+                               c.slice_bits.get() + size_t(words) * layers);
+    size_t mismatched = 0;
+    for (int i=0; i < layers; ++i) {
+        c.render2D(tape, T, zs[i]);
+        const int32_t* image = c.stages[3].filled.get();
+        for (int p=0; p < size * size; ++p) {
+            const bool bit = (bits[size_t(i) * words + p / 32] >> (p % 32)) & 1;
+            mismatched += (bit != (image[p] != 0));
+        }
+    }
+    std::cout << "mismatched pixels " << mismatched << "\n";
+    return 0;
+}
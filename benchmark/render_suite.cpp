@@ -0,0 +1,357 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// libfive
+#include <libfive/tree/tree.hpp>
+#include <libfive/tree/archive.hpp>
+
+#include "tape.hpp"
+#include "context.hpp"
+
+#include "stats.hpp"
+
+// Instrumented frames per result, which are run after the timed ones
+#define STATS_FRAMES 10
+
+struct Result {
+    std::string name;   // Model file, without its directory
+    int dim;
+    int size;
+    int iterations;
+    Timing timing;
+    mpr::RenderStats stats; // Mean times (and last counts) of STATS_FRAMES
+};
+
+static std::vector<int> parse_sizes(const std::string& s) {
+    std::vector<int> out;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        out.push_back(std::stoi(item));
+    }
+    return out;
+}
+
+static std::string base_name(const std::string& path) {
+    const auto i = path.find_last_of('/');
+    return (i == std::string::npos) ? path : path.substr(i + 1);
+}
+
+static Result run(const std::string& path, const libfive::Tree& t,
+                  int dim, int size, int warmup, int iterations)
+{
+    auto tape = mpr::Tape(t);
+    auto c = mpr::Context(size);
+
+    Eigen::Matrix4f T = Eigen::Matrix4f::Identity();
+    T(3,2) = 0.3f;
+    auto f = [&]() {
+        if (dim == 2) {
+            c.render2D(tape, Eigen::Matrix3f::Identity());
+        } else {
+            c.render3D(tape, T);
+        }
+    };
+
+    Result r;
+    r.name = base_name(path);
+    r.dim = dim;
+    r.size = size;
+    r.iterations = iterations;
+    r.timing = get_timing(f, warmup, iterations);
+
+    // Then run a few more frames with stats, so that the timing events
+    // don't affect the timings above
+    c.collect_stats = true;
+    r.stats = mpr::RenderStats();
+    for (int i=0; i < STATS_FRAMES; ++i) {
+        f();
+        const auto s = c.renderStats();
+        r.stats.setup_ms += s.setup_ms / STATS_FRAMES;
+        for (unsigned j=0; j < 4; ++j) {
+            r.stats.eval_ms[j] += s.eval_ms[j] / STATS_FRAMES;
+            if (j < 3) {
+                r.stats.subdivide_ms[j] += s.subdivide_ms[j] / STATS_FRAMES;
+            }
+            r.stats.tile_counts[j] = s.tile_counts[j];
+        }
+        r.stats.normals_ms += s.normals_ms / STATS_FRAMES;
+        r.stats.total_ms += s.total_ms / STATS_FRAMES;
+        r.stats.tape_used = s.tape_used;
+        r.stats.tape_capacity = s.tape_capacity;
+        r.stats.subtape_pushes = s.subtape_pushes;
+        r.stats.subtape_overflows = s.subtape_overflows;
+        r.stats.mean_subtape_length = s.mean_subtape_length;
+    }
+    return r;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static const char* CSV_HEADER =
+    "file,dim,size,iterations,"
+    "mean_ms,stdev_ms,min_ms,p50_ms,p90_ms,p99_ms,max_ms,"
+    "setup_ms,eval0_ms,eval1_ms,eval2_ms,eval3_ms,"
+    "subdivide0_ms,subdivide1_ms,subdivide2_ms,normals_ms,gpu_total_ms,"
+    "tiles0,tiles1,tiles2,tiles3,"
+    "tape_used,tape_capacity,subtape_pushes,subtape_overflows,"
+    "mean_subtape_length\n";
+
+static void write_csv(FILE* out, const std::vector<Result>& results) {
+    fprintf(out, "%s", CSV_HEADER);
+    for (auto& r : results) {
+        const auto& t = r.timing;
+        const auto& s = r.stats;
+        fprintf(out, "%s,%d,%d,%d,", r.name.c_str(), r.dim, r.size,
+                r.iterations);
+        fprintf(out, "%f,%f,%f,%f,%f,%f,%f,",
+                t.mean, t.stdev, t.min, t.p50, t.p90, t.p99, t.max);
+        fprintf(out, "%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,",
+                s.setup_ms, s.eval_ms[0], s.eval_ms[1], s.eval_ms[2],
+                s.eval_ms[3], s.subdivide_ms[0], s.subdivide_ms[1],
+                s.subdivide_ms[2], s.normals_ms, s.total_ms);
+        fprintf(out, "%d,%d,%d,%d,%d,%d,%d,%d,%f\n",
+                s.tile_counts[0], s.tile_counts[1], s.tile_counts[2],
+                s.tile_counts[3], s.tape_used, s.tape_capacity,
+                s.subtape_pushes, s.subtape_overflows, s.mean_subtape_length);
+    }
+}
+
+static void write_json(FILE* out, const std::vector<Result>& results) {
+    fprintf(out, "[\n");
+    for (unsigned i=0; i < results.size(); ++i) {
+        const auto& r = results[i];
+        const auto& t = r.timing;
+        const auto& s = r.stats;
+        fprintf(out, "  {\"file\": \"%s\", \"dim\": %d, \"size\": %d, "
+                     "\"iterations\": %d,\n",
+                r.name.c_str(), r.dim, r.size, r.iterations);
+        fprintf(out, "   \"timing_ms\": {\"mean\": %f, \"stdev\": %f, "
+                     "\"min\": %f, \"p50\": %f, \"p90\": %f, \"p99\": %f, "
+                     "\"max\": %f},\n",
+                t.mean, t.stdev, t.min, t.p50, t.p90, t.p99, t.max);
+        fprintf(out, "   \"gpu_ms\": {\"setup\": %f, "
+                     "\"eval\": [%f, %f, %f, %f], "
+                     "\"subdivide\": [%f, %f, %f], "
+                     "\"normals\": %f, \"total\": %f},\n",
+                s.setup_ms, s.eval_ms[0], s.eval_ms[1], s.eval_ms[2],
+                s.eval_ms[3], s.subdivide_ms[0], s.subdivide_ms[1],
+                s.subdivide_ms[2], s.normals_ms, s.total_ms);
+        fprintf(out, "   \"tiles\": [%d, %d, %d, %d],\n",
+                s.tile_counts[0], s.tile_counts[1], s.tile_counts[2],
+                s.tile_counts[3]);
+        fprintf(out, "   \"subtapes\": {\"used\": %d, \"capacity\": %d, "
+                     "\"pushes\": %d, \"overflows\": %d, "
+                     "\"mean_length\": %f}}%s\n",
+                s.tape_used, s.tape_capacity, s.subtape_pushes,
+                s.subtape_overflows, s.mean_subtape_length,
+                (i + 1 < results.size()) ? "," : "");
+    }
+    fprintf(out, "]\n");
+}
+
+static std::string result_key(const std::string& name, int dim, int size) {
+    return name + ":" + std::to_string(dim) + ":" + std::to_string(size);
+}
+
+/*
+ *  Reads the p50 times from a baseline in CSV format (as written by
+ *  --format csv), keyed by file, dimension, and size.  Returns false if
+ *  the file can't be read.
+ */
+static bool read_baseline(const std::string& path,
+                          std::map<std::string, double>& out)
+{
+    std::ifstream ifs(path);
+    if (!ifs.is_open()) {
+        return false;
+    }
+    std::string line;
+    if (!std::getline(ifs, line)) {
+        return false;
+    }
+
+    // Find the columns that we need from the header, so that baselines
+    // survive columns being added later on
+    std::map<std::string, unsigned> columns;
+    {
+        std::stringstream ss(line);
+        std::string col;
+        for (unsigned i=0; std::getline(ss, col, ','); ++i) {
+            columns[col] = i;
+        }
+    }
+    for (auto c : {"file", "dim", "size", "p50_ms"}) {
+        if (columns.find(c) == columns.end()) {
+            return false;
+        }
+    }
+
+    while (std::getline(ifs, line)) {
+        std::vector<std::string> cells;
+        std::stringstream ss(line);
+        std::string cell;
+        while (std::getline(ss, cell, ',')) {
+            cells.push_back(cell);
+        }
+        if (cells.size() < columns.size()) {
+            continue;
+        }
+        out[result_key(cells[columns["file"]],
+                       std::stoi(cells[columns["dim"]]),
+                       std::stoi(cells[columns["size"]]))] =
+            std::stod(cells[columns["p50_ms"]]);
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    // Usage:
+    //  render_suite [options] [--dim 2|3 model.frep...]...
+    //
+    // Every model is rendered at each size, and results are written to
+    // stdout (or to the --out file) as JSON or CSV.  --dim applies to the
+    // models which follow it, so 2D and 3D models can be run together.
+    //
+    // Options:
+    //  --sizes 256,512,...   (256,512,1024,1536,2048 by default)
+    //  --warmup N            (20 by default)
+    //  --iterations N        (100 by default)
+    //  --max-ms T            skips larger sizes of a model once its mean
+    //                        time passes T (no limit by default)
+    //  --format json|csv     (json by default)
+    //  --out path
+    //  --baseline path.csv   compares p50 times against a CSV baseline,
+    //                        printing a table to stderr and exiting with 1
+    //                        if any result is slower by more than
+    //  --tolerance F         (0.1 = 10% by default)
+    std::vector<int> sizes = {256, 512, 1024, 1536, 2048};
+    int warmup = 20;
+    int iterations = 100;
+    double max_ms = 0;
+    std::string format = "json";
+    std::string out_path;
+    std::string baseline_path;
+    double tolerance = 0.1;
+    std::vector<std::pair<std::string, int>> models;
+
+    int dim = 3;
+    for (int i=1; i < argc; ++i) {
+        const std::string arg(argv[i]);
+        const bool has_value = i + 1 < argc;
+        if (arg == "--sizes" && has_value) {
+            sizes = parse_sizes(argv[++i]);
+        } else if (arg == "--warmup" && has_value) {
+            warmup = std::stoi(argv[++i]);
+        } else if (arg == "--iterations" && has_value) {
+            iterations = std::stoi(argv[++i]);
+        } else if (arg == "--max-ms" && has_value) {
+            max_ms = std::stod(argv[++i]);
+        } else if (arg == "--format" && has_value) {
+            format = argv[++i];
+        } else if (arg == "--out" && has_value) {
+            out_path = argv[++i];
+        } else if (arg == "--baseline" && has_value) {
+            baseline_path = argv[++i];
+        } else if (arg == "--tolerance" && has_value) {
+            tolerance = std::stod(argv[++i]);
+        } else if (arg == "--dim" && has_value) {
+            dim = std::stoi(argv[++i]);
+            if (dim != 2 && dim != 3) {
+                fprintf(stderr, "--dim must be 2 or 3\n");
+                exit(1);
+            }
+        } else if (arg.compare(0, 2, "--") == 0) {
+            fprintf(stderr, "Unknown option %s\n", arg.c_str());
+            exit(1);
+        } else {
+            models.push_back(std::make_pair(arg, dim));
+        }
+    }
+    if ((format != "json" && format != "csv") || iterations < 2) {
+        fprintf(stderr, "Invalid --format or --iterations\n");
+        exit(1);
+    }
+
+    std::vector<Result> results;
+    for (auto& m : models) {
+        std::ifstream ifs;
+        ifs.open(m.first);
+        if (!ifs.is_open()) {
+            fprintf(stderr, "Could not open file %s\n", m.first.c_str());
+            exit(1);
+        }
+        auto a = libfive::Archive::deserialize(ifs);
+        const auto t = a.shapes.front().tree;
+
+        for (auto size : sizes) {
+            fprintf(stderr, "%s (%dD) at %d\n",
+                    base_name(m.first).c_str(), m.second, size);
+            results.push_back(run(m.first, t, m.second, size,
+                                  warmup, iterations));
+            if (max_ms > 0 && results.back().timing.mean > max_ms) {
+                break;
+            }
+        }
+    }
+
+    FILE* out = stdout;
+    if (!out_path.empty()) {
+        out = fopen(out_path.c_str(), "w");
+        if (!out) {
+            fprintf(stderr, "Could not open %s\n", out_path.c_str());
+            exit(1);
+        }
+    }
+    if (format == "csv") {
+        write_csv(out, results);
+    } else {
+        write_json(out, results);
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    if (baseline_path.empty()) {
+        return 0;
+    }
+    std::map<std::string, double> baseline;
+    if (!read_baseline(baseline_path, baseline)) {
+        fprintf(stderr, "Could not read baseline %s\n",
+                baseline_path.c_str());
+        exit(1);
+    }
+    bool regressed = false;
+    fprintf(stderr, "\nfile dim size baseline_p50 p50 change\n");
+    for (auto& r : results) {
+        auto b = baseline.find(result_key(r.name, r.dim, r.size));
+        if (b == baseline.end()) {
+            fprintf(stderr, "%s %d %d - %f new\n", r.name.c_str(), r.dim,
+                    r.size, r.timing.p50);
+            continue;
+        }
+        const double change = r.timing.p50 / b->second - 1.0;
+        const bool slower = change > tolerance;
+        regressed |= slower;
+        fprintf(stderr, "%s %d %d %f %f %+.1f%%%s\n", r.name.c_str(), r.dim,
+                r.size, b->second, r.timing.p50, change * 100.0,
+                slower ? " REGRESSION" : "");
+    }
+    return regressed ? 1 : 0;
+}
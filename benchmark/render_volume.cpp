@@ -0,0 +1,72 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+// libfive
+#include <libfive/tree/tree.hpp>
+#include <libfive/tree/archive.hpp>
+
+#include "tape.hpp"
+#include "context.hpp"
+#include "stats.hpp"
+
+int main(int argc, char **argv)
+{
+    // Renders the sparse volume of a model (see Context::renderVolume) at a
+    // range of sizes, printing the time per render, then (to stderr) the
+    // number of filled tiles at each stage, the number of ambiguous leaves,
+    // and the size of the result compared to a dense bit-per-voxel grid.
+    libfive::Tree t = libfive::Tree::X();
+    if (argc == 2) {
+        std::ifstream ifs;
+        ifs.open(argv[1]);
+        if (ifs.is_open()) {
+            auto a = libfive::Archive::deserialize(ifs);
+            t = a.shapes.front().tree;
+        } else {
+            fprintf(stderr, "Could not open file %s\n", argv[1]);
+            exit(1);
+        }
+    } else {
+        auto X = libfive::Tree::X();
+        auto Y = libfive::Tree::Y();
+        auto Z = libfive::Tree::Z();
+        t = min(sqrt((X + 0.5)*(X + 0.5) + Y*Y + Z*Z) - 0.25,
+                sqrt((X - 0.5)*(X - 0.5) + Y*Y + Z*Z) - 0.25);
+    }
+    auto tape = mpr::Tape(t);
+    const Eigen::Matrix4f T = Eigen::Matrix4f::Identity();
+
+    const std::vector<int> sizes = {256, 512, 1024, 1536, 2048};
+    for (auto size: sizes) {
+        auto c = mpr::Context(size);
+        std::cout << size << " ";
+        auto mean = get_stats([&](){ c.renderVolume(tape, T); });
+
+        const int32_t* counts = c.volume_counts_host.get();
+        const size_t bytes = sizeof(int32_t) * (counts[0] + counts[1] +
+                                                counts[2] + counts[3]) +
+                             sizeof(uint64_t) * counts[3];
+        const double dense = double(size) * size * size / 8;
+        fprintf(stderr, "  filled: %d / %d / %d tiles, %d leaves, "
+                        "%zu bytes (%.4f of dense)\n",
+                counts[0], counts[1], counts[2], counts[3], bytes,
+                bytes / dense);
+
+        if (mean > 750) {
+            break;
+        }
+    }
+    return 0;
+}
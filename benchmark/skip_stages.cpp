@@ -0,0 +1,100 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#include <cstdio>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// libfive
+#include <libfive/tree/tree.hpp>
+#include <libfive/tree/archive.hpp>
+
+#include "tape.hpp"
+#include "context.hpp"
+
+#include "stats.hpp"
+
+// Renders a model with every valid Context::skip_stages mask, and reports
+// the fastest one.  This only chooses which of the fixed 64 / 16 / 4 stages
+// are evaluated; the tile sizes themselves can't be changed.
+int main(int argc, char **argv)
+{
+    // Pass --2d to tune 2D rendering instead of 3D, and --size N to pick the
+    // image size (512 by default).  Skipping several stages makes the later
+    // stages very large, so big images may run out of memory.
+    bool is_2d = false;
+    int32_t size = 512;
+    while (argc >= 2) {
+        const std::string arg(argv[1]);
+        if (arg == "--2d") {
+            is_2d = true;
+        } else if (arg == "--size" && argc >= 3) {
+            size = std::stoi(argv[2]);
+            argv++;
+            argc--;
+        } else {
+            break;
+        }
+        argv++;
+        argc--;
+    }
+
+    libfive::Tree t = libfive::Tree::X();
+    if (argc == 2) {
+        std::ifstream ifs;
+        ifs.open(argv[1]);
+        if (ifs.is_open()) {
+            auto a = libfive::Archive::deserialize(ifs);
+            t = a.shapes.front().tree;
+        } else {
+            fprintf(stderr, "Could not open file %s\n", argv[1]);
+            exit(1);
+        }
+    } else {
+        auto X = libfive::Tree::X();
+        auto Y = libfive::Tree::Y();
+        auto Z = libfive::Tree::Z();
+        t = min(sqrt((X + 0.5)*(X + 0.5) + Y*Y + Z*Z) - 0.25,
+                sqrt((X - 0.5)*(X - 0.5) + Y*Y + Z*Z) - 0.25);
+    }
+    auto tape = mpr::Tape(t);
+
+    Eigen::Matrix4f T = Eigen::Matrix4f::Identity();
+    T(3,2) = 0.3f;
+    Eigen::Matrix3f T2 = Eigen::Matrix3f::Identity();
+
+    // In 3D, each of the three interval stages may be skipped (but not all
+    // of them at once); in 2D, only stages 0 and 2 are used.
+    const std::vector<uint32_t> masks = is_2d
+        ? std::vector<uint32_t>{0, 1, 4, 5}
+        : std::vector<uint32_t>{0, 1, 2, 3, 4, 5, 6};
+
+    std::cout << "skip_stages mean stdev\n";
+    uint32_t best_mask = 0;
+    double best_time = 0;
+    for (auto mask : masks) {
+        auto c = mpr::Context(size);
+        c.skip_stages = mask;
+        std::cout << mask << " ";
+        const double mean = is_2d
+            ? get_stats([&](){ c.render2D(tape, T2); })
+            : get_stats([&](){ c.render3D(tape, T); });
+        if (mask == masks.front() || mean < best_time) {
+            best_mask = mask;
+            best_time = mean;
+        }
+    }
+    std::cout << "\nfastest: skip_stages = " << best_mask
+              << " (" << best_time << " ms)\n";
+    return 0;
+}
@@ -0,0 +1,73 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#include <cstdio>
+#include <iostream>
+#include <fstream>
+
+// libfive
+#include <libfive/tree/tree.hpp>
+#include <libfive/tree/archive.hpp>
+
+#include "tape.hpp"
+#include "context.hpp"
+
+#include "stats.hpp"
+
+int main(int argc, char **argv)
+{
+    libfive::Tree t = libfive::Tree::X();
+    if (argc == 2) {
+        std::ifstream ifs;
+        ifs.open(argv[1]);
+        if (ifs.is_open()) {
+            auto a = libfive::Archive::deserialize(ifs);
+            t = a.shapes.front().tree;
+        } else {
+            fprintf(stderr, "Could not open file %s\n", argv[1]);
+            exit(1);
+        }
+    } else {
+        auto X = libfive::Tree::X();
+        auto Y = libfive::Tree::Y();
+        auto Z = libfive::Tree::Z();
+        t = min(sqrt((X + 0.5)*(X + 0.5) + Y*Y + Z*Z) - 0.25,
+                sqrt((X - 0.5)*(X - 0.5) + Y*Y + Z*Z) - 0.25);
+    }
+
+    // Print static resource usage of every evaluator specialization
+    std::cout << "kernel slots registers local_bytes blocks_per_sm occupancy\n";
+    for (auto& k : mpr::Context::evaluatorOccupancy()) {
+        std::cout << k.name << " " << k.slots << " " << k.registers << " "
+                  << k.local_bytes << " " << k.blocks_per_sm << " "
+                  << k.occupancy << "\n";
+    }
+
+    auto tape = mpr::Tape(t);
+    std::cout << "\ntape uses " << tape.num_slots << " slots\n";
+
+    Eigen::Matrix4f T = Eigen::Matrix4f::Identity();
+    T(3,2) = 0.3f;
+
+    // Then render with each specialization that fits the tape, by raising
+    // the minimum slot count.  Smaller arrays should be faster.
+    std::cout << "min_slots mean stdev\n";
+    auto c = mpr::Context(1024);
+    for (int32_t min_slots : {0, 8, 16, 32, 64, 128}) {
+        if (min_slots && min_slots < tape.num_slots) {
+            continue;
+        }
+        c.min_slots = min_slots;
+        std::cout << min_slots << " ";
+        get_stats([&](){ c.render3D(tape, T); });
+    }
+    return 0;
+}
@@ -9,6 +9,7 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 
 Copyright (C) 2019-2020  Matt Keeter
 */
+#include <algorithm>
 #include <chrono>
 #include <vector>
 #include <cmath>
@@ -16,7 +17,7 @@ Copyright (C) 2019-2020  Matt Keeter
 
 #include "stats.hpp"
 
-double get_stats(std::function<void()> f, int warmup, int count) {
+Timing get_timing(std::function<void()> f, int warmup, int count) {
     // Warm up
     for (int i=0; i < warmup; ++i) {
         f();
@@ -32,16 +33,33 @@ double get_stats(std::function<void()> f, int warmup, int count) {
         times_ms.push_back(
                 duration_cast<nanoseconds>(end_gpu - start_gpu).count() / 1e6);
     }
-    double mean = 0;
+    Timing out;
+    out.mean = 0;
     for (auto& b : times_ms) {
-        mean += b;
+        out.mean += b;
     }
-    mean /= times_ms.size();
-    double stdev = 0;
+    out.mean /= times_ms.size();
+    out.stdev = 0;
     for (auto& b : times_ms) {
-        stdev += std::pow(b - mean, 2);
+        out.stdev += std::pow(b - out.mean, 2);
     }
-    stdev = sqrt(stdev / (times_ms.size() - 1));
-    std::cout << mean << " " << stdev << "\n";
-    return mean;
+    out.stdev = sqrt(out.stdev / (times_ms.size() - 1));
+
+    std::sort(times_ms.begin(), times_ms.end());
+    auto percentile = [&](double p) {
+        const size_t rank = std::ceil(p / 100.0 * times_ms.size());
+        return times_ms[std::max<size_t>(rank, 1) - 1];
+    };
+    out.min = times_ms.front();
+    out.p50 = percentile(50);
+    out.p90 = percentile(90);
+    out.p99 = percentile(99);
+    out.max = times_ms.back();
+    return out;
+}
+
+double get_stats(std::function<void()> f, int warmup, int count) {
+    const Timing t = get_timing(f, warmup, count);
+    std::cout << t.mean << " " << t.stdev << "\n";
+    return t.mean;
 }
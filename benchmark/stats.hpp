@@ -11,4 +11,21 @@ Copyright (C) 2019-2020  Matt Keeter
 */
 #include <functional>
 
+/*  Summary of a set of timings, in milliseconds.  Percentiles pick the
+ *  nearest sample (so p50 of an even count is the lower middle one). */
+struct Timing {
+    double mean;
+    double stdev;
+    double min;
+    double p50;
+    double p90;
+    double p99;
+    double max;
+};
+
+/*  Calls `f` `warmup` times, then times `count` more calls */
+Timing get_timing(std::function<void()> f, int warmup=20, int count=100);
+
+/*  As get_timing, but prints the mean and standard deviation and returns
+ *  the mean */
 double get_stats(std::function<void()> f, int warmup=20, int count=100);
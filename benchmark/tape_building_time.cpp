@@ -54,5 +54,29 @@ int main(int argc, char **argv)
         std::chrono::duration_cast<std::chrono::milliseconds>(end_gpu - start_gpu).count() / 100 <<
         " ms\n";
 
+    // Rebuild the tape with a shared builder, which only has to analyze
+    // the nodes that are new since the last build (here, just the root)
+    mpr::TapeBuilder builder;
+    builder.build(t);
+    start_gpu = std::chrono::steady_clock::now();
+    for (unsigned i=0; i < 100; ++i) {
+        auto r = builder.build(max(t, libfive::Tree(-1.0f - i)));
+    }
+    end_gpu = std::chrono::steady_clock::now();
+    std::cout << "Incremental rebuild took " <<
+        std::chrono::duration_cast<std::chrono::milliseconds>(end_gpu - start_gpu).count() / 100 <<
+        " ms (" << builder.cachedNodes() << " cached nodes)\n";
+
+    // Compare with loading a saved tape, which skips building entirely
+    mpr::Tape(t).save("out.tape");
+    start_gpu = std::chrono::steady_clock::now();
+    for (unsigned i=0; i < 100; ++i) {
+        auto r = mpr::Tape::load("out.tape");
+    }
+    end_gpu = std::chrono::steady_clock::now();
+    std::cout << "Loading saved tape took " <<
+        std::chrono::duration_cast<std::chrono::microseconds>(end_gpu - start_gpu).count() / 100 <<
+        " us\n";
+
     return 0;
 }
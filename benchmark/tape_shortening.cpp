@@ -62,8 +62,8 @@ int main(int, char**)
         const uint32_t y = tile.position / (size / 64);
 
         unsigned len = 0;
-        for (auto j = tile.tape + 1; OP(&ctx.tape_data[j]); ++j) {
-            auto d = ctx.tape_data[j];
+        for (auto j = tile.tape + 1; OP(&ctx.subtapePool()[j]); ++j) {
+            auto d = ctx.subtapePool()[j];
             if (OP(&d) == mpr::GPU_OP_JUMP) {
                 j += JUMP_TARGET(&d);
             } else {
@@ -94,8 +94,8 @@ int main(int, char**)
         const uint32_t y = tile.position / (size / 8);
 
         unsigned len = 0;
-        for (auto j = tile.tape + 1; OP(&ctx.tape_data[j]); ++j) {
-            auto d = ctx.tape_data[j];
+        for (auto j = tile.tape + 1; OP(&ctx.subtapePool()[j]); ++j) {
+            auto d = ctx.subtapePool()[j];
             if (OP(&d) == mpr::GPU_OP_JUMP) {
                 j += JUMP_TARGET(&d);
             } else {
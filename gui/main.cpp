@@ -25,7 +25,7 @@ Copyright (C) 2019-2020  Matt Keeter
 #include "effects.hpp"
 #include "tape.hpp"
 
-#include "interpreter.hpp"
+#include "script_worker.hpp"
 #include "tex.hpp"
 
 #define TEXTURE_SIZE 2048
@@ -35,11 +35,6 @@ static void glfw_error_callback(int error, const char* description)
     fprintf(stderr, "glfw Error %d: %s\n", error, description);
 }
 
-struct Shape {
-    mpr::Tape tape;
-    libfive::Tree tree;
-};
-
 ////////////////////////////////////////////////////////////////////////////////
 
 int main(int argc, char** argv)
@@ -105,9 +100,12 @@ int main(int argc, char** argv)
         }
     }
 
-    // Create the interpreter
-    Interpreter interpreter;
-    bool needs_eval = true;
+    // Scripts are evaluated (and their tapes built) on a worker thread,
+    // which wakes up the main loop when a result is ready.  Until then, we
+    // keep drawing the previous result's shapes.
+    ScriptWorker worker([]() { glfwPostEmptyEvent(); });
+    ScriptResult script;
+    worker.submit(editor.GetText());
 
     // Our state
     bool show_demo_window = false;
@@ -136,8 +134,6 @@ int main(int argc, char** argv)
     };
     update_mats();
 
-    std::map<libfive::Tree::Id, Shape> shapes;
-
     // Generate a texture which we'll draw into
     GLuint gl_tex;
     glGenTextures(1, &gl_tex);
@@ -163,6 +159,10 @@ int main(int argc, char** argv)
     mpr::Context ctx(render_size);
     mpr::Effects effects;
 
+    // Rendering, effects, and texture uploads all run on this stream, so
+    // they're ordered without synchronizing the whole device.
+    auto stream = mpr::makeStream();
+
     while (!glfwWindowShouldClose(window))
     {
         // Poll and handle events (inputs, window resize, etc.)
@@ -261,43 +261,34 @@ int main(int argc, char** argv)
 
         // Draw the interpreter window and handle re-evaluation as needed
         ImGui::Begin("Text editor");
-            if (needs_eval) {
-                interpreter.eval(editor.GetText());
-
-                // Erase shapes that are no longer in the script
-                auto itr = shapes.begin();
-                while (itr != shapes.end()) {
-                    if (interpreter.shapes.find(itr->first) == interpreter.shapes.end()) {
-                        itr = shapes.erase(itr);
-                    } else {
-                        ++itr;
-                    }
-                }
-                // Create new shapes from the script
-                for (auto& t : interpreter.shapes) {
-                    if (shapes.find(t.first) == shapes.end()) {
-                        Shape s = { mpr::Tape(t.second), t.second };
-                        shapes.emplace(t.first, std::move(s));
-                    }
-                }
-            }
+            // Swap in the newest result, if the worker has finished one
+            worker.poll(script);
+            const bool busy = worker.busy();
 
             float size = ImGui::GetContentRegionAvail().y;
-            if (interpreter.result_valid) {
+            if (script.valid) {
                 size -= ImGui::GetFrameHeight() *
-                        (std::count(interpreter.result_str.begin(),
-                                    interpreter.result_str.end(), '\n') + 1);
+                        (std::count(script.str.begin(),
+                                    script.str.end(), '\n') + 1);
             } else {
                 size -= ImGui::GetFrameHeight() *
-                        (std::count(interpreter.result_err_str.begin(),
-                                    interpreter.result_err_str.end(), '\n') + 1);
+                        (std::count(script.err_str.begin(),
+                                    script.err_str.end(), '\n') + 1);
+            }
+            if (busy) {
+                size -= ImGui::GetFrameHeight();
             }
 
-            needs_eval = editor.Render("TextEditor", ImVec2(0, size));
-            if (interpreter.result_valid) {
-                ImGui::Text("%s", interpreter.result_str.c_str());
+            if (editor.Render("TextEditor", ImVec2(0, size))) {
+                worker.submit(editor.GetText());
+            }
+            if (script.valid) {
+                ImGui::Text("%s", script.str.c_str());
             } else {
-                ImGui::Text("%s", interpreter.result_err_str.c_str());
+                ImGui::Text("%s", script.err_str.c_str());
+            }
+            if (busy) {
+                ImGui::Text("Evaluating...");
             }
         ImGui::End();
 
@@ -341,7 +332,7 @@ int main(int argc, char** argv)
         ImGui::Begin("Shapes");
             bool append = false;
 
-            for (auto& s : shapes) {
+            for (auto& s : script.shapes) {
                 ImGui::Text("Shape at %p", (void*)s.first);
                 ImGui::Columns(2);
                 //ImGui::Text("%u clauses", s.second.handle->tape.num_clauses);
@@ -361,39 +352,30 @@ int main(int argc, char** argv)
                         mat2d.block<2, 1>(0, 2) = mat.block<2, 1>(0, 3);
                         mat2d.block<1, 2>(2, 0) = mat.block<1, 2>(3, 0);
                         mat2d.block<1, 1>(2, 2) = mat.block<1, 1>(3, 3);
-                        ctx.render2D(s.second.tape, mat2d);
+                        ctx.render2DAsync(s.second->tape, mat2d, 0.0f,
+                                          stream.get());
                     } else {
-                        ctx.render3D(s.second.tape, model.matrix());
+                        ctx.render3DAsync(s.second->tape, model.matrix(),
+                                          stream.get());
                     }
                     auto end = high_resolution_clock::now();
                     auto dt = duration_cast<microseconds>(end - start);
                     ImGui::Text("Render time: %f s", dt.count() / 1e6);
 
-                    if (render_mode == RENDER_MODE_SSAO) {
-                        start = high_resolution_clock::now();
-                        effects.drawSSAO(ctx);
-                        end = high_resolution_clock::now();
-                        auto dt = duration_cast<microseconds>(end - start);
-                        ImGui::Text("SSAO time: %f s", dt.count() / 1e6);
-                    } else if (render_mode == RENDER_MODE_SHADED) {
-                        start = high_resolution_clock::now();
-                        effects.drawShaded(ctx);
-                        end = high_resolution_clock::now();
-                        auto dt = duration_cast<microseconds>(end - start);
-                        ImGui::Text("SSAO + shading time: %f s", dt.count() / 1e6);
-                    }
-
+                    // SSAO and shading are fused into the texture upload,
+                    // which is only enqueued here, finishing while the host
+                    // moves on to the next shape or frame.
                     start = high_resolution_clock::now();
                     copy_to_texture(ctx, effects, cuda_tex, TEXTURE_SIZE,
-                                    append, (Mode)render_mode);
+                                    append, (Mode)render_mode, stream.get());
                     end = high_resolution_clock::now();
                     dt = duration_cast<microseconds>(end - start);
-                    ImGui::Text("Texture load time: %f s", dt.count() / 1e6);
+                    ImGui::Text("Texture enqueue time: %f s", dt.count() / 1e6);
                 }
 
                 if (ImGui::Button("Save shape.frep")) {
                     auto a = libfive::Archive();
-                    a.addShape(s.second.tree);
+                    a.addShape(s.second->tree);
                     std::ofstream out("shape.frep");
                     if (out.is_open()) {
                         a.serialize(out);
@@ -449,7 +431,8 @@ int main(int argc, char** argv)
         glfwSwapBuffers(window);
     }
 
-    // Cleanup
+    // Cleanup, stopping the worker first since it wakes up GLFW
+    worker.stop();
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
     ImGui::DestroyContext();
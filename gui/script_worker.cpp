@@ -0,0 +1,157 @@
+/*
+Simple GUI to demonstrate the reference implementation of
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include <stdexcept>
+
+#include "script_worker.hpp"
+
+ScriptWorker::ScriptWorker(std::function<void()> on_result)
+    : on_result(on_result), thread([this]() { run(); })
+{
+    // Nothing to do here
+}
+
+ScriptWorker::~ScriptWorker() {
+    stop();
+}
+
+void ScriptWorker::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+    }
+    cv.notify_all();
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void ScriptWorker::submit(const std::string& s) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        script = s;
+        submitted++;
+    }
+    cv.notify_all();
+}
+
+bool ScriptWorker::poll(ScriptResult& out) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!has_result) {
+        return false;
+    }
+    out = std::move(result);
+    has_result = false;
+    return true;
+}
+
+bool ScriptWorker::busy() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return published != submitted;
+}
+
+void ScriptWorker::run() {
+    // The interpreter is built here, so that Guile is only ever used from
+    // this thread
+    Interpreter interpreter;
+
+    // Shared between evaluations, so that editing a script only has to
+    // analyze the parts of each shape that changed
+    mpr::TapeBuilder builder;
+
+    // Every shape with a built tape, and the shapes of the last valid script
+    ShapeMap built;
+    ShapeMap valid;
+
+    uint64_t generation = 0;
+    auto stale = [&]() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return done || submitted != generation;
+    };
+
+    while (true) {
+        std::string s;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&]() { return done || submitted != generation; });
+            if (done) {
+                return;
+            }
+            generation = submitted;
+            s = script;
+        }
+        interpreter.eval(s);
+
+        ScriptResult out;
+        out.valid = interpreter.result_valid;
+        out.str = interpreter.result_str;
+        out.err_str = interpreter.result_err_str;
+        out.err_range = interpreter.result_err_range;
+
+        // Build tapes for new shapes, bailing out if a newer script arrives.
+        // Tapes that were already built are kept for the next script.
+        if (out.valid) {
+            ShapeMap next;
+            bool cancelled = false;
+            for (auto& t : interpreter.shapes) {
+                if (stale()) {
+                    cancelled = true;
+                    break;
+                }
+                auto itr = built.find(t.first);
+                if (itr != built.end()) {
+                    next.insert(*itr);
+                    continue;
+                }
+                // Shapes which don't fit the evaluators (e.g. with too many
+                // parameters) make the whole script invalid
+                try {
+                    next.emplace(t.first, std::make_shared<const Shape>(
+                                Shape { builder.build(t.second), t.second }));
+                } catch (const std::runtime_error& e) {
+                    out.valid = false;
+                    out.err_str = e.what();
+                    out.err_range = {0, 0, 0, 0};
+                    break;
+                }
+            }
+            if (cancelled) {
+                built.insert(next.begin(), next.end());
+                continue;
+            } else if (out.valid) {
+                built = next;
+                valid = next;
+            } else {
+                built.insert(next.begin(), next.end());
+            }
+        }
+        out.shapes = valid;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (submitted != generation) {
+                continue;
+            }
+            result = std::move(out);
+            has_result = true;
+            published = generation;
+        }
+        on_result();
+    }
+}
@@ -0,0 +1,101 @@
+/*
+Simple GUI to demonstrate the reference implementation of
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#pragma once
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "tape.hpp"
+#include "interpreter.hpp"
+
+struct Shape {
+    mpr::Tape tape;
+    libfive::Tree tree;
+};
+typedef std::map<libfive::Tree::Id, std::shared_ptr<const Shape>> ShapeMap;
+
+/*  Everything that the GUI needs from one evaluation of the script */
+struct ScriptResult {
+    bool valid = true;
+    std::string str;        // Printed result, if valid
+    std::string err_str;    // Error message, if not
+    Range err_range;
+
+    // Shapes from the script, or from the last valid script if this one
+    // has an error.  Shapes are shared with the worker's cache, so a shape
+    // that survives an edit keeps its tape.
+    ShapeMap shapes;
+};
+
+/*
+ *  Evaluates scripts and builds their tapes on a background thread, so that
+ *  the GUI keeps rendering the previous shapes at full frame rate while a
+ *  script is running.
+ *
+ *  Only the newest script matters: submitting a script replaces one that is
+ *  still queued, and a script which is superseded while it's running is
+ *  abandoned between tape builds.  Guile evaluation itself can't be
+ *  interrupted, so it always runs to completion.
+ *
+ *  Every use of Guile and of the TapeBuilder happens on the worker thread.
+ */
+struct ScriptWorker {
+    /*  `on_result` is called from the worker thread when a result is ready,
+     *  e.g. to wake up the GUI's event loop */
+    explicit ScriptWorker(std::function<void()> on_result);
+    ~ScriptWorker();
+
+    /*  Queues a script for evaluation */
+    void submit(const std::string& script);
+
+    /*  Moves the newest finished result into `out`, returning false (and
+     *  leaving `out` alone) if there isn't a new one.  Since results are
+     *  swapped in whole, the caller never sees a partly-built set of shapes. */
+    bool poll(ScriptResult& out);
+
+    /*  Returns true if the newest script hasn't finished yet */
+    bool busy();
+
+    /*  Stops the worker thread, waiting for the current script to finish.
+     *  This is called by the destructor, but should be called earlier if
+     *  `on_result` uses something which is about to be destroyed. */
+    void stop();
+
+private:
+    void run();
+
+    std::function<void()> on_result;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::string script;         // Newest script
+    uint64_t submitted=0;       // Generation of `script`
+    uint64_t published=0;       // Generation of the newest result
+    bool has_result=false;      // True if `result` hasn't been polled yet
+    ScriptResult result;
+    bool done=false;
+
+    // Declared last, so that it starts after everything else is constructed
+    std::thread thread;
+};
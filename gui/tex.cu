@@ -22,12 +22,12 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #include "tex.hpp"
 
-cudaGraphicsResource* register_texture(GLuint t)
+CudaTexture register_texture(GLuint t)
 {
     cudaGraphicsResource* gl_tex;
     CUDA_CHECK(cudaGraphicsGLRegisterImage(&gl_tex, t, GL_TEXTURE_2D,
                                       cudaGraphicsMapFlagsWriteDiscard));
-    return gl_tex;
+    return CudaTexture { gl_tex, 0, mpr::makeEvent() };
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -99,65 +99,27 @@ void copy_normals_to_surface(int32_t* const __restrict__ image,
     }
 }
 
-__global__
-void copy_ssao_to_surface(int32_t* const __restrict__ image,
-                          int32_t* const __restrict__ ssao,
-                          int image_size_px,
-                          cudaSurfaceObject_t surf,
-                          int texture_size_px, bool append)
-{
-    int x = threadIdx.x + blockIdx.x * blockDim.x;
-    int y = threadIdx.y + blockIdx.y * blockDim.y;
-
-    if (x < texture_size_px && y < texture_size_px) {
-        const uint32_t px = x * image_size_px / texture_size_px;
-        const uint32_t py = y * image_size_px / texture_size_px;
-        const auto h = image[px + py * image_size_px];
-        if (h) {
-            auto s = ssao[px + py * image_size_px];
-            surf2Dwrite(0xFF000000 | s | (s << 8) | (s << 16),
-                        surf, x*4, y);
-        } else if (!append) {
-            surf2Dwrite(0, surf, x*4, y);
-        }
-    }
-}
-
-__global__
-void copy_shaded_to_surface(int32_t* const __restrict__ image,
-                            int32_t* const __restrict__ shaded,
-                            int image_size_px,
-                            cudaSurfaceObject_t surf,
-                            int texture_size_px, bool append)
-{
-    int x = threadIdx.x + blockIdx.x * blockDim.x;
-    int y = threadIdx.y + blockIdx.y * blockDim.y;
-
-    if (x < texture_size_px && y < texture_size_px) {
-        const uint32_t px = x * image_size_px / texture_size_px;
-        const uint32_t py = y * image_size_px / texture_size_px;
-        const auto h = image[px + py * image_size_px];
-        if (h) {
-            surf2Dwrite(shaded[px + py * image_size_px],
-                        surf, x*4, y);
-        } else if (!append) {
-            surf2Dwrite(0, surf, x*4, y);
-        }
-    }
-}
-
 ////////////////////////////////////////////////////////////////////////////////
 
 void copy_to_texture(const mpr::Context& ctx,
-                     const mpr::Effects& effects,
-                     cudaGraphicsResource* gl_tex,
+                     mpr::Effects& effects,
+                     CudaTexture& tex,
                      int texture_size_px,
                      bool append,
-                     Mode mode)
+                     Mode mode,
+                     cudaStream_t stream)
 {
+    // The previous upload's surface can only go away once it's finished
+    if (tex.surf) {
+        CUDA_CHECK(cudaEventSynchronize(tex.done.get()));
+        CUDA_CHECK(cudaDestroySurfaceObject(tex.surf));
+        tex.surf = 0;
+    }
+
     cudaArray* array;
-    CUDA_CHECK(cudaGraphicsMapResources(1, &gl_tex));
-    CUDA_CHECK(cudaGraphicsSubResourceGetMappedArray(&array, gl_tex, 0, 0));
+    CUDA_CHECK(cudaGraphicsMapResources(1, &tex.resource, stream));
+    CUDA_CHECK(cudaGraphicsSubResourceGetMappedArray(
+                &array, tex.resource, 0, 0));
 
     // Specify texture
     struct cudaResourceDesc res_desc;
@@ -166,50 +128,46 @@ void copy_to_texture(const mpr::Context& ctx,
     res_desc.res.array.array = array;
 
     // Surface object??!
-    cudaSurfaceObject_t surf = 0;
-    CUDA_CHECK(cudaCreateSurfaceObject(&surf, &res_desc));
-    CUDA_CHECK(cudaDeviceSynchronize());
+    CUDA_CHECK(cudaCreateSurfaceObject(&tex.surf, &res_desc));
+    const cudaSurfaceObject_t surf = tex.surf;
 
     const unsigned u = (texture_size_px + 15) / 16;
     switch (mode) {
         case RENDER_MODE_2D:
-            copy_2d_to_surface<<<dim3(u, u), dim3(16, 16)>>>(
+            copy_2d_to_surface<<<dim3(u, u), dim3(16, 16), 0, stream>>>(
                     ctx.stages[3].filled.get(),
                     ctx.image_size_px,
                     surf, texture_size_px, append);
             break;
         case RENDER_MODE_DEPTH:
-            copy_depth_to_surface<<<dim3(u, u), dim3(16, 16)>>>(
+            copy_depth_to_surface<<<dim3(u, u), dim3(16, 16), 0, stream>>>(
                     ctx.stages[3].filled.get(),
                     ctx.image_size_px,
                     surf, texture_size_px, append);
             break;
         case RENDER_MODE_NORMALS:
-            copy_normals_to_surface<<<dim3(u, u), dim3(16, 16)>>>(
+            copy_normals_to_surface<<<dim3(u, u), dim3(16, 16), 0, stream>>>(
                     ctx.stages[3].filled.get(),
                     ctx.normals.get(),
                     ctx.image_size_px,
                     surf, texture_size_px, append);
             break;
         case RENDER_MODE_SSAO:
-            copy_ssao_to_surface<<<dim3(u, u), dim3(16, 16)>>>(
-                    ctx.stages[3].filled.get(),
-                    effects.image.get(),
-                    ctx.image_size_px,
-                    surf, texture_size_px, append);
+            effects.drawToSurface(ctx, surf, texture_size_px, append,
+                                  mpr::EFFECTS_SSAO, mpr::SSAO_REFERENCE,
+                                  stream);
             break;
         case RENDER_MODE_SHADED:
-            copy_shaded_to_surface<<<dim3(u, u), dim3(16, 16)>>>(
-                    ctx.stages[3].filled.get(),
-                    effects.image.get(),
-                    ctx.image_size_px,
-                    surf, texture_size_px, append);
+            effects.drawToSurface(ctx, surf, texture_size_px, append,
+                                  mpr::EFFECTS_SHADED, mpr::SSAO_REFERENCE,
+                                  stream);
             break;
         default: break;
     }
     CUDA_CHECK(cudaGetLastError());
 
-    CUDA_CHECK(cudaDeviceSynchronize());
-    CUDA_CHECK(cudaDestroySurfaceObject(surf));
-    CUDA_CHECK(cudaGraphicsUnmapResources(1, &gl_tex));
+    // Unmapping is stream-ordered, so GL won't read the texture until
+    // these kernels are done.
+    CUDA_CHECK(cudaGraphicsUnmapResources(1, &tex.resource, stream));
+    CUDA_CHECK(cudaEventRecord(tex.done.get(), stream));
 }
@@ -20,13 +20,24 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #pragma once
 #include <cuda_gl_interop.h>
 
+#include "util.hpp"
+
 // Forward declaration
 namespace mpr {
 struct Context;
 struct Effects;
 }
 
-cudaGraphicsResource* register_texture(GLuint t);
+/*  A GL texture which is registered with CUDA.  Uploads are stream-ordered,
+ *  so each one's surface object is kept until the next upload, which waits
+ *  on `done` before destroying it. */
+struct CudaTexture {
+    cudaGraphicsResource* resource;
+    cudaSurfaceObject_t surf;
+    mpr::Event done;
+};
+
+CudaTexture register_texture(GLuint t);
 
 enum Mode {
     RENDER_MODE_2D,
@@ -36,8 +47,14 @@ enum Mode {
     RENDER_MODE_SHADED,
 };
 
+/*  Draws the context's most recent render into the texture, on `stream`.
+ *  SSAO and shading are drawn straight into the texture, and nothing waits
+ *  on the host, so the upload overlaps with whatever the host does next;
+ *  the render (and the next render with the same context) must be on the
+ *  same stream. */
 void copy_to_texture(const mpr::Context& ctx,
-                     const mpr::Effects& effects,
-                     cudaGraphicsResource* gl_tex,
+                     mpr::Effects& effects,
+                     CudaTexture& tex,
                      int texture_size_px,
-                     bool append, Mode mode);
+                     bool append, Mode mode,
+                     cudaStream_t stream);
@@ -21,3 +21,5 @@ Copyright (C) 2019-2020  Matt Keeter
 #define I_RHS(d) (((uint8_t*)(d))[3])
 #define IMM(d) (((float*)(d))[1])
 #define JUMP_TARGET(d) (((int32_t*)(d))[1])
+#define PARAM_INDEX(d) (((int32_t*)(d))[1])
+#define SPILL_INDEX(d) (((int32_t*)(d))[1])
@@ -11,13 +11,20 @@ Copyright (C) 2019-2020  Matt Keeter
 */
 #pragma once
 #include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 #include <Eigen/Eigen>
 
+#include "parameters.hpp"
+#include "render_stats.hpp"
 #include "util.hpp"
 
 namespace mpr {
 
-// Forward declaration
+// Forward declarations
 struct Tape;
 
 struct TileNode {
@@ -35,12 +42,276 @@ struct Tiles {
     size_t tile_array_size=0;
 };
 
+/*  Controls how a Context allocates its GPU buffers */
+enum MemoryPolicy {
+    /*  Every buffer comes from cudaMallocManaged, so the host can read
+     *  (and write) anything directly.  This is the default. */
+    MEMORY_MANAGED,
+
+    /*  Buffers which are only touched by the GPU (tapes, tiles, counters,
+     *  and scratch values) come from cudaMalloc, which avoids page-migration
+     *  stalls.  Output images (`filled` and `normals`) stay managed, so they
+     *  can still be read by the host, but are hinted to live on the GPU.
+     *  It is an error to dereference `tape_index` from the host. */
+    MEMORY_DEVICE,
+};
+
+/*  Selects the outputs of a 3D render (see Context::render_flags) */
+enum RenderFlags {
+    /*  The heightmap in `stages[3].filled`, which is always rendered */
+    RENDER_DEPTH = 1,
+
+    /*  Per-pixel normals in `normals`, which need an extra pass of automatic
+     *  differentiation over every filled pixel */
+    RENDER_NORMALS = 2,
+};
+
+/*  Selects the hardware that renders frames (see Context::backend) */
+enum Backend {
+    /*  Every stage runs in CUDA kernels.  This is the default. */
+    BACKEND_CUDA,
+
+    /*  render2D and render3D (and their async versions) run on a pool of
+     *  CPU threads instead (see cpu_render.hpp), reading the same tape,
+     *  without using the GPU.  Other kinds of render aren't supported. */
+    BACKEND_CPU,
+};
+
+/*  Static resource usage of one evaluator kernel, from the CUDA runtime */
+struct KernelOccupancy {
+    const char* name;
+    int32_t slots;          // Size of the per-thread slot array
+    int32_t registers;      // Registers per thread
+    size_t local_bytes;     // Local memory (incl. spills) per thread
+    int32_t blocks_per_sm;  // Resident blocks per multiprocessor
+    float occupancy;        // Fraction of the maximum resident warps
+};
+
+/*  Sets `count` runtime parameters, starting at index `first`.  These are
+ *  the values of the free variables in tapes (see TapeBuilder::parameter),
+ *  and live in a small constant buffer on the current device, which is
+ *  shared by every Context and tape.  Changing a parameter is a copy of a
+ *  few bytes (ordered on `stream`) before the next render, without
+ *  rebuilding or uploading the tape. */
+void setParameters(const float* values, int32_t count, int32_t first=0,
+                   cudaStream_t stream=0);
+
+/*  Sets the parameter with the given name in `tape`, throwing
+ *  std::runtime_error if the tape doesn't have one */
+void setParameter(const Tape& tape, const std::string& name, float value,
+                  cudaStream_t stream=0);
+
 struct Context {
-    Context(int32_t image_size_px);
+    /*  Images are `image_size_px` square (and deep, in 3D), which must be a
+     *  multiple of the 64-pixel first-stage tiles; other sizes throw
+     *  std::runtime_error.  Other aspect ratios are rendered in a larger
+     *  square context with viewport culling (see viewport_width).
+     *
+     *  With BACKEND_CPU (which the MPR_BACKEND environment variable can
+     *  also select, see `backend`), the constructor doesn't touch the GPU,
+     *  and `policy` is ignored. */
+    Context(int32_t image_size_px, MemoryPolicy policy=MEMORY_MANAGED,
+            Backend backend=BACKEND_CUDA);
+    Context(Context&&);
+    Context& operator=(Context&&);
+    ~Context();
+
     void render3D(const Tape& tape, const Eigen::Matrix4f& mat);
     void render2D(const Tape& tape, const Eigen::Matrix3f& mat,
                   const float z=0.0f);
 
+    /*  Renders several shapes (each with its own tape and matrix) in a single
+     *  pass through the stages, so that small shapes share kernel launches
+     *  instead of each running a mostly-idle GPU.
+     *
+     *  Shapes are rendered independently, into separate images: shape i's
+     *  depth image starts at `stages[3].filled.get() + i * image_size_px^2`,
+     *  and its normals at the same offset in `normals`.
+     *
+     *  The tapes must fit into the subtape pool together, and the number of
+     *  shapes is limited by the 32-bit tile positions at the voxel stage
+     *  (e.g. to 128 shapes for a 1024^3 render). */
+    typedef std::pair<const Tape*, Eigen::Matrix4f> BatchShape;
+    typedef std::vector<BatchShape, Eigen::aligned_allocator<BatchShape>> Batch;
+    void render3DBatch(const Batch& shapes);
+
+    /*  Renders one tape from several camera matrices, e.g. to make a set of
+     *  thumbnails.  This is a batch (see above) where every shape shares
+     *  the same base tape, which is only copied into the tape pool once;
+     *  view i is stored in image i. */
+    typedef std::vector<Eigen::Matrix4f,
+                        Eigen::aligned_allocator<Eigen::Matrix4f>> Views;
+    void render3DViews(const Tape& tape, const Views& mats);
+
+    /*  Renders a 3D image which is `tiles` times larger than the context's
+     *  image size on each side, for resolutions which wouldn't fit in GPU
+     *  memory.  The volume is split into sub-frustums of `image_size_px^3`
+     *  voxels, which are rendered one at a time with the usual stage buffers,
+     *  so device memory doesn't depend on the final resolution.
+     *
+     *  Sub-frustums are rendered front-to-back (from the top of the Z range),
+     *  and a column stops early once every pixel is filled.  When a column
+     *  of the image finishes, `callback` is called with its XY tile index,
+     *  and its depth and normal images (in host memory, with depth in pixels
+     *  of the full-size image).  These buffers are only valid during the
+     *  callback, which should copy them into a larger image or to a file. */
+    typedef std::function<void(int32_t tx, int32_t ty,
+                               const int32_t* depth,
+                               const uint32_t* normals)> TileCallback;
+    void render3DTiled(const Tape& tape, const Eigen::Matrix4f& mat,
+                       const int32_t tiles, const TileCallback& callback);
+
+    /*  Stream-ordered versions of render3D and render2D.  Every kernel,
+     *  memset, and readback is enqueued on `stream`, so several contexts
+     *  can share one GPU without serializing the whole device.  The host
+     *  only waits on `stream` itself (to read back per-stage tile counts
+     *  into pinned memory), never on the device as a whole.
+     *
+     *  The returned event is owned by the Context and is recorded after the
+     *  last kernel of the frame; the caller must wait on it (or on the
+     *  stream) before reading `stages[3].filled` or `normals`.
+     *
+     *  With `device_sizing` enabled, even the per-stage readbacks go away
+     *  and the frame is enqueued without any host synchronization. */
+    cudaEvent_t render3DAsync(const Tape& tape, const Eigen::Matrix4f& mat,
+                              cudaStream_t stream);
+    cudaEvent_t render2DAsync(const Tape& tape, const Eigen::Matrix3f& mat,
+                              const float z, cudaStream_t stream);
+
+    /*  Renders `n` 2D slices of `tape`, at the heights in the host array
+     *  `zs`, which is much cheaper than calling render2D once per slice.
+     *  The tape is copied once, and consecutive slices are handled in
+     *  groups of `slice_group`: the 64^2 tiles are evaluated once per group,
+     *  over the group's whole range of heights, so their pruning and
+     *  subtapes are shared by every slice in it.  Smaller tiles and pixels
+     *  are then evaluated per slice, without waiting on the host.
+     *
+     *  Afterwards, `slice_bits` holds one bit per pixel for each slice (in
+     *  the same layout as `occupancy`), with slice k starting at word
+     *  k * image_size_px^2 / 32.  This runs on the default stream, and
+     *  overwrites the stage buffers and images. */
+    void render2DSlices(const Tape& tape, const Eigen::Matrix3f& mat,
+                        const float* zs, int32_t n);
+    int32_t slice_group=8;
+    Ptr<uint32_t[]> slice_bits;
+
+    /*  Captures a 3D render of `tape` into a CUDA graph, which is replayed by
+     *  renderCached with a new matrix each time.  This removes most of the
+     *  per-kernel launch overhead, which dominates small images.
+     *
+     *  The tape must stay alive (and unchanged) until the next call to
+     *  prepare.  The graph is recorded lazily on the first renderCached,
+     *  and rerecorded whenever a buffer it uses has to be reallocated.
+     *
+     *  The graph always runs in device-sizing mode (see `device_sizing`,
+     *  which is left as it was), so stage buffers are sized from earlier
+     *  frames and a replayed frame can run out of room.  Once the frame's
+     *  event has completed, the caller must check overflowed(): if it's
+     *  true, tiles were dropped, and calling renderCached again grows the
+     *  buffers, records a new graph, and renders the frame in full. */
+    void prepare(const Tape& tape);
+    cudaEvent_t renderCached(const Eigen::Matrix4f& mat,
+                             cudaStream_t stream=0);
+
+    /*  Progressive 3D rendering, for interactive use.  beginRender3D runs
+     *  the interval stages up to and including `preview_stage` (0 for the
+     *  64^3 stage, 1 for 16^3), then returns with a coarse depth image.
+     *  Each call to refineRender3D runs more stages until `budget_ms` has
+     *  passed (always running at least one), and returns true once the
+     *  final image is done.
+     *
+     *  At any point, `stages[previewStage()].filled` is a conservative depth
+     *  image: it only includes tiles which are known to be filled, at that
+     *  stage's resolution (image_size_px / 16, / 4, or full size), with Z in
+     *  the same units.  Stages can't be split, so the budget is only checked
+     *  between them.  Everything runs on the default stream.
+     *
+     *  The tape must stay alive until the frame is finished, and the context
+     *  must not be used for other renders in the meantime.  Stage buffers
+     *  are still grown between frames in device-sizing mode, but a frame
+     *  which overflows them isn't re-rendered (see overflowed()). */
+    void beginRender3D(const Tape& tape, const Eigen::Matrix4f& mat,
+                       int32_t preview_stage=0);
+    bool refineRender3D(double budget_ms);
+    int32_t previewStage() const;
+
+    /*  In device-sizing mode, returns true if the most recent frame ran out of
+     *  room in one of its stage buffers and had to drop tiles.  The buffers
+     *  are grown automatically at the start of the next frame, and
+     *  render2D / render3D re-render until this returns false.
+     *
+     *  This reads back results from the GPU, so it must only be called
+     *  once the frame's event has completed. */
+    bool overflowed() const;
+
+    /*  Evaluates `tape` at `n` points, writing the value at each point to
+     *  `out` and (if `grad` isn't null) its gradient to `grad`.  Values use
+     *  the float interpreter from the voxel stage, and gradients use the
+     *  automatic differentiation from the normal pass.  No image is
+     *  touched, so this can be mixed freely with renders.
+     *
+     *  Pointers to device or managed memory are used in place, so data can
+     *  stay on the GPU; pointers to ordinary host memory are staged through
+     *  a device buffer (which makes the async version block on readback).
+     *
+     *  When `point_block_size` is non-zero, each run of that many
+     *  consecutive points is treated as a cluster: its bounding box is
+     *  evaluated with interval arithmetic, as a tile would be, and its
+     *  points use the shortened tape.  This pays off for spatially coherent
+     *  batches (e.g. samples along a toolpath, or points sorted along a
+     *  space-filling curve); scattered points give loose bounds and little
+     *  pruning. */
+    void evalPoints(const Tape& tape, const float3* pts, size_t n,
+                    float* out, float3* grad=nullptr);
+    cudaEvent_t evalPointsAsync(const Tape& tape, const float3* pts,
+                                size_t n, float* out, float3* grad,
+                                cudaStream_t stream);
+    int32_t point_block_size=0;
+
+    /*  Renders the whole volume of `tape` (not just its front surface) as a
+     *  sparse hierarchy, for meshing and collision.  Occlusion culling is
+     *  disabled, and each stage's tiles are classified as empty, filled, or
+     *  ambiguous; only ambiguous tiles are subdivided, and only ambiguous
+     *  4^3 tiles are evaluated per voxel.  Interior regions are stored as
+     *  coarse filled tiles, so memory scales with the surface area of the
+     *  shape rather than its volume.
+     *
+     *  Voxels use the same grid (and matrix) as render3D.  Afterwards:
+     *  -   volumeFilled(i) lists the first volume_counts_host[i] filled
+     *      tiles of stage i (64^3, 16^3, and 4^3 voxels), as positions
+     *      x + y * n + z * n^2 in that stage's grid of n tiles per side
+     *  -   The first volume_counts_host[3] tiles of `stages[3].tiles` are
+     *      the ambiguous 4^3 tiles, with positions in the same form, and
+     *      volume_masks[k] has bit x + 4y + 16z set for each filled voxel
+     *      of tile k.
+     *
+     *  This uses the stage buffers (and overwrites their tile lists), and
+     *  runs on the default stream. */
+    void renderVolume(const Tape& tape, const Eigen::Matrix4f& mat);
+    const int32_t* volumeFilled(int32_t stage) const;
+    Ptr<uint64_t[]> volume_masks;
+    HostPtr<int32_t[]> volume_counts_host;  // Filled tiles per stage, then
+                                            // the ambiguous 4^3 tiles
+
+    /*  Extracts a triangle mesh of the surface of `tape`, using the tiles
+     *  from renderVolume (whose results are also left in place).  Each
+     *  ambiguous 4^3 tile is meshed by marching tetrahedra over its cells,
+     *  using its shortened tape: values at the cell corners, and gradients
+     *  (for normals) at the vertices.  The mesh has one cell per voxel, in
+     *  model space, and triangles are wound counter-clockwise when seen from
+     *  outside of the shape.
+     *
+     *  Afterwards, mesh_vertices and mesh_normals hold mesh_counts_host[0]
+     *  vertices, and mesh_indices holds mesh_counts_host[1] triangles (as
+     *  three vertex indices each), in device memory.  Vertices aren't
+     *  shared between tiles, so a vertex on a tile's face is repeated in
+     *  each tile that touches it. */
+    void renderMesh(const Tape& tape, const Eigen::Matrix4f& mat);
+    Ptr<float3[]> mesh_vertices;
+    Ptr<float3[]> mesh_normals;
+    Ptr<uint32_t[]> mesh_indices;
+    HostPtr<int32_t[]> mesh_counts_host;    // Vertices, then triangles
+
     /*  Renders a 2D image using a brute-force approach, without subdivision
      *  or tape pruning.  This is only useful for benchmarking, and is not
      *  recommended for regular use. */
@@ -58,18 +329,262 @@ struct Context {
                                   const Eigen::Matrix4f& mat);
 
     int32_t image_size_px;
+    MemoryPolicy memory_policy;
+
+    /*  The subtape pool holds chunks of SUBTAPE_CHUNK_SIZE clauses (see
+     *  tape_capacity).  When it fills up, tiles stop pushing subtapes and
+     *  keep evaluating their parent's (longer) tape, which is much slower.  The pool is allocated by the first frame which needs
+     *  it, with room for `initial_subtapes`.
+     *
+     *  Failed pushes are counted (see subtapeOverflows).  If `grow_subtapes`
+     *  is set, the pool is doubled (up to `max_subtapes`) before the next
+     *  frame that follows an overflowing one. */
+    size_t initial_subtapes=NUM_SUBTAPES;
+    size_t max_subtapes=NUM_SUBTAPES * 4;
+    bool grow_subtapes=true;
 
-    Ptr<uint64_t[]> tape_data;    // original tape is copied to index 0
-    Ptr<int32_t> tape_index;    // single value
+    /*  When true, pushed subtapes are written as one contiguous run of
+     *  clauses (sized by a counting pass), rather than as a linked list of
+     *  SUBTAPE_CHUNK_SIZE chunks.  This costs an extra walk of the parent tape
+     *  when pushing, but later stages never have to follow a jump. */
+    bool contiguous_subtapes=false;
+
+    /*  When true, tiles with the same parent tape which make the same min/max
+     *  choices share one pushed subtape, found through a hash table that is
+     *  cleared at the start of every frame.  This
+     *  saves room in the subtape pool (and bandwidth) when large regions of
+     *  a model simplify the same way, at the cost of hashing each tile's
+     *  choices.  A hash collision between two tiles with the same parent
+     *  would give one of them the wrong tape, which is very unlikely with
+     *  64-bit keys. */
+    bool dedupe_subtapes=false;
+
+    /*  When non-zero, per-voxel evaluation first copies this many clauses of
+     *  each tile's tape into shared memory, so that the 32 threads working on
+     *  a tile don't all read their tape from global memory.  Deep tapes are
+     *  usually short, so a few dozen clauses (e.g. 64) is plenty. */
+    int32_t voxel_cache_clauses=0;
+
+    /*  Evaluators are compiled for slot arrays of 8, 16, 32, 64, and 128
+     *  slots, and each frame uses the smallest one that fits its tapes (see
+     *  Tape::num_slots).  Setting this forces a larger array, which is mostly
+     *  useful for benchmarking; 128 always uses the largest one. */
+    int32_t min_slots=0;
+
+    /*  When true, the first stage evaluates the root tape with a kernel that
+     *  is compiled for it at runtime (see jit.hpp), rather than with the
+     *  interpreter.  The first frame with a new tape pays for compilation,
+     *  then the kernel is cached.  Batches of different tapes, and every
+     *  later stage, still use the interpreter.  So does the first stage when
+     *  it's evaluated in slabs (`z_slabs`), with affine arithmetic (bit 0 of
+     *  `affine_stages`), or from cached subtapes (`incremental`). */
+    bool jit=false;
+
+    /*  When true, 3D renders of a single shape remember what each first-stage
+     *  tile found (empty, filled, or a pushed subtape), over slightly
+     *  inflated bounds in model space.  In the next frame, tiles whose new
+     *  bounds still fit in the old ones reuse that result, and start from the
+     *  cached subtape instead of the root tape, so small camera moves mostly
+     *  skip the first (and most expensive) stage.  Cached subtapes are kept
+     *  at the start of the subtape pool, and the cache is rebuilt when they
+     *  fill a quarter of it, or when the tape changes. */
+    bool incremental=false;
+
+    /*  Bit i of this mask skips interval evaluation at stage i, so the stage
+     *  only subdivides its tiles, which keep their parent's tape.  In 3D,
+     *  stages 0-2 are 64^3, 16^3, and 4^3 tiles; in 2D, stages 0 and 2 are
+     *  64^2 and 8^2 tiles.  These sizes (and the 64-way subdivision between
+     *  stages) are fixed, so this only chooses which stages are evaluated.
+     *  Models with large, smooth features may be faster with fewer stages,
+     *  and intricate ones with every stage.  Skipping stages makes later
+     *  stages much larger; benchmark/skip_stages picks the fastest mask for
+     *  a model. */
+    uint32_t skip_stages=0;
+
+    /*  Interval stages with fewer than this many tiles evaluate each tile
+     *  with a whole warp (splitting it into 32 pieces), rather than with a
+     *  single thread, so that small stages still fill the GPU.  This defaults
+     *  to the number of warps which the device can keep resident; setting it
+     *  to 0 disables warp evaluation. */
+    int32_t warp_tiles=0;
+
+    /*  Bit i of this mask evaluates stage i with affine arithmetic (see
+     *  gpu_affine.hpp) instead of intervals, using the same stage numbers as
+     *  `skip_stages`.  Affine bounds track how values depend on a tile's
+     *  inputs, so they're tighter on deep expressions and leave fewer tiles
+     *  ambiguous, but each clause is a few times more expensive.  Stages
+     *  evaluated by warps (see `warp_tiles`) still use intervals.  Whether
+     *  it pays off depends on the model; benchmark/affine_tiles compares
+     *  masks. */
+    uint32_t affine_stages=0;
+
+    /*  Reports register use, local memory, and theoretical occupancy of every
+     *  slot-count specialization of the 3D evaluators on the current device. */
+    static std::vector<KernelOccupancy> evaluatorOccupancy();
+
+    /*  Reallocates the subtape pool with room for `count` subtapes.  The old
+     *  pool is retired, so this is safe to call between frames. */
+    void resizeSubtapes(size_t count);
+
+    /*  Makes this context use the same subtape pool and `values` buffer as
+     *  `other`, dropping its own (once its last frame has finished).  This
+     *  saves most of a context's memory when many of them live on one GPU,
+     *  but the caller must make sure that frames from contexts which share
+     *  scratch space never overlap: render them on one stream, or with
+     *  blocking render calls from one thread at a time.  The incremental
+     *  tile cache is disabled while scratch space is shared, since it refers
+     *  to subtapes from the previous frame. */
+    void shareScratch(const Context& other);
+
+    /*  Waits for the last frame, then frees every buffer which the next
+     *  frame would rebuild: retired buffers, tile arrays for the later
+     *  stages, the dedupe table, the tile cache, any captured graph,
+     *  and (if it isn't shared) the scratch pool.  Images are kept.  This is
+     *  meant for contexts which sit idle between bursts of rendering; the
+     *  next frame is slower, since it reallocates everything. */
+    void trim();
+
+    /*  Returns the number of failed subtape pushes in the most recent frame.
+     *  Like overflowed(), this must only be called once the frame's event
+     *  has completed. */
+    int32_t subtapeOverflows() const;
+
+    // Total size of the subtape pool, in clauses
+    int32_t tape_capacity() const;
+
+    /*  Returns the subtape pool (in device or managed memory, following
+     *  `memory_policy`), where `stages[i].tiles[k].tape` indexes the tile's
+     *  tape, and the end of the pool after the most recent frame, which is
+     *  at least tape_capacity() if it ran out of room.  Like overflowed(),
+     *  subtapeEnd must only be called once the frame's event has
+     *  completed. */
+    const uint64_t* subtapePool() const;
+    int32_t subtapeEnd() const;
 
     Tiles stages[4];        // 64^3, 16^3, 4^3, voxels
+    int32_t image_count=0;  // Number of images in each stage's `filled`
+
+    /*  Returns the number of tiles in a 3D stage which were masked by
+     *  occlusion before being evaluated, in the most recent frame.  As with
+     *  overflowed(), this must only be called once the frame's event has
+     *  completed. */
+    int32_t culledTiles(int32_t stage) const;
+
+    /*  Outputs of each 3D render, as a mask of RenderFlags.  Without
+     *  RENDER_NORMALS, the normal pass is skipped (and `normals` is left
+     *  untouched, not cleared), which is all that's needed for heightmaps. */
+    uint32_t render_flags=RENDER_DEPTH | RENDER_NORMALS;
+
+    /*  When greater than 1, each 3D interval stage is evaluated in this many
+     *  slabs of Z layers, from front to back, with occlusion culling between
+     *  them.  Tiles behind a surface found in an earlier slab are then
+     *  skipped, rather than fully evaluated in the same launch that finds
+     *  the surface.  Each slab costs a launch over the whole stage, so a few
+     *  slabs (e.g. 4) are usually best. */
+    int32_t z_slabs=0;
+
+    /*  When false (the default), the host reads back each stage's tile count
+     *  and sizes the next stage's buffer and launch grid to fit exactly.
+     *
+     *  When true, stage buffers are kept at a high-water mark and every
+     *  kernel is launched over the whole buffer, reading the real count
+     *  from a counter on the device.  This removes all host round-trips
+     *  from the frame, at the cost of some idle threads and extra memory. */
+    bool device_sizing=false;
 
-    Ptr<int32_t> num_active_tiles;  // GPU-allocated count of active tiles
+    /*  Used to split a frame across several GPUs (see MultiContext): this
+     *  context only renders the XY columns of 64-pixel tiles where
+     *  (x + y) % partition_count == partition_index. */
+    int32_t partition_index=0;
+    int32_t partition_count=1;
 
-    Ptr<void> values; // Used to pass data around
-    size_t values_size=0;
+    /*  Viewport culling: when non-zero, render2D and render3D only evaluate
+     *  the tiles which overlap the `viewport_width` by `viewport_height`
+     *  pixels starting at (`viewport_x`, `viewport_y`), and the rest of the
+     *  image is left empty.  This only skips work; the context is still
+     *  `image_size_px` square (and deep), and every buffer is sized for the
+     *  full square, so a 1920x1080 display still needs a 2048^2 context and
+     *  its memory.  The caller's matrix must put the model into the region,
+     *  and edge tiles are evaluated in full. */
+    int32_t viewport_x=0;
+    int32_t viewport_y=0;
+    int32_t viewport_width=0;
+    int32_t viewport_height=0;
+
+    /*  When set (by default it is empty, and nothing is culled), 3D renders
+     *  drop first-stage tiles whose model-space bounds don't overlap this
+     *  box before evaluating anything, so that small models in a large view
+     *  volume don't pay for empty space.  The box must contain every shape
+     *  that is being rendered. */
+    Eigen::AlignedBox3f bounds;
+
+    /*  When true, render2D and render3D (and their async and batch versions)
+     *  record timing events between each part of the frame, and read back
+     *  tile counts and subtape pool usage at its end; frames are also marked
+     *  with NVTX ranges when built with MPR_NVTX.  renderStats returns the
+     *  results of the most recent frame, and (like overflowed) must only
+     *  be called once the frame's event has completed.  A graph captured by
+     *  renderCached records stats if this was set when it was captured. */
+    bool collect_stats=false;
+    RenderStats renderStats() const;
+
+    /*  Returns the peak size of the scratch buffers (in bytes), counting
+     *  retired buffers which hadn't been freed yet */
+    size_t scratchHighWater() const;
 
     Ptr<uint32_t[]> normals;
+
+    /*  When true, each frame also writes its output in a compact encoding,
+     *  which cuts the bytes that the host reads back (or that are copied
+     *  into a texture).  2D frames pack `stages[3].filled` into `occupancy`,
+     *  one bit per pixel (pixel i is bit i % 32 of word i / 32), which is
+     *  32x smaller.  3D frames pack depth into `depth16` (one image per
+     *  shape), which is 2x smaller; it is only allocated when depths fit in
+     *  16 bits, i.e. for images up to 65532 pixels on a side.
+     *
+     *  The int32 images are still written, since the renderer builds them
+     *  with atomic max, and MultiContext composites after this packing, so
+     *  only its int32 image is complete. */
+    bool compact_images=false;
+    Ptr<uint32_t[]> occupancy;
+    Ptr<uint16_t[]> depth16;
+
+    /*  With BACKEND_CPU, render2D and render3D (and their async versions)
+     *  are evaluated by host threads, with the same algorithm as the GPU,
+     *  and write the same images.  The backend is chosen when the context
+     *  is built, and can't be changed afterwards.  Setting the MPR_BACKEND
+     *  environment variable to "cpu" makes it the default, so that a
+     *  program which only calls render2D and render3D can be pointed at it
+     *  without changes.  Most of the benchmarks use other entry points, and
+     *  so they don't run on it; benchmark/render_cpu times the CPU
+     *  renderer instead.
+     *
+     *  A CPU context makes no CUDA calls: its images (`stages[i].filled`,
+     *  `normals`, and the compact images) are in host memory, and frames
+     *  read the tape's host copy, render on the context's thread pool, and
+     *  return a null event.  setParameters also uploads parameters to the
+     *  GPU, so without one, use setCpuParameters (in cpu_render.hpp), which
+     *  only updates the host copy.  For machines without the CUDA toolkit,
+     *  the mpr_cpu library has the same renderer behind CpuContext.
+     *
+     *  Every other kind of render (batches, views, tiled, slices, cached,
+     *  progressive, points, volumes, meshes, brute force, and heatmaps),
+     *  and every GPU-side query (e.g. culledTiles or tape_capacity), needs
+     *  BACKEND_CUDA, and throws std::runtime_error on a CPU context.  GPU
+     *  tuning options (`jit`, `z_slabs`, dedupe, contiguous tapes, the
+     *  incremental cache, skipped and affine stages, `bounds`, and
+     *  `device_sizing`) are ignored, overflowed() is always false, and
+     *  trim() does nothing.  Only `stages[3].filled` (and `normals`) match the
+     *  GPU exactly; the coarser stages may hold fewer filled tiles, since
+     *  the CPU skips tiles behind the surface rather than evaluating them.
+     *
+     *  With `cpu_threads` at 0, the pool has one thread per hardware
+     *  thread. */
+    Backend backend;
+    int32_t cpu_threads=0;
+
+    struct Impl;
+    std::unique_ptr<Impl> impl;
 };
 
 } // mpr
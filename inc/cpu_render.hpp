@@ -0,0 +1,114 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <Eigen/Eigen>
+
+#include "render_stats.hpp"
+
+/*
+ *  A CPU implementation of render2D and render3D, which is used when a
+ *  Context's `backend` is BACKEND_CPU, and by CpuContext (below).
+ *
+ *  It reads the same clauses as the GPU (from Tape::clauses, the host
+ *  copy), and runs the same algorithm: tiles are evaluated with interval
+ *  arithmetic, empty and filled tiles stop there, and ambiguous tiles push
+ *  a shorter tape (built from their min/max choices) for their subtiles.
+ *  Results are written into the Context's images, in the same layout and
+ *  with the same conventions as the GPU's stages (see copy_filled_3d), and
+ *  normals use the same automatic differentiation and packing.
+ *
+ *  The order of work is different.  A pool of worker threads takes whole
+ *  columns of tiles, and walks each column from front (high Z) to back,
+ *  so a tile behind a surface that was already found in its column is
+ *  skipped without being evaluated.  Each first-stage column splits its
+ *  ambiguous tiles into sub-columns, which are pushed onto the worker's
+ *  own queue and stolen by idle workers.
+ *
+ *  Per-voxel (and per-pixel) evaluation handles a batch of lanes at once:
+ *  16 lanes when built with AVX-512, and 8 (i.e. one AVX register)
+ *  otherwise.  Arithmetic, min/max, and sqrt clauses use AVX-512 or AVX2
+ *  intrinsics on the whole batch, and other clauses (e.g. sin or pow) are
+ *  a scalar loop over it.  Without AVX2, every clause is a loop.
+ */
+namespace mpr {
+
+// Forward declarations
+struct CpuPool;
+struct Tape;
+
+/*  Everything that a CPU frame reads and writes, filled in from a Context */
+struct CpuFrame {
+    const uint64_t* tape;       // Host clauses, e.g. Tape::clauses
+    int32_t image_size_px;
+    int32_t* filled[4];         // Each stage's image, as in Context::stages
+    uint32_t* normals;          // Null to skip the normal pass (3D only)
+    int32_t viewport[4];        // Pixels from [0], [1] up to [2], [3]
+    int32_t partition_index;
+    int32_t partition_count;
+
+    /*  The worker pool, which is built by the first frame (and rebuilt if
+     *  `threads` changes).  0 threads uses one worker per hardware thread. */
+    std::shared_ptr<CpuPool>* pool;
+    int32_t threads;
+
+    /*  If not null, this is filled in with host timings and tile counts.
+     *  Stages are interleaved on the CPU, so the whole depth pass is
+     *  reported as eval_ms[0]. */
+    RenderStats* stats;
+};
+
+void renderCpu3D(const CpuFrame& frame, const Eigen::Matrix4f& mat);
+void renderCpu2D(const CpuFrame& frame, const Eigen::Matrix3f& mat,
+                 const float z);
+
+/*  Host copy of the runtime parameters, which is kept up to date by
+ *  setParameters (see context.hpp).  Without CUDA, this is the only way to
+ *  set them. */
+void setCpuParameters(const float* values, int32_t count, int32_t first);
+
+/*  Renders into host images, without touching CUDA at all.  This is the
+ *  interface of the mpr_cpu library, which is built from tape.cpp and
+ *  cpu_render.cpp with MPR_CPU_ONLY defined (so Tape has no GPU copy) and
+ *  doesn't need the CUDA toolkit, for machines without a GPU.
+ *
+ *  Images have the same layout as a Context's `stages[i].filled` and
+ *  `normals` for a single shape, and the same size limits: the constructor
+ *  throws std::runtime_error unless `image_size_px` is a multiple of 64. */
+struct CpuContext {
+    CpuContext(int32_t image_size_px);
+    ~CpuContext();
+
+    void render3D(const Tape& tape, const Eigen::Matrix4f& mat);
+    void render2D(const Tape& tape, const Eigen::Matrix3f& mat,
+                  const float z=0.0f);
+
+    const int32_t image_size_px;
+    std::vector<int32_t> filled[4];
+    std::vector<uint32_t> normals;
+
+    /*  These match the Context options of the same names: normals are only
+     *  written when `render_normals` is set, and `stats` is only filled in
+     *  when `collect_stats` is set. */
+    bool render_normals=true;
+    int32_t cpu_threads=0;
+    bool collect_stats=false;
+    RenderStats stats=RenderStats();
+
+private:
+    CpuFrame frame(const Tape& tape);
+    std::shared_ptr<CpuPool> pool;
+};
+
+}   // namespace mpr
@@ -18,18 +18,65 @@ namespace mpr {
 
 struct Context;
 
+/*  Selects the SSAO implementation, trading quality for speed */
+enum SSAOQuality {
+    /*  Every pixel takes 64 samples directly from the full-resolution depth
+     *  image in global memory. */
+    SSAO_REFERENCE,
+
+    /*  Each block of pixels loads the neighborhood that its samples can
+     *  reach into shared memory first.  At large image sizes, this
+     *  neighborhood is subsampled, so the result is slightly coarser. */
+    SSAO_TILED,
+
+    /*  As SSAO_TILED, but at half resolution, with a depth-aware upsample
+     *  before the usual blur. */
+    SSAO_HALF,
+};
+
+/*  Selects what drawToSurface writes */
+enum EffectsMode {
+    EFFECTS_SSAO,       // Blurred SSAO, as grayscale
+    EFFECTS_SHADED,     // Lighting with SSAO, as in drawShaded
+    EFFECTS_LIGHT,      // Lighting without SSAO, in a single kernel
+};
+
 struct Effects {
     Effects();
 
     Ptr<int32_t[]> tmp;
     Ptr<int32_t[]> image;
 
-    void drawSSAO(const Context& ctx);
-    void drawShaded(const Context& ctx);
+    void drawSSAO(const Context& ctx, SSAOQuality quality=SSAO_REFERENCE);
+    void drawShaded(const Context& ctx, SSAOQuality quality=SSAO_REFERENCE);
+
+    /*  Draws the context's most recent 3D render into `surf`, a surface of
+     *  texture_size_px x texture_size_px RGBA pixels (e.g. from a mapped
+     *  graphics resource), sampling the nearest pixel of the image.
+     *
+     *  Unlike drawSSAO and drawShaded, the blur and shading are fused into
+     *  the kernel which writes the surface, so `image` is never touched and
+     *  only visible pixels are blurred and shaded.  Everything is enqueued
+     *  on `stream` without synchronizing, so the caller must order it after
+     *  the render (e.g. by rendering on the same stream), and before the
+     *  next render which reuses the context.
+     *
+     *  With `append`, empty pixels are left untouched. */
+    void drawToSurface(const Context& ctx, cudaSurfaceObject_t surf,
+                       int texture_size_px, bool append, EffectsMode mode,
+                       SSAOQuality quality=SSAO_REFERENCE,
+                       cudaStream_t stream=0);
 
 protected:
     void resizeTo(const Context& ctx);
 
+    /*  Writes unblurred SSAO for every filled pixel into `out`, which must be
+     *  cleared beforehand.  Kernels are enqueued on `stream`. */
+    void drawRawSSAO(const Context& ctx, SSAOQuality quality, int32_t* out,
+                     cudaStream_t stream);
+
+    Ptr<int32_t[]> half;    // Half-resolution SSAO, for SSAO_HALF
+
     int32_t image_size_px;
 
     Eigen::Matrix<float, 64, 3> ssao_kernel;
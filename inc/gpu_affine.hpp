@@ -0,0 +1,452 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#pragma once
+
+#include <cfloat>
+
+#include "gpu_interval.hpp"
+
+namespace mpr {
+
+/*
+ *  Affine is a drop-in replacement for Interval in the tile evaluator (see
+ *  Context::affine_stages), which tracks how each value depends on the
+ *  tile's X, Y, and Z inputs:
+ *
+ *      x = c + a.x * ex + a.y * ey + a.z * ez + e * ee
+ *
+ *  where ex, ey, ez are the same unknowns in [-1, 1] for every slot, and ee
+ *  is an independent unknown in [-1, 1] which soaks up nonlinear terms and
+ *  rounding error.  Because the input terms are shared, expressions like
+ *  (x - y) * (x + y) or x - x don't overestimate like intervals do.
+ *
+ *  Each value also carries the interval result of the same operations, and
+ *  its bounds are the intersection of the two, so it's never looser than
+ *  plain intervals.  Operations without a good linear approximation (e.g.
+ *  trig functions) only use the bounds, which drops their correlations.
+ *
+ *  Like Interval, every bound is conservative: affine coefficients are
+ *  computed with normal rounding, then the error term is widened by a few
+ *  ulps of every coefficient.
+ */
+struct Affine {
+    __device__ inline Affine() { /* YOLO */ }
+#ifdef __CUDACC__
+    __device__ inline explicit Affine(float f)
+        : c(f), a(make_float3(0.0f, 0.0f, 0.0f)), e(0.0f), i(f) {}
+
+    /*  Wraps an interval, without any dependence on the inputs */
+    __device__ inline explicit Affine(const Interval& v)
+        : a(make_float3(0.0f, 0.0f, 0.0f)), i(v)
+    {
+        if (isfinite(v.lower()) && isfinite(v.upper())) {
+            c = v.mid();
+            e = v.rad();
+        } else {
+            c = 0.0f;
+            e = CUDART_INF_F;
+        }
+    }
+
+    __device__ inline static Affine X(const Interval& x) {
+        return input(x, make_float3(1.0f, 0.0f, 0.0f));
+    }
+    __device__ inline static Affine Y(const Interval& y) {
+        return input(y, make_float3(0.0f, 1.0f, 0.0f));
+    }
+    __device__ inline static Affine Z(const Interval& z) {
+        return input(z, make_float3(0.0f, 0.0f, 1.0f));
+    }
+
+    /*  Returns the total deviation from `c`, rounded up */
+    __device__ inline float radius() const {
+        return __fadd_ru(__fadd_ru(fabsf(a.x), fabsf(a.y)),
+                         __fadd_ru(fabsf(a.z), e));
+    }
+
+    /*  Returns the affine range intersected with the interval range.  If
+     *  either one is NaN, the interval is returned as-is, so that NaN
+     *  handling matches Interval. */
+    __device__ inline Interval bounds() const {
+        const float r = radius();
+        const float lo = __fsub_rd(c, r);
+        const float hi = __fadd_ru(c, r);
+        if (isnan(lo) || isnan(hi) ||
+            isnan(i.lower()) || isnan(i.upper()))
+        {
+            return i;
+        }
+        return {fmaxf(lo, i.lower()), fminf(hi, i.upper())};
+    }
+
+    __device__ inline float lower() const { return bounds().lower(); }
+    __device__ inline float upper() const { return bounds().upper(); }
+
+    /*  Widens the error term by the rounding error of computing `c` and `a`
+     *  in round-to-nearest, plus a tiny absolute term for underflow */
+    __device__ inline void round() {
+        const float m = __fadd_ru(fabsf(c), radius());
+        e = __fadd_ru(e, __fadd_ru(__fmul_ru(m, 2.0f * FLT_EPSILON),
+                                   FLT_MIN));
+    }
+#endif
+
+    float c;        // Central value
+    float3 a;       // Deviation along the tile's X, Y, Z inputs
+    float e;        // Independent error, always non-negative
+    Interval i;     // Interval result of the same expression
+
+private:
+#ifdef __CUDACC__
+    __device__ inline static Affine input(const Interval& v,
+                                          const float3& axis) {
+        if (!isfinite(v.lower()) || !isfinite(v.upper())) {
+            return Affine(v);
+        }
+        Affine out;
+        const float r = v.rad();
+        out.c = v.mid();
+        out.a = make_float3(axis.x * r, axis.y * r, axis.z * r);
+        out.e = 0.0f;
+        out.i = v;
+        return out;
+    }
+#endif
+};
+
+#ifdef __CUDACC__
+
+__device__ inline Interval bounds(const Interval& x) {
+    return x;
+}
+
+__device__ inline Interval bounds(const Affine& x) {
+    return x.bounds();
+}
+
+/*  Returns alpha * x + zeta +/- delta, with the given interval result */
+__device__ inline Affine affine_linear(const Affine& x, float alpha,
+                                       float zeta, float delta,
+                                       const Interval& i) {
+    Affine out;
+    out.c = alpha * x.c + zeta;
+    out.a = make_float3(alpha * x.a.x, alpha * x.a.y, alpha * x.a.z);
+    out.e = __fadd_ru(__fmul_ru(fabsf(alpha), x.e), delta);
+    out.i = i;
+    out.round();
+    return out;
+}
+
+/*
+ *  Min-range approximation of a monotonic, convex or concave function f
+ *  over x's bounds [lo, hi], where alpha is the slope of f at the end which
+ *  makes f(t) - alpha * t monotonic.  f_lo and f_hi are f(lo) and f(hi),
+ *  which are only accurate to a few ulps, so the error is widened to match.
+ */
+__device__ inline Affine affine_min_range(const Affine& x, float alpha,
+                                          float lo, float hi,
+                                          float f_lo, float f_hi,
+                                          const Interval& i) {
+    const float g_lo = f_lo - alpha * lo;
+    const float g_hi = f_hi - alpha * hi;
+    const float slop = __fmul_ru(
+            __fadd_ru(__fadd_ru(fabsf(f_lo), fabsf(f_hi)),
+                      __fmul_ru(fabsf(alpha), __fadd_ru(fabsf(lo),
+                                                        fabsf(hi)))),
+            8.0f * FLT_EPSILON);
+    return affine_linear(x, alpha, (g_lo + g_hi) / 2.0f,
+                         __fadd_ru(fabsf(g_lo - g_hi) / 2.0f, slop), i);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+__device__ inline Affine operator-(const Affine& x) {
+    Affine out;
+    out.c = -x.c;
+    out.a = make_float3(-x.a.x, -x.a.y, -x.a.z);
+    out.e = x.e;
+    out.i = -x.i;
+    return out;
+}
+
+__device__ inline Affine operator+(const Affine& x, const Affine& y) {
+    Affine out;
+    out.c = x.c + y.c;
+    out.a = make_float3(x.a.x + y.a.x, x.a.y + y.a.y, x.a.z + y.a.z);
+    out.e = __fadd_ru(x.e, y.e);
+    out.i = x.bounds() + y.bounds();
+    out.round();
+    return out;
+}
+
+__device__ inline Affine operator+(const Affine& x, const float& y) {
+    Affine out = x;
+    out.c = x.c + y;
+    out.i = x.bounds() + y;
+    out.round();
+    return out;
+}
+
+__device__ inline Affine operator+(const float& y, const Affine& x) {
+    return x + y;
+}
+
+__device__ inline Affine operator-(const Affine& x, const Affine& y) {
+    return x + -y;
+}
+
+__device__ inline Affine operator-(const Affine& x, const float& y) {
+    return x + -y;
+}
+
+__device__ inline Affine operator-(const float& x, const Affine& y) {
+    return -y + x;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+__device__ inline Affine operator*(const Affine& x, const Affine& y) {
+    // The product of the two deviations is bounded by their radii
+    Affine out;
+    out.c = x.c * y.c;
+    out.a = make_float3(x.c * y.a.x + y.c * x.a.x,
+                        x.c * y.a.y + y.c * x.a.y,
+                        x.c * y.a.z + y.c * x.a.z);
+    out.e = __fadd_ru(__fadd_ru(__fmul_ru(fabsf(x.c), y.e),
+                                __fmul_ru(fabsf(y.c), x.e)),
+                      __fmul_ru(x.radius(), y.radius()));
+    out.i = x.bounds() * y.bounds();
+    out.round();
+    return out;
+}
+
+__device__ inline Affine operator*(const Affine& x, const float& y) {
+    Affine out;
+    out.c = x.c * y;
+    out.a = make_float3(x.a.x * y, x.a.y * y, x.a.z * y);
+    out.e = __fmul_ru(x.e, fabsf(y));
+    out.i = x.bounds() * y;
+    out.round();
+    return out;
+}
+
+__device__ inline Affine operator*(const float& x, const Affine& y) {
+    return y * x;
+}
+
+__device__ inline Affine square(const Affine& x) {
+    // (c + d)^2 = c^2 + 2cd + d^2, with d^2 in [0, r^2] centered at r^2 / 2
+    const float r = x.radius();
+    const float h = __fmul_ru(r, r) / 2.0f;
+    Affine out;
+    out.c = x.c * x.c + h;
+    out.a = make_float3(2.0f * x.c * x.a.x,
+                        2.0f * x.c * x.a.y,
+                        2.0f * x.c * x.a.z);
+    out.e = __fadd_ru(__fmul_ru(2.0f * fabsf(x.c), x.e), h);
+    out.i = square(x.bounds());
+    out.round();
+    return out;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+__device__ inline Affine recip(const Affine& x) {
+    const Interval b = x.bounds();
+    if (b.lower() > 0.0f) {
+        // 1/t is convex and decreasing, so use the slope at the upper end
+        const float lo = b.lower();
+        const float hi = b.upper();
+        return affine_min_range(x, -1.0f / (hi * hi), lo, hi,
+                                1.0f / lo, 1.0f / hi, recip(b));
+    } else if (b.upper() < 0.0f) {
+        return -recip(-x);
+    } else {
+        return Affine(recip(b));
+    }
+}
+
+__device__ inline Affine operator/(const Affine& x, const Affine& y) {
+    Affine out = x * recip(y);
+    out.i = x.bounds() / y.bounds();
+    return out;
+}
+
+__device__ inline Affine operator/(const Affine& x, const float& y) {
+    if (y == 0.0f) {
+        return Affine(x.bounds() / y);
+    }
+    Affine out;
+    out.c = x.c / y;
+    out.a = make_float3(x.a.x / y, x.a.y / y, x.a.z / y);
+    out.e = __fdiv_ru(x.e, fabsf(y));
+    out.i = x.bounds() / y;
+    out.round();
+    return out;
+}
+
+__device__ inline Affine operator/(const float& x, const Affine& y) {
+    Affine out = recip(y) * x;
+    out.i = x / y.bounds();
+    return out;
+}
+
+__device__ inline Affine sqrt(const Affine& x) {
+    const Interval b = x.bounds();
+    if (b.lower() > 0.0f && isfinite(b.upper())) {
+        // sqrt is concave and increasing, so use the slope at the upper end
+        const float lo = b.lower();
+        const float hi = b.upper();
+        const float s_hi = sqrtf(hi);
+        return affine_min_range(x, 0.5f / s_hi, lo, hi, sqrtf(lo), s_hi,
+                                sqrt(b));
+    }
+    return Affine(sqrt(b));
+}
+
+__device__ inline Affine exp(const Affine& x) {
+    const Interval b = x.bounds();
+    if (isfinite(b.lower()) && b.upper() < 80.0f) {
+        // exp is convex and increasing, so use the slope at the lower end
+        const float lo = b.lower();
+        const float hi = b.upper();
+        const float e_lo = expf(lo);
+        return affine_min_range(x, e_lo, lo, hi, e_lo, expf(hi), exp(b));
+    }
+    return Affine(exp(b));
+}
+
+__device__ inline Affine abs(const Affine& x) {
+    const Interval b = x.bounds();
+    if (b.lower() >= 0.0f) {
+        return x;
+    } else if (b.upper() < 0.0f) {
+        return -x;
+    } else {
+        return Affine(abs(b));
+    }
+}
+
+// Everything else is evaluated on the bounds alone
+#define AFFINE_UNARY(f)                                     \
+__device__ inline Affine f(const Affine& x) {               \
+    return Affine(f(x.bounds()));                           \
+}
+AFFINE_UNARY(sin)
+AFFINE_UNARY(cos)
+AFFINE_UNARY(tan)
+AFFINE_UNARY(asin)
+AFFINE_UNARY(acos)
+AFFINE_UNARY(atan)
+AFFINE_UNARY(log)
+#undef AFFINE_UNARY
+
+#define AFFINE_BINARY(f)                                            \
+__device__ inline Affine f(const Affine& x, const Affine& y) {      \
+    return Affine(f(x.bounds(), y.bounds()));                       \
+}                                                                   \
+__device__ inline Affine f(const Affine& x, const float& y) {       \
+    return Affine(f(x.bounds(), y));                                \
+}                                                                   \
+__device__ inline Affine f(const float& x, const Affine& y) {       \
+    return Affine(f(x, y.bounds()));                                \
+}
+AFFINE_BINARY(atan2)
+AFFINE_BINARY(pow)
+AFFINE_BINARY(nth_root)
+AFFINE_BINARY(mod)
+AFFINE_BINARY(compare)
+#undef AFFINE_BINARY
+
+////////////////////////////////////////////////////////////////////////////////
+
+// min and max keep the chosen branch's affine form when the choice is
+// unambiguous, and otherwise only its bounds
+__device__ inline Affine min(const Affine& x, const Affine& y, int& choice) {
+    const Interval out = min(x.bounds(), y.bounds(), choice);
+    return (choice == 1) ? x : (choice == 2) ? y : Affine(out);
+}
+
+__device__ inline Affine min(const Affine& x, const float& y, int& choice) {
+    const Interval out = min(x.bounds(), y, choice);
+    return (choice == 1) ? x : (choice == 2) ? Affine(y) : Affine(out);
+}
+
+__device__ inline Affine min(const float& x, const Affine& y, int& choice) {
+    const Interval out = min(x, y.bounds(), choice);
+    return (choice == 1) ? Affine(x) : (choice == 2) ? y : Affine(out);
+}
+
+__device__ inline Affine max(const Affine& x, const Affine& y, int& choice) {
+    const Interval out = max(x.bounds(), y.bounds(), choice);
+    return (choice == 1) ? x : (choice == 2) ? y : Affine(out);
+}
+
+__device__ inline Affine max(const Affine& x, const float& y, int& choice) {
+    const Interval out = max(x.bounds(), y, choice);
+    return (choice == 1) ? x : (choice == 2) ? Affine(y) : Affine(out);
+}
+
+__device__ inline Affine max(const float& x, const Affine& y, int& choice) {
+    const Interval out = max(x, y.bounds(), choice);
+    return (choice == 1) ? Affine(x) : (choice == 2) ? y : Affine(out);
+}
+
+/*  As in libfive, only a value with a NaN bound is considered NaN */
+__device__ inline Affine nanfill(const Affine& x, const Affine& y) {
+    const Interval b = x.bounds();
+    return (isnan(b.lower()) || isnan(b.upper())) ? y : x;
+}
+
+__device__ inline Affine nanfill(const Affine& x, const float& y) {
+    return nanfill(x, Affine(y));
+}
+
+__device__ inline Affine nanfill(const float& x, const Affine& y) {
+    return nanfill(Affine(x), y);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Compound opcodes, which keep their correlations through the expansion
+
+__device__ inline Affine mul_add(const Affine& x, const Affine& y,
+                                 const float& z) {
+    return x * y + z;
+}
+
+__device__ inline Affine mul_add(const Affine& x, const float& y,
+                                 const Affine& z) {
+    return x * y + z;
+}
+
+__device__ inline Affine square_add(const Affine& x, const Affine& y) {
+    return square(x) + y;
+}
+
+__device__ inline Affine square_add(const Affine& x, const float& y) {
+    return square(x) + y;
+}
+
+__device__ inline Affine sub_square(const Affine& x, const Affine& y) {
+    return square(x - y);
+}
+
+__device__ inline Affine sub_square(const Affine& x, const float& y) {
+    return square(x - y);
+}
+
+__device__ inline Affine hypot(const Affine& x, const Affine& y) {
+    return sqrt(square(x) + square(y));
+}
+#endif
+
+}   // namespace mpr
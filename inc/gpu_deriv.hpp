@@ -13,6 +13,8 @@ Copyright (C) 2019-2020  Matt Keeter
 
 #include <math_constants.h>
 
+#include "gpu_float.hpp"
+
 namespace mpr {
 
 struct Deriv {
@@ -202,6 +204,157 @@ __device__ inline Deriv log(const Deriv& a) {
     const float v = a.value();
     return {logf(v), a.dx() / v, a.dy() / v, a.dz() / v};
 }
+
+__device__ inline Deriv tan(const Deriv& a) {
+    const float t = tanf(a.value());
+    const float d = 1 + t * t;
+    return {t, d * a.dx(), d * a.dy(), d * a.dz()};
+}
+
+__device__ inline Deriv recip(const Deriv& a) {
+    return 1.0f / a;
+}
+
+__device__ inline Deriv atan2(const Deriv& y, const Deriv& x) {
+    const float d = x.value() * x.value() + y.value() * y.value();
+    return {atan2f(y.value(), x.value()),
+            (x.value() * y.dx() - y.value() * x.dx()) / d,
+            (x.value() * y.dy() - y.value() * x.dy()) / d,
+            (x.value() * y.dz() - y.value() * x.dz()) / d};
+}
+
+__device__ inline Deriv atan2(const Deriv& y, const float& x) {
+    return atan2(y, Deriv(x));
+}
+
+__device__ inline Deriv atan2(const float& y, const Deriv& x) {
+    return atan2(Deriv(y), x);
+}
+
+__device__ inline Deriv pow(const Deriv& a, const float& b) {
+    const float d = b * powf(a.value(), b - 1);
+    return {powf(a.value(), b), d * a.dx(), d * a.dy(), d * a.dz()};
+}
+
+__device__ inline Deriv pow(const float& a, const Deriv& b) {
+    const float v = powf(a, b.value());
+    const float d = v * logf(a);
+    return {v, d * b.dx(), d * b.dy(), d * b.dz()};
+}
+
+__device__ inline Deriv pow(const Deriv& a, const Deriv& b) {
+    // The exponent is usually constant; skip its term in that case, since
+    // the log of a negative base would turn the derivatives into NaN.
+    if (b.dx() == 0.0f && b.dy() == 0.0f && b.dz() == 0.0f) {
+        return pow(a, b.value());
+    }
+    const float v = powf(a.value(), b.value());
+    const float da = b.value() * powf(a.value(), b.value() - 1);
+    const float db = v * logf(a.value());
+    return {v,
+            da * a.dx() + db * b.dx(),
+            da * a.dy() + db * b.dy(),
+            da * a.dz() + db * b.dz()};
+}
+
+__device__ inline Deriv nth_root(const Deriv& a, const float& n) {
+    const float v = nth_root(a.value(), n);
+    const float d = v / (n * a.value());
+    return {v, d * a.dx(), d * a.dy(), d * a.dz()};
+}
+
+__device__ inline Deriv nth_root(const Deriv& a, const Deriv& n) {
+    // As with pow, the root is usually constant
+    if (n.dx() == 0.0f && n.dy() == 0.0f && n.dz() == 0.0f) {
+        return nth_root(a, n.value());
+    }
+    const float v = nth_root(a.value(), n.value());
+    const float da = v / (n.value() * a.value());
+    const float dn = -v * logf(fabsf(a.value())) / (n.value() * n.value());
+    return {v,
+            da * a.dx() + dn * n.dx(),
+            da * a.dy() + dn * n.dy(),
+            da * a.dz() + dn * n.dz()};
+}
+
+__device__ inline Deriv nth_root(const float& a, const Deriv& n) {
+    return nth_root(Deriv(a), n);
+}
+
+__device__ inline Deriv mod(const Deriv& a, const float& b) {
+    return {mod(a.value(), b), a.dx(), a.dy(), a.dz()};
+}
+
+__device__ inline Deriv mod(const Deriv& a, const Deriv& b) {
+    // a mod b = a - k * b, where k is constant almost everywhere
+    const float v = mod(a.value(), b.value());
+    const float k = roundf((a.value() - v) / b.value());
+    return {v,
+            a.dx() - k * b.dx(),
+            a.dy() - k * b.dy(),
+            a.dz() - k * b.dz()};
+}
+
+__device__ inline Deriv mod(const float& a, const Deriv& b) {
+    return mod(Deriv(a), b);
+}
+
+__device__ inline Deriv nanfill(const Deriv& a, const Deriv& b) {
+    return isnan(a.value()) ? b : a;
+}
+
+__device__ inline Deriv nanfill(const Deriv& a, const float& b) {
+    return nanfill(a, Deriv(b));
+}
+
+__device__ inline Deriv nanfill(const float& a, const Deriv& b) {
+    return nanfill(Deriv(a), b);
+}
+
+__device__ inline Deriv compare(const Deriv& a, const Deriv& b) {
+    return Deriv(compare(a.value(), b.value()));
+}
+
+__device__ inline Deriv compare(const Deriv& a, const float& b) {
+    return Deriv(compare(a.value(), b));
+}
+
+__device__ inline Deriv compare(const float& a, const Deriv& b) {
+    return Deriv(compare(a, b.value()));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Compound opcodes (see gpu_interval.hpp)
+
+__device__ inline Deriv mul_add(const Deriv& a, const Deriv& b,
+                                const float& c) {
+    return a * b + c;
+}
+
+__device__ inline Deriv mul_add(const Deriv& a, const float& b,
+                                const Deriv& c) {
+    return a * b + c;
+}
+
+__device__ inline Deriv square_add(const Deriv& a, const Deriv& b) {
+    return square(a) + b;
+}
+
+__device__ inline Deriv square_add(const Deriv& a, const float& b) {
+    return square(a) + b;
+}
+
+__device__ inline Deriv sub_square(const Deriv& a, const Deriv& b) {
+    return square(a - b);
+}
+
+__device__ inline Deriv sub_square(const Deriv& a, const float& b) {
+    return square(a - b);
+}
+
+__device__ inline Deriv hypot(const Deriv& a, const Deriv& b) {
+    return sqrt(square(a) + square(b));
+}
 #endif
 
 }   // namespace mpr
@@ -0,0 +1,55 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#pragma once
+
+namespace mpr {
+
+#ifdef __CUDACC__
+
+// Scalar versions of the libfive opcodes which don't have a CUDA builtin,
+// following libfive's own (CPU) definitions.
+
+__device__ inline float recip(const float& a) {
+    return 1.0f / a;
+}
+
+/*  Odd roots of negative numbers are real, so they're taken as -(-a)^(1/n) */
+__device__ inline double nth_root(const double& a, const double& n) {
+    return (a < 0.0 && ::fabs(::fmod(n, 2.0)) == 1.0)
+        ? -::pow(-a, 1.0 / n)
+        : ::pow(a, 1.0 / n);
+}
+
+__device__ inline float nth_root(const float& a, const float& n) {
+    return (a < 0.0f && fabsf(fmodf(n, 2.0f)) == 1.0f)
+        ? -powf(-a, 1.0f / n)
+        : powf(a, 1.0f / n);
+}
+
+/*  Modulo which wraps into [0, b) for positive b (unlike fmodf) */
+__device__ inline float mod(const float& a, const float& b) {
+    const float r = fmodf(a, b);
+    return (r < 0.0f) ? (r + b) : r;
+}
+
+__device__ inline float nanfill(const float& a, const float& b) {
+    return isnan(a) ? b : a;
+}
+
+/*  Returns -1, 0, or 1 if a is less than, equal to, or greater than b */
+__device__ inline float compare(const float& a, const float& b) {
+    return (a < b) ? -1.0f : ((a > b) ? 1.0f : 0.0f);
+}
+
+#endif
+
+}   // namespace mpr
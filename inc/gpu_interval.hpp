@@ -13,6 +13,8 @@ Copyright (C) 2019-2020  Matt Keeter
 
 #include <math_constants.h>
 
+#include "gpu_float.hpp"
+
 namespace mpr {
 
 struct Interval {
@@ -433,6 +435,198 @@ __device__ inline Interval log(const Interval& x) {
                 __double2float_ru(::log(x.upper()))};
     }
 }
+
+__device__ inline Interval tan(const Interval& x) {
+    // tan is increasing between its asymptotes (at odd multiples of pi/2),
+    // so the interval is unbounded unless both ends are between the same two
+    const double k = floor((x.lower() + M_PI / 2) / M_PI);
+    if (x.upper() >= (k + 1) * M_PI - M_PI / 2) {
+        return {-CUDART_INF_F, CUDART_INF_F};
+    }
+    // Use double precision, since there aren't _ru / _rd primitives
+    return {__double2float_rd(::tan(x.lower())),
+            __double2float_ru(::tan(x.upper()))};
+}
+
+__device__ inline Interval recip(const Interval& x) {
+    return 1.0f / x;
+}
+
+__device__ inline Interval atan2(const Interval& y, const Interval& x) {
+    // The branch cut is along the negative X axis, so a box which touches
+    // it (or the origin) covers the whole range.  Otherwise, the extremes
+    // are at the corners of the box.
+    if (x.lower() <= 0.0f && y.lower() <= 0.0f && y.upper() >= 0.0f) {
+        return {-CUDART_PI_F, CUDART_PI_F};
+    }
+    // Use double precision, since there aren't _ru / _rd primitives
+    const double a = ::atan2((double)y.lower(), (double)x.lower());
+    const double b = ::atan2((double)y.lower(), (double)x.upper());
+    const double c = ::atan2((double)y.upper(), (double)x.lower());
+    const double d = ::atan2((double)y.upper(), (double)x.upper());
+    return {__double2float_rd(fmin(fmin(a, b), fmin(c, d))),
+            __double2float_ru(fmax(fmax(a, b), fmax(c, d)))};
+}
+
+__device__ inline Interval atan2(const Interval& y, const float& x) {
+    return atan2(y, Interval(x));
+}
+
+__device__ inline Interval atan2(const float& y, const Interval& x) {
+    return atan2(Interval(y), x);
+}
+
+/*  libfive's exponents are almost always constant, which is the tight case:
+ *  integer powers keep the sign of odd powers, and other powers are only
+ *  defined for non-negative bases. */
+__device__ inline Interval pow(const Interval& x, const float& n) {
+    if (n < 0.0f) {
+        return 1.0f / pow(x, -n);
+    } else if (n == 0.0f) {
+        return Interval(1.0f);
+    }
+    // Use double precision, since there aren't _ru / _rd primitives
+    if (n == floorf(n)) {
+        const double l = ::pow((double)x.lower(), (double)n);
+        const double u = ::pow((double)x.upper(), (double)n);
+        if (fmodf(n, 2.0f) != 0.0f || x.lower() >= 0.0f) {
+            return {__double2float_rd(l), __double2float_ru(u)};
+        } else if (x.upper() <= 0.0f) {
+            return {__double2float_rd(u), __double2float_ru(l)};
+        } else {
+            return {0.0f, __double2float_ru(fmax(l, u))};
+        }
+    } else if (x.upper() < 0.0f) {
+        return {CUDART_NAN_F, CUDART_NAN_F};
+    } else {
+        return {__double2float_rd(::pow(fmax(x.lower(), 0.0), (double)n)),
+                __double2float_ru(::pow((double)x.upper(), (double)n))};
+    }
+}
+
+__device__ inline Interval pow(const Interval& x, const Interval& n) {
+    if (n.lower() == n.upper()) {
+        return pow(x, n.lower());
+    } else if (x.lower() > 0.0f) {
+        return exp(n * log(x));
+    } else {
+        return {-CUDART_INF_F, CUDART_INF_F};
+    }
+}
+
+__device__ inline Interval pow(const float& x, const Interval& n) {
+    return pow(Interval(x), n);
+}
+
+__device__ inline Interval nth_root(const Interval& x, const float& n) {
+    if (n < 0.0f) {
+        return 1.0f / nth_root(x, -n);
+    }
+    // Roots are increasing, and even roots are only defined for x >= 0
+    const bool odd = fabsf(fmodf(n, 2.0f)) == 1.0f;
+    if (!odd && x.upper() < 0.0f) {
+        return {CUDART_NAN_F, CUDART_NAN_F};
+    }
+    const double l = odd ? x.lower() : fmax(x.lower(), 0.0);
+    return {__double2float_rd(nth_root(l, (double)n)),
+            __double2float_ru(nth_root((double)x.upper(), (double)n))};
+}
+
+__device__ inline Interval nth_root(const Interval& x, const Interval& n) {
+    if (n.lower() == n.upper()) {
+        return nth_root(x, n.lower());
+    } else {
+        return {-CUDART_INF_F, CUDART_INF_F};
+    }
+}
+
+__device__ inline Interval nth_root(const float& x, const Interval& n) {
+    return nth_root(Interval(x), n);
+}
+
+__device__ inline Interval mod(const Interval& x, const Interval& y) {
+    if (y.lower() <= 0.0f) {
+        return {-CUDART_INF_F, CUDART_INF_F};
+    }
+    // With a constant modulus, the result is exact unless x wraps around
+    if (y.lower() == y.upper()) {
+        const double b = y.lower();
+        const double k = floor(x.lower() / b);
+        if (x.upper() < (k + 1) * b) {
+            return {fmaxf(__double2float_rd(x.lower() - k * b), 0.0f),
+                    fminf(__double2float_ru(x.upper() - k * b), y.upper())};
+        }
+    }
+    return {0.0f, y.upper()};
+}
+
+__device__ inline Interval mod(const Interval& x, const float& y) {
+    return mod(x, Interval(y));
+}
+
+__device__ inline Interval mod(const float& x, const Interval& y) {
+    return mod(Interval(x), y);
+}
+
+/*  As in libfive, only an interval with a NaN bound is considered NaN */
+__device__ inline Interval nanfill(const Interval& x, const Interval& y) {
+    return (isnan(x.lower()) || isnan(x.upper())) ? y : x;
+}
+
+__device__ inline Interval nanfill(const Interval& x, const float& y) {
+    return nanfill(x, Interval(y));
+}
+
+__device__ inline Interval nanfill(const float& x, const Interval& y) {
+    return nanfill(Interval(x), y);
+}
+
+__device__ inline Interval compare(const Interval& x, const Interval& y) {
+    // compare is increasing in x and decreasing in y
+    return {compare(x.lower(), y.upper()), compare(x.upper(), y.lower())};
+}
+
+__device__ inline Interval compare(const Interval& x, const float& y) {
+    return compare(x, Interval(y));
+}
+
+__device__ inline Interval compare(const float& x, const Interval& y) {
+    return compare(Interval(x), y);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Compound opcodes, which evaluate the same as their expansions but only
+// take one pass through the interpreter's dispatch
+
+__device__ inline Interval mul_add(const Interval& x, const Interval& y,
+                                   const float& z) {
+    return x * y + z;
+}
+
+__device__ inline Interval mul_add(const Interval& x, const float& y,
+                                   const Interval& z) {
+    return x * y + z;
+}
+
+__device__ inline Interval square_add(const Interval& x, const Interval& y) {
+    return square(x) + y;
+}
+
+__device__ inline Interval square_add(const Interval& x, const float& y) {
+    return square(x) + y;
+}
+
+__device__ inline Interval sub_square(const Interval& x, const Interval& y) {
+    return square(x - y);
+}
+
+__device__ inline Interval sub_square(const Interval& x, const float& y) {
+    return square(x - y);
+}
+
+__device__ inline Interval hypot(const Interval& x, const Interval& y) {
+    return sqrt(square(x) + square(y));
+}
 #endif
 
 }   // namespace mpr
@@ -10,8 +10,12 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 Copyright (C) 2019-2020  Matt Keeter
 */
 #pragma once
+#ifndef __CUDACC_RTC__
 #include <cstdint>
+#ifndef MPR_CPU_ONLY
 #include <cuda_runtime.h>
+#endif
+#endif
 
 namespace mpr {
 
@@ -30,6 +34,8 @@ enum Opcode {
     GPU_OP_EXP_LHS,
     GPU_OP_ABS_LHS,
     GPU_OP_LOG_LHS,
+    GPU_OP_TAN_LHS,
+    GPU_OP_RECIP_LHS,
 
     // Commutative opcodes
     GPU_OP_ADD_LHS_IMM,
@@ -48,14 +54,54 @@ enum Opcode {
     GPU_OP_DIV_LHS_IMM,
     GPU_OP_DIV_IMM_RHS,
     GPU_OP_DIV_LHS_RHS,
+    GPU_OP_ATAN2_LHS_IMM,
+    GPU_OP_ATAN2_IMM_RHS,
+    GPU_OP_ATAN2_LHS_RHS,
+    GPU_OP_POW_LHS_IMM,
+    GPU_OP_POW_IMM_RHS,
+    GPU_OP_POW_LHS_RHS,
+    GPU_OP_NTH_ROOT_LHS_IMM,
+    GPU_OP_NTH_ROOT_IMM_RHS,
+    GPU_OP_NTH_ROOT_LHS_RHS,
+    GPU_OP_MOD_LHS_IMM,
+    GPU_OP_MOD_IMM_RHS,
+    GPU_OP_MOD_LHS_RHS,
+    GPU_OP_NANFILL_LHS_IMM,
+    GPU_OP_NANFILL_IMM_RHS,
+    GPU_OP_NANFILL_LHS_RHS,
+    GPU_OP_COMPARE_LHS_IMM,
+    GPU_OP_COMPARE_IMM_RHS,
+    GPU_OP_COMPARE_LHS_RHS,
 
     // Copy-only opcodes (used after pushing)
     GPU_OP_COPY_IMM,
     GPU_OP_COPY_LHS,
     GPU_OP_COPY_RHS,
+
+    // Loads a runtime parameter (see setParameters), by PARAM_INDEX
+    GPU_OP_PARAM,
+
+    // Compound opcodes (formed by TapeBuilder when fusing clauses)
+    GPU_OP_MUL_ADD_LHS_RHS_IMM, // lhs * rhs + imm
+    GPU_OP_MUL_ADD_LHS_IMM_RHS, // lhs * imm + rhs
+    GPU_OP_SQUARE_ADD_LHS_IMM,  // lhs^2 + imm
+    GPU_OP_SQUARE_ADD_LHS_RHS,  // lhs^2 + rhs
+    GPU_OP_SUB_SQUARE_LHS_IMM,  // (lhs - imm)^2
+    GPU_OP_SUB_SQUARE_LHS_RHS,  // (lhs - rhs)^2
+    GPU_OP_HYPOT_LHS_RHS,       // sqrt(lhs^2 + rhs^2)
+
+    // Moves values between the slot array and the spill array, by
+    // SPILL_INDEX (formed by TapeBuilder when a tape runs out of slots)
+    GPU_OP_SPILL,   // spill = lhs (I_OUT is unused)
+    GPU_OP_RELOAD,  // out = spill
+
+    GPU_OP_COUNT,   // Not an opcode; used to version saved tapes
 };
 
+// This is defined in gpu_opcode.cu, so it's missing from the CPU-only library
+#ifndef MPR_CPU_ONLY
 __host__ __device__
 const char* gpu_op_str(uint8_t op);
+#endif
 
 }   // namespace mpr
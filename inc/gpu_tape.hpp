@@ -0,0 +1,861 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#pragma once
+
+// This header is also compiled at runtime by NVRTC (see jit.hpp), so it
+// can only use headers which NVRTC can find by itself.
+#ifndef __CUDACC_RTC__
+#include <cassert>
+#endif
+
+#include "clause.hpp"
+#include "gpu_deriv.hpp"
+#include "gpu_interval.hpp"
+#include "gpu_opcode.hpp"
+#include "parameters.hpp"
+
+namespace mpr {
+
+/*
+ *  Unpacks a tile position into its X, Y, and Z coordinates, plus its index
+ *  in the (2D) image.
+ *
+ *  When rendering a batch of shapes, each shape's tiles follow the previous
+ *  shape's tiles, i.e. shapes are stacked along the Z axis.  The Z coordinate
+ *  is relative to the tile's own shape, and the image index points into that
+ *  shape's image, which are stored one after the other.
+ */
+static inline __device__
+int4 unpack(int32_t pos, int32_t tiles_per_side)
+{
+    const int32_t layer = pos / (tiles_per_side * tiles_per_side);
+    return make_int4(pos % tiles_per_side,
+                    (pos / tiles_per_side) % tiles_per_side,
+                     layer % tiles_per_side,
+                     pos % (tiles_per_side * tiles_per_side) +
+                     (layer / tiles_per_side) * tiles_per_side * tiles_per_side);
+}
+
+/*
+ *  Records the choice `c` made by a min or max clause during interval
+ *  evaluation, packing 16 choices into each word of `choices`.  Choices past
+ *  the end of the array are dropped, which makes shorten_tape keep both
+ *  branches of those clauses.
+ */
+template <int N>
+static inline __device__
+void record_choice(uint32_t (&choices)[N], int& choice_index,
+                   bool& has_any_choice, const int c)
+{
+    if (choice_index < N * 16) {
+        choices[choice_index / 16] |= (c << ((choice_index % 16) * 2));
+    }
+    choice_index++;
+    has_any_choice |= (c != 0);
+}
+
+/*
+ *  Tracks which entries of the spill array are read by GPU_OP_RELOAD clauses
+ *  that a backwards walk (shorten_tape, push_subtape) has already kept, so
+ *  that a GPU_OP_SPILL clause is only kept if its value is reloaded later.
+ */
+template <int SLOTS>
+struct SpillMask {
+    uint32_t words[(SPILL_ARRAY_SIZE(SLOTS) + 31) / 32];
+
+    __device__ void clear() {
+        for (unsigned i=0; i < sizeof(words) / sizeof(words[0]); ++i) {
+            words[i] = 0;
+        }
+    }
+
+    /*  Checks whether the clause `d` is needed, where `out_active` says
+     *  whether its output slot is active (which spills don't have) */
+    __device__ bool needed(const uint64_t& d, const bool out_active) const {
+        if (OP(&d) != GPU_OP_SPILL) {
+            return out_active;
+        }
+        const int32_t i = SPILL_INDEX(&d);
+        return (words[i / 32] >> (i % 32)) & 1;
+    }
+
+    /*  Updates the mask once the clause `d` has been kept */
+    __device__ void keep(const uint64_t& d) {
+        const int32_t i = SPILL_INDEX(&d);
+        if (OP(&d) == GPU_OP_RELOAD) {
+            words[i / 32] |= (1u << (i % 32));
+        } else if (OP(&d) == GPU_OP_SPILL) {
+            words[i / 32] &= ~(1u << (i % 32));
+        }
+    }
+};
+
+/*
+ *  shorten_tape
+ *
+ *  Walks backwards through a tape, starting from its final clause at `data`,
+ *  and finds the clauses which are active given the min/max `choices` made
+ *  during evaluation.  This is the same "mark" algorithm as the chunked
+ *  tape pushing in finish_tile, but it writes into a contiguous output
+ *  range: `out` points one past the last clause to be written, and clauses
+ *  are written backwards from there.
+ *
+ *  When `out` is null, nothing is written; this is used to count how many
+ *  clauses will be kept, so that the caller can claim exactly that much
+ *  space.  Returns the number of clauses kept (not including the tape's
+ *  first and last clauses), and leaves `data` at the tape's first clause.
+ *  `active` must have room for SLOTS values.
+ */
+template <int SLOTS>
+static inline __device__
+int32_t shorten_tape(const uint64_t* __restrict__& data, const uint8_t i_out,
+                     const uint32_t* const __restrict__ choices,
+                     const int choice_array_size, int choice_index,
+                     int* const __restrict__ active,
+                     uint64_t* __restrict__ out)
+{
+    for (unsigned i=0; i < SLOTS; ++i) {
+        active[i] = false;
+    }
+    active[i_out] = true;
+    SpillMask<SLOTS> spills;
+    spills.clear();
+
+    int32_t count = 0;
+    while (1) {
+        uint64_t d = *--data;
+        if (!OP(&d)) {
+            break;
+        }
+        const uint8_t op = OP(&d);
+        if (op == GPU_OP_JUMP) {
+            data += JUMP_TARGET(&d);
+            continue;
+        }
+
+        const bool has_choice = op >= GPU_OP_MIN_LHS_IMM &&
+                                op <= GPU_OP_MAX_LHS_RHS;
+        choice_index -= has_choice;
+
+        const uint8_t i_out = I_OUT(&d);
+        if (!spills.needed(d, active[i_out])) {
+            continue;
+        }
+        spills.keep(d);
+
+        assert(!has_choice || choice_index >= 0);
+
+        const int choice = (has_choice && choice_index < choice_array_size * 16)
+            ? ((choices[choice_index / 16] >>
+              ((choice_index % 16) * 2)) & 3)
+            : 0;
+
+        active[i_out] = false;
+        if (choice == 0) {
+            const uint8_t i_lhs = I_LHS(&d);
+            if (i_lhs) {
+                active[i_lhs] = true;
+            }
+            const uint8_t i_rhs = I_RHS(&d);
+            if (i_rhs) {
+                active[i_rhs] = true;
+            }
+        } else if (choice == 1 /* LHS */) {
+            const uint8_t i_lhs = I_LHS(&d);
+            active[i_lhs] = true;
+            if (i_lhs == i_out) {
+                continue;
+            }
+            OP(&d) = GPU_OP_COPY_LHS;
+        } else if (choice == 2 /* RHS */) {
+            const uint8_t i_rhs = I_RHS(&d);
+            if (i_rhs) {
+                active[i_rhs] = true;
+                if (i_rhs == i_out) {
+                    continue;
+                }
+                OP(&d) = GPU_OP_COPY_RHS;
+            } else {
+                OP(&d) = GPU_OP_COPY_IMM;
+            }
+        }
+        if (out) {
+            *--out = d;
+        }
+        ++count;
+    }
+    return count;
+}
+
+/*
+ *  push_subtape
+ *
+ *  Writes the tape which is active given a tile's min/max `choices` into
+ *  the subtape pool (see eval_tiles_i for the two layouts), where `data`
+ *  points to the final clause of the tile's current tape.  Returns the start
+ *  of the new tape, or -1 (after incrementing `tape_overflows[0]`) if the
+ *  pool ran out of room.  Successful pushes are counted in `tape_overflows[1]`,
+ *  and their lengths (in clauses, without chunk links) are summed in
+ *  `tape_overflows[2]`.  `active` must have room for SLOTS values.
+ */
+template <int SLOTS>
+static inline __device__
+int32_t push_subtape(const uint64_t* __restrict__ data,
+                     const uint32_t* const __restrict__ choices,
+                     const int choice_array_size, int choice_index,
+                     int* const __restrict__ active,
+
+                     uint64_t* const __restrict__ tape_data,
+                     int32_t* const __restrict__ tape_index,
+                     const int32_t tape_capacity,
+                     int32_t* const __restrict__ tape_overflows,
+                     const bool contiguous)
+{
+    const uint8_t i_out = I_OUT(data);
+
+    if (contiguous) {
+        // First pass: count the active clauses, plus the tape's first and
+        // last clauses, which are copied from the parent tape.
+        const uint64_t* __restrict__ walk = data;
+        const int32_t length = shorten_tape<SLOTS>(walk, i_out,
+                choices, choice_array_size, choice_index, active,
+                nullptr) + 2;
+
+        if (*tape_index >= tape_capacity) {
+            atomicAdd(tape_overflows, 1);
+            return -1;
+        }
+        const int32_t out_index = atomicAdd(tape_index, length);
+        if (out_index + length >= tape_capacity) {
+            atomicAdd(tape_overflows, 1);
+            return -1;
+        }
+
+        // Second pass: write the clauses backwards from the end
+        tape_data[out_index + length - 1] = *data;
+        shorten_tape<SLOTS>(data, i_out, choices, choice_array_size,
+                            choice_index, active,
+                            &tape_data[out_index + length - 1]);
+        tape_data[out_index] = *data;
+
+        atomicAdd(tape_overflows + 1, 1);
+        atomicAdd(tape_overflows + 2, length);
+        return out_index;
+    }
+
+    for (unsigned i=0; i < SLOTS; ++i) {
+        active[i] = false;
+    }
+    active[i_out] = true;
+    SpillMask<SLOTS> spills;
+    spills.clear();
+
+    // Check to make sure the tape isn't full
+    // This doesn't mean that we'll successfully claim a chunk, because
+    // other threads could claim chunks before us, but it's a way to check
+    // quickly (and prevents tape_index from getting absurdly large).
+    if (*tape_index >= tape_capacity) {
+        atomicAdd(tape_overflows, 1);
+        return -1;
+    }
+
+    // Claim a chunk of tape
+    int32_t out_index = atomicAdd(tape_index, SUBTAPE_CHUNK_SIZE);
+    int32_t out_offset = SUBTAPE_CHUNK_SIZE;
+
+    // If we've run out of tape, then immediately return
+    if (out_index + out_offset >= tape_capacity) {
+        atomicAdd(tape_overflows, 1);
+        return -1;
+    }
+
+    // Write out the end of the tape, which is the same as the ending
+    // of the previous tape (0 opcode, with i_out as the last slot)
+    out_offset--;
+    tape_data[out_index + out_offset] = *data;
+    int32_t length = 2; // First and last clauses
+
+    while (1) {
+        uint64_t d = *--data;
+        if (!OP(&d)) {
+            break;
+        }
+        const uint8_t op = OP(&d);
+        if (op == GPU_OP_JUMP) {
+            data += JUMP_TARGET(&d);
+            continue;
+        }
+
+        const bool has_choice = op >= GPU_OP_MIN_LHS_IMM &&
+                                op <= GPU_OP_MAX_LHS_RHS;
+        choice_index -= has_choice;
+
+        const uint8_t i_out = I_OUT(&d);
+        if (!spills.needed(d, active[i_out])) {
+            continue;
+        }
+        spills.keep(d);
+
+        assert(!has_choice || choice_index >= 0);
+
+        const int choice = (has_choice &&
+                            choice_index < choice_array_size * 16)
+            ? ((choices[choice_index / 16] >>
+              ((choice_index % 16) * 2)) & 3)
+            : 0;
+
+        // If we're about to write a new piece of data to the tape,
+        // (and are done with the current chunk), then we need to
+        // add another link to the linked list.
+        --out_offset;
+        if (out_offset == 0) {
+            const int32_t prev_index = out_index;
+
+            // Early exit if we can't finish writing out this tape
+            if (*tape_index >= tape_capacity) {
+                atomicAdd(tape_overflows, 1);
+                return -1;
+            }
+            out_index = atomicAdd(tape_index, SUBTAPE_CHUNK_SIZE);
+            out_offset = SUBTAPE_CHUNK_SIZE;
+
+            // Later exit if we claimed a chunk that exceeds the tape array
+            if (out_index + out_offset >= tape_capacity) {
+                atomicAdd(tape_overflows, 1);
+                return -1;
+            }
+            --out_offset;
+
+            // Forward-pointing link
+            OP(&tape_data[out_index + out_offset]) = GPU_OP_JUMP;
+            const int32_t delta = (int32_t)prev_index -
+                                  (int32_t)(out_index + out_offset);
+            JUMP_TARGET(&tape_data[out_index + out_offset]) = delta;
+
+            // Backward-pointing link
+            OP(&tape_data[prev_index]) = GPU_OP_JUMP;
+            JUMP_TARGET(&tape_data[prev_index]) = -delta;
+
+            // We've written the jump, so adjust the offset again
+            --out_offset;
+        }
+
+        active[i_out] = false;
+        if (choice == 0) {
+            const uint8_t i_lhs = I_LHS(&d);
+            if (i_lhs) {
+                active[i_lhs] = true;
+            }
+            const uint8_t i_rhs = I_RHS(&d);
+            if (i_rhs) {
+                active[i_rhs] = true;
+            }
+        } else if (choice == 1 /* LHS */) {
+            // The non-immediate is always the LHS in commutative ops, and
+            // min/max (the only clauses that produce a choice) are commutative
+            const uint8_t i_lhs = I_LHS(&d);
+            active[i_lhs] = true;
+            if (i_lhs == i_out) {
+                ++out_offset;
+                continue;
+            } else {
+                OP(&d) = GPU_OP_COPY_LHS;
+            }
+        } else if (choice == 2 /* RHS */) {
+            const uint8_t i_rhs = I_RHS(&d);
+            if (i_rhs) {
+                active[i_rhs] = true;
+                if (i_rhs == i_out) {
+                    ++out_offset;
+                    continue;
+                } else {
+                    OP(&d) = GPU_OP_COPY_RHS;
+                }
+            } else {
+                OP(&d) = GPU_OP_COPY_IMM;
+            }
+        }
+        tape_data[out_index + out_offset] = d;
+        ++length;
+    }
+
+    // Write the beginning of the tape
+    out_offset--;
+    tape_data[out_index + out_offset] = *data;
+
+    atomicAdd(tape_overflows + 1, 1);
+    atomicAdd(tape_overflows + 2, length);
+
+    // Return the beginning of the tape
+    return out_index + out_offset;
+}
+
+
+/*
+ *  The subtape table is a hash table which lets tiles with the same parent
+ *  tape and the same choices share one pushed subtape, rather than each
+ *  writing their own copy.  It's cleared (to all ones) before every frame,
+ *  so an empty entry has a key of ~0 and a tape of -1.
+ *
+ *  `tape` is -1 while the tile that claimed the entry is still pushing its
+ *  subtape, -2 if that push ran out of room, and otherwise the start of the
+ *  subtape in the pool.  `parent` is checked as well as the key, so a hash
+ *  collision would also need the same parent tape.
+ */
+struct SubtapeEntry {
+    uint64_t key;
+    int32_t parent;
+    int32_t tape;
+};
+
+/*  Hashes a tile's parent tape and the words of `choices` that are in use */
+static inline __device__
+uint64_t hash_choices(const int32_t parent,
+                      const uint32_t* const __restrict__ choices,
+                      const int choice_array_size, const int choice_index)
+{
+    const int used = (choice_index + 15) / 16;
+    const int words = (used < choice_array_size) ? used : choice_array_size;
+    uint64_t h = 14695981039346656037ull ^ (uint32_t)parent;
+    for (int i=0; i < words; ++i) {
+        h = (h ^ choices[i]) * 1099511628211ull;
+        h ^= h >> 29;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+
+    // ~0 marks an empty entry
+    return (h == ~0ull) ? 0 : h;
+}
+
+/*
+ *  Looks up the subtape for `key` (from hash_choices) and `parent` in a
+ *  table of `table_size` entries, which must be a power of two.
+ *
+ *  Returns the subtape's start if another tile has already pushed it, or -2
+ *  if that tile ran out of room in the pool.  Otherwise, returns -1, and the
+ *  caller should push the subtape itself.  If the caller claimed a new
+ *  entry, `entry` points to it, and the caller must publish the result with
+ *  publish_subtape; tiles which find an entry that's still being written
+ *  don't wait for it, and push their own copy instead.
+ */
+static inline __device__
+int32_t find_subtape(SubtapeEntry* const __restrict__ table,
+                     const int32_t table_size,
+                     const uint64_t key, const int32_t parent,
+                     SubtapeEntry*& entry)
+{
+    entry = nullptr;
+    for (int32_t i=0; i < 8; ++i) {
+        SubtapeEntry& e = table[(key + i) & (table_size - 1)];
+        const uint64_t prev = atomicCAS((unsigned long long*)&e.key,
+                                        ~0ull, (unsigned long long)key);
+        if (prev == ~0ull) {
+            e.parent = parent;
+            entry = &e;
+            return -1;
+        } else if (prev == key) {
+            const int32_t tape = *(volatile int32_t*)&e.tape;
+            if (tape == -1) {
+                return -1;
+            }
+            __threadfence();
+            if (*(volatile int32_t*)&e.parent == parent) {
+                return tape;
+            }
+        }
+    }
+    // The table is too full around this key, so we're on our own
+    return -1;
+}
+
+/*  Publishes the result of push_subtape (a tape start, or -1 if the push
+ *  failed) into an entry claimed by find_subtape */
+static inline __device__
+void publish_subtape(SubtapeEntry* const __restrict__ entry,
+                     const int32_t tape)
+{
+    __threadfence();
+    atomicExch(&entry->tape, (tape == -1) ? -2 : tape);
+}
+
+/*
+ *  finish_tile
+ *
+ *  Handles the result of interval evaluation for a single tile, once every
+ *  clause of its tape has run (see eval_tiles_i for the details).  `data`
+ *  points to the tape's final clause, and `result` is the value of its output
+ *  slot.  Empty, masked, and filled tiles are marked by setting `position` to
+ *  -1; otherwise, if any min/max clause made a choice, a shorter tape is
+ *  pushed into the subtape pool and its start is written to `tape`.
+ *
+ *  If `subtape_table` isn't null, tiles look up their parent tape and
+ *  choices in it first, and reuse a matching subtape that another tile has
+ *  already pushed (see SubtapeEntry).
+ *
+ *  `active` must have room for SLOTS values, and may alias the evaluator's
+ *  slot array (which is no longer needed).
+ *
+ *  DIMENSION 0 is used for clusters of points (see Context::evalPoints),
+ *  which have no image: every cluster which made a choice pushes a subtape,
+ *  since its points need exact values even if it is empty or filled.
+ *
+ *  In 3D, a null `image` selects volume mode (see Context::renderVolume):
+ *  tiles are never masked, and filled tiles are marked by setting `position`
+ *  to -2 - position, for collect_filled_tiles to record.
+ */
+template <int DIMENSION, int SLOTS>
+static inline __device__
+void finish_tile(const Interval result, const uint64_t* __restrict__ data,
+                 const uint32_t* const __restrict__ choices,
+                 const int choice_array_size, int choice_index,
+                 const bool has_any_choice, int* const __restrict__ active,
+
+                 uint64_t* const __restrict__ tape_data,
+                 int32_t* const __restrict__ tape_index,
+                 const int32_t tape_capacity,
+                 int32_t* const __restrict__ tape_overflows,
+                 const bool contiguous,
+                 SubtapeEntry* const __restrict__ subtape_table,
+                 const int32_t subtape_table_size,
+                 int32_t* const __restrict__ image,
+                 const uint32_t tiles_per_side,
+
+                 int32_t& position, int32_t& tape)
+{
+    // Empty
+    if (DIMENSION && result.lower() > 0.0f) {
+        position = -1;
+        return;
+    }
+
+    // Masked
+    if (DIMENSION == 3 && image) {
+        const int4 pos = unpack(position, tiles_per_side);
+        if (image[pos.w] > pos.z) {
+            position = -1;
+            return;
+        }
+    }
+
+    // Filled
+    if (DIMENSION && result.upper() < 0.0f) {
+        if (DIMENSION == 3 && !image) {
+            position = -2 - position;
+            return;
+        }
+        const int4 pos = unpack(position, tiles_per_side);
+        position = -1;
+        if (DIMENSION == 3) {
+            atomicMax(&image[pos.w], pos.z);
+        } else {
+            image[pos.w] = 1;
+        }
+        return;
+    }
+
+    if (!has_any_choice) {
+        return;
+    }
+
+    // Reuse an identical subtape, if another tile has already pushed one
+    SubtapeEntry* entry = nullptr;
+    if (subtape_table) {
+        const uint64_t key = hash_choices(tape, choices, choice_array_size,
+                                          choice_index);
+        const int32_t found = find_subtape(subtape_table, subtape_table_size,
+                                           key, tape, entry);
+        if (found >= 0) {
+            tape = found;
+            return;
+        } else if (found == -2) {
+            atomicAdd(tape_overflows, 1);
+            return;
+        }
+    }
+
+    const int32_t out = push_subtape<SLOTS>(
+        data, choices, choice_array_size, choice_index, active,
+        tape_data, tape_index, tape_capacity, tape_overflows, contiguous);
+    if (entry) {
+        publish_subtape(entry, out);
+    }
+    if (out != -1) {
+        tape = out;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ *  Float and float2 versions of the opcodes, so that eval_tape can use the
+ *  same names as the Deriv opcodes in gpu_deriv.hpp.  A float2 holds two
+ *  points, which are evaluated side by side.
+ *
+ *  These live in their own namespace (which eval_tape pulls in), since
+ *  float overloads in mpr itself would be ambiguous with CUDA's own in
+ *  files which use the mpr namespace.
+ */
+namespace point {
+
+using mpr::recip;
+using mpr::nth_root;
+using mpr::mod;
+using mpr::nanfill;
+using mpr::compare;
+
+__device__ inline float sqrt(const float& a) { return sqrtf(a); }
+__device__ inline float sin(const float& a) { return sinf(a); }
+__device__ inline float cos(const float& a) { return cosf(a); }
+__device__ inline float asin(const float& a) { return asinf(a); }
+__device__ inline float acos(const float& a) { return acosf(a); }
+__device__ inline float atan(const float& a) { return atanf(a); }
+__device__ inline float exp(const float& a) { return expf(a); }
+__device__ inline float abs(const float& a) { return fabsf(a); }
+__device__ inline float log(const float& a) { return logf(a); }
+__device__ inline float tan(const float& a) { return tanf(a); }
+
+__device__ inline float min(const float& a, const float& b) {
+    return fminf(a, b);
+}
+__device__ inline float max(const float& a, const float& b) {
+    return fmaxf(a, b);
+}
+__device__ inline float atan2(const float& a, const float& b) {
+    return atan2f(a, b);
+}
+__device__ inline float pow(const float& a, const float& b) {
+    return powf(a, b);
+}
+__device__ inline float hypot(const float& a, const float& b) {
+    return hypotf(a, b);
+}
+
+__device__ inline float mul_add(const float& a, const float& b,
+                                const float& c) {
+    return fmaf(a, b, c);
+}
+__device__ inline float square_add(const float& a, const float& b) {
+    return fmaf(a, a, b);
+}
+__device__ inline float sub_square(const float& a, const float& b) {
+    return (a - b) * (a - b);
+}
+
+#define POINT_UNARY(f)                                                      \
+__device__ inline float2 f(const float2& a) {                               \
+    return make_float2(f(a.x), f(a.y));                                     \
+}
+#define POINT_BINARY(f)                                                     \
+__device__ inline float2 f(const float2& a, const float2& b) {              \
+    return make_float2(f(a.x, b.x), f(a.y, b.y));                           \
+}                                                                           \
+__device__ inline float2 f(const float2& a, const float& b) {               \
+    return make_float2(f(a.x, b), f(a.y, b));                               \
+}                                                                           \
+__device__ inline float2 f(const float& a, const float2& b) {               \
+    return make_float2(f(a, b.x), f(a, b.y));                               \
+}
+#define POINT_OPERATOR(op)                                                  \
+__device__ inline float2 operator op(const float2& a, const float2& b) {    \
+    return make_float2(a.x op b.x, a.y op b.y);                             \
+}                                                                           \
+__device__ inline float2 operator op(const float2& a, const float& b) {     \
+    return make_float2(a.x op b, a.y op b);                                 \
+}                                                                           \
+__device__ inline float2 operator op(const float& a, const float2& b) {     \
+    return make_float2(a op b.x, a op b.y);                                 \
+}
+
+POINT_UNARY(sqrt)
+POINT_UNARY(sin)
+POINT_UNARY(cos)
+POINT_UNARY(asin)
+POINT_UNARY(acos)
+POINT_UNARY(atan)
+POINT_UNARY(exp)
+POINT_UNARY(abs)
+POINT_UNARY(log)
+POINT_UNARY(tan)
+POINT_UNARY(recip)
+
+POINT_BINARY(min)
+POINT_BINARY(max)
+POINT_BINARY(atan2)
+POINT_BINARY(pow)
+POINT_BINARY(nth_root)
+POINT_BINARY(mod)
+POINT_BINARY(nanfill)
+POINT_BINARY(compare)
+POINT_BINARY(hypot)
+POINT_BINARY(square_add)
+POINT_BINARY(sub_square)
+
+POINT_OPERATOR(+)
+POINT_OPERATOR(-)
+POINT_OPERATOR(*)
+POINT_OPERATOR(/)
+
+#undef POINT_UNARY
+#undef POINT_BINARY
+#undef POINT_OPERATOR
+
+__device__ inline float2 operator-(const float2& a) {
+    return make_float2(-a.x, -a.y);
+}
+__device__ inline float2 mul_add(const float2& a, const float2& b,
+                                 const float& c) {
+    return make_float2(fmaf(a.x, b.x, c), fmaf(a.y, b.y, c));
+}
+__device__ inline float2 mul_add(const float2& a, const float& b,
+                                 const float2& c) {
+    return make_float2(fmaf(a.x, b, c.x), fmaf(a.y, b, c.y));
+}
+
+/*  Converts an immediate or parameter into a value of type T */
+template <typename T>
+__device__ inline T constant(const float& a) {
+    return T(a);
+}
+template <>
+__device__ inline float2 constant<float2>(const float& a) {
+    return make_float2(a, a);
+}
+
+}   // namespace point
+
+/*
+ *  eval_tape
+ *
+ *  Interprets a tape at a point, with slot values of type T: float, float2
+ *  (for two points at once), or Deriv (for the gradient as well).  `data`
+ *  points to the tape's first clause, and the X, Y, and Z slots that it
+ *  names must already be loaded into `slots`.  `params` holds the runtime
+ *  parameters (tape_parameters, on the GPU).  Returns the tape's output.
+ *
+ *  If `cache` isn't null, it holds a copy of the first `cache_clauses`
+ *  clauses of the tape (e.g. in shared memory, see eval_voxels_f), which
+ *  are read from there instead; clauses past the end of the cache (or
+ *  reached through a jump to another chunk) are read from `data`.
+ *
+ *  This is used by every non-interval evaluator.  Interval evaluation also
+ *  records min/max choices, so eval_tiles_i has its own interpreter.
+ */
+template <typename T, int SLOTS>
+static inline __device__
+T eval_tape(const uint64_t* __restrict__ data, T (&slots)[SLOTS],
+            const float* const __restrict__ params,
+            const uint64_t* const __restrict__ cache=nullptr,
+            const int32_t cache_clauses=0)
+{
+    using namespace point;
+    const uint64_t* const __restrict__ tape = data;
+    T spills[SPILL_ARRAY_SIZE(SLOTS)];
+
+    while (1) {
+        ++data;
+        const int64_t offset = data - tape;
+        const uint64_t d = (cache && offset >= 0 && offset < cache_clauses)
+            ? cache[offset] : *data;
+        if (!OP(&d)) {
+            break;
+        }
+        switch (OP(&d)) {
+            case GPU_OP_JUMP: data += JUMP_TARGET(&d); continue;
+
+#define lhs slots[I_LHS(&d)]
+#define rhs slots[I_RHS(&d)]
+#define imm IMM(&d)
+#define param params[PARAM_INDEX(&d)]
+#define out slots[I_OUT(&d)]
+
+            case GPU_OP_SQUARE_LHS: out = lhs * lhs; break;
+            case GPU_OP_SQRT_LHS: out = sqrt(lhs); break;
+            case GPU_OP_NEG_LHS: out = -lhs; break;
+            case GPU_OP_SIN_LHS: out = sin(lhs); break;
+            case GPU_OP_COS_LHS: out = cos(lhs); break;
+            case GPU_OP_ASIN_LHS: out = asin(lhs); break;
+            case GPU_OP_ACOS_LHS: out = acos(lhs); break;
+            case GPU_OP_ATAN_LHS: out = atan(lhs); break;
+            case GPU_OP_EXP_LHS: out = exp(lhs); break;
+            case GPU_OP_ABS_LHS: out = abs(lhs); break;
+            case GPU_OP_LOG_LHS: out = log(lhs); break;
+            case GPU_OP_TAN_LHS: out = tan(lhs); break;
+            case GPU_OP_RECIP_LHS: out = recip(lhs); break;
+
+            // Commutative opcodes
+            case GPU_OP_ADD_LHS_IMM: out = lhs + imm; break;
+            case GPU_OP_ADD_LHS_RHS: out = lhs + rhs; break;
+            case GPU_OP_MUL_LHS_IMM: out = lhs * imm; break;
+            case GPU_OP_MUL_LHS_RHS: out = lhs * rhs; break;
+            case GPU_OP_MIN_LHS_IMM: out = min(lhs, imm); break;
+            case GPU_OP_MIN_LHS_RHS: out = min(lhs, rhs); break;
+            case GPU_OP_MAX_LHS_IMM: out = max(lhs, imm); break;
+            case GPU_OP_MAX_LHS_RHS: out = max(lhs, rhs); break;
+
+            // Non-commutative opcodes
+            case GPU_OP_SUB_LHS_IMM: out = lhs - imm; break;
+            case GPU_OP_SUB_IMM_RHS: out = imm - rhs; break;
+            case GPU_OP_SUB_LHS_RHS: out = lhs - rhs; break;
+
+            case GPU_OP_DIV_LHS_IMM: out = lhs / imm; break;
+            case GPU_OP_DIV_IMM_RHS: out = imm / rhs; break;
+            case GPU_OP_DIV_LHS_RHS: out = lhs / rhs; break;
+            case GPU_OP_ATAN2_LHS_IMM: out = atan2(lhs, imm); break;
+            case GPU_OP_ATAN2_IMM_RHS: out = atan2(imm, rhs); break;
+            case GPU_OP_ATAN2_LHS_RHS: out = atan2(lhs, rhs); break;
+            case GPU_OP_POW_LHS_IMM: out = pow(lhs, imm); break;
+            case GPU_OP_POW_IMM_RHS: out = pow(imm, rhs); break;
+            case GPU_OP_POW_LHS_RHS: out = pow(lhs, rhs); break;
+            case GPU_OP_NTH_ROOT_LHS_IMM: out = nth_root(lhs, imm); break;
+            case GPU_OP_NTH_ROOT_IMM_RHS: out = nth_root(imm, rhs); break;
+            case GPU_OP_NTH_ROOT_LHS_RHS: out = nth_root(lhs, rhs); break;
+            case GPU_OP_MOD_LHS_IMM: out = mod(lhs, imm); break;
+            case GPU_OP_MOD_IMM_RHS: out = mod(imm, rhs); break;
+            case GPU_OP_MOD_LHS_RHS: out = mod(lhs, rhs); break;
+            case GPU_OP_NANFILL_LHS_IMM: out = nanfill(lhs, imm); break;
+            case GPU_OP_NANFILL_IMM_RHS: out = nanfill(imm, rhs); break;
+            case GPU_OP_NANFILL_LHS_RHS: out = nanfill(lhs, rhs); break;
+            case GPU_OP_COMPARE_LHS_IMM: out = compare(lhs, imm); break;
+            case GPU_OP_COMPARE_IMM_RHS: out = compare(imm, rhs); break;
+            case GPU_OP_COMPARE_LHS_RHS: out = compare(lhs, rhs); break;
+
+            case GPU_OP_COPY_IMM: out = constant<T>(imm); break;
+            case GPU_OP_COPY_LHS: out = lhs; break;
+            case GPU_OP_COPY_RHS: out = rhs; break;
+            case GPU_OP_PARAM: out = constant<T>(param); break;
+
+            // Compound opcodes
+            case GPU_OP_MUL_ADD_LHS_RHS_IMM: out = mul_add(lhs, rhs, imm); break;
+            case GPU_OP_MUL_ADD_LHS_IMM_RHS: out = mul_add(lhs, imm, rhs); break;
+            case GPU_OP_SQUARE_ADD_LHS_IMM: out = square_add(lhs, imm); break;
+            case GPU_OP_SQUARE_ADD_LHS_RHS: out = square_add(lhs, rhs); break;
+            case GPU_OP_SUB_SQUARE_LHS_IMM: out = sub_square(lhs, imm); break;
+            case GPU_OP_SUB_SQUARE_LHS_RHS: out = sub_square(lhs, rhs); break;
+            case GPU_OP_HYPOT_LHS_RHS: out = hypot(lhs, rhs); break;
+
+            case GPU_OP_SPILL: spills[SPILL_INDEX(&d)] = lhs; break;
+            case GPU_OP_RELOAD: out = spills[SPILL_INDEX(&d)]; break;
+
+#undef lhs
+#undef rhs
+#undef imm
+#undef param
+#undef out
+        }
+    }
+
+    return slots[I_OUT(data)];
+}
+
+}   // namespace mpr
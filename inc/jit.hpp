@@ -0,0 +1,59 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#pragma once
+#include <memory>
+#include <string>
+#include <cuda.h>
+
+namespace mpr {
+
+// Forward declaration
+struct Tape;
+
+/*
+ *  Runtime-compiled evaluators for root tapes.
+ *
+ *  The interpreters in context.cu fetch every clause from memory and branch
+ *  on its opcode, which is the price of evaluating arbitrary subtapes.  In
+ *  the first stage, every tile evaluates the same (root) tape, so it can be
+ *  turned into straight-line code instead, like the hand-written kernel in
+ *  benchmark/brute.cu.  These functions generate CUDA source for a copy of
+ *  eval_tiles_i which is specialized on one tape, compile it with NVRTC, and
+ *  load it into the current device's context.
+ *
+ *  Subtapes are pushed on the GPU and are usually unique to a tile, so later
+ *  stages always use the interpreter.
+ */
+
+// CUDA modules are handles, so we wrap them in the same RAII style (see util.hpp)
+struct ModuleDeleter {
+    void operator()(CUmodule m) { cuModuleUnload(m); }
+};
+using Module = std::unique_ptr<CUmod_st, ModuleDeleter>;
+
+/*  Returns the source of the first-stage interval evaluator for `tape`,
+ *  which defines an extern "C" kernel named `eval_tiles_jit` with the same
+ *  parameters as eval_tiles_i.  Returns an empty string if the tape can't be
+ *  compiled (e.g. because it uses jumps). */
+std::string jitTilesSource(const Tape& tape, int dimension);
+
+/*  Returns the compiled first-stage evaluator for `tape`, compiling it on
+ *  the first call.  Kernels are cached for the life of the process, keyed by
+ *  the tape's hash, the dimension, and the current device.
+ *
+ *  Returns null if the tape is too long to be worth compiling, or if NVRTC
+ *  or module loading failed (in which case the error is printed once).  The
+ *  caller should fall back to the interpreter.  This is thread-safe, but
+ *  compiling a new tape takes tens to hundreds of milliseconds. */
+CUfunction jitEvalTiles(const Tape& tape, int dimension);
+
+}   // namespace mpr
@@ -0,0 +1,57 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <Eigen/Eigen>
+
+#include "context.hpp"
+#include "tape.hpp"
+#include "util.hpp"
+
+namespace mpr {
+
+/*  Splits each frame across several GPUs.  Every device has its own Context
+ *  (with its own subtape pool) and its own copy of the tape, and renders a
+ *  round-robin subset of the XY columns of 64^3 root tiles.  The per-device
+ *  depth and normal images are then merged with a max-Z composite on the
+ *  first device.
+ *
+ *  Because each pixel column is owned by exactly one device, no work is
+ *  duplicated, and frame time should scale roughly with device count. */
+struct MultiContext {
+    MultiContext(int32_t image_size_px, const std::vector<int>& devices);
+
+    /*  Renders a 3D image, leaving the merged result in `depth()` and
+     *  `normals()` (which live on the first device, in managed memory). */
+    void render3D(const Tape& tape, const Eigen::Matrix4f& mat);
+
+    const int32_t* depth() const { return contexts[0].stages[3].filled.get(); }
+    const uint32_t* normals() const { return contexts[0].normals.get(); }
+
+    int32_t image_size_px;
+    std::vector<int> devices;
+    std::vector<Context> contexts;
+
+    // One stream per device, so that every device renders concurrently
+    std::vector<Stream> streams;
+
+    // Per-device copies of the most recent tape
+    std::vector<Tape> tapes;
+
+    // Staging buffers on the first device, used to merge results from the
+    // other devices.
+    Ptr<int32_t[]> peer_depth;
+    Ptr<uint32_t[]> peer_normals;
+};
+
+}   // namespace mpr
@@ -15,6 +15,18 @@ Copyright (C) 2019-2020  Matt Keeter
 #define NUM_THREADS (64 * NUM_TILES)
 #define SUBTAPE_CHUNK_SIZE 64
 
+// Size of the largest per-thread slot array in the evaluators
+#define MAX_SLOTS 128
+
+// Size of the per-thread spill array, which holds values that don't fit in
+// the slot array.  Only tapes using all MAX_SLOTS slots spill, so only the
+// largest evaluators need one.
+#define MAX_SPILLS 256
+#define SPILL_ARRAY_SIZE(SLOTS) ((SLOTS) == MAX_SLOTS ? MAX_SPILLS : 1)
+
+// Number of runtime parameters (free variables) in the device-side buffer
+#define MAX_PARAMETERS 256
+
 #ifdef BIG_SERVER
 #define NUM_SUBTAPES 6400000
 #else
@@ -0,0 +1,38 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#pragma once
+#include <cstdint>
+
+namespace mpr {
+
+/*  Timing and tile counts for one frame (see Context::collect_stats).
+ *  Times are in milliseconds.  On the GPU, they're measured with events
+ *  between each part of the frame, so they include any time that the GPU
+ *  spent waiting for the host (e.g. between stages of a progressive
+ *  render).  The CPU backend fills in host timings (see CpuFrame::stats). */
+struct RenderStats {
+    float setup_ms;         // Tape copies, clearing images, loading tiles
+    float eval_ms[4];       // Interval evaluation, then voxels at [3]
+    float subdivide_ms[3];  // Masking, counting, and subdividing tiles
+    float normals_ms;
+    float total_ms;
+
+    int32_t tile_counts[4];     // Tiles in each stage (including masked ones)
+    int32_t tape_used;          // End of the subtape pool, in clauses
+    int32_t tape_capacity;
+    int32_t subtape_pushes;
+    int32_t subtape_overflows;  // Pushes which didn't fit in the pool
+    float mean_subtape_length;  // In clauses, over successful pushes
+    int32_t cache_hits;         // Reused first-stage tiles (see incremental)
+};
+
+}   // namespace mpr
@@ -11,8 +11,14 @@ Copyright (C) 2019-2020  Matt Keeter
 */
 #pragma once
 #include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
 
+// The CPU-only library (see cpu_render.hpp) has no GPU copy of the tape
+#ifndef MPR_CPU_ONLY
 #include "util.hpp"
+#endif
 
 // Forward declaration
 namespace libfive {
@@ -24,9 +30,114 @@ namespace mpr {
 struct Tape {
     Tape(const libfive::Tree& tree);
 
+    /*  Copies `length` already-flattened clauses from host memory into
+     *  `clauses` and a new buffer on the GPU */
+    Tape(const uint64_t* flat, int32_t length, int32_t num_slots);
+
+    /*  Copies the tape data into a new buffer, which is allocated on the
+     *  current device (from the host copy).  This is used to give each GPU
+     *  its own copy. */
+    Tape(const Tape& other);
+    Tape(Tape&& other)=default;
+
+    /*  Saves the flat clause array and parameter names to a binary file,
+     *  which can be loaded (much faster than rebuilding from a tree) with
+     *  Tape::load.  The file records the opcode set that it was built with,
+     *  and load refuses files from a build with a different set, or from an
+     *  older version of the format.  load also checks that every clause has
+     *  a valid opcode, and slots, spills, and parameters within the
+     *  evaluators' limits, so a corrupt file can't make them index out of
+     *  bounds.
+     *
+     *  Both functions throw std::runtime_error on failure. */
+    void save(const std::string& path) const;
+    static Tape load(const std::string& path);
+
+    /*  Host copy of the clauses, which is read by the CPU backend, save,
+     *  and the JIT, so that none of them touch the GPU */
+    std::vector<uint64_t> clauses;
+
+#ifndef MPR_CPU_ONLY
     // data is a pointer in GPU (unified) memory
     Ptr<uint64_t[]> data;
+#endif
     int32_t length;
+
+    /*  Number of slots used by the tape (including slot 0), which bounds
+     *  the size of each thread's slot array during evaluation.  This is at
+     *  most MAX_SLOTS: a tape which needs more moves values into a spill
+     *  array of MAX_SPILLS entries (with GPU_OP_SPILL and GPU_OP_RELOAD),
+     *  and building a tape which needs more than that throws
+     *  std::runtime_error. */
+    int32_t num_slots;
+
+    /*  Hash of the tape's clauses, which is used to find compiled kernels
+     *  for the tape (see jit.hpp) without reading it back from the GPU. */
+    uint64_t hash;
+
+    /*  Names of the runtime parameters, by index (see
+     *  TapeBuilder::parameter), with empty names for unnamed free
+     *  variables.  These are saved (and loaded) with the clauses. */
+    std::vector<std::string> parameters;
+
+    /*  Returns the index of the named parameter, or -1 */
+    int32_t parameter(const std::string& name) const;
+};
+
+/*  Builds tapes from trees, keeping a cache of every node that it has seen.
+ *
+ *  libfive deduplicates trees, so when a script is re-evaluated, unchanged
+ *  subexpressions are the same nodes as before, and only new nodes need to
+ *  be analyzed.  Scheduling and slot allocation still run over the whole
+ *  tape, but only touch flat arrays.
+ *
+ *  The builder keeps every tree that it has built alive (so that cached
+ *  nodes can't be freed and reused), until the cache grows past `max_nodes`
+ *  and is cleared.  Tape(const libfive::Tree&) uses a temporary builder. */
+struct TapeBuilder {
+    TapeBuilder();
+    ~TapeBuilder();
+
+    Tape build(const libfive::Tree& tree);
+
+    /*  Drops every cached node and tree, and every parameter */
+    void clear();
+
+    /*  Returns the number of nodes in the cache */
+    size_t cachedNodes() const;
+
+    /*  Names a free variable (made with libfive::Tree::var()), returning
+     *  its parameter index, which is where it's read from at render time
+     *  (see setParameters).  Free variables are numbered in the order that
+     *  the builder first sees them, here or while building, and every tape
+     *  from the builder shares that numbering (even when the node cache is
+     *  cleared by build) until clear() is called.  This (and build) throws
+     *  std::runtime_error if the builder would have more than
+     *  MAX_PARAMETERS free variables. */
+    int32_t parameter(const libfive::Tree& var, const std::string& name);
+
+    size_t max_nodes=1 << 22;
+
+    /*  When set (the default), constant subexpressions are folded, and
+     *  identities like x * 1, x + 0, and -(-x) are simplified away. */
+    bool simplify=true;
+
+    /*  When set (the default), common patterns like (x - a)^2 + y are merged
+     *  into compound opcodes, which reduces dispatch overhead per clause. */
+    bool fuse=true;
+
+    /*  When set, the tree is also pruned against the region within `lower`
+     *  and `upper` (in model coordinates, i.e. after the render matrix is
+     *  applied to the [-1, 1] view volume).  Clauses which are provably
+     *  unused anywhere in the region, like one side of a min or max, are
+     *  removed.  The resulting tape is only valid when rendering inside the
+     *  region, so this is off by default. */
+    bool prune=false;
+    float lower[3]={-1.0f, -1.0f, -1.0f};
+    float upper[3]={1.0f, 1.0f, 1.0f};
+
+    struct Impl;
+    std::unique_ptr<Impl> impl;
 };
 
 } // namespace mpr
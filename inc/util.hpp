@@ -33,22 +33,111 @@ inline T* cudaMallocManagedChecked(size_t count, const char *file, int line) {
     return static_cast<T*>(ptr);
 }
 
+#define CUDA_MALLOC_DEVICE(T, c) cudaMallocDeviceChecked<T>(c, __FILE__, __LINE__)
+template <typename T>
+inline T* cudaMallocDeviceChecked(size_t count, const char *file, int line) {
+    void* ptr;
+    gpuCheck(cudaMalloc(&ptr, sizeof(T) * count), file, line);
+    return static_cast<T*>(ptr);
+}
+
 #define CUDA_FREE(c) cudaFreeChecked((void*)c, __FILE__, __LINE__)
 inline void cudaFreeChecked(void* ptr, const char *file, int line) {
     //printf("%p freed [%s:%i]\n", ptr, file, line);
     gpuCheck(cudaFree(ptr), file, line);
 }
 
+#define CUDA_MALLOC_HOST(T, c) cudaMallocHostChecked<T>(c, __FILE__, __LINE__)
+template <typename T>
+inline T* cudaMallocHostChecked(size_t count, const char *file, int line) {
+    void* ptr;
+    gpuCheck(cudaMallocHost(&ptr, sizeof(T) * count), file, line);
+    return static_cast<T*>(ptr);
+}
+
+#define CUDA_FREE_HOST(c) cudaFreeHostChecked((void*)c, __FILE__, __LINE__)
+inline void cudaFreeHostChecked(void* ptr, const char *file, int line) {
+    gpuCheck(cudaFreeHost(ptr), file, line);
+}
+
+#define HOST_MALLOC(T, c) hostMallocChecked<T>(c, __FILE__, __LINE__)
+template <typename T>
+inline T* hostMallocChecked(size_t count, const char *file, int line) {
+    void* ptr = malloc(sizeof(T) * count);
+    if (ptr == nullptr && count) {
+        fprintf(stderr, "Error: out of host memory %s %d\n", file, line);
+        exit(1);
+    }
+    return static_cast<T*>(ptr);
+}
+
 namespace mpr {
 
+/*  Frees CUDA memory, or plain host memory (from HOST_MALLOC) if it was
+ *  built with `host` set, which is how CPU-backend contexts free images */
 struct Deleter {
+    Deleter() {}
+    explicit Deleter(bool host) : host(host) {}
+
     template <typename T>
-    void operator()(T* ptr) { CUDA_FREE(ptr); }
+    void operator()(T* ptr) {
+        if (host) {
+            free((void*)ptr);
+        } else {
+            CUDA_FREE(ptr);
+        }
+    }
+    bool host=false;
 };
 
 template <typename T>
 using Ptr = std::unique_ptr<T, Deleter>;
 
+// Page-locked host memory, used as the target of asynchronous readbacks
+struct HostDeleter {
+    template <typename T>
+    void operator()(T* ptr) { CUDA_FREE_HOST(ptr); }
+};
+
+template <typename T>
+using HostPtr = std::unique_ptr<T, HostDeleter>;
+
+// CUDA events are handles, so we wrap them in the same RAII style
+struct EventDeleter {
+    void operator()(cudaEvent_t e) { CUDA_CHECK(cudaEventDestroy(e)); }
+};
+using Event = std::unique_ptr<CUevent_st, EventDeleter>;
+
+inline Event makeEvent() {
+    cudaEvent_t e;
+    CUDA_CHECK(cudaEventCreateWithFlags(&e, cudaEventDisableTiming));
+    return Event(e);
+}
+
+// Events which can be passed to cudaEventElapsedTime, which are slightly
+// more expensive to record
+inline Event makeTimingEvent() {
+    cudaEvent_t e;
+    CUDA_CHECK(cudaEventCreate(&e));
+    return Event(e);
+}
+
+struct StreamDeleter {
+    void operator()(cudaStream_t s) { CUDA_CHECK(cudaStreamDestroy(s)); }
+};
+using Stream = std::unique_ptr<CUstream_st, StreamDeleter>;
+
+inline Stream makeStream() {
+    cudaStream_t s;
+    CUDA_CHECK(cudaStreamCreateWithFlags(&s, cudaStreamNonBlocking));
+    return Stream(s);
+}
+
+struct GraphExecDeleter {
+    void operator()(cudaGraphExec_t g) { CUDA_CHECK(cudaGraphExecDestroy(g)); }
+};
+using GraphExec = std::unique_ptr<CUgraphExec_st, GraphExecDeleter>;
+
 // Helper function to do constexpr integer powers
 inline constexpr unsigned __host__ __device__ pow(unsigned p, unsigned n) {
     return n ? p * pow(p, n - 1) : 1;
@@ -51,3 +51,23 @@ echo "Bear sculpt"
 ./benchmark/render_3d_table ../benchmark/files/bear.frep
 mkdir -p bear
 mv *.png bear
+
+echo "------------------------------------------------------------"
+echo "Bear sculpt, orbiting with the incremental cache"
+# Prints the mean, p50, and p99 frame times with and without the cache
+./benchmark/render_3d_table --orbit --incremental ../benchmark/files/bear.frep
+mkdir -p bear_orbit
+mv *.png bear_orbit
+
+echo "============================================================"
+echo "                  Machine-readable results                  "
+echo "============================================================"
+# Set BASELINE to a CSV from an earlier run to fail on regressions
+./benchmark/render_suite --format csv --out results.csv \
+    ${BASELINE:+--baseline "$BASELINE"} \
+    --dim 2 ../benchmark/files/prospero.frep \
+            ../benchmark/files/involute_gear_2d.frep \
+    --dim 3 ../benchmark/files/architecture.frep \
+            ../benchmark/files/involute_gear_3d.frep \
+            ../benchmark/files/bear.frep
+cat results.csv
@@ -9,43 +9,215 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 
 Copyright (C) 2019-2020  Matt Keeter
 */
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
 #include "context.hpp"
+#include "context_impl.hpp"
 #include "parameters.hpp"
 
 namespace mpr {
 
-Context::Context(int32_t image_size_px)
-    : image_size_px(image_size_px)
+/*  Hints that a managed buffer should live on the current GPU, then moves it
+ *  there, so that the first kernel to touch it doesn't take page faults.
+ *  This is skipped on devices which can't migrate pages concurrently. */
+static void prefer_device(const void* ptr, size_t bytes) {
+    int device;
+    CUDA_CHECK(cudaGetDevice(&device));
+    int concurrent;
+    CUDA_CHECK(cudaDeviceGetAttribute(
+            &concurrent, cudaDevAttrConcurrentManagedAccess, device));
+    if (concurrent) {
+        CUDA_CHECK(cudaMemAdvise(ptr, bytes,
+                                 cudaMemAdviseSetPreferredLocation, device));
+        CUDA_CHECK(cudaMemPrefetchAsync(ptr, bytes, device));
+    }
+}
+
+Context::Context(int32_t image_size_px, MemoryPolicy policy,
+                 Backend backend)
+    : image_size_px(image_size_px), memory_policy(policy), backend(backend),
+      impl(new Impl)
 {
-    // Build the four stages
-    for (unsigned i=0; i < 4; ++i) {
-        const unsigned tile_size_px = 64 / (1 << (i * 2));
-        stages[i].filled.reset(CUDA_MALLOC(
-                int32_t,
-                pow(image_size_px / tile_size_px, 2)));
+    // Every stage's tiles (and images) evenly divide the first stage's
+    if (image_size_px <= 0 || image_size_px % 64) {
+        throw std::runtime_error("image_size_px must be a positive "
+                                 "multiple of 64");
+    }
+
+    // Lets existing programs run on the CPU backend without changes
+    const char* b = getenv("MPR_BACKEND");
+    if (b && !strcmp(b, "cpu")) {
+        this->backend = BACKEND_CPU;
     }
 
-    normals.reset(CUDA_MALLOC(uint32_t, image_size_px * image_size_px));
+    // Build the four stages' images, and the first stage's tiles
+    reserve_images(*this, 1);
 
-    // Allocate a bunch of memory to store tapes
-    tape_data.reset(CUDA_MALLOC(uint64_t, NUM_SUBTAPES * SUBTAPE_CHUNK_SIZE));
-    tape_index.reset(CUDA_MALLOC(int32_t, 1));
-    *tape_index = 0;
+    // The CPU backend only needs its images, which are in host memory
+    if (this->backend == BACKEND_CPU) {
+        return;
+    }
 
-    // Allocate an index to keep track of active tiles
-    num_active_tiles.reset(CUDA_MALLOC(int32_t, 1));
+    // Allocate a bunch of memory to store tapes, plus counters for pushes
+    // which didn't fit (and for those which did)
+    impl->tape_index.reset(alloc<int32_t>(*this, 1));
+    CUDA_CHECK(cudaMemset(impl->tape_index.get(), 0, sizeof(int32_t)));
+    impl->tape_overflows.reset(alloc<int32_t>(*this, 3));
+    CUDA_CHECK(cudaMemset(impl->tape_overflows.get(), 0, sizeof(int32_t) * 3));
+    impl->tape_overflows_host.reset(CUDA_MALLOC_HOST(int32_t, 1));
+    *impl->tape_overflows_host = 0;
 
-    // The first array of tiles must have enough space to hold all of the
-    // 64^3 tiles in the volume, which shouldn't be too much.
-    stages[0].tiles.reset(CUDA_MALLOC(
-            TileNode,
-            pow(image_size_px / 64, 3)));
+    // The subtape pool itself is allocated by the first frame (see
+    // reserve_subtapes), so that it can be shared before then.
+    impl->scratch = std::make_shared<ScratchPool>();
+
+    // Allocate per-stage counts to keep track of active tiles
+    impl->tile_counts.reset(alloc<int32_t>(*this, 4));
+    impl->tile_counts_host.reset(CUDA_MALLOC_HOST(int32_t, 4));
+    for (unsigned i=0; i < 4; ++i) {
+        impl->tile_counts_host[i] = 0;
+    }
+
+    // Same for tiles which were culled by occlusion
+    impl->cull_counts.reset(alloc<int32_t>(*this, 4));
+    CUDA_CHECK(cudaMemset(impl->cull_counts.get(), 0, sizeof(int32_t) * 4));
+    impl->cull_counts_host.reset(CUDA_MALLOC_HOST(int32_t, 4));
+    for (unsigned i=0; i < 4; ++i) {
+        impl->cull_counts_host[i] = 0;
+    }
+
+    // Marks the end of each asynchronous render
+    impl->frame_done = makeEvent();
+
+    // Storage for the transform matrix, which is updated on the GPU.  This
+    // is grown (and `tape_starts` is allocated) to render a batch of shapes.
+    impl->batch_size = 1;
+    impl->mat_buffer.reset(alloc<Eigen::Matrix4f>(*this, impl->batch_size));
 
     // We leave the other stage_t's tile arrays unallocated for now, since
     // they're initialized to all zeros and will be resized to fit later.
 
+    // Tile counts below one warp per resident warp slot leave most of the
+    // device idle, so those stages use warp evaluation (see eval_tiles_i)
+    int device, sm_count, sm_threads;
+    CUDA_CHECK(cudaGetDevice(&device));
+    CUDA_CHECK(cudaDeviceGetAttribute(
+            &sm_count, cudaDevAttrMultiProcessorCount, device));
+    CUDA_CHECK(cudaDeviceGetAttribute(
+            &sm_threads, cudaDevAttrMaxThreadsPerMultiProcessor, device));
+    warp_tiles = sm_count * sm_threads / 32;
+
     // Prefer the L1 cache!
     cudaDeviceSetCacheConfig(cudaFuncCachePreferL1);
 }
 
+// These are defined here, where Impl is a complete type
+Context::Context(Context&&) = default;
+Context& Context::operator=(Context&&) = default;
+Context::~Context() = default;
+
+size_t Context::scratchHighWater() const {
+    return impl->scratch_high_water;
+}
+
+int32_t Context::tape_capacity() const {
+    require_cuda(*this, "tape_capacity");
+    return impl->scratch->num_subtapes * SUBTAPE_CHUNK_SIZE;
+}
+
+const uint64_t* Context::subtapePool() const {
+    require_cuda(*this, "subtapePool");
+    return impl->scratch->tape_data.get();
+}
+
+int32_t Context::subtapeEnd() const {
+    require_cuda(*this, "subtapeEnd");
+    int32_t end;
+    CUDA_CHECK(cudaMemcpy(&end, impl->tape_index.get(), sizeof(int32_t),
+                          cudaMemcpyDefault));
+    return end;
+}
+
+const int32_t* Context::volumeFilled(int32_t stage) const {
+    require_cuda(*this, "volumeFilled");
+    return impl->volume_filled[stage].get();
+}
+
+void require_cuda(const Context& ctx, const char* name) {
+    if (ctx.backend == BACKEND_CPU) {
+        throw std::runtime_error(std::string(name) + " needs BACKEND_CUDA");
+    }
+}
+
+void reserve_images(Context& ctx, int32_t count) {
+    if (count <= ctx.image_count) {
+        return;
+    }
+
+    // CPU frames finish before returning, so their images (which are in
+    // host memory) can be replaced right away, and they don't use tiles.
+    if (ctx.backend == BACKEND_CPU) {
+        for (unsigned i=0; i < 4; ++i) {
+            const unsigned tile_size_px = 64 / (1 << (i * 2));
+            ctx.stages[i].filled = alloc_image<int32_t>(ctx,
+                size_t(count) * pow(ctx.image_size_px / tile_size_px, 2));
+        }
+        ctx.normals.reset();
+        ctx.depth16.reset();
+        ctx.image_count = count;
+        return;
+    }
+
+    // Old buffers may still be in use by a frame in flight, so they're
+    // retired (and freed by release_retired) rather than freed immediately.
+    for (unsigned i=0; i < 4; ++i) {
+        const unsigned tile_size_px = 64 / (1 << (i * 2));
+        const size_t size =
+            size_t(count) * pow(ctx.image_size_px / tile_size_px, 2);
+        if (ctx.stages[i].filled) {
+            ctx.impl->retired.emplace_back(ctx.stages[i].filled.release());
+        }
+        ctx.stages[i].filled = alloc_image<int32_t>(ctx, size);
+        if (ctx.memory_policy == MEMORY_DEVICE) {
+            prefer_device(ctx.stages[i].filled.get(), sizeof(int32_t) * size);
+        }
+    }
+
+    // Normals (and compact depth) are only allocated by frames which render
+    // them, so they're dropped here and reallocated at the new size by the
+    // next such frame.
+    if (ctx.normals) {
+        ctx.impl->retired.emplace_back(ctx.normals.release());
+    }
+    if (ctx.depth16) {
+        ctx.impl->retired.emplace_back(ctx.depth16.release());
+    }
+
+    // The first array of tiles must have enough space to hold all of the
+    // 64^3 tiles in the volume (for every shape), which shouldn't be too much.
+    if (ctx.stages[0].tiles) {
+        ctx.impl->retired.emplace_back(ctx.stages[0].tiles.release());
+    }
+    ctx.stages[0].tile_array_size =
+        size_t(count) * pow(ctx.image_size_px / 64, 3);
+    ctx.stages[0].tiles.reset(
+        alloc<TileNode>(ctx, ctx.stages[0].tile_array_size));
+
+    ctx.image_count = count;
+}
+
+void alloc_normals(Context& ctx) {
+    if (ctx.normals) {
+        return;
+    }
+    const size_t size = size_t(ctx.image_count) * pow(ctx.image_size_px, 2);
+    ctx.normals = alloc_image<uint32_t>(ctx, size);
+    if (ctx.memory_policy == MEMORY_DEVICE && ctx.backend == BACKEND_CUDA) {
+        prefer_device(ctx.normals.get(), sizeof(uint32_t) * size);
+    }
+}
+
 } // namespace mpr
@@ -9,24 +9,51 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 
 Copyright (C) 2019-2020  Matt Keeter
 */
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <stdexcept>
+
 #include "clause.hpp"
 #include "context.hpp"
+#include "context_impl.hpp"
+#include "cpu_render.hpp"
+#include "jit.hpp"
 #include "parameters.hpp"
 #include "tape.hpp"
 
+#include "gpu_affine.hpp"
 #include "gpu_deriv.hpp"
 #include "gpu_interval.hpp"
 #include "gpu_opcode.hpp"
+#include "gpu_tape.hpp"
+
+// NVTX ranges mark each part of a frame in Nsight timelines, when enabled
+// at build time (with the MPR_NVTX CMake option)
+#ifdef MPR_NVTX
+#include <nvtx3/nvToolsExt.h>
+#define NVTX_PUSH(name) nvtxRangePushA(name)
+#define NVTX_POP() nvtxRangePop()
+#else
+#define NVTX_PUSH(name)
+#define NVTX_POP()
+#endif
 
 using namespace mpr;
 
+/*  Runtime parameters, which are read by GPU_OP_PARAM clauses.  This is a
+ *  single buffer per device, shared by every context (see setParameters). */
+__constant__ float tape_parameters[MAX_PARAMETERS];
+
+/*  Incremented whenever parameters change, since tiles from the tile cache
+ *  are only valid for the parameters that they were evaluated with */
+static uint64_t parameter_generation = 0;
+
+/*  Returns the index of the shape that a 3D tile position belongs to */
 static inline __device__
-int4 unpack(int32_t pos, int32_t tiles_per_side)
+int32_t shape_of(int32_t pos, int32_t tiles_per_side)
 {
-    return make_int4(pos % tiles_per_side,
-                    (pos / tiles_per_side) % tiles_per_side,
-                    (pos / tiles_per_side) / tiles_per_side,
-                     pos % (tiles_per_side * tiles_per_side));
+    return pos / (tiles_per_side * tiles_per_side * tiles_per_side);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -39,23 +66,114 @@ int4 unpack(int32_t pos, int32_t tiles_per_side)
  *  to 0 (for the default tape), and its `next` pointer to -1 (indicating
  *  that there is no following node, yet).
  *
+ *  When rendering a batch of shapes, `tape_starts` holds the start of each
+ *  shape's tape, and the tiles for each shape (`tiles_per_side^3` of them)
+ *  follow each other.  Otherwise, it's null and every tile uses tape 0.
+ *
+ *  The first thread also resets `tape_index` to `tape_length`, which marks
+ *  the end of the base tape in the subtape pool, and clears the pool's
+ *  overflow and push counters.  Doing this on the GPU
+ *  (rather than writing through managed memory from the host) keeps the
+ *  whole frame ordered on a single stream.  It also stores `in_tile_count`
+ *  in `out_tile_count`, which is the device-side count that later kernels
+ *  read to find the end of the tile list.
+ *
+ *  When rendering is split across several GPUs, each one only owns a subset
+ *  of the XY columns of top-level tiles (assigned round-robin, so that the
+ *  work is balanced even if the model is off-center).  Tiles in columns
+ *  that belong to another partition are marked with position = -1, so
+ *  they're skipped by every later stage.  Likewise, tiles outside of the
+ *  `viewport` (a range of tiles in X and Y, see viewport_tiles) are masked.
+ *
  *  This function should be called before the first stage of per-tile
  *  evaluation, when we want to evaluate every single top-level tile.
  */
 __global__
 void preload_tiles(TileNode* const __restrict__ in_tiles,
-                   const int32_t in_tile_count)
+                   const int32_t in_tile_count,
+                   int32_t* const __restrict__ out_tile_count,
+                   int32_t* const __restrict__ tape_index,
+                   const int32_t tape_length,
+                   int32_t* const __restrict__ tape_overflows,
+                   const int32_t tiles_per_side,
+                   const int32_t partition_index,
+                   const int32_t partition_count,
+                   const int4 viewport,
+                   const int32_t* const __restrict__ tape_starts)
 {
     const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (tile_index == 0) {
+        *tape_index = tape_length;
+        tape_overflows[0] = 0;
+        tape_overflows[1] = 0;
+        tape_overflows[2] = 0;
+        *out_tile_count = in_tile_count;
+    }
     if (tile_index >= in_tile_count) {
         return;
     }
 
-    in_tiles[tile_index].position = tile_index;
-    in_tiles[tile_index].tape = 0;
+    const int4 pos = unpack(tile_index, tiles_per_side);
+    const bool owned = (pos.x + pos.y) % partition_count == partition_index &&
+                       pos.x >= viewport.x && pos.y >= viewport.y &&
+                       pos.x < viewport.z && pos.y < viewport.w;
+    in_tiles[tile_index].position = owned ? tile_index : -1;
+    in_tiles[tile_index].tape = tape_starts
+        ? tape_starts[shape_of(tile_index, tiles_per_side)] : 0;
     in_tiles[tile_index].next = -1;
 }
 
+/*
+ *  store_matrix
+ *
+ *  Writes `mat` to device memory.  Kernel parameters are copied at launch
+ *  time, so this is a fully stream-ordered way to update the matrix (unlike
+ *  a copy from pageable host memory, which may block).
+ */
+__global__
+void store_matrix(Eigen::Matrix4f* const __restrict__ out,
+                  const Eigen::Matrix4f mat)
+{
+    *out = mat;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*  Calculates the bounds of the 3D tile at `position` in model space, after
+ *  growing it by `margin` (as a fraction of the tile size) on every side. */
+static inline __device__
+void tile_bounds_3d(const int32_t position, const uint32_t tiles_per_side,
+                    const Eigen::Matrix4f& mat, const float margin,
+                    Interval* const __restrict__ out)
+{
+    const int4 pos = unpack(position, tiles_per_side);
+    const Interval ix = {((pos.x - margin) / (float)tiles_per_side - 0.5f) * 2.0f,
+                   ((pos.x + 1 + margin) / (float)tiles_per_side - 0.5f) * 2.0f};
+    const Interval iy = {((pos.y - margin) / (float)tiles_per_side - 0.5f) * 2.0f,
+                   ((pos.y + 1 + margin) / (float)tiles_per_side - 0.5f) * 2.0f};
+    const Interval iz = {((pos.z - margin) / (float)tiles_per_side - 0.5f) * 2.0f,
+                   ((pos.z + 1 + margin) / (float)tiles_per_side - 0.5f) * 2.0f};
+
+    Interval ix_, iy_, iz_, iw_;
+    ix_ = mat(0, 0) * ix +
+          mat(0, 1) * iy +
+          mat(0, 2) * iz + mat(0, 3);
+    iy_ = mat(1, 0) * ix +
+          mat(1, 1) * iy +
+          mat(1, 2) * iz + mat(1, 3);
+    iz_ = mat(2, 0) * ix +
+          mat(2, 1) * iy +
+          mat(2, 2) * iz + mat(2, 3);
+    iw_ = mat(3, 0) * ix +
+          mat(3, 1) * iy +
+          mat(3, 2) * iz + mat(3, 3);
+
+    // Projection!
+    out[0] = ix_ / iw_;
+    out[1] = iy_ / iw_;
+    out[2] = iz_ / iw_;
+}
+
 /*
  *  calculate_intervals
  *
@@ -64,6 +182,10 @@ void preload_tiles(TileNode* const __restrict__ in_tiles,
  *  screen-aligned), then applies the transform specified by `mat` and writes
  *  the results to the `values` array.
  *
+ *  In 3D, `mat` is read from device memory (rather than passed by value), so
+ *  that a captured CUDA graph can be replayed with a different matrix.  It's
+ *  an array with one matrix per shape, when rendering a batch of shapes.
+ *
  *  The values array is packed as triples, i.e. [X0 Y0 Z0 X1 Y1 Z1 ...]
  *
  *  This function could theoretically take place at the beginning of
@@ -77,58 +199,70 @@ void preload_tiles(TileNode* const __restrict__ in_tiles,
  */
 __global__
 void calculate_intervals_3d(const TileNode* const __restrict__ in_tiles,
-                            const uint32_t in_tile_count,
+                            const int32_t* const __restrict__ in_tile_count,
                             const uint32_t tiles_per_side,
-                            const Eigen::Matrix4f mat,
+                            const Eigen::Matrix4f* const __restrict__ mat_ptr,
                             Interval* const __restrict__ values)
 {
-    const uint32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
-    if (tile_index >= in_tile_count) {
+    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (tile_index >= *in_tile_count) {
         return;
     }
 
-    const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
-    const Interval ix = {(pos.x / (float)tiles_per_side - 0.5f) * 2.0f,
-                   ((pos.x + 1) / (float)tiles_per_side - 0.5f) * 2.0f};
-    const Interval iy = {(pos.y / (float)tiles_per_side - 0.5f) * 2.0f,
-                   ((pos.y + 1) / (float)tiles_per_side - 0.5f) * 2.0f};
-    const Interval iz = {(pos.z / (float)tiles_per_side - 0.5f) * 2.0f,
-                   ((pos.z + 1) / (float)tiles_per_side - 0.5f) * 2.0f};
+    const int32_t position = in_tiles[tile_index].position;
+    tile_bounds_3d(position, tiles_per_side,
+                   mat_ptr[shape_of(position, tiles_per_side)], 0.0f,
+                   &values[tile_index * 3]);
+}
 
-    Interval ix_, iy_, iz_, iw_;
-    ix_ = mat(0, 0) * ix +
-          mat(0, 1) * iy +
-          mat(0, 2) * iz + mat(0, 3);
-    iy_ = mat(1, 0) * ix +
-          mat(1, 1) * iy +
-          mat(1, 2) * iz + mat(1, 3);
-    iz_ = mat(2, 0) * ix +
-          mat(2, 1) * iy +
-          mat(2, 2) * iz + mat(2, 3);
-    iw_ = mat(3, 0) * ix +
-          mat(3, 1) * iy +
-          mat(3, 2) * iz + mat(3, 3);
+/*
+ *  cull_tiles_3d
+ *
+ *  Masks every tile whose bounds in model space can't overlap the box from
+ *  `lower` to `upper` (see Context::bounds).  The bounds come from interval
+ *  arithmetic, so they're conservative: tiles are only dropped if they are
+ *  certainly outside of the box.
+ */
+__global__
+void cull_tiles_3d(TileNode* const __restrict__ in_tiles,
+                   const int32_t* const __restrict__ in_tile_count,
+                   const uint32_t tiles_per_side,
+                   const Eigen::Matrix4f* const __restrict__ mat_ptr,
+                   const float3 lower, const float3 upper)
+{
+    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (tile_index >= *in_tile_count) {
+        return;
+    }
 
-    // Projection!
-    ix_ = ix_ / iw_;
-    iy_ = iy_ / iw_;
-    iz_ = iz_ / iw_;
+    const int32_t position = in_tiles[tile_index].position;
+    if (position == -1) {
+        return;
+    }
 
-    values[tile_index * 3] = ix_;
-    values[tile_index * 3 + 1] = iy_;
-    values[tile_index * 3 + 2] = iz_;
+    Interval v[3];
+    tile_bounds_3d(position, tiles_per_side,
+                   mat_ptr[shape_of(position, tiles_per_side)], 0.0f, v);
+    if (v[0].upper() < lower.x || v[0].lower() > upper.x ||
+        v[1].upper() < lower.y || v[1].lower() > upper.y ||
+        v[2].upper() < lower.z || v[2].lower() > upper.z)
+    {
+        in_tiles[tile_index].position = -1;
+    }
 }
 
+/*  In 2D, every tile spans Z from `z_lower` to `z_upper`, which are equal
+ *  except for the shared first stage of render2DSlices. */
 __global__
 void calculate_intervals_2d(const TileNode* const __restrict__ in_tiles,
-                            const uint32_t in_tile_count,
+                            const int32_t* const __restrict__ in_tile_count,
                             const uint32_t tiles_per_side,
                             const Eigen::Matrix3f mat,
-                            const float z,
+                            const float z_lower, const float z_upper,
                             Interval* const __restrict__ values)
 {
-    const uint32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
-    if (tile_index >= in_tile_count) {
+    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (tile_index >= *in_tile_count) {
         return;
     }
 
@@ -155,7 +289,31 @@ void calculate_intervals_2d(const TileNode* const __restrict__ in_tiles,
 
     values[tile_index * 3] = ix_;
     values[tile_index * 3 + 1] = iy_;
-    values[tile_index * 3 + 2] = {z, z};
+    values[tile_index * 3 + 2] = {z_lower, z_upper};
+}
+
+/*  Returns piece `k` of `i` split into `n` equal pieces.  Neighbouring pieces
+ *  share a bound, and the outer bounds are copied from `i`, so the pieces
+ *  cover it exactly.  Unbounded intervals (e.g. from a projection through
+ *  the eye) aren't split. */
+static inline __device__
+Interval split_interval(const Interval& i, int k, int n)
+{
+    if (isinf(i.lower()) || isinf(i.upper())) {
+        return i;
+    }
+    const float w = i.upper() - i.lower();
+    return {k ? (i.lower() + w * k / n) : i.lower(),
+            (k + 1 < n) ? (i.lower() + w * (k + 1) / n) : i.upper()};
+}
+
+/*  Merges the choice made by a min/max clause across the lanes of a warp:
+ *  a branch can only be dropped if every lane dropped it. */
+static inline __device__
+int warp_choice(int c)
+{
+    const int first = __shfl_sync(0xffffffff, c, 0);
+    return __all_sync(0xffffffff, c == first) ? first : 0;
 }
 
 /*
@@ -183,38 +341,95 @@ void calculate_intervals_2d(const TileNode* const __restrict__ in_tiles,
  *  only mark one branch.
  *
  *  The new tape is written to the tile's `tape` variable, because it is valid
- *  for any evaluation which takes place within the tile.
+ *  for any evaluation which takes place within the tile.  If the subtape pool
+ *  (which holds `tape_capacity` clauses) runs out of room, the tile keeps its
+ *  parent's tape, and `tape_overflows` is incremented so that the host can
+ *  grow the pool before the next frame.
+ *
+ *  If `contiguous` is set, the new tape is written without chunks (and the
+ *  jumps between them): the active clauses are counted in a first pass,
+ *  then exactly that much space is claimed and filled in a second pass.
+ *  This walks the parent tape twice, but every later stage reads a dense
+ *  array of clauses.
+ *
+ *  SLOTS is the size of the per-thread slot array, which must be larger than
+ *  every slot index in the tape (see slot_tier).
+ *
+ *  If WARP is true, each tile is evaluated by a whole warp instead of a
+ *  single thread.  This is used when there are too few tiles to fill the
+ *  GPU (e.g. 64 tiles in the first stage of a 256^3 render): each lane
+ *  evaluates one piece of the tile's interval (see split_interval), then
+ *  the lanes vote on the result.  The tile is empty or filled if every
+ *  piece is, and a min/max branch is only dropped if every lane chose the
+ *  same branch.  Splitting the tile also makes its bounds tighter, so fewer
+ *  tiles are ambiguous.  The first lane then finishes the tile as usual.
+ *
+ *  DIMENSION 0 evaluates clusters of points for evalPoints, which have no
+ *  image (see finish_tile).
+ *
+ *  T is the type that's used for evaluation, which is either Interval or
+ *  Affine (see Context::affine_stages).  Tile bounds are always passed in as
+ *  intervals, and turned into T with T::X, T::Y, and T::Z.
  */
-template <int DIMENSION>
+template <int DIMENSION, bool WARP, int SLOTS, typename T=Interval>
 __global__
 void eval_tiles_i(uint64_t* const __restrict__ tape_data,
                   int32_t* const __restrict__ tape_index,
+                  const int32_t tape_capacity,
+                  int32_t* const __restrict__ tape_overflows,
+                  const bool contiguous,
+                  SubtapeEntry* const __restrict__ subtape_table,
+                  const int32_t subtape_table_size,
                   int32_t* const __restrict__ image,
                   const uint32_t tiles_per_side,
 
                   TileNode* const __restrict__ in_tiles,
-                  const int32_t in_tile_count,
+                  const int32_t* const __restrict__ in_tile_count,
 
                   const Interval* __restrict__ values)
 {
-    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
-    if (tile_index >= in_tile_count) {
+    // In warp mode, every lane of a warp works on the same tile, so these
+    // early exits are taken (or not) by the whole warp at once.
+    const int32_t thread_index = threadIdx.x + blockIdx.x * blockDim.x;
+    const int32_t tile_index = WARP ? (thread_index / 32) : thread_index;
+    const int lane = threadIdx.x % 32;
+    if (tile_index >= *in_tile_count) {
         return;
     }
 
-    // Check to see if we're masked
-    if (in_tiles[tile_index].position == -1) {
+    // Check to see if we're masked (or hidden, see hide_tiles)
+    if (in_tiles[tile_index].position < 0) {
         return;
     }
 
-    Interval slots[128];
-    slots[((const uint8_t*)tape_data)[1]] = values[tile_index * 3];
-    slots[((const uint8_t*)tape_data)[2]] = values[tile_index * 3 + 1];
-    slots[((const uint8_t*)tape_data)[3]] = values[tile_index * 3 + 2];
-
-    // Pick out the tape based on the pointer stored in the tiles list
+    // Pick out the tape based on the pointer stored in the tiles list.  Its
+    // first clause stores the X, Y, Z slots, which differ between the shapes
+    // of a batch (subtapes copy this clause from their parent).
     const uint64_t* __restrict__ data = &tape_data[in_tiles[tile_index].tape];
 
+    T slots[SLOTS];
+    T spills[SPILL_ARRAY_SIZE(SLOTS)];
+    if (!WARP) {
+        slots[((const uint8_t*)data)[1]] = T::X(values[tile_index * 3]);
+        slots[((const uint8_t*)data)[2]] = T::Y(values[tile_index * 3 + 1]);
+        slots[((const uint8_t*)data)[3]] = T::Z(values[tile_index * 3 + 2]);
+    } else if (DIMENSION == 3) {
+        // Split into 4 x 4 x 2 pieces
+        slots[((const uint8_t*)data)[1]] = T::X(
+            split_interval(values[tile_index * 3], lane % 4, 4));
+        slots[((const uint8_t*)data)[2]] = T::Y(
+            split_interval(values[tile_index * 3 + 1], (lane / 4) % 4, 4));
+        slots[((const uint8_t*)data)[3]] = T::Z(
+            split_interval(values[tile_index * 3 + 2], lane / 16, 2));
+    } else {
+        // Split into 8 x 4 pieces, since Z is a single value
+        slots[((const uint8_t*)data)[1]] = T::X(
+            split_interval(values[tile_index * 3], lane % 8, 8));
+        slots[((const uint8_t*)data)[2]] = T::Y(
+            split_interval(values[tile_index * 3 + 1], lane / 8, 4));
+        slots[((const uint8_t*)data)[3]] = T::Z(values[tile_index * 3 + 2]);
+    }
+
     constexpr static int CHOICE_ARRAY_SIZE = 256;
     uint32_t choices[CHOICE_ARRAY_SIZE] = {0};
     int choice_index = 0;
@@ -231,6 +446,7 @@ void eval_tiles_i(uint64_t* const __restrict__ tape_data,
 #define lhs slots[I_LHS(&d)]
 #define rhs slots[I_RHS(&d)]
 #define imm IMM(&d)
+#define param tape_parameters[PARAM_INDEX(&d)]
 #define out slots[I_OUT(&d)]
 
             case GPU_OP_SQUARE_LHS: out = square(lhs); break;
@@ -244,6 +460,8 @@ void eval_tiles_i(uint64_t* const __restrict__ tape_data,
             case GPU_OP_EXP_LHS:    out = exp(lhs); break;
             case GPU_OP_ABS_LHS:    out = abs(lhs); break;
             case GPU_OP_LOG_LHS:    out = log(lhs); break;
+            case GPU_OP_TAN_LHS:    out = tan(lhs); break;
+            case GPU_OP_RECIP_LHS:  out = recip(lhs); break;
 
             // Commutative opcodes
             case GPU_OP_ADD_LHS_IMM: out = lhs + imm; break;
@@ -251,15 +469,14 @@ void eval_tiles_i(uint64_t* const __restrict__ tape_data,
             case GPU_OP_MUL_LHS_IMM: out = lhs * imm; break;
             case GPU_OP_MUL_LHS_RHS: out = lhs * rhs; break;
 
-#define CHOICE(f, a, b) {                                               \
-    int c = 0;                                                          \
-    out = f(a, b, c);                                                   \
-    if (choice_index < CHOICE_ARRAY_SIZE * 16) {                        \
-        choices[choice_index / 16] |= (c << ((choice_index % 16) * 2)); \
-    }                                                                   \
-    choice_index++;                                                     \
-    has_any_choice |= (c != 0);                                         \
-    break;                                                              \
+#define CHOICE(f, a, b) {                                       \
+    int c = 0;                                                  \
+    out = f(a, b, c);                                           \
+    if (WARP) {                                                 \
+        c = warp_choice(c);                                     \
+    }                                                           \
+    record_choice(choices, choice_index, has_any_choice, c);    \
+    break;                                                      \
 }
             case GPU_OP_MIN_LHS_IMM: CHOICE(min, lhs, imm);
             case GPU_OP_MIN_LHS_RHS: CHOICE(min, lhs, rhs);
@@ -273,224 +490,327 @@ void eval_tiles_i(uint64_t* const __restrict__ tape_data,
             case GPU_OP_DIV_LHS_IMM: out = lhs / imm; break;
             case GPU_OP_DIV_IMM_RHS: out = imm / rhs; break;
             case GPU_OP_DIV_LHS_RHS: out = lhs / rhs; break;
-
-            case GPU_OP_COPY_IMM: out = Interval(imm); break;
+            case GPU_OP_ATAN2_LHS_IMM: out = atan2(lhs, imm); break;
+            case GPU_OP_ATAN2_IMM_RHS: out = atan2(imm, rhs); break;
+            case GPU_OP_ATAN2_LHS_RHS: out = atan2(lhs, rhs); break;
+            case GPU_OP_POW_LHS_IMM: out = pow(lhs, imm); break;
+            case GPU_OP_POW_IMM_RHS: out = pow(imm, rhs); break;
+            case GPU_OP_POW_LHS_RHS: out = pow(lhs, rhs); break;
+            case GPU_OP_NTH_ROOT_LHS_IMM: out = nth_root(lhs, imm); break;
+            case GPU_OP_NTH_ROOT_IMM_RHS: out = nth_root(imm, rhs); break;
+            case GPU_OP_NTH_ROOT_LHS_RHS: out = nth_root(lhs, rhs); break;
+            case GPU_OP_MOD_LHS_IMM: out = mod(lhs, imm); break;
+            case GPU_OP_MOD_IMM_RHS: out = mod(imm, rhs); break;
+            case GPU_OP_MOD_LHS_RHS: out = mod(lhs, rhs); break;
+            case GPU_OP_NANFILL_LHS_IMM: out = nanfill(lhs, imm); break;
+            case GPU_OP_NANFILL_IMM_RHS: out = nanfill(imm, rhs); break;
+            case GPU_OP_NANFILL_LHS_RHS: out = nanfill(lhs, rhs); break;
+            case GPU_OP_COMPARE_LHS_IMM: out = compare(lhs, imm); break;
+            case GPU_OP_COMPARE_IMM_RHS: out = compare(imm, rhs); break;
+            case GPU_OP_COMPARE_LHS_RHS: out = compare(lhs, rhs); break;
+
+            case GPU_OP_COPY_IMM: out = T(imm); break;
             case GPU_OP_COPY_LHS: out = lhs; break;
             case GPU_OP_COPY_RHS: out = rhs; break;
+            case GPU_OP_PARAM: out = T(param); break;
+
+            // Compound opcodes
+            case GPU_OP_MUL_ADD_LHS_RHS_IMM: out = mul_add(lhs, rhs, imm); break;
+            case GPU_OP_MUL_ADD_LHS_IMM_RHS: out = mul_add(lhs, imm, rhs); break;
+            case GPU_OP_SQUARE_ADD_LHS_IMM: out = square_add(lhs, imm); break;
+            case GPU_OP_SQUARE_ADD_LHS_RHS: out = square_add(lhs, rhs); break;
+            case GPU_OP_SUB_SQUARE_LHS_IMM: out = sub_square(lhs, imm); break;
+            case GPU_OP_SUB_SQUARE_LHS_RHS: out = sub_square(lhs, rhs); break;
+            case GPU_OP_HYPOT_LHS_RHS: out = hypot(lhs, rhs); break;
+
+            case GPU_OP_SPILL: spills[SPILL_INDEX(&d)] = lhs; break;
+            case GPU_OP_RELOAD: out = spills[SPILL_INDEX(&d)]; break;
 
             default: assert(false);
         }
 #undef lhs
 #undef rhs
 #undef imm
+#undef param
 #undef out
+#undef CHOICE
     }
 
-    // Check the result
-    const uint8_t i_out = I_OUT(data);
+    // Check the result, and push a shorter tape if the tile is ambiguous.
+    // The slot array is reused to track which slots are active.
+    Interval result = bounds(slots[I_OUT(data)]);
+    if (WARP) {
+        // finish_tile only looks at the signs of the result's bounds
+        const bool empty = __all_sync(0xffffffff, result.lower() > 0.0f);
+        const bool filled = __all_sync(0xffffffff, result.upper() < 0.0f);
+        if (lane) {
+            return;
+        }
+        result = Interval(empty ? 1.0f : -1.0f, filled ? -1.0f : 1.0f);
+    }
+    finish_tile<DIMENSION, SLOTS>(
+        result, data, choices, CHOICE_ARRAY_SIZE, choice_index,
+        has_any_choice, (int*)slots,
+        tape_data, tape_index, tape_capacity, tape_overflows, contiguous,
+        subtape_table, subtape_table_size, image, tiles_per_side,
+        in_tiles[tile_index].position, in_tiles[tile_index].tape);
+}
 
-    // Empty
-    if (slots[i_out].lower() > 0.0f) {
-        in_tiles[tile_index].position = -1;
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ *  mask_filled_tiles
+ *
+ *  For every tile in the `in_tiles` array, compares its z position against
+ *  the image's z value at the tile's xy position.  If the tile is below the
+ *  image, then it will never contribute, so its position is set to -1 to mark
+ *  it as inactive.  If `culled` isn't null, masked tiles are counted in it.
+ */
+__global__
+void mask_filled_tiles(int32_t* const __restrict__ image,
+                       const uint32_t tiles_per_side,
+
+                       TileNode* const __restrict__ in_tiles,
+                       const int32_t* const __restrict__ in_tile_count,
+                       int32_t* const __restrict__ culled)
+{
+    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (tile_index >= *in_tile_count) {
         return;
     }
 
-    // Masked
-    if (DIMENSION == 3) {
-        const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
-        if (image[pos.w] > pos.z) {
-            in_tiles[tile_index].position = -1;
-            return;
-        }
+    const int32_t tile = in_tiles[tile_index].position;
+    // Already marked as filled or empty
+    if (tile == -1) {
+        return;
     }
 
-    // Filled
-    if (slots[i_out].upper() < 0.0f) {
-        const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
+    const int4 pos = unpack(tile, tiles_per_side);
+
+    // If this tile is completely masked by the image, then skip it
+    if (image[pos.w] > pos.z) {
         in_tiles[tile_index].position = -1;
-        if (DIMENSION == 3) {
-            atomicMax(&image[pos.w], pos.z);
-        } else {
-            image[pos.w] = 1;
+        if (culled) {
+            atomicAdd(culled, 1);
         }
-        return;
     }
+}
 
-    if (!has_any_choice) {
+/*
+ *  hide_tiles, reveal_z_slab
+ *
+ *  These kernels let a stage be evaluated in slabs of Z layers, from front
+ *  (high Z) to back, so that tiles behind a surface found in an earlier slab
+ *  are culled before they're evaluated (see Context::z_slabs).
+ *
+ *  hide_tiles marks every active tile as hidden, by storing its position as
+ *  -2 - position.  Evaluation skips every negative position.  Then, for each
+ *  slab, reveal_z_slab restores tiles with Z in [z_min, z_max), or masks
+ *  them (counting them in `culled`) if the image already covers them.
+ */
+__global__
+void hide_tiles(TileNode* const __restrict__ in_tiles,
+                const int32_t* const __restrict__ in_tile_count)
+{
+    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (tile_index >= *in_tile_count) {
         return;
     }
 
-    ////////////////////////////////////////////////////////////////////////////
-    // Tape pushing!
-    // Use this array to track which slots are active
-    int* const __restrict__ active = (int*)slots;
-    for (unsigned i=0; i < 128; ++i) {
-        active[i] = false;
+    const int32_t tile = in_tiles[tile_index].position;
+    if (tile >= 0) {
+        in_tiles[tile_index].position = -2 - tile;
     }
-    active[i_out] = true;
+}
 
-    // Check to make sure the tape isn't full
-    // This doesn't mean that we'll successfully claim a chunk, because
-    // other threads could claim chunks before us, but it's a way to check
-    // quickly (and prevents tape_index from getting absurdly large).
-    if (*tape_index >= NUM_SUBTAPES * SUBTAPE_CHUNK_SIZE) {
+__global__
+void reveal_z_slab(const int32_t* const __restrict__ image,
+                   const uint32_t tiles_per_side,
+
+                   TileNode* const __restrict__ in_tiles,
+                   const int32_t* const __restrict__ in_tile_count,
+                   const int32_t z_min, const int32_t z_max,
+                   int32_t* const __restrict__ culled)
+{
+    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (tile_index >= *in_tile_count) {
         return;
     }
 
-    // Claim a chunk of tape
-    int32_t out_index = atomicAdd(tape_index, SUBTAPE_CHUNK_SIZE);
-    int32_t out_offset = SUBTAPE_CHUNK_SIZE;
-
-    // If we've run out of tape, then immediately return
-    if (out_index + out_offset >= NUM_SUBTAPES * SUBTAPE_CHUNK_SIZE) {
+    const int32_t hidden = in_tiles[tile_index].position;
+    if (hidden >= -1) {
+        return;
+    }
+    const int32_t tile = -2 - hidden;
+    const int4 pos = unpack(tile, tiles_per_side);
+    if (pos.z < z_min || pos.z >= z_max) {
         return;
     }
 
-    // Write out the end of the tape, which is the same as the ending
-    // of the previous tape (0 opcode, with i_out as the last slot)
-    out_offset--;
-    tape_data[out_index + out_offset] = *data;
-
-    while (1) {
-        uint64_t d = *--data;
-        if (!OP(&d)) {
-            break;
-        }
-        const uint8_t op = OP(&d);
-        if (op == GPU_OP_JUMP) {
-            data += JUMP_TARGET(&d);
-            continue;
-        }
+    if (image[pos.w] > pos.z) {
+        in_tiles[tile_index].position = -1;
+        atomicAdd(culled, 1);
+    } else {
+        in_tiles[tile_index].position = tile;
+    }
+}
 
-        const bool has_choice = op >= GPU_OP_MIN_LHS_IMM &&
-                                op <= GPU_OP_MAX_LHS_RHS;
-        choice_index -= has_choice;
+////////////////////////////////////////////////////////////////////////////////
 
-        const uint8_t i_out = I_OUT(&d);
-        if (!active[i_out]) {
-            continue;
-        }
+/*
+ *  reuse_tile_cache, update_tile_cache
+ *
+ *  In incremental mode (see Context::incremental), each first-stage tile
+ *  remembers what it found in an earlier frame: its (slightly inflated)
+ *  bounds in model space, and whether the tile was empty, filled, or
+ *  ambiguous with a particular subtape.  When the camera moves a little, a
+ *  tile's new bounds usually still fit in the remembered bounds, and then
+ *  the old result still holds.
+ *
+ *  reuse_tile_cache runs after calculate_intervals_3d.  Tiles that hit the
+ *  cache are marked empty or filled, or keep their old subtape (which is
+ *  then evaluated over the tile's new bounds, so the tile may still be
+ *  classified or shortened further).  Tiles that miss are evaluated over
+ *  inflated bounds, so that their result survives small moves, and are
+ *  marked as pending.  update_tile_cache runs after evaluation and stores
+ *  the results of pending tiles.
+ *
+ *  Cached subtapes live at the start of the subtape pool, and the pool's
+ *  tape index starts past them (rather than at the end of the root tape).
+ *  Every miss pushes more subtapes, so once they take up a quarter of the
+ *  pool (or the key changes, because of a new tape or a new pool), the
+ *  cache is dropped and rebuilt from scratch.
+ */
+struct TileCacheState {
+    uint64_t key;   // Identifies the tape and pool which the cache is for
+    int32_t end;    // End of the cached subtapes in the pool
+    int32_t hits;   // Tiles which reused their entry in the latest frame
+};
+
+struct CachedTile {
+    float lower[3];
+    float upper[3];
+    int32_t result; // Subtape start, or one of the values below
+};
+
+#define TILE_CACHE_INVALID  -1
+#define TILE_CACHE_EMPTY    -2
+#define TILE_CACHE_FILLED   -3
+#define TILE_CACHE_PENDING  -4
+
+/*  Tiles which miss the cache are evaluated over bounds which are this much
+ *  larger (as a fraction of the tile size) on every side. */
+#define TILE_CACHE_MARGIN   0.25f
 
-        assert(!has_choice || choice_index >= 0);
+__global__
+void reuse_tile_cache(TileNode* const __restrict__ in_tiles,
+                      const int32_t in_tile_count,
+                      const uint32_t tiles_per_side,
+                      const Eigen::Matrix4f* const __restrict__ mat_ptr,
+                      Interval* const __restrict__ values,
+                      CachedTile* const __restrict__ cache,
+                      TileCacheState* const __restrict__ state,
+                      const uint64_t key,
+                      int32_t* const __restrict__ image,
+                      int32_t* const __restrict__ tape_index,
+                      const int32_t tape_length,
+                      const int32_t tape_capacity)
+{
+    const bool stale = state->key != key || state->end < tape_length ||
+                       state->end > tape_capacity / 4;
 
-        const int choice = (has_choice && choice_index < CHOICE_ARRAY_SIZE * 16)
-            ? ((choices[choice_index / 16] >>
-              ((choice_index % 16) * 2)) & 3)
-            : 0;
+    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (tile_index == 0 && !stale) {
+        *tape_index = state->end;
+    }
+    if (tile_index >= in_tile_count) {
+        return;
+    }
 
-        // If we're about to write a new piece of data to the tape,
-        // (and are done with the current chunk), then we need to
-        // add another link to the linked list.
-        --out_offset;
-        if (out_offset == 0) {
-            const int32_t prev_index = out_index;
+    CachedTile& entry = cache[tile_index];
+    const int32_t position = in_tiles[tile_index].position;
+    if (position == -1) {
+        // Skipped by partitioning, so this tile keeps its entry (unless the
+        // entry belongs to an older cache)
+        if (stale) {
+            entry.result = TILE_CACHE_INVALID;
+        }
+        return;
+    }
 
-            // Early exit if we can't finish writing out this tape
-            if (*tape_index >= NUM_SUBTAPES * SUBTAPE_CHUNK_SIZE) {
-                return;
-            }
-            out_index = atomicAdd(tape_index, SUBTAPE_CHUNK_SIZE);
-            out_offset = SUBTAPE_CHUNK_SIZE;
-
-            // Later exit if we claimed a chunk that exceeds the tape array
-            if (out_index + out_offset >= NUM_SUBTAPES * SUBTAPE_CHUNK_SIZE) {
-                return;
-            }
-            --out_offset;
-
-            // Forward-pointing link
-            OP(&tape_data[out_index + out_offset]) = GPU_OP_JUMP;
-            const int32_t delta = (int32_t)prev_index -
-                                  (int32_t)(out_index + out_offset);
-            JUMP_TARGET(&tape_data[out_index + out_offset]) = delta;
-
-            // Backward-pointing link
-            OP(&tape_data[prev_index]) = GPU_OP_JUMP;
-            JUMP_TARGET(&tape_data[prev_index]) = -delta;
-
-            // We've written the jump, so adjust the offset again
-            --out_offset;
+    Interval* const __restrict__ v = &values[tile_index * 3];
+    const int32_t result = stale ? TILE_CACHE_INVALID : entry.result;
+    if (result != TILE_CACHE_INVALID && result != TILE_CACHE_PENDING) {
+        bool hit = true;
+        for (unsigned i=0; i < 3; ++i) {
+            // Written so that NaN bounds are a miss
+            hit &= (v[i].lower() >= entry.lower[i]) &&
+                   (v[i].upper() <= entry.upper[i]);
         }
-
-        active[i_out] = false;
-        if (choice == 0) {
-            const uint8_t i_lhs = I_LHS(&d);
-            if (i_lhs) {
-                active[i_lhs] = true;
-            }
-            const uint8_t i_rhs = I_RHS(&d);
-            if (i_rhs) {
-                active[i_rhs] = true;
-            }
-        } else if (choice == 1 /* LHS */) {
-            // The non-immediate is always the LHS in commutative ops, and
-            // min/max (the only clauses that produce a choice) are commutative
-            const uint8_t i_lhs = I_LHS(&d);
-            active[i_lhs] = true;
-            if (i_lhs == i_out) {
-                ++out_offset;
-                continue;
-            } else {
-                OP(&d) = GPU_OP_COPY_LHS;
-            }
-        } else if (choice == 2 /* RHS */) {
-            const uint8_t i_rhs = I_RHS(&d);
-            if (i_rhs) {
-                active[i_rhs] = true;
-                if (i_rhs == i_out) {
-                    ++out_offset;
-                    continue;
-                } else {
-                    OP(&d) = GPU_OP_COPY_RHS;
-                }
+        if (hit) {
+            atomicAdd(&state->hits, 1);
+            if (result == TILE_CACHE_EMPTY) {
+                in_tiles[tile_index].position = -1;
+            } else if (result == TILE_CACHE_FILLED) {
+                const int4 pos = unpack(position, tiles_per_side);
+                atomicMax(&image[pos.w], pos.z);
+                in_tiles[tile_index].position = -1;
             } else {
-                OP(&d) = GPU_OP_COPY_IMM;
+                in_tiles[tile_index].tape = result;
             }
+            return;
         }
-        tape_data[out_index + out_offset] = d;
     }
 
-    // Write the beginning of the tape
-    out_offset--;
-    tape_data[out_index + out_offset] = *data;
-
-    // Record the beginning of the tape in the output tile
-    in_tiles[tile_index].tape = out_index + out_offset;
+    tile_bounds_3d(position, tiles_per_side, *mat_ptr, TILE_CACHE_MARGIN, v);
+    for (unsigned i=0; i < 3; ++i) {
+        entry.lower[i] = v[i].lower();
+        entry.upper[i] = v[i].upper();
+    }
+    entry.result = TILE_CACHE_PENDING;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-
-/*
- *  mask_filled_tiles
- *
- *  For every tile in the `in_tiles` array, compares its z position against
- *  the image's z value at the tile's xy position.  If the tile is below the
- *  image, then it will never contribute, so its position is set to -1 to mark
- *  it as inactive.
- */
 __global__
-void mask_filled_tiles(int32_t* const __restrict__ image,
+void update_tile_cache(const TileNode* const __restrict__ in_tiles,
+                       const int32_t in_tile_count,
                        const uint32_t tiles_per_side,
-
-                       TileNode* const __restrict__ in_tiles,
-                       const int32_t in_tile_count)
+                       CachedTile* const __restrict__ cache,
+                       TileCacheState* const __restrict__ state,
+                       const uint64_t key,
+                       const int32_t* const __restrict__ image,
+                       const int32_t* const __restrict__ tape_index)
 {
     const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (tile_index == 0) {
+        state->key = key;
+        state->end = *tape_index;
+    }
     if (tile_index >= in_tile_count) {
         return;
     }
 
-    const int32_t tile = in_tiles[tile_index].position;
-    // Already marked as filled or empty
-    if (tile == -1) {
+    CachedTile& entry = cache[tile_index];
+    if (entry.result != TILE_CACHE_PENDING) {
         return;
     }
 
-    const int4 pos = unpack(tile, tiles_per_side);
-
-    // If this tile is completely masked by the image, then skip it
-    if (image[pos.w] > pos.z) {
-        in_tiles[tile_index].position = -1;
+    // Tiles which are still active were ambiguous, and their tape is valid
+    // over the inflated bounds.  Tiles which were marked as empty or filled
+    // can be told apart by the image: a filled tile raised it to exactly its
+    // own depth, and no tile in front of an empty tile was filled (or it
+    // would have been masked, which tells us nothing).
+    const TileNode& t = in_tiles[tile_index];
+    if (t.position != -1) {
+        entry.result = t.tape;
+    } else {
+        const int4 pos = unpack(tile_index, tiles_per_side);
+        if (image[pos.w] < pos.z) {
+            entry.result = TILE_CACHE_EMPTY;
+        } else if (image[pos.w] == pos.z && pos.z > 0) {
+            entry.result = TILE_CACHE_FILLED;
+        } else {
+            entry.result = TILE_CACHE_INVALID;
+        }
     }
 }
 
@@ -502,8 +822,15 @@ void mask_filled_tiles(int32_t* const __restrict__ image,
  *  For every tile in `in_tiles`, which is active (i.e. has a position that
  *  has not been set to -1), set its `next` value to a unique value.
  *
- *  The total number of active tiles is stored in `num_active_tiles`; `next`
- *  values range from 0 to `num_active_tiles - 1`.
+ *  Each active tile reserves `scale` slots in the next stage (64 when it will
+ *  be subdivided, 1 when it's copied directly), and the total number of
+ *  reserved slots is accumulated in `out_tile_count`; `next` values range
+ *  from 0 to `out_tile_count / scale - 1`.
+ *
+ *  Tiles which would land beyond `out_capacity` are dropped (their `next`
+ *  is set to -1), so that a too-small buffer in the next stage is never
+ *  overrun.  `out_tile_count` still records the full count, so the host can
+ *  notice the overflow and grow the buffer afterwards.
  *
  *  Philosophically, this function packs sparse items (active tiles in
  *  `in_tiles`) tightly.  It could also be implemented as a scan, but this is
@@ -511,17 +838,22 @@ void mask_filled_tiles(int32_t* const __restrict__ image,
  */
 __global__
 void assign_next_nodes(TileNode* const __restrict__ in_tiles,
-                       const int32_t in_tile_count,
+                       const int32_t* const __restrict__ in_tile_count,
 
-                       int32_t* __restrict__ const num_active_tiles)
+                       int32_t* __restrict__ const out_tile_count,
+                       const int32_t scale,
+                       const int32_t out_capacity)
 {
     const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
-    if (tile_index >= in_tile_count) {
+    const int32_t count = *in_tile_count;
+    if (blockIdx.x * blockDim.x >= count) {
         return;
     }
 
-    const bool is_active = tile_index < in_tile_count &&
-                           in_tiles[tile_index].position != -1;
+    // Every thread in a partially-filled block has to reach the
+    // __syncthreads calls below, so we only bail out for whole blocks.
+    const bool is_valid = tile_index < count;
+    const bool is_active = is_valid && in_tiles[tile_index].position != -1;
 
     // Do two levels of accumulation, to reduce atomic pressure on a single
     // global variable.  Does this help?  Who knows!
@@ -539,13 +871,13 @@ void assign_next_nodes(TileNode* const __restrict__ in_tiles,
 
     // Only one thread gets to contribute to the global offset
     if (threadIdx.x == 0) {
-        local_offset = atomicAdd(num_active_tiles, local_offset);
+        local_offset = atomicAdd(out_tile_count, local_offset * scale) / scale;
     }
     __syncthreads();
 
-    if (is_active) {
+    if (is_active && (local_offset + my_offset) * scale < out_capacity) {
         in_tiles[tile_index].next = local_offset + my_offset;
-    } else {
+    } else if (is_valid) {
         in_tiles[tile_index].next = -1;
     }
 }
@@ -564,31 +896,38 @@ void assign_next_nodes(TileNode* const __restrict__ in_tiles,
 __global__
 void subdivide_active_tiles_3d(
         const TileNode* const __restrict__ in_tiles,
-        const int32_t in_tile_count,
+        const int32_t* const __restrict__ in_tile_count,
         const int32_t tiles_per_side,
+        const int4 viewport,
         TileNode* const __restrict__ out_tiles)
 {
     const int32_t index = threadIdx.x + blockIdx.x * blockDim.x;
     const int32_t subtile_index = index % 64;
     const int32_t tile_index = index / 64;
-    if (tile_index >= in_tile_count || in_tiles[tile_index].next == -1) {
+    if (tile_index >= *in_tile_count || in_tiles[tile_index].next == -1) {
         return;
     }
 
-    const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
+    const int32_t position = in_tiles[tile_index].position;
+    const int4 pos = unpack(position, tiles_per_side);
     const int32_t subtiles_per_side = tiles_per_side * 4;
 
+    // Subtiles stay in their parent's shape, which is stacked along Z
     const int4 sub = unpack(subtile_index, 4);
     const int32_t sx = pos.x * 4 + sub.x;
     const int32_t sy = pos.y * 4 + sub.y;
-    const int32_t sz = pos.z * 4 + sub.z;
+    const int32_t sz = pos.z * 4 + sub.z +
+                       shape_of(position, tiles_per_side) * subtiles_per_side;
     const int32_t next_tile =
         sx +
         sy * subtiles_per_side +
         sz * subtiles_per_side * subtiles_per_side;
 
+    // Subtiles which are outside of the viewport are masked
     const int t = in_tiles[tile_index].next * 64 + subtile_index;
-    out_tiles[t].position = next_tile;
+    out_tiles[t].position = (sx >= viewport.x && sy >= viewport.y &&
+                             sx < viewport.z && sy < viewport.w)
+        ? next_tile : -1;
     out_tiles[t].tape = in_tiles[tile_index].tape;
     out_tiles[t].next = -1;
 }
@@ -596,14 +935,15 @@ void subdivide_active_tiles_3d(
 __global__
 void subdivide_active_tiles_2d(
         const TileNode* const __restrict__ in_tiles,
-        const int32_t in_tile_count,
+        const int32_t* const __restrict__ in_tile_count,
         const int32_t tiles_per_side,
+        const int4 viewport,
         TileNode* const __restrict__ out_tiles)
 {
     const int32_t index = threadIdx.x + blockIdx.x * blockDim.x;
     const int32_t subtile_index = index % 64;
     const int32_t tile_index = index / 64;
-    if (tile_index >= in_tile_count || in_tiles[tile_index].next == -1) {
+    if (tile_index >= *in_tile_count || in_tiles[tile_index].next == -1) {
         return;
     }
 
@@ -616,8 +956,11 @@ void subdivide_active_tiles_2d(
     const int32_t sy = pos.y * 8 + sub.y;
     const int32_t next_tile = sx + sy * subtiles_per_side;
 
+    // Subtiles which are outside of the viewport are masked
     const int t = in_tiles[tile_index].next * 64 + subtile_index;
-    out_tiles[t].position = next_tile;
+    out_tiles[t].position = (sx >= viewport.x && sy >= viewport.y &&
+                             sx < viewport.z && sy < viewport.w)
+        ? next_tile : -1;
     out_tiles[t].tape = in_tiles[tile_index].tape;
     out_tiles[t].next = -1;
 }
@@ -636,11 +979,11 @@ void subdivide_active_tiles_2d(
  */
 __global__
 void copy_active_tiles(TileNode* const __restrict__ in_tiles,
-                       const int32_t in_tile_count,
+                       const int32_t* const __restrict__ in_tile_count,
                        TileNode* const __restrict__ out_tiles)
 {
     const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
-    if (tile_index >= in_tile_count || in_tiles[tile_index].next == -1) {
+    if (tile_index >= *in_tile_count || in_tiles[tile_index].next == -1) {
         return;
     }
     const int t = in_tiles[tile_index].next;
@@ -650,6 +993,31 @@ void copy_active_tiles(TileNode* const __restrict__ in_tiles,
     in_tiles[tile_index].next = -1;
 }
 
+/*
+ *  collect_filled_tiles
+ *
+ *  In volume mode, appends the position of each tile which eval_tiles_i
+ *  found to be filled (marked as -2 - position, see finish_tile) to
+ *  `filled`, counting them in `filled_count`, then marks the tile as
+ *  inactive.
+ */
+__global__
+void collect_filled_tiles(TileNode* const __restrict__ in_tiles,
+                          const int32_t* const __restrict__ in_tile_count,
+                          int32_t* const __restrict__ filled,
+                          int32_t* const __restrict__ filled_count)
+{
+    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (tile_index >= *in_tile_count) {
+        return;
+    }
+    const int32_t position = in_tiles[tile_index].position;
+    if (position <= -2) {
+        filled[atomicAdd(filled_count, 1)] = -2 - position;
+        in_tiles[tile_index].position = -1;
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 /*
@@ -660,6 +1028,9 @@ void copy_active_tiles(TileNode* const __restrict__ in_tiles,
  *
  *  The higher-resolution image must be empty (all 0) when this is called;
  *  no comparison of Z values is done.
+ *
+ *  In 3D, the grid's Z dimension selects an image, when rendering a batch
+ *  of shapes.
  */
 __global__
 void copy_filled_3d(const int32_t* __restrict__ prev,
@@ -668,6 +1039,8 @@ void copy_filled_3d(const int32_t* __restrict__ prev,
 {
     const int32_t x = threadIdx.x + blockIdx.x * blockDim.x;
     const int32_t y = threadIdx.y + blockIdx.y * blockDim.y;
+    prev += blockIdx.z * (image_size_px / 4) * (image_size_px / 4);
+    image += blockIdx.z * image_size_px * image_size_px;
 
     if (x < image_size_px && y < image_size_px) {
         int32_t t = prev[x / 4 + y / 4 * (image_size_px / 4)];
@@ -693,6 +1066,41 @@ void copy_filled_2d(const int32_t* __restrict__ prev,
 
 ////////////////////////////////////////////////////////////////////////////////
 
+/*
+ *  Packs a 2D image into one bit per pixel, with pixel i in bit (i % 32) of
+ *  word (i / 32).  Each warp builds one word with a ballot, so every thread
+ *  reads one pixel and there are no atomics.
+ */
+__global__
+void pack_occupancy(const int32_t* __restrict__ image,
+                    uint32_t* __restrict__ bits,
+                    const int32_t num_pixels)
+{
+    const int32_t i = threadIdx.x + blockIdx.x * blockDim.x;
+    const uint32_t word = __ballot_sync(0xffffffff,
+                                        i < num_pixels && image[i]);
+    if (i < num_pixels && (threadIdx.x % 32) == 0) {
+        bits[i / 32] = word;
+    }
+}
+
+/*
+ *  Packs 3D depth values into 16 bits per pixel.  Depths never exceed
+ *  image_size_px + 3, so this is exact when that fits (see compact_images).
+ */
+__global__
+void pack_depth16(const int32_t* __restrict__ image,
+                  uint16_t* __restrict__ depth,
+                  const int32_t num_pixels)
+{
+    const int32_t i = threadIdx.x + blockIdx.x * blockDim.x;
+    if (i < num_pixels) {
+        depth[i] = image[i];
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 /*
  *  calculate_voxels
  *
@@ -706,9 +1114,9 @@ void copy_filled_2d(const int32_t* __restrict__ prev,
  */
 __global__
 void calculate_voxels(const TileNode* const __restrict__ in_tiles,
-                      const uint32_t in_tile_count,
+                      const int32_t* const __restrict__ in_tile_count,
                       const uint32_t tiles_per_side,
-                      const Eigen::Matrix4f mat,
+                      const Eigen::Matrix4f* const __restrict__ mat_ptr,
                       float2* const __restrict__ values)
 {
     // Each tile is executed by 32 threads (one for each pair of voxels).
@@ -719,11 +1127,13 @@ void calculate_voxels(const TileNode* const __restrict__ in_tiles,
     const int32_t voxel_index = threadIdx.x + blockIdx.x * blockDim.x;
     const int32_t tile_index = voxel_index / 32;
 
-    if (tile_index >= in_tile_count) {
+    if (tile_index >= *in_tile_count) {
         return;
     }
-    const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
+    const int32_t position = in_tiles[tile_index].position;
+    const int4 pos = unpack(position, tiles_per_side);
     const int4 sub = unpack(threadIdx.x % 32, 4);
+    const Eigen::Matrix4f& mat = mat_ptr[shape_of(position, tiles_per_side)];
 
     const int32_t px = pos.x * 4 + sub.x;
     const int32_t py = pos.y * 4 + sub.y;
@@ -763,7 +1173,7 @@ void calculate_voxels(const TileNode* const __restrict__ in_tiles,
 
 __global__
 void calculate_pixels(const TileNode* const __restrict__ in_tiles,
-                      const uint32_t in_tile_count,
+                      const int32_t* const __restrict__ in_tile_count,
                       const uint32_t tiles_per_side,
                       const Eigen::Matrix3f mat, const float z,
                       float2* const __restrict__ values)
@@ -776,7 +1186,7 @@ void calculate_pixels(const TileNode* const __restrict__ in_tiles,
     const int32_t voxel_index = threadIdx.x + blockIdx.x * blockDim.x;
     const int32_t tile_index = voxel_index / 32;
 
-    if (tile_index >= in_tile_count) {
+    if (tile_index >= *in_tile_count) {
         return;
     }
     const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
@@ -824,17 +1234,36 @@ void calculate_pixels(const TileNode* const __restrict__ in_tiles,
  *
  *  Filled voxels are written to `image`, using atomic operations to accumulate
  *  the voxel with the tallest Z value.
+ *
+ *  When CACHED is true, the 32 threads working on a tile first copy the
+ *  first `cache_clauses` clauses of its tape into shared memory (with one
+ *  slice per tile, so the launch must provide that much dynamic shared
+ *  memory), then interpret from there; clauses past the end of the cache
+ *  (or reached through a jump to another chunk) are read from global memory.
+ *  `tape_capacity` is the size of `tape_data`, which bounds the copy.
+ *
+ *  In 3D, if `masks` isn't null, voxels are never masked by the image, and
+ *  the filled voxels of each tile are written to its entry in `masks`
+ *  instead (see Context::renderVolume), with voxel (x, y, z) in bit
+ *  x + 4y + 16z.
+ *
+ *  As in eval_tiles_i, SLOTS is the size of the per-thread slot array.
  */
-template <unsigned DIMENSION>
+template <unsigned DIMENSION, bool CACHED, int SLOTS>
 __global__
+__launch_bounds__(NUM_TILES * 32)
 void eval_voxels_f(const uint64_t* const __restrict__ tape_data,
                    int32_t* const __restrict__ image,
                    const uint32_t tiles_per_side,
 
                    TileNode* const __restrict__ in_tiles,
-                   const int32_t in_tile_count,
+                   const int32_t* const __restrict__ in_tile_count,
 
-                   const float2* const __restrict__ values)
+                   const float2* const __restrict__ values,
+
+                   const int32_t tape_capacity,
+                   const int32_t cache_clauses,
+                   uint64_t* const __restrict__ masks)
 {
     // Each tile is executed by 32 threads (one for each pair of voxels, so
     // we can do all of our load/stores as float2s and make memory happier).
@@ -844,13 +1273,36 @@ void eval_voxels_f(const uint64_t* const __restrict__ tape_data,
     // time they're stored in the in_tiles list.
     const int32_t voxel_index = threadIdx.x + blockIdx.x * blockDim.x;
     const int32_t tile_index = voxel_index / 32;
-    if (tile_index >= in_tile_count) {
+    if (tile_index >= *in_tile_count) {
         return;
     }
 
+    // Load the start of the tape into this tile's slice of shared memory.
+    // This happens before any early return, since each thread loads part
+    // of the tape; every thread in the warp shares the same tile.
+    extern __shared__ uint64_t tape_cache[];
+    uint64_t* const __restrict__ cache =
+        &tape_cache[(threadIdx.x / 32) * cache_clauses];
+    const int32_t tape_start = in_tiles[tile_index].tape;
+    if (CACHED) {
+        for (int32_t i=threadIdx.x % 32;
+             i < cache_clauses && tape_start + i < tape_capacity; i += 32)
+        {
+            cache[i] = tape_data[tape_start + i];
+        }
+        __syncwarp();
+    }
+
+    // In 3D, each shape of a batch has its own image
+    const int32_t position = in_tiles[tile_index].position;
+    int32_t* const __restrict__ shape_image = (DIMENSION == 3)
+        ? image + shape_of(position, tiles_per_side) *
+                  tiles_per_side * tiles_per_side * 16
+        : image;
+
     // Check whether this pixel is masked in the output image
-    if (DIMENSION == 3) {
-        const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
+    if (DIMENSION == 3 && !masks) {
+        const int4 pos = unpack(position, tiles_per_side);
         const int4 sub = unpack(threadIdx.x % 32, 4);
 
         const int32_t px = pos.x * 4 + sub.x;
@@ -858,103 +1310,56 @@ void eval_voxels_f(const uint64_t* const __restrict__ tape_data,
         const int32_t pz = pos.z * 4 + sub.z;
 
         // Early return if this pixel won't ever be filled
-        if (image[px + py * tiles_per_side * 4] >= pz + 2) {
+        if (shape_image[px + py * tiles_per_side * 4] >= pz + 2) {
             return;
         }
     }
 
-    float2 slots[128];
+    float2 slots[SLOTS];
 
     // Pick out the tape based on the pointer stored in the tiles list
-    const uint64_t* __restrict__ data = &tape_data[in_tiles[tile_index].tape];
-    slots[((const uint8_t*)tape_data)[1]] = values[voxel_index * 3];
-    slots[((const uint8_t*)tape_data)[2]] = values[voxel_index * 3 + 1];
-    slots[((const uint8_t*)tape_data)[3]] = values[voxel_index * 3 + 2];
-
-    while (1) {
-        const uint64_t d = *++data;
-        if (!OP(&d)) {
-            break;
-        }
-        switch (OP(&d)) {
-            case GPU_OP_JUMP: data += JUMP_TARGET(&d); continue;
-
-#define lhs slots[I_LHS(&d)]
-#define rhs slots[I_RHS(&d)]
-#define imm IMM(&d)
-#define out slots[I_OUT(&d)]
-
-            case GPU_OP_SQUARE_LHS: out = make_float2(lhs.x * lhs.x, lhs.y * lhs.y); break;
-            case GPU_OP_SQRT_LHS: out = make_float2(sqrtf(lhs.x), sqrtf(lhs.y)); break;
-            case GPU_OP_NEG_LHS: out = make_float2(-lhs.x, -lhs.y); break;
-            case GPU_OP_SIN_LHS: out = make_float2(sinf(lhs.x), sinf(lhs.y)); break;
-            case GPU_OP_COS_LHS: out = make_float2(cosf(lhs.x), cosf(lhs.y)); break;
-            case GPU_OP_ASIN_LHS: out = make_float2(asinf(lhs.x), asinf(lhs.y)); break;
-            case GPU_OP_ACOS_LHS: out = make_float2(acosf(lhs.x), acosf(lhs.y)); break;
-            case GPU_OP_ATAN_LHS: out = make_float2(atanf(lhs.x), atanf(lhs.y)); break;
-            case GPU_OP_EXP_LHS: out = make_float2(expf(lhs.x), expf(lhs.y)); break;
-            case GPU_OP_ABS_LHS: out = make_float2(fabsf(lhs.x), fabsf(lhs.y)); break;
-            case GPU_OP_LOG_LHS: out = make_float2(logf(lhs.x), logf(lhs.y)); break;
-
-            // Commutative opcodes
-            case GPU_OP_ADD_LHS_IMM: out = make_float2(lhs.x + imm, lhs.y + imm); break;
-            case GPU_OP_ADD_LHS_RHS: out = make_float2(lhs.x + rhs.x, lhs.y + rhs.y); break;
-            case GPU_OP_MUL_LHS_IMM: out = make_float2(lhs.x * imm, lhs.y * imm); break;
-            case GPU_OP_MUL_LHS_RHS: out = make_float2(lhs.x * rhs.x, lhs.y * rhs.y); break;
-            case GPU_OP_MIN_LHS_IMM: out = make_float2(fminf(lhs.x, imm), fminf(lhs.y, imm)); break;
-            case GPU_OP_MIN_LHS_RHS: out = make_float2(fminf(lhs.x, rhs.x), fminf(lhs.y, rhs.y)); break;
-            case GPU_OP_MAX_LHS_IMM: out = make_float2(fmaxf(lhs.x, imm), fmaxf(lhs.y, imm)); break;
-            case GPU_OP_MAX_LHS_RHS: out = make_float2(fmaxf(lhs.x, rhs.x), fmaxf(lhs.y, rhs.y)); break;
-
-            // Non-commutative opcodes
-            case GPU_OP_SUB_LHS_IMM: out = make_float2(lhs.x - imm, lhs.y - imm); break;
-            case GPU_OP_SUB_IMM_RHS: out = make_float2(imm - rhs.x, imm - rhs.y); break;
-            case GPU_OP_SUB_LHS_RHS: out = make_float2(lhs.x - rhs.x, lhs.y - rhs.y); break;
-
-            case GPU_OP_DIV_LHS_IMM: out = make_float2(lhs.x / imm, lhs.y / imm); break;
-            case GPU_OP_DIV_IMM_RHS: out = make_float2(imm / rhs.x, imm / rhs.y); break;
-            case GPU_OP_DIV_LHS_RHS: out = make_float2(lhs.x / rhs.x, lhs.y / rhs.y); break;
-
-            case GPU_OP_COPY_IMM: out = make_float2(imm, imm); break;
-            case GPU_OP_COPY_LHS: out = make_float2(lhs.x, lhs.y); break;
-            case GPU_OP_COPY_RHS: out = make_float2(rhs.x, rhs.y); break;
-
-#undef lhs
-#undef rhs
-#undef imm
-#undef out
+    const uint64_t* const __restrict__ data = &tape_data[tape_start];
+    slots[((const uint8_t*)data)[1]] = values[voxel_index * 3];
+    slots[((const uint8_t*)data)[2]] = values[voxel_index * 3 + 1];
+    slots[((const uint8_t*)data)[3]] = values[voxel_index * 3 + 2];
+
+    const float2 result = eval_tape(data, slots, tape_parameters,
+                                    CACHED ? cache : nullptr, cache_clauses);
+
+    const int4 pos = unpack(position, tiles_per_side);
+    if (DIMENSION == 3 && masks) {
+        // Lane i holds voxels i and i + 32 of the tile, in bit order, and
+        // every lane of the warp works on the same tile.
+        const uint32_t lo = __ballot_sync(0xffffffff, result.x < 0.0f);
+        const uint32_t hi = __ballot_sync(0xffffffff, result.y < 0.0f);
+        if (threadIdx.x % 32 == 0) {
+            masks[tile_index] = lo | (uint64_t(hi) << 32);
         }
-    }
-
-    // Check the result
-    const uint8_t i_out = I_OUT(data);
-
-    const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
-    if (DIMENSION == 3) {
+    } else if (DIMENSION == 3) {
         const int4 sub = unpack(threadIdx.x % 32, 4);
         // The second voxel is always higher in Z, so it masks the lower voxel
-        if (slots[i_out].y < 0.0f) {
+        if (result.y < 0.0f) {
             const int32_t px = pos.x * 4 + sub.x;
             const int32_t py = pos.y * 4 + sub.y;
             const int32_t pz = pos.z * 4 + sub.z + 2;
 
-            atomicMax(&image[px + py * tiles_per_side * 4], pz);
-        } else if (slots[i_out].x < 0.0f) {
+            atomicMax(&shape_image[px + py * tiles_per_side * 4], pz);
+        } else if (result.x < 0.0f) {
             const int32_t px = pos.x * 4 + sub.x;
             const int32_t py = pos.y * 4 + sub.y;
             const int32_t pz = pos.z * 4 + sub.z;
 
-            atomicMax(&image[px + py * tiles_per_side * 4], pz);
+            atomicMax(&shape_image[px + py * tiles_per_side * 4], pz);
         }
     } else if (DIMENSION == 2) {
         const int4 sub = unpack(threadIdx.x % 32, 8);
-        if (slots[i_out].y < 0.0f) {
+        if (result.y < 0.0f) {
             const int32_t px = pos.x * 8 + sub.x;
             const int32_t py = pos.y * 8 + sub.y + 4;
 
             image[px + py * tiles_per_side * 8] = 1;
         }
-        if (slots[i_out].x < 0.0f) {
+        if (result.x < 0.0f) {
             const int32_t px = pos.x * 8 + sub.x;
             const int32_t py = pos.y * 8 + sub.y;
 
@@ -974,26 +1379,33 @@ void eval_voxels_f(const uint64_t* const __restrict__ tape_data,
  *
  *  We search through the `tiles`, `subtiles`, `microtiles` structure to
  *  find the shortest tape useful for each pixel, as an optimization.
+ *
+ *  The grid's Z dimension selects a shape, when rendering a batch of shapes.
+ *  As in eval_tiles_i, SLOTS is the size of the per-thread slot array.
  */
+template <int SLOTS>
 __global__
 void eval_pixels_d(const uint64_t* const __restrict__ tape_data,
                    const int32_t* const __restrict__ image,
                    uint32_t* const __restrict__ output,
                    const uint32_t image_size_px,
 
-                   Eigen::Matrix4f mat,
+                   const Eigen::Matrix4f* const __restrict__ mat_ptr,
 
                    const TileNode* const __restrict__ tiles,
                    const TileNode* const __restrict__ subtiles,
                    const TileNode* const __restrict__ microtiles)
 {
+    const int32_t shape = blockIdx.z;
+    const Eigen::Matrix4f& mat = mat_ptr[shape];
     const int32_t px = threadIdx.x + blockIdx.x * blockDim.x;
     const int32_t py = threadIdx.y + blockIdx.y * blockDim.y;
     if (px >= image_size_px || py >= image_size_px) {
         return;
     }
 
-    const int32_t pxy = px + py * image_size_px;
+    const int32_t pxy = px + py * image_size_px +
+                        shape * image_size_px * image_size_px;
     int32_t pz = image[pxy];
     if (pz == 0) {
         return;
@@ -1004,40 +1416,18 @@ void eval_pixels_d(const uint64_t* const __restrict__ tape_data,
         pz += 1;
     }
 
-    Deriv slots[128];
-
-    {   // Calculate size and load into initial slots
-        const float size_recip = 1.0f / image_size_px;
-
-        const float fx = ((px + 0.5f) * size_recip - 0.5f) * 2.0f;
-        const float fy = ((py + 0.5f) * size_recip - 0.5f) * 2.0f;
-        const float fz = ((pz + 0.5f) * size_recip - 0.5f) * 2.0f;
-
-        // Otherwise, calculate the X/Y/Z values
-        const float fw_ = mat(3, 0) * fx +
-                          mat(3, 1) * fy +
-                          mat(3, 2) * fz + mat(3, 3);
-        for (unsigned i=0; i < 3; ++i) {
-            slots[((const uint8_t*)tape_data)[i + 1]] = Deriv(
-                (mat(i, 0) * fx +
-                 mat(i, 1) * fy +
-                 mat(i, 2) * fz + mat(i, 3)) / fw_);
-        }
-        slots[((const uint8_t*)tape_data)[1]].v.x = 1.0f;
-        slots[((const uint8_t*)tape_data)[2]].v.y = 1.0f;
-        slots[((const uint8_t*)tape_data)[3]].v.z = 1.0f;
-    }
-
-
     const uint64_t* __restrict__ data = tape_data;
 
     {   // Pick out the tape based on the pointer stored in the tiles list
+        const int32_t tiles_per_side = image_size_px / 64;
         const int32_t tile_x = px / 64;
         const int32_t tile_y = py / 64;
         const int32_t tile_z = pz / 64;
         const int32_t tile = tile_x +
-                             tile_y * (image_size_px / 64) +
-                             tile_z * (image_size_px / 64) * (image_size_px / 64);
+                             tile_y * tiles_per_side +
+                             tile_z * tiles_per_side * tiles_per_side +
+                             shape * tiles_per_side * tiles_per_side *
+                                     tiles_per_side;
 
         if (tiles[tile].next == -1) {
             data = &tape_data[tiles[tile].tape];
@@ -1065,63 +1455,32 @@ void eval_pixels_d(const uint64_t* const __restrict__ tape_data,
         }
     }
 
-    while (1) {
-        const uint64_t d = *++data;
-        if (!OP(&d)) {
-            break;
-        }
-        switch (OP(&d)) {
-            case GPU_OP_JUMP: data += JUMP_TARGET(&d); continue;
-
-#define lhs slots[I_LHS(&d)]
-#define rhs slots[I_RHS(&d)]
-#define imm IMM(&d)
-#define out slots[I_OUT(&d)]
+    Deriv slots[SLOTS];
 
-            case GPU_OP_SQUARE_LHS: out = lhs * lhs; break;
-            case GPU_OP_SQRT_LHS: out = sqrt(lhs); break;
-            case GPU_OP_NEG_LHS: out = -lhs; break;
-            case GPU_OP_SIN_LHS: out = sin(lhs); break;
-            case GPU_OP_COS_LHS: out = cos(lhs); break;
-            case GPU_OP_ASIN_LHS: out = asin(lhs); break;
-            case GPU_OP_ACOS_LHS: out = acos(lhs); break;
-            case GPU_OP_ATAN_LHS: out = atan(lhs); break;
-            case GPU_OP_EXP_LHS: out = exp(lhs); break;
-            case GPU_OP_ABS_LHS: out = abs(lhs); break;
-            case GPU_OP_LOG_LHS: out = log(lhs); break;
+    {   // Calculate size and load into initial slots, which are stored in
+        // the first clause of the tape (since they differ between shapes)
+        const float size_recip = 1.0f / image_size_px;
 
-            // Commutative opcodes
-            case GPU_OP_ADD_LHS_IMM: out = lhs + imm; break;
-            case GPU_OP_ADD_LHS_RHS: out = lhs + rhs; break;
-            case GPU_OP_MUL_LHS_IMM: out = lhs * imm; break;
-            case GPU_OP_MUL_LHS_RHS: out = lhs * rhs; break;
-            case GPU_OP_MIN_LHS_IMM: out = min(lhs, imm); break;
-            case GPU_OP_MIN_LHS_RHS: out = min(lhs, rhs); break;
-            case GPU_OP_MAX_LHS_IMM: out = max(lhs, imm); break;
-            case GPU_OP_MAX_LHS_RHS: out = max(lhs, rhs); break;
+        const float fx = ((px + 0.5f) * size_recip - 0.5f) * 2.0f;
+        const float fy = ((py + 0.5f) * size_recip - 0.5f) * 2.0f;
+        const float fz = ((pz + 0.5f) * size_recip - 0.5f) * 2.0f;
 
-            // Non-commutative opcodes
-            case GPU_OP_SUB_LHS_IMM: out = lhs - imm; break;
-            case GPU_OP_SUB_IMM_RHS: out = imm - rhs; break;
-            case GPU_OP_SUB_LHS_RHS: out = lhs - rhs; break;
-
-            case GPU_OP_DIV_LHS_IMM: out = lhs / imm; break;
-            case GPU_OP_DIV_IMM_RHS: out = imm / rhs; break;
-            case GPU_OP_DIV_LHS_RHS: out = lhs / rhs; break;
-
-            case GPU_OP_COPY_IMM: out = Deriv(imm); break;
-            case GPU_OP_COPY_LHS: out = lhs; break;
-            case GPU_OP_COPY_RHS: out = rhs; break;
-
-#undef lhs
-#undef rhs
-#undef imm
-#undef out
+        // Otherwise, calculate the X/Y/Z values
+        const float fw_ = mat(3, 0) * fx +
+                          mat(3, 1) * fy +
+                          mat(3, 2) * fz + mat(3, 3);
+        for (unsigned i=0; i < 3; ++i) {
+            slots[((const uint8_t*)data)[i + 1]] = Deriv(
+                (mat(i, 0) * fx +
+                 mat(i, 1) * fy +
+                 mat(i, 2) * fz + mat(i, 3)) / fw_);
         }
+        slots[((const uint8_t*)data)[1]].v.x = 1.0f;
+        slots[((const uint8_t*)data)[2]].v.y = 1.0f;
+        slots[((const uint8_t*)data)[3]].v.z = 1.0f;
     }
 
-    const uint8_t i_out = I_OUT(data);
-    const Deriv result = slots[i_out];
+    const Deriv result = eval_tape(data, slots, tape_parameters);
     float norm = sqrtf(powf(result.dx(), 2) +
                        powf(result.dy(), 2) +
                        powf(result.dz(), 2));
@@ -1133,22 +1492,1404 @@ void eval_pixels_d(const uint64_t* const __restrict__ tape_data,
 
 ////////////////////////////////////////////////////////////////////////////////
 
+/*
+ *  calculate_point_blocks
+ *
+ *  Builds one tile for each cluster of `block_size` consecutive points (see
+ *  Context::point_block_size), and stores the bounding box of the cluster's
+ *  points as X/Y/Z intervals in `values`, for eval_tiles_i<0>.  The first
+ *  thread also resets the tile count and the subtape pool, as preload_tiles
+ *  does at the start of a frame.
+ */
+__global__
+void calculate_point_blocks(const float3* const __restrict__ pts,
+                            const int32_t n, const int32_t block_size,
+                            TileNode* const __restrict__ blocks,
+                            int32_t* const __restrict__ block_count,
+                            int32_t* const __restrict__ tape_index,
+                            const int32_t tape_length,
+                            int32_t* const __restrict__ tape_overflows,
+                            Interval* const __restrict__ values)
+{
+    const int32_t num_blocks = (n + block_size - 1) / block_size;
+    const int32_t b = threadIdx.x + blockIdx.x * blockDim.x;
+    if (b == 0) {
+        *block_count = num_blocks;
+        *tape_index = tape_length;
+        tape_overflows[0] = 0;
+        tape_overflows[1] = 0;
+        tape_overflows[2] = 0;
+    }
+    if (b >= num_blocks) {
+        return;
+    }
+
+    float3 lo = pts[b * block_size];
+    float3 hi = lo;
+    const int32_t end = min(n, (b + 1) * block_size);
+    for (int32_t i=b * block_size + 1; i < end; ++i) {
+        const float3 p = pts[i];
+        lo = make_float3(fminf(lo.x, p.x), fminf(lo.y, p.y), fminf(lo.z, p.z));
+        hi = make_float3(fmaxf(hi.x, p.x), fmaxf(hi.y, p.y), fmaxf(hi.z, p.z));
+    }
+    values[b * 3] = Interval(lo.x, hi.x);
+    values[b * 3 + 1] = Interval(lo.y, hi.y);
+    values[b * 3 + 2] = Interval(lo.z, hi.z);
+
+    blocks[b].position = b;
+    blocks[b].tape = 0;
+    blocks[b].next = -1;
+}
+
+/*
+ *  Evaluates the tape starting at `data` at a single point (see eval_tape),
+ *  with one point per thread.
+ */
+template <int SLOTS>
+static inline __device__
+float eval_point_f(const uint64_t* __restrict__ data, const float3 p)
+{
+    float slots[SLOTS];
+    slots[((const uint8_t*)data)[1]] = p.x;
+    slots[((const uint8_t*)data)[2]] = p.y;
+    slots[((const uint8_t*)data)[3]] = p.z;
+
+    return eval_tape(data, slots, tape_parameters);
+}
+
+/*
+ *  eval_points_f
+ *
+ *  Evaluates the tape at each of `n` points, writing the result to `out`.
+ *
+ *  If `blocks` isn't null, point i uses the tape of cluster
+ *  i / `block_size` (see calculate_point_blocks); otherwise, every point
+ *  uses the tape at the start of `tape_data`.
+ */
+template <int SLOTS>
+__global__
+void eval_points_f(const uint64_t* const __restrict__ tape_data,
+                   const TileNode* const __restrict__ blocks,
+                   const int32_t block_size,
+                   const float3* const __restrict__ pts,
+                   const int32_t n,
+                   float* const __restrict__ result)
+{
+    const int32_t index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (index >= n) {
+        return;
+    }
+    const uint64_t* const __restrict__ data = blocks
+        ? &tape_data[blocks[index / block_size].tape]
+        : tape_data;
+    result[index] = eval_point_f<SLOTS>(data, pts[index]);
+}
+
+/*
+ *  As eval_point_f, but with automatic differentiation (as in
+ *  eval_pixels_d), returning the value and gradient at the point.
+ */
+template <int SLOTS>
+static inline __device__
+Deriv eval_point_d(const uint64_t* __restrict__ data, const float3 p)
+{
+    Deriv slots[SLOTS];
+    slots[((const uint8_t*)data)[1]] = Deriv(p.x, 1.0f, 0.0f, 0.0f);
+    slots[((const uint8_t*)data)[2]] = Deriv(p.y, 0.0f, 1.0f, 0.0f);
+    slots[((const uint8_t*)data)[3]] = Deriv(p.z, 0.0f, 0.0f, 1.0f);
+
+    return eval_tape(data, slots, tape_parameters);
+}
+
+/*
+ *  eval_points_d
+ *
+ *  As eval_points_f, but also writing the gradient at each point to `grad`.
+ */
+template <int SLOTS>
+__global__
+void eval_points_d(const uint64_t* const __restrict__ tape_data,
+                   const TileNode* const __restrict__ blocks,
+                   const int32_t block_size,
+                   const float3* const __restrict__ pts,
+                   const int32_t n,
+                   float* const __restrict__ result,
+                   float3* const __restrict__ grad)
+{
+    const int32_t index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (index >= n) {
+        return;
+    }
+    const uint64_t* const __restrict__ data = blocks
+        ? &tape_data[blocks[index / block_size].tape]
+        : tape_data;
+    const Deriv r = eval_point_d<SLOTS>(data, pts[index]);
+    result[index] = r.value();
+    grad[index] = make_float3(r.dx(), r.dy(), r.dz());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*  Each 4^3 tile is meshed from the 5^3 corners of its cells, and from the
+ *  lattice edges which start at each corner (in seven directions) */
+#define MESH_CORNERS (5 * 5 * 5)
+#define MESH_EDGES (MESH_CORNERS * 7)
+
+/*  Cells are split into six tetrahedra around their main diagonal.  Each
+ *  one is a chain of cube corners (with bit 0 for +x, bit 1 for +y, and bit
+ *  2 for +z) in which every corner is a subset of the corners after it, so
+ *  each of its edges runs from a corner in one of the seven directions. */
+__constant__ uint8_t MESH_TETS[6][4] = {
+    {0, 1, 3, 7}, {0, 1, 5, 7}, {0, 2, 3, 7},
+    {0, 2, 6, 7}, {0, 4, 5, 7}, {0, 4, 6, 7},
+};
+
+/*  Returns the index of the corner at offset `bits` (as in MESH_TETS) from
+ *  corner `c` of a tile's lattice */
+static inline __device__
+int32_t mesh_offset(const int32_t c, const int32_t bits) {
+    return c + (bits & 1) + ((bits >> 1) & 1) * 5 + (bits >> 2) * 25;
+}
+
+/*  Returns the corner at the far end of lattice edge `e`, or -1 if the edge
+ *  leaves the tile */
+static inline __device__
+int32_t mesh_edge_end(const int32_t e) {
+    const int32_t c = e / 7;
+    const int32_t dir = e % 7 + 1;
+    if (c % 5 + (dir & 1) > 4 ||
+        (c / 5) % 5 + ((dir >> 1) & 1) > 4 ||
+        c / 25 + (dir >> 2) > 4)
+    {
+        return -1;
+    }
+    return mesh_offset(c, dir);
+}
+
+/*  Returns the position in model space of lattice corner `c` of the 3D
+ *  tile at `pos`.  Corners on the tile's faces land exactly on the bounds
+ *  from tile_bounds_3d, so the tile's shortened tape is valid there. */
+static inline __device__
+float3 mesh_corner(const int4 pos, const int32_t c,
+                   const uint32_t tiles_per_side, const Eigen::Matrix4f& mat)
+{
+    const float n = tiles_per_side;
+    const float fx = ((pos.x + (c % 5) / 4.0f) / n - 0.5f) * 2.0f;
+    const float fy = ((pos.y + ((c / 5) % 5) / 4.0f) / n - 0.5f) * 2.0f;
+    const float fz = ((pos.z + (c / 25) / 4.0f) / n - 0.5f) * 2.0f;
+    const float fw = mat(3, 0) * fx + mat(3, 1) * fy + mat(3, 2) * fz +
+                     mat(3, 3);
+    return make_float3(
+        (mat(0, 0) * fx + mat(0, 1) * fy + mat(0, 2) * fz + mat(0, 3)) / fw,
+        (mat(1, 0) * fx + mat(1, 1) * fy + mat(1, 2) * fz + mat(1, 3)) / fw,
+        (mat(2, 0) * fx + mat(2, 1) * fy + mat(2, 2) * fz + mat(2, 3)) / fw);
+}
+
+/*  Returns the lattice corner of corner `i` of tetrahedron `t` of a tile,
+ *  where tetrahedra are numbered 6 * cell + k (with cells in x/y/z order) */
+static inline __device__
+int32_t mesh_tet_corner(const int32_t t, const int32_t i) {
+    const int32_t cell = t / 6;
+    const int32_t c = cell % 4 + ((cell / 4) % 4) * 5 + (cell / 16) * 25;
+    return mesh_offset(c, MESH_TETS[t % 6][i]);
+}
+
+/*  Returns the lattice edge between corners `i` and `j` of tetrahedron `t` */
+static inline __device__
+int32_t mesh_tet_edge(const int32_t t, const int32_t i, const int32_t j) {
+    const int32_t lo = min(i, j);
+    const int32_t hi = max(i, j);
+    const int32_t dir = MESH_TETS[t % 6][hi] ^ MESH_TETS[t % 6][lo];
+    return mesh_tet_corner(t, lo) * 7 + dir - 1;
+}
+
+/*  Returns a bitmask of the corners of tetrahedron `t` that are inside the
+ *  shape, given the values at every lattice corner */
+static inline __device__
+int32_t mesh_tet_inside(const float* const __restrict__ values,
+                        const int32_t t)
+{
+    int32_t inside = 0;
+    for (int32_t i=0; i < 4; ++i) {
+        inside |= (values[mesh_tet_corner(t, i)] < 0.0f) << i;
+    }
+    return inside;
+}
+
+/*  Returns the number of triangles (up to 2) that a tetrahedron contributes,
+ *  given the mask from mesh_tet_inside.  If `edges` isn't null, each
+ *  triangle's vertices are written to it, as three pairs of tetrahedron
+ *  corners (with the edge's two corners on opposite sides of the surface). */
+static inline __device__
+int32_t mesh_tet_triangles(const int32_t inside, int2* const __restrict__ edges)
+{
+    const int32_t k = __popc(inside);
+    if (k == 2) {
+        if (edges) {
+            int32_t in[2];
+            int32_t out[2];
+            int32_t num_in = 0;
+            int32_t num_out = 0;
+            for (int32_t i=0; i < 4; ++i) {
+                if (inside & (1 << i)) {
+                    in[num_in++] = i;
+                } else {
+                    out[num_out++] = i;
+                }
+            }
+            // The four edges form a quad, which is split into two triangles
+            edges[0] = make_int2(in[0], out[0]);
+            edges[1] = make_int2(in[0], out[1]);
+            edges[2] = make_int2(in[1], out[1]);
+            edges[3] = make_int2(in[0], out[0]);
+            edges[4] = make_int2(in[1], out[1]);
+            edges[5] = make_int2(in[1], out[0]);
+        }
+        return 2;
+    } else if (k == 1 || k == 3) {
+        if (edges) {
+            const int32_t lone = __ffs(k == 1 ? inside : (~inside & 0xF)) - 1;
+            int32_t j = 0;
+            for (int32_t i=0; i < 4; ++i) {
+                if (i != lone) {
+                    edges[j++] = make_int2(lone, i);
+                }
+            }
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ *  mesh_tiles
+ *
+ *  Extracts a triangle mesh from every 4^3 tile in `in_tiles` with
+ *  marching tetrahedra (see Context::renderMesh).  Each tile is handled by
+ *  one warp, which uses the tile's shortened tape throughout:
+ *  -   The 5^3 corners of the tile's cells are evaluated with the float
+ *      interpreter (as in eval_points_f), into shared memory
+ *  -   Each lattice edge with a sign change gets a vertex, which is
+ *      numbered within the tile with a ballot
+ *  -   The warp reserves space for all of the tile's vertices and triangles
+ *      with one atomic add each (into `counts`), then writes out each
+ *      vertex (placed by linear interpolation along its edge, with a normal
+ *      from automatic differentiation) and each triangle, wound so that
+ *      its front face points out of the shape.
+ *
+ *  Neighboring tiles sample their shared faces at the same points, so the
+ *  mesh is closed across tiles, though vertices on those faces are stored
+ *  once per tile.
+ *
+ *  If a tile's output doesn't fit in the buffers, it is dropped, but the
+ *  counts still advance, so that the caller can grow the buffers and run
+ *  this again.
+ */
+template <int SLOTS>
+__global__
+__launch_bounds__(NUM_TILES * 32)
+void mesh_tiles(const uint64_t* const __restrict__ tape_data,
+                const TileNode* const __restrict__ in_tiles,
+                const int32_t* const __restrict__ in_tile_count,
+                const uint32_t tiles_per_side,
+                const Eigen::Matrix4f* const __restrict__ mat_ptr,
+
+                int32_t* const __restrict__ counts,
+                float3* const __restrict__ vertices,
+                float3* const __restrict__ normals,
+                const int32_t max_vertices,
+                uint32_t* const __restrict__ indices,
+                const int32_t max_triangles)
+{
+    // Every thread in a warp shares a tile, so the warp returns together
+    const int32_t tile_index = (threadIdx.x + blockIdx.x * blockDim.x) / 32;
+    if (tile_index >= *in_tile_count) {
+        return;
+    }
+    const int32_t lane = threadIdx.x % 32;
+    const uint32_t lanes_below = (1u << lane) - 1;
+
+    __shared__ float corner_values[NUM_TILES][MESH_CORNERS];
+    __shared__ int16_t edge_vertices[NUM_TILES][MESH_EDGES];
+    float* const __restrict__ values = corner_values[threadIdx.x / 32];
+    int16_t* const __restrict__ edges = edge_vertices[threadIdx.x / 32];
+
+    const int32_t position = in_tiles[tile_index].position;
+    const int4 pos = unpack(position, tiles_per_side);
+    const Eigen::Matrix4f& mat = mat_ptr[shape_of(position, tiles_per_side)];
+    const uint64_t* const __restrict__ tape =
+        &tape_data[in_tiles[tile_index].tape];
+
+    for (int32_t c=lane; c < MESH_CORNERS; c += 32) {
+        values[c] = eval_point_f<SLOTS>(
+            tape, mesh_corner(pos, c, tiles_per_side, mat));
+    }
+    __syncwarp();
+
+    // Number the edges with sign changes, in order
+    int32_t num_vertices = 0;
+    for (int32_t base=0; base < MESH_EDGES; base += 32) {
+        const int32_t e = base + lane;
+        const int32_t end = (e < MESH_EDGES) ? mesh_edge_end(e) : -1;
+        const bool crossing = end >= 0 &&
+            ((values[e / 7] < 0.0f) != (values[end] < 0.0f));
+        const uint32_t mask = __ballot_sync(0xffffffff, crossing);
+        if (e < MESH_EDGES) {
+            edges[e] = crossing ? num_vertices + __popc(mask & lanes_below)
+                                : -1;
+        }
+        num_vertices += __popc(mask);
+    }
+
+    // Count triangles, then reserve space for this tile's output
+    int32_t num_triangles = 0;
+    for (int32_t t=lane; t < 64 * 6; t += 32) {
+        num_triangles += mesh_tet_triangles(mesh_tet_inside(values, t),
+                                            nullptr);
+    }
+    for (int32_t i=16; i; i >>= 1) {
+        num_triangles += __shfl_xor_sync(0xffffffff, num_triangles, i);
+    }
+    if (num_triangles == 0) {
+        return;
+    }
+    int32_t first_vertex = 0;
+    int32_t first_triangle = 0;
+    if (lane == 0) {
+        first_vertex = atomicAdd(&counts[0], num_vertices);
+        first_triangle = atomicAdd(&counts[1], num_triangles);
+    }
+    first_vertex = __shfl_sync(0xffffffff, first_vertex, 0);
+    first_triangle = __shfl_sync(0xffffffff, first_triangle, 0);
+    if (first_vertex + num_vertices > max_vertices ||
+        first_triangle + num_triangles > max_triangles)
+    {
+        return;
+    }
+    __syncwarp();
+
+    for (int32_t e=lane; e < MESH_EDGES; e += 32) {
+        if (edges[e] < 0) {
+            continue;
+        }
+        const int32_t end = mesh_edge_end(e);
+        const float3 a = mesh_corner(pos, e / 7, tiles_per_side, mat);
+        const float3 b = mesh_corner(pos, end, tiles_per_side, mat);
+        const float va = values[e / 7];
+        const float vb = values[end];
+        const float f = fminf(fmaxf(va / (va - vb), 0.0f), 1.0f);
+        const float3 p = make_float3(a.x + (b.x - a.x) * f,
+                                     a.y + (b.y - a.y) * f,
+                                     a.z + (b.z - a.z) * f);
+        const Deriv d = eval_point_d<SLOTS>(tape, p);
+        const float norm = sqrtf(d.dx() * d.dx() + d.dy() * d.dy() +
+                                 d.dz() * d.dz());
+        const int32_t v = first_vertex + edges[e];
+        vertices[v] = p;
+        normals[v] = (norm > 0.0f)
+            ? make_float3(d.dx() / norm, d.dy() / norm, d.dz() / norm)
+            : make_float3(0.0f, 0.0f, 0.0f);
+    }
+    __syncwarp();
+
+    int32_t triangle = first_triangle;
+    for (int32_t base=0; base < 64 * 6; base += 32) {
+        const int32_t t = base + lane;
+        int2 tri_edges[6];
+        const int32_t n = mesh_tet_triangles(mesh_tet_inside(values, t),
+                                             tri_edges);
+
+        // Store triangles in tetrahedron order, as with vertices
+        const uint32_t one = __ballot_sync(0xffffffff, n >= 1);
+        const uint32_t two = __ballot_sync(0xffffffff, n == 2);
+        int32_t k = triangle + __popc(one & lanes_below) +
+                               __popc(two & lanes_below);
+        triangle += __popc(one) + __popc(two);
+
+        for (int32_t j=0; j < n; ++j, ++k) {
+            uint32_t tri[3];
+            for (int32_t i=0; i < 3; ++i) {
+                const int2 ij = tri_edges[j * 3 + i];
+                tri[i] = first_vertex + edges[mesh_tet_edge(t, ij.x, ij.y)];
+            }
+
+            // The first vertex's edge crosses from the inside of the shape
+            // to the outside, so the winding should agree with it
+            const int2 ij = tri_edges[j * 3];
+            const int32_t ci = mesh_tet_corner(t, ij.x);
+            const int32_t cj = mesh_tet_corner(t, ij.y);
+            const float3 p_in = mesh_corner(pos, values[ci] < 0.0f ? ci : cj,
+                                            tiles_per_side, mat);
+            const float3 p_out = mesh_corner(pos, values[ci] < 0.0f ? cj : ci,
+                                             tiles_per_side, mat);
+            const float3 p0 = vertices[tri[0]];
+            const float3 p1 = vertices[tri[1]];
+            const float3 p2 = vertices[tri[2]];
+            const float3 u = make_float3(p1.x - p0.x, p1.y - p0.y, p1.z - p0.z);
+            const float3 w = make_float3(p2.x - p0.x, p2.y - p0.y, p2.z - p0.z);
+            const float facing =
+                (u.y * w.z - u.z * w.y) * (p_out.x - p_in.x) +
+                (u.z * w.x - u.x * w.z) * (p_out.y - p_in.y) +
+                (u.x * w.y - u.y * w.x) * (p_out.z - p_in.z);
+
+            indices[k * 3] = tri[0];
+            indices[k * 3 + 1] = (facing < 0.0f) ? tri[2] : tri[1];
+            indices[k * 3 + 2] = (facing < 0.0f) ? tri[1] : tri[2];
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*  Grows a scratch buffer (a stage's tile array or `values`), which
+ *  currently holds `capacity` elements of type T, to fit `count`.
+ *  Buffers grow geometrically, and the old buffer is retired rather than
+ *  freed, so that nothing is freed in the middle of a frame. */
+template <typename T, typename P>
+static void reserve_scratch(Context& ctx, P& buf, size_t& capacity,
+                            size_t count)
+{
+    if (count <= capacity) {
+        return;
+    }
+
+    // Grow geometrically, so that a long-running context quickly reaches a
+    // size where it stops allocating altogether.
+    const size_t next = std::max(count, capacity * 2);
+
+    // The old buffer may still be in use by a previous frame (or by earlier
+    // kernels in this one), and cudaFree would synchronize the whole device,
+    // so we hold onto it until release_retired is called.
+    if (buf) {
+        ctx.impl->retired.emplace_back(buf.release());
+        ctx.impl->retired_bytes += capacity * sizeof(T);
+        ctx.impl->scratch_bytes -= capacity * sizeof(T);
+    }
+    buf.reset(alloc<T>(ctx, next));
+    capacity = next;
+    ctx.impl->scratch_bytes += next * sizeof(T);
+    ctx.impl->scratch_high_water = std::max(ctx.impl->scratch_high_water,
+        ctx.impl->scratch_bytes + ctx.impl->retired_bytes);
+}
+
+/*  Frees retired scratch buffers, if the last frame has finished.  This
+ *  is called at the start of every frame, and never blocks. */
+static void release_retired(Context& ctx) {
+    if (!ctx.impl->retired.empty() &&
+        cudaEventQuery(ctx.impl->frame_done.get()) == cudaSuccess)
+    {
+        ctx.impl->retired.clear();
+        ctx.impl->retired_bytes = 0;
+    }
+}
+
+/*  Reserves the shared values array, which holds `count` values of type T */
+template <typename T>
+static void reserve_values(Context& ctx, size_t count) {
+    reserve_scratch<T>(ctx, ctx.impl->scratch->values,
+                       ctx.impl->scratch->values_size, count);
+}
+
+/*
+ *  Rounds a tile count up to a whole number of blocks.  In device-sizing mode,
+ *  kernels are launched over the entire stage buffer, so its size must be a
+ *  multiple of NUM_THREADS (which is also a multiple of 64 and NUM_TILES).
+ */
+static size_t round_to_blocks(size_t count) {
+    return (count + NUM_THREADS - 1) / NUM_THREADS * NUM_THREADS;
+}
+
+/*
+ *  Returns the number of tiles that a device-sized launch can cover, which
+ *  is the buffer size rounded down to whole blocks (in case the buffer was
+ *  allocated to an exact size by the host-sized path).
+ */
+static int32_t block_capacity(const Tiles& t) {
+    return t.tile_array_size / NUM_THREADS * NUM_THREADS;
+}
+
+/*
+ *  Grows a stage's tile array to hold at least `count` tiles, with some
+ *  headroom so that small frame-to-frame changes don't cause a reallocation.
+ *  This is only used in device-sizing mode; the host-sized path allocates
+ *  exactly what it needs.
+ */
+static bool reserve_tiles(Context& ctx, Tiles& t, size_t count) {
+    if (count > size_t(block_capacity(t))) {
+        reserve_scratch<TileNode>(ctx, t.tiles, t.tile_array_size,
+                                  round_to_blocks(count + count / 4));
+        return true;
+    }
+    return false;
+}
+
+/*
+ *  Tile sizes stored in each stage, or 0 for unused stages.  Stage 3 holds
+ *  the same tiles as stage 2, which are evaluated voxel-by-voxel.
+ */
+static const unsigned TILE_SIZES_3D[4] = {64, 16, 4, 4};
+static const unsigned TILE_SIZES_2D[4] = {64, 0, 8, 8};
+
+/*
+ *  Prepares stage buffers for a device-sized frame, returning true if any
+ *  buffer was reallocated.
+ *
+ *  Every stage starts with room for a layer of tiles covering the whole
+ *  image (or each of `images` images, for a batch of shapes), which is an
+ *  upper bound in 2D and a reasonable guess in 3D.  Then,
+ *  if the previous frame has finished, stages are grown to fit its counts.
+ *  We only query the event (rather than waiting on it), so this never
+ *  blocks; a frame which is still in flight will be checked next time.
+ */
+static bool reserve_stages(Context& ctx, const unsigned* tile_size_px,
+                           size_t images=1)
+{
+    const bool done = cudaEventQuery(ctx.impl->frame_done.get()) == cudaSuccess;
+    bool changed = false;
+    for (unsigned i=1; i < 4; ++i) {
+        if (tile_size_px[i]) {
+            const size_t layer =
+                images * pow(ctx.image_size_px / tile_size_px[i], 2);
+            changed |= reserve_tiles(ctx, ctx.stages[i], layer);
+            if (done) {
+                changed |= reserve_tiles(ctx, ctx.stages[i],
+                                         ctx.impl->tile_counts_host[i]);
+            }
+        }
+    }
+    return changed;
+}
+
+/*
+ *  Allocates the subtape pool (with `initial_subtapes` subtapes) before the
+ *  first frame which needs it, or after trim.  Then, doubles the pool (up to
+ *  `max_subtapes`) if the previous frame ran out of room while pushing
+ *  subtapes.  Like reserve_stages, this only queries the previous frame's
+ *  event, so it never blocks.
+ */
+static void reserve_subtapes(Context& ctx) {
+    ScratchPool& pool = *ctx.impl->scratch;
+    if (!pool.tape_data) {
+        ctx.resizeSubtapes(std::max(pool.num_subtapes,
+                                    ctx.initial_subtapes));
+    } else if (ctx.grow_subtapes && pool.num_subtapes < ctx.max_subtapes &&
+               cudaEventQuery(ctx.impl->frame_done.get()) == cudaSuccess &&
+               *ctx.impl->tape_overflows_host > 0)
+    {
+        ctx.resizeSubtapes(std::min(pool.num_subtapes * 2, ctx.max_subtapes));
+    }
+}
+
+/*
+ *  Allocates the normal image before the first 3D frame which renders it.
+ *  This must happen before graph capture, since it calls cudaMalloc.
+ */
+static void reserve_normals(Context& ctx) {
+    if (ctx.render_flags & RENDER_NORMALS) {
+        alloc_normals(ctx);
+    }
+}
+
+/*
+ *  Allocates the compact images (if `compact_images` is set) before the
+ *  first frame which writes them, for the same reason as reserve_normals.
+ */
+static void reserve_compact(Context& ctx) {
+    if (!ctx.compact_images) {
+        return;
+    }
+    const size_t pixels = size_t(ctx.image_size_px) * ctx.image_size_px;
+    if (!ctx.occupancy) {
+        ctx.occupancy = alloc_image<uint32_t>(ctx, pixels / 32);
+    }
+    if (!ctx.depth16 && ctx.image_size_px + 3 <= UINT16_MAX) {
+        ctx.depth16 = alloc_image<uint16_t>(ctx, ctx.image_count * pixels);
+    }
+}
+
+void Context::resizeSubtapes(size_t count) {
+    require_cuda(*this, "resizeSubtapes");
+    assert(count * SUBTAPE_CHUNK_SIZE <= INT32_MAX);
+
+    // As in reserve_scratch, the old pool is retired rather than freed, and
+    // counts towards the high-water mark until it is released.
+    ScratchPool& pool = *impl->scratch;
+    const size_t bytes = sizeof(uint64_t) * SUBTAPE_CHUNK_SIZE;
+    if (pool.tape_data) {
+        impl->retired.emplace_back(pool.tape_data.release());
+        impl->retired_bytes += pool.num_subtapes * bytes;
+        // A shared pool may have been counted by another context instead
+        impl->scratch_bytes -= std::min(impl->scratch_bytes,
+                                        pool.num_subtapes * bytes);
+    }
+    pool.num_subtapes = count;
+    pool.tape_data.reset(alloc<uint64_t>(*this, count * SUBTAPE_CHUNK_SIZE));
+    impl->scratch_bytes += count * bytes;
+    impl->scratch_high_water = std::max(impl->scratch_high_water,
+        impl->scratch_bytes + impl->retired_bytes);
+    *impl->tape_overflows_host = 0;
+}
+
+void Context::shareScratch(const Context& other) {
+    require_cuda(*this, "shareScratch");
+    CUDA_CHECK(cudaEventSynchronize(impl->frame_done.get()));
+    impl->scratch = other.impl->scratch;
+}
+
+void Context::trim() {
+    // A CPU context's only buffers are its images
+    if (backend == BACKEND_CPU) {
+        return;
+    }
+    CUDA_CHECK(cudaEventSynchronize(impl->frame_done.get()));
+    impl->retired.clear();
+    impl->retired_bytes = 0;
+
+    // The first stage's tiles are sized with the images, and kept with them;
+    // every other buffer here is grown by reserve_scratch as frames need it.
+    for (unsigned i=1; i < 4; ++i) {
+        stages[i].tiles.reset();
+        stages[i].tile_array_size = 0;
+    }
+    impl->subtape_table.reset();
+    impl->subtape_table_size = 0;
+    impl->tile_cache.reset();
+    impl->tile_cache_size = 0;
+    impl->tile_cache_state.reset();
+
+    // A captured graph refers to the buffers above
+    impl->graph.reset();
+    impl->graph_buffers.clear();
+
+    // Shared scratch space may still be used by other contexts.  The pool
+    // keeps its size, so that the next frame doesn't start out too small.
+    if (impl->scratch.use_count() == 1) {
+        impl->scratch->tape_data.reset();
+        impl->scratch->values.reset();
+        impl->scratch->values_size = 0;
+    }
+    impl->scratch_bytes = 0;
+}
+
+int32_t Context::subtapeOverflows() const {
+    require_cuda(*this, "subtapeOverflows");
+    return *impl->tape_overflows_host;
+}
+
+int32_t Context::culledTiles(int32_t stage) const {
+    require_cuda(*this, "culledTiles");
+    return impl->cull_counts_host[stage];
+}
+
+/*
+ *  Indices into Context::Impl::stats_events.  Each stage has three events:
+ *  stage 3 marks its start, then the end of voxel and normal evaluation, and
+ *  the others mark their start, then the end of interval evaluation and of
+ *  subdivision.
+ */
+enum StatsEvent {
+    STATS_BEGIN,
+    STATS_SETUP,
+    STATS_STAGE,
+    STATS_EVENT_COUNT = STATS_STAGE + 4 * 3,
+};
+
+/*  Values read back into Context::Impl::stats_host at the end of a frame */
+enum StatsValue {
+    STATS_TILE_COUNTS,                      // One per stage
+    STATS_TAPE_INDEX = STATS_TILE_COUNTS + 4,
+    STATS_OVERFLOWS,
+    STATS_PUSHES,
+    STATS_PUSHED_CLAUSES,
+    STATS_CACHE_HITS,
+    STATS_VALUE_COUNT,
+};
+
+static const char* const STAGE_NAMES[4] = {
+    "stage 0", "stage 1", "stage 2", "stage 3"};
+
+/*
+ *  Records one of the frame's timing events (see StatsEvent), if the context
+ *  is collecting stats.  The events and readback buffer are only allocated
+ *  once they're first used.
+ */
+static void record_stats(Context& ctx, int32_t event, cudaStream_t stream) {
+    if (!ctx.collect_stats) {
+        return;
+    }
+    if (ctx.impl->stats_events.empty()) {
+        for (unsigned i=0; i < STATS_EVENT_COUNT; ++i) {
+            ctx.impl->stats_events.push_back(makeTimingEvent());
+        }
+        ctx.impl->stats_host.reset(
+                CUDA_MALLOC_HOST(int32_t, STATS_VALUE_COUNT));
+    }
+    CUDA_CHECK(cudaEventRecord(ctx.impl->stats_events[event].get(), stream));
+}
+
+/*  Opens an NVTX range for one stage, and records the stage's first event */
+static void begin_stage_stats(Context& ctx, int32_t stage,
+                              cudaStream_t stream)
+{
+    NVTX_PUSH(STAGE_NAMES[stage]);
+    record_stats(ctx, STATS_STAGE + stage * 3, stream);
+}
+
+/*  Records the stage's last event and closes its NVTX range */
+static void end_stage_stats(Context& ctx, int32_t stage, cudaStream_t stream)
+{
+    record_stats(ctx, STATS_STAGE + stage * 3 + 2, stream);
+    NVTX_POP();
+}
+
+/*
+ *  Reads back the per-stage tile counts, the end of the subtape pool, the
+ *  push counters, and the tile cache hits into `stats_host`, at the end of
+ *  a frame.
+ */
+static void read_stats(Context& ctx, cudaStream_t stream) {
+    if (!ctx.collect_stats) {
+        return;
+    }
+    CUDA_CHECK(cudaMemcpyAsync(ctx.impl->stats_host.get() + STATS_TILE_COUNTS,
+                               ctx.impl->tile_counts.get(), sizeof(int32_t) * 4,
+                               cudaMemcpyDeviceToHost, stream));
+    CUDA_CHECK(cudaMemcpyAsync(ctx.impl->stats_host.get() + STATS_TAPE_INDEX,
+                               ctx.impl->tape_index.get(), sizeof(int32_t),
+                               cudaMemcpyDeviceToHost, stream));
+    CUDA_CHECK(cudaMemcpyAsync(ctx.impl->stats_host.get() + STATS_OVERFLOWS,
+                               ctx.impl->tape_overflows.get(),
+                               sizeof(int32_t) * 3,
+                               cudaMemcpyDeviceToHost, stream));
+
+    // Frames which don't use the cache have cleared its state
+    if (ctx.impl->tile_cache_state) {
+        auto state = reinterpret_cast<TileCacheState*>(
+                ctx.impl->tile_cache_state.get());
+        CUDA_CHECK(cudaMemcpyAsync(ctx.impl->stats_host.get() +
+                                   STATS_CACHE_HITS,
+                                   &state->hits, sizeof(int32_t),
+                                   cudaMemcpyDeviceToHost, stream));
+    } else {
+        ctx.impl->stats_host[STATS_CACHE_HITS] = 0;
+    }
+}
+
+RenderStats Context::renderStats() const {
+    if (backend == BACKEND_CPU) {
+        return impl->cpu_stats;
+    }
+    RenderStats out = RenderStats();
+    if (impl->stats_events.empty()) {
+        return out;
+    }
+
+    auto elapsed = [&](int32_t a, int32_t b) {
+        float ms;
+        CUDA_CHECK(cudaEventElapsedTime(&ms, impl->stats_events[a].get(),
+                                        impl->stats_events[b].get()));
+        return ms;
+    };
+    out.setup_ms = elapsed(STATS_BEGIN, STATS_SETUP);
+    for (unsigned i=0; i < 4; ++i) {
+        const int32_t e = STATS_STAGE + i * 3;
+        out.eval_ms[i] = elapsed(e, e + 1);
+        if (i < 3) {
+            out.subdivide_ms[i] = elapsed(e + 1, e + 2);
+        } else {
+            out.normals_ms = elapsed(e + 1, e + 2);
+        }
+        out.tile_counts[i] = impl->stats_host[STATS_TILE_COUNTS + i];
+    }
+    out.total_ms = elapsed(STATS_BEGIN, STATS_EVENT_COUNT - 1);
+
+    out.tape_used = impl->stats_host[STATS_TAPE_INDEX];
+    out.tape_capacity = tape_capacity();
+    out.subtape_overflows = impl->stats_host[STATS_OVERFLOWS];
+    out.subtape_pushes = impl->stats_host[STATS_PUSHES];
+    out.mean_subtape_length = out.subtape_pushes
+        ? float(impl->stats_host[STATS_PUSHED_CLAUSES]) / out.subtape_pushes
+        : 0.0f;
+    out.cache_hits = impl->stats_host[STATS_CACHE_HITS];
+    return out;
+}
+
+/*
+ *  Picks the evaluator specialization for tapes using `num_slots` slots,
+ *  which is the smallest slot array that fits them (and `min_slots`).
+ *  Smaller arrays use less local memory (or fit entirely in registers),
+ *  which matters most for small tapes.
+ */
+static int32_t slot_tier(const Context& ctx, int32_t num_slots) {
+    num_slots = std::max(num_slots, ctx.min_slots);
+    for (int32_t tier : {8, 16, 32, 64}) {
+        if (num_slots <= tier) {
+            return tier;
+        }
+    }
+    return MAX_SLOTS;
+}
+
+/*
+ *  Expands CALL(S) for the compile-time slot count S matching `tier`, which
+ *  must come from slot_tier.
+ */
+#define DISPATCH_SLOTS(tier, CALL)          \
+    switch (tier) {                         \
+        case 8:  CALL(8);   break;          \
+        case 16: CALL(16);  break;          \
+        case 32: CALL(32);  break;          \
+        case 64: CALL(64);  break;          \
+        default: CALL(MAX_SLOTS); break;    \
+    }
+
+template <typename F>
+static KernelOccupancy kernel_occupancy(const char* name, int32_t slots,
+                                        F kernel, int block_size,
+                                        const cudaDeviceProp& prop)
+{
+    cudaFuncAttributes attr;
+    CUDA_CHECK(cudaFuncGetAttributes(&attr, kernel));
+    int blocks = 0;
+    CUDA_CHECK(cudaOccupancyMaxActiveBlocksPerMultiprocessor(
+                &blocks, kernel, block_size, 0));
+    const float warps = blocks * ((block_size + 31) / 32);
+    return KernelOccupancy {
+        name, slots, attr.numRegs, attr.localSizeBytes, blocks,
+        warps / (prop.maxThreadsPerMultiProcessor / 32)};
+}
+
+std::vector<KernelOccupancy> Context::evaluatorOccupancy() {
+    int device;
+    CUDA_CHECK(cudaGetDevice(&device));
+    cudaDeviceProp prop;
+    CUDA_CHECK(cudaGetDeviceProperties(&prop, device));
+
+    std::vector<KernelOccupancy> out;
+#define REPORT(S)                                                           \
+    out.push_back(kernel_occupancy("eval_tiles_i", S,                       \
+                                   eval_tiles_i<3, false, S>,               \
+                                   NUM_THREADS, prop));                     \
+    out.push_back(kernel_occupancy("eval_tiles_i (warp)", S,                \
+                                   eval_tiles_i<3, true, S>,                \
+                                   NUM_THREADS, prop));                     \
+    out.push_back(kernel_occupancy("eval_tiles_i (affine)", S,              \
+                                   eval_tiles_i<3, false, S, Affine>,       \
+                                   NUM_THREADS, prop));                     \
+    out.push_back(kernel_occupancy("eval_voxels_f", S,                      \
+                                   eval_voxels_f<3, false, S>,              \
+                                   NUM_TILES * 32, prop));                  \
+    out.push_back(kernel_occupancy("eval_pixels_d", S,                      \
+                                   eval_pixels_d<S>, 16 * 16, prop))
+    REPORT(8);
+    REPORT(16);
+    REPORT(32);
+    REPORT(64);
+    REPORT(MAX_SLOTS);
+#undef REPORT
+    return out;
+}
+
+/*  Returns the subtape table, or null if subtapes aren't deduplicated */
+static SubtapeEntry* subtape_table(const Context& ctx) {
+    return ctx.dedupe_subtapes
+        ? reinterpret_cast<SubtapeEntry*>(ctx.impl->subtape_table.get())
+        : nullptr;
+}
+
+/*  Sizes and clears the subtape table (if it's used) before a frame.  Every
+ *  push claims at least one chunk of the pool, so there's an entry for each
+ *  chunk, rounded up to a power of two. */
+static void reset_subtape_table(Context& ctx, cudaStream_t stream) {
+    if (!ctx.dedupe_subtapes) {
+        return;
+    }
+    size_t entries = 1;
+    while (entries < ctx.impl->scratch->num_subtapes) {
+        entries *= 2;
+    }
+    reserve_scratch<SubtapeEntry>(ctx, ctx.impl->subtape_table,
+                                  ctx.impl->subtape_table_size, entries);
+    CUDA_CHECK(cudaMemsetAsync(ctx.impl->subtape_table.get(), 0xff,
+                               sizeof(SubtapeEntry) *
+                               ctx.impl->subtape_table_size, stream));
+}
+
+/*
+ *  Launches interval evaluation over stage `i`'s `count` tiles, which are
+ *  `tile_size_px` pixels on a side.  A null `image` selects volume mode
+ *  (see finish_tile).
+ */
+template <int DIMENSION, bool WARP, int SLOTS, typename T=Interval>
+static void launch_eval_tiles(Context& ctx, unsigned i, unsigned tile_size_px,
+                              unsigned count, int32_t* image,
+                              cudaStream_t stream)
+{
+    const unsigned num_threads = WARP ? (count * 32) : count;
+    const unsigned num_blocks = (num_threads + NUM_THREADS - 1) / NUM_THREADS;
+    eval_tiles_i<DIMENSION, WARP, SLOTS, T><<<num_blocks, NUM_THREADS,
+                                              0, stream>>>(
+        ctx.impl->scratch->tape_data.get(),
+        ctx.impl->tape_index.get(),
+        ctx.tape_capacity(),
+        ctx.impl->tape_overflows.get(),
+        ctx.contiguous_subtapes,
+        subtape_table(ctx),
+        ctx.impl->subtape_table_size,
+        image,
+        ctx.image_size_px / tile_size_px,
+
+        ctx.stages[i].tiles.get(),
+        ctx.impl->tile_counts.get() + i,
+
+        reinterpret_cast<Interval*>(ctx.impl->scratch->values.get()));
+}
+
+template <int DIMENSION>
+static void launch_eval_tiles(Context& ctx, unsigned i, unsigned tile_size_px,
+                              unsigned count, int32_t slots,
+                              cudaStream_t stream, bool volume=false)
+{
+    int32_t* const image = volume ? nullptr : ctx.stages[i].filled.get();
+
+    // Tiles get a whole warp each when there are too few to fill the GPU.
+    // Otherwise, stages in `affine_stages` use affine arithmetic.
+    if (count < (unsigned)std::max(ctx.warp_tiles, 0)) {
+#define LAUNCH(S) launch_eval_tiles<DIMENSION, true, S>(ctx, i, tile_size_px, \
+                                                        count, image, stream)
+        DISPATCH_SLOTS(slots, LAUNCH)
+#undef LAUNCH
+    } else if (ctx.affine_stages & (1 << i)) {
+#define LAUNCH(S) launch_eval_tiles<DIMENSION, false, S, Affine>(           \
+                        ctx, i, tile_size_px, count, image, stream)
+        DISPATCH_SLOTS(slots, LAUNCH)
+#undef LAUNCH
+    } else {
+#define LAUNCH(S) launch_eval_tiles<DIMENSION, false, S>(ctx, i, tile_size_px, \
+                                                         count, image, stream)
+        DISPATCH_SLOTS(slots, LAUNCH)
+#undef LAUNCH
+    }
+}
+
+/*
+ *  Launches the runtime-compiled evaluator for `tape` over the first stage's
+ *  tiles, which must all use the tape at the start of `tape_data`.  Returns
+ *  false (without launching anything) if there's no compiled kernel, in
+ *  which case the caller should use the interpreter.  Compiled kernels only
+ *  use intervals, so this also returns false if the first stage is in
+ *  `affine_stages`.
+ */
+template <int DIMENSION>
+static bool launch_jit_tiles(Context& ctx, const Tape& tape,
+                             unsigned num_blocks, cudaStream_t stream)
+{
+    if (ctx.affine_stages & 1) {
+        return false;
+    }
+    const CUfunction f = jitEvalTiles(tape, DIMENSION);
+    if (!f) {
+        return false;
+    }
+    uint64_t* tape_data = ctx.impl->scratch->tape_data.get();
+    int32_t* tape_index = ctx.impl->tape_index.get();
+    int32_t tape_capacity = ctx.tape_capacity();
+    int32_t* tape_overflows = ctx.impl->tape_overflows.get();
+    bool contiguous = ctx.contiguous_subtapes;
+    SubtapeEntry* table = subtape_table(ctx);
+    int32_t table_size = ctx.impl->subtape_table_size;
+    int32_t* image = ctx.stages[0].filled.get();
+    uint32_t tiles_per_side = ctx.image_size_px / 64;
+    TileNode* in_tiles = ctx.stages[0].tiles.get();
+    int32_t* in_tile_count = ctx.impl->tile_counts.get();
+    Interval* values =
+        reinterpret_cast<Interval*>(ctx.impl->scratch->values.get());
+    void* args[] = {&tape_data, &tape_index, &tape_capacity, &tape_overflows,
+                    &contiguous, &table, &table_size, &image, &tiles_per_side,
+                    &in_tiles, &in_tile_count, &values};
+    if (cuLaunchKernel(f, num_blocks, 1, 1, NUM_THREADS, 1, 1, 0, stream,
+                       args, nullptr) != CUDA_SUCCESS)
+    {
+        fprintf(stderr, "Could not launch compiled tape\n");
+        exit(1);
+    }
+    return true;
+}
+
+/*
+ *  Launches normal evaluation over every pixel of `num_shapes` images.
+ */
+template <int SLOTS>
+static void launch_eval_pixels(const Context& ctx, int32_t num_shapes,
+                               cudaStream_t stream)
+{
+    const uint32_t u = ((ctx.image_size_px + 15) / 16);
+    eval_pixels_d<SLOTS><<<dim3(u, u, num_shapes), dim3(16, 16), 0, stream>>>(
+            ctx.impl->scratch->tape_data.get(),
+            ctx.stages[3].filled.get(),
+            ctx.normals.get(),
+            ctx.image_size_px,
+            ctx.impl->mat_buffer.get(),
+            ctx.stages[0].tiles.get(),
+            ctx.stages[1].tiles.get(),
+            ctx.stages[2].tiles.get());
+}
+
+static void launch_eval_pixels(const Context& ctx, int32_t num_shapes,
+                               int32_t slots, cudaStream_t stream)
+{
+#define LAUNCH(S) launch_eval_pixels<S>(ctx, num_shapes, stream)
+    DISPATCH_SLOTS(slots, LAUNCH)
+#undef LAUNCH
+}
+
+/*
+ *  Launches per-voxel evaluation over the last stage's tiles, selecting the
+ *  shared-memory tape cache if `voxel_cache_clauses` is set.  In volume
+ *  mode, filled voxels are written to `masks` (see eval_voxels_f).
+ */
+template <unsigned DIMENSION, int SLOTS>
+static void launch_eval_voxels(const Context& ctx, unsigned num_blocks,
+                               cudaStream_t stream, uint64_t* masks)
+{
+    const uint32_t tiles_per_side =
+        ctx.image_size_px / (DIMENSION == 3 ? 4 : 8);
+    const int32_t k = ctx.voxel_cache_clauses;
+    if (k) {
+        eval_voxels_f<DIMENSION, true, SLOTS><<<num_blocks, NUM_TILES * 32,
+                                                NUM_TILES * k * sizeof(uint64_t),
+                                                stream>>>(
+            ctx.impl->scratch->tape_data.get(),
+            ctx.stages[3].filled.get(),
+            tiles_per_side,
+
+            ctx.stages[3].tiles.get(),
+            ctx.impl->tile_counts.get() + 3,
+
+            reinterpret_cast<float2*>(ctx.impl->scratch->values.get()),
+            ctx.tape_capacity(), k, masks);
+    } else {
+        eval_voxels_f<DIMENSION, false, SLOTS><<<num_blocks, NUM_TILES * 32,
+                                                 0, stream>>>(
+            ctx.impl->scratch->tape_data.get(),
+            ctx.stages[3].filled.get(),
+            tiles_per_side,
+
+            ctx.stages[3].tiles.get(),
+            ctx.impl->tile_counts.get() + 3,
+
+            reinterpret_cast<float2*>(ctx.impl->scratch->values.get()),
+            ctx.tape_capacity(), 0, masks);
+    }
+}
+
+template <unsigned DIMENSION>
+static void launch_eval_voxels(const Context& ctx, unsigned num_blocks,
+                               int32_t slots, cudaStream_t stream,
+                               uint64_t* masks=nullptr)
+{
+#define LAUNCH(S) launch_eval_voxels<DIMENSION, S>(ctx, num_blocks, stream, \
+                                                   masks)
+    DISPATCH_SLOTS(slots, LAUNCH)
+#undef LAUNCH
+}
+
+/*
+ *  Launches interval evaluation over evalPoints' clusters of points, which
+ *  pushes a shortened tape for each of them (see calculate_point_blocks).
+ */
+template <int SLOTS>
+static void launch_eval_point_blocks(Context& ctx, int32_t count,
+                                     cudaStream_t stream)
+{
+    eval_tiles_i<0, false, SLOTS><<<(count + NUM_THREADS - 1) / NUM_THREADS,
+                                    NUM_THREADS, 0, stream>>>(
+        ctx.impl->scratch->tape_data.get(),
+        ctx.impl->tape_index.get(),
+        ctx.tape_capacity(),
+        ctx.impl->tape_overflows.get(),
+        ctx.contiguous_subtapes,
+        nullptr, 0,
+        nullptr, 0,
+
+        ctx.impl->point_blocks.get(),
+        ctx.impl->point_block_count.get(),
+
+        reinterpret_cast<Interval*>(ctx.impl->scratch->values.get()));
+}
+
+/*
+ *  Launches per-point evaluation, with gradients if `grad` isn't null.
+ */
+template <int SLOTS>
+static void launch_eval_points(const Context& ctx, const TileNode* blocks,
+                               const float3* pts, int32_t n,
+                               float* out, float3* grad, cudaStream_t stream)
+{
+    const unsigned num_blocks = (n + NUM_THREADS - 1) / NUM_THREADS;
+    if (grad) {
+        eval_points_d<SLOTS><<<num_blocks, NUM_THREADS, 0, stream>>>(
+            ctx.impl->scratch->tape_data.get(), blocks, ctx.point_block_size,
+            pts, n, out, grad);
+    } else {
+        eval_points_f<SLOTS><<<num_blocks, NUM_THREADS, 0, stream>>>(
+            ctx.impl->scratch->tape_data.get(), blocks, ctx.point_block_size,
+            pts, n, out);
+    }
+}
+
+/*
+ *  Launches meshing of the ambiguous 4^3 tiles left by build_volume_tiles,
+ *  into the context's mesh buffers.
+ */
+template <int SLOTS>
+static void launch_mesh_tiles(const Context& ctx, unsigned count,
+                              cudaStream_t stream)
+{
+    mesh_tiles<SLOTS><<<(count + NUM_TILES - 1) / NUM_TILES, NUM_TILES * 32,
+                        0, stream>>>(
+        ctx.impl->scratch->tape_data.get(),
+        ctx.stages[3].tiles.get(),
+        ctx.impl->tile_counts.get() + 3,
+        ctx.image_size_px / 4,
+        ctx.impl->mat_buffer.get(),
+
+        ctx.impl->mesh_counts.get(),
+        ctx.mesh_vertices.get(),
+        ctx.mesh_normals.get(),
+        std::min<size_t>(ctx.impl->mesh_vertices_size, INT32_MAX),
+        ctx.mesh_indices.get(),
+        std::min<size_t>(ctx.impl->mesh_indices_size / 3, INT32_MAX));
+}
+
+bool Context::overflowed() const {
+    if (backend == BACKEND_CPU) {
+        return false;
+    }
+    for (unsigned i=1; i < 4; ++i) {
+        if (impl->tile_counts_host[i] > block_capacity(stages[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*  Returns the key for the tile cache when rendering `tape`, which changes
+ *  whenever cached results could be wrong (a different tape or parameters,
+ *  or a new subtape pool which doesn't hold the cached subtapes). */
+static uint64_t tile_cache_key(const Context& ctx, const Tape& tape) {
+    uint64_t key = tape.hash ^ (uint64_t(ctx.tape_capacity()) << 32);
+    key ^= reinterpret_cast<uintptr_t>(ctx.impl->scratch->tape_data.get()) *
+           0x9e3779b97f4a7c15ULL;
+    key ^= uint64_t(tape.length) * 0xff51afd7ed558ccdULL;
+    key ^= parameter_generation * 0xc4ceb9fe1a85ec53ULL;
+    return key ? key : 1;   // 0 marks an empty cache
+}
+
+/*  Returns the range of tiles of `tile_size_px` pixels which overlap the
+ *  viewport (see Context::viewport_width), as [x, y) to [z, w), counting
+ *  partial tiles. */
+static int4 viewport_tiles(const Context& ctx, int32_t tile_size_px) {
+    const int32_t n = ctx.image_size_px;
+    const int32_t x0 = std::min(std::max(ctx.viewport_x, 0), n);
+    const int32_t y0 = std::min(std::max(ctx.viewport_y, 0), n);
+    const int32_t x1 = ctx.viewport_width > 0
+        ? std::min(x0 + ctx.viewport_width, n) : n;
+    const int32_t y1 = ctx.viewport_height > 0
+        ? std::min(y0 + ctx.viewport_height, n) : n;
+    return make_int4(x0 / tile_size_px, y0 / tile_size_px,
+                     (x1 + tile_size_px - 1) / tile_size_px,
+                     (y1 + tile_size_px - 1) / tile_size_px);
+}
+
+/*  Renders one frame with the CPU backend (see Context::backend) into the
+ *  context's host images.  `mat3` is used for 3D frames and `mat2` (at `z`)
+ *  for 2D frames.  This doesn't make any CUDA calls. */
+static void render_cpu(Context& ctx, const Tape& tape,
+                       const Eigen::Matrix4f* mat3,
+                       const Eigen::Matrix3f* mat2, const float z)
+{
+    if (mat3) {
+        reserve_normals(ctx);
+    }
+    reserve_compact(ctx);
+
+    CpuFrame frame;
+    frame.tape = tape.clauses.data();
+    frame.image_size_px = ctx.image_size_px;
+    for (unsigned i=0; i < 4; ++i) {
+        frame.filled[i] = ctx.stages[i].filled.get();
+    }
+    frame.normals = (mat3 && (ctx.render_flags & RENDER_NORMALS))
+        ? ctx.normals.get() : nullptr;
+    const int4 v = viewport_tiles(ctx, 1);
+    frame.viewport[0] = v.x;
+    frame.viewport[1] = v.y;
+    frame.viewport[2] = v.z;
+    frame.viewport[3] = v.w;
+    frame.partition_index = ctx.partition_index;
+    frame.partition_count = ctx.partition_count;
+    frame.pool = &ctx.impl->cpu_pool;
+    frame.threads = ctx.cpu_threads;
+    frame.stats = ctx.collect_stats ? &ctx.impl->cpu_stats : nullptr;
+
+    NVTX_PUSH(mat3 ? "renderCpu3D" : "renderCpu2D");
+    if (mat3) {
+        renderCpu3D(frame, *mat3);
+    } else {
+        renderCpu2D(frame, *mat2, z);
+    }
+
+    // Pack the compact image on the host, as the GPU's pack kernels would
+    const size_t pixels = size_t(ctx.image_size_px) * ctx.image_size_px;
+    const int32_t* image = ctx.stages[3].filled.get();
+    if (ctx.compact_images && mat2) {
+        for (size_t i=0; i < pixels / 32; ++i) {
+            uint32_t word = 0;
+            for (unsigned j=0; j < 32; ++j) {
+                word |= uint32_t(image[i * 32 + j] != 0) << j;
+            }
+            ctx.occupancy[i] = word;
+        }
+    } else if (ctx.compact_images && mat3 && ctx.depth16) {
+        for (size_t i=0; i < pixels; ++i) {
+            ctx.depth16[i] = image[i];
+        }
+    }
+    NVTX_POP();
+}
+
+/*  Empties the tile cache (if there is one).  This must be called by every
+ *  render which doesn't use the cache, since it overwrites the subtape pool
+ *  that cached tiles point into. */
+static void drop_tile_cache(Context& ctx, cudaStream_t stream) {
+    if (ctx.impl->tile_cache_state) {
+        CUDA_CHECK(cudaMemsetAsync(ctx.impl->tile_cache_state.get(), 0,
+                                   sizeof(TileCacheState), stream));
+    }
+}
+
+/*  Reuses cached first-stage results (in incremental mode), and starts the
+ *  tape index past the cached subtapes.  Returns false if the cache isn't
+ *  used for this frame, which is the case for batches of shapes (or when the
+ *  first stage is skipped). */
+static bool use_tile_cache(Context& ctx, const Tape& tape, int32_t num_shapes,
+                           unsigned count, cudaStream_t stream)
+{
+    if (!ctx.incremental || num_shapes != 1 || (ctx.skip_stages & 1) ||
+        ctx.impl->scratch.use_count() > 1)
+    {
+        drop_tile_cache(ctx, stream);
+        return false;
+    }
+    if (!ctx.impl->tile_cache_state) {
+        ctx.impl->tile_cache_state.reset(alloc<TileCacheState>(ctx, 1));
+        CUDA_CHECK(cudaMemsetAsync(ctx.impl->tile_cache_state.get(), 0,
+                                   sizeof(TileCacheState), stream));
+    }
+    if (ctx.impl->tile_cache_size < count) {
+        // A new cache must not be trusted, so its state is cleared on the GPU
+        reserve_scratch<CachedTile>(ctx, ctx.impl->tile_cache,
+                                    ctx.impl->tile_cache_size, count);
+        drop_tile_cache(ctx, stream);
+    }
+    auto state = reinterpret_cast<TileCacheState*>(
+            ctx.impl->tile_cache_state.get());
+    CUDA_CHECK(cudaMemsetAsync(&state->hits, 0, sizeof(int32_t), stream));
+
+    const unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
+    reuse_tile_cache<<<num_blocks, NUM_THREADS, 0, stream>>>(
+        ctx.stages[0].tiles.get(), count, ctx.image_size_px / 64,
+        ctx.impl->mat_buffer.get(),
+        reinterpret_cast<Interval*>(ctx.impl->scratch->values.get()),
+        reinterpret_cast<CachedTile*>(ctx.impl->tile_cache.get()), state,
+        tile_cache_key(ctx, tape), ctx.stages[0].filled.get(),
+        ctx.impl->tape_index.get(), tape.length, ctx.tape_capacity());
+    return true;
+}
+
+/*  Stores the results of first-stage tiles which missed the cache */
+static void store_tile_cache(Context& ctx, const Tape& tape, unsigned count,
+                              cudaStream_t stream)
+{
+    const unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
+    update_tile_cache<<<num_blocks, NUM_THREADS, 0, stream>>>(
+        ctx.stages[0].tiles.get(), count, ctx.image_size_px / 64,
+        reinterpret_cast<CachedTile*>(ctx.impl->tile_cache.get()),
+        reinterpret_cast<TileCacheState*>(ctx.impl->tile_cache_state.get()),
+        tile_cache_key(ctx, tape), ctx.stages[0].filled.get(),
+        ctx.impl->tape_index.get());
+}
+
+/*
+ *  Lists every buffer that a captured graph refers to, which is compared
+ *  against the list from capture time to decide whether to capture again.
+ */
+static std::vector<const void*> graph_inputs(const Context& ctx) {
+    std::vector<const void*> out;
+    for (unsigned i=0; i < 4; ++i) {
+        out.push_back(ctx.stages[i].tiles.get());
+        out.push_back(ctx.stages[i].filled.get());
+    }
+    out.push_back(ctx.impl->scratch->values.get());
+    out.push_back(ctx.impl->subtape_table.get());
+    out.push_back(ctx.impl->tile_cache.get());
+    out.push_back(ctx.impl->tile_cache_state.get());
+    out.push_back(ctx.normals.get());
+    out.push_back(ctx.depth16.get());
+    out.push_back(ctx.impl->scratch->tape_data.get());
+    out.push_back(ctx.impl->mat_buffer.get());
+    return out;
+}
+
 void Context::render2D(const Tape& tape, const Eigen::Matrix3f& mat, const float z) {
-    // Reset the tape index and copy the tape to the beginning of the
-    // context's tape buffer area.
-    *tape_index = tape.length;
-    cudaMemcpyAsync(tape_data.get(), tape.data.get(),
-                    sizeof(uint64_t) * tape.length,
-                    cudaMemcpyDeviceToDevice);
+    if (backend == BACKEND_CPU) {
+        render_cpu(*this, tape, nullptr, &mat, z);
+        return;
+    }
+    do {
+        render2DAsync(tape, mat, z, 0);
+        CUDA_CHECK(cudaDeviceSynchronize());
+    } while (device_sizing && overflowed());
+}
+
+cudaEvent_t Context::render2DAsync(const Tape& tape, const Eigen::Matrix3f& mat,
+                                   const float z, cudaStream_t stream)
+{
+    if (backend == BACKEND_CPU) {
+        render_cpu(*this, tape, nullptr, &mat, z);
+        return nullptr;
+    }
+    release_retired(*this);
+    reserve_subtapes(*this);
+    reserve_compact(*this);
+
+    if (device_sizing) {
+        reserve_stages(*this, TILE_SIZES_2D);
+    }
+
+    NVTX_PUSH("render2D");
+    NVTX_PUSH("setup");
+    record_stats(*this, STATS_BEGIN, stream);
+
+    // Copy the tape to the beginning of the context's tape buffer area.
+    // The tape index is reset to the end of this tape by preload_tiles.
+    CUDA_CHECK(cudaMemcpyAsync(impl->scratch->tape_data.get(), tape.data.get(),
+                               sizeof(uint64_t) * tape.length,
+                               cudaMemcpyDeviceToDevice, stream));
 
     // Reset all of the data arrays.  In 2D, we only use stages 0, 2, and 3
     // for 64^2, 8^2, and per-voxel evaluation steps.
     CUDA_CHECK(cudaMemsetAsync(stages[0].filled.get(), 0, sizeof(int32_t) *
-                               pow(image_size_px / 64, 2)));
+                               pow(image_size_px / 64, 2), stream));
     CUDA_CHECK(cudaMemsetAsync(stages[2].filled.get(), 0, sizeof(int32_t) *
-                               pow(image_size_px / 8, 2)));
+                               pow(image_size_px / 8, 2), stream));
     CUDA_CHECK(cudaMemsetAsync(stages[3].filled.get(), 0, sizeof(int32_t) *
-                               pow(image_size_px, 2)));
+                               pow(image_size_px, 2), stream));
+    CUDA_CHECK(cudaMemsetAsync(impl->tile_counts.get(), 0, sizeof(int32_t) * 4,
+                               stream));
+    reset_subtape_table(*this, stream);
+    drop_tile_cache(*this, stream);
 
     ////////////////////////////////////////////////////////////////////////////
     // Evaluation of 64x64 tiles
@@ -1156,251 +2897,884 @@ void Context::render2D(const Tape& tape, const Eigen::Matrix3f& mat, const float
 
     // Go the whole list of first-stage tiles, assigning each to
     // be [position, tape = 0, next = -1]
+    //
+    // Throughout this function, `count` is the number of tiles covered by
+    // each launch.  This is the exact number of tiles when the host sizes
+    // each stage, or the stage's buffer size in device-sizing mode (where
+    // the kernels check against the real count in `tile_counts`).
     unsigned count = pow(image_size_px / 64, 2);
     unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
-    preload_tiles<<<num_blocks, NUM_THREADS>>>(stages[0].tiles.get(), count);
+    preload_tiles<<<num_blocks, NUM_THREADS, 0, stream>>>(
+        stages[0].tiles.get(), count, impl->tile_counts.get(),
+        impl->tape_index.get(), tape.length, impl->tape_overflows.get(),
+        image_size_px / 64, partition_index, partition_count,
+        viewport_tiles(*this, 64), nullptr);
+    record_stats(*this, STATS_SETUP, stream);
+    NVTX_POP();
+
+    // Every kernel in this frame uses the same slot array size
+    const int32_t slots = slot_tier(*this, tape.num_slots);
 
     // Iterate over 64^2, 8^2 tiles
     for (unsigned i=0; i < 3; i += 2) {
         const unsigned tile_size_px = i ? 8 : 64;
         const unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
+        begin_stage_stats(*this, i, stream);
 
-        if (values_size < num_blocks * NUM_THREADS * 3) {
-            values.reset(CUDA_MALLOC(Interval, num_blocks * NUM_THREADS * 3));
-            values_size = num_blocks * NUM_THREADS * 3;
+        // As in 3D, stages in `skip_stages` only subdivide their tiles
+        if (!(skip_stages & (1 << i))) {
+            reserve_values<Interval>(*this, num_blocks * NUM_THREADS * 3);
+
+            // Unpack position values into interval X/Y/Z in the values array
+            // This is done in a separate kernel to avoid bloating the
+            // eval_tiles_i kernel with more registers, which is detrimental
+            // to occupancy.
+            calculate_intervals_2d<<<num_blocks, NUM_THREADS, 0, stream>>>(
+                stages[i].tiles.get(),
+                impl->tile_counts.get() + i,
+                image_size_px / tile_size_px,
+                mat, z, z,
+                reinterpret_cast<Interval*>(impl->scratch->values.get()));
+
+            // Do the actual tape evaluation, which is the expensive step.
+            // The first stage only uses the root tape, so it may be compiled.
+            if (i || !jit ||
+                !launch_jit_tiles<2>(*this, tape, num_blocks, stream))
+            {
+                launch_eval_tiles<2>(*this, i, tile_size_px, count, slots,
+                                      stream);
+            }
         }
+        record_stats(*this, STATS_STAGE + i * 3 + 1, stream);
 
-        // Unpack position values into interval X/Y/Z in the values array
-        // This is done in a separate kernel to avoid bloating the
-        // eval_tiles_i kernel with more registers, which is detrimental
-        // to occupancy.
-        calculate_intervals_2d<<<num_blocks, NUM_THREADS>>>(
+        // Count up active tiles, to figure out how much memory needs to be
+        // allocated in the next stage.
+        //
+        // In device-sizing mode, the next stage's buffer is already
+        // allocated, and later kernels are launched over all of it (rounded
+        // down to whole blocks, in case the host-sized path allocated it).
+        const int next = i ? 3 : 2;
+        const int32_t capacity = device_sizing
+            ? block_capacity(stages[next]) : INT32_MAX;
+        assign_next_nodes<<<num_blocks, NUM_THREADS, 0, stream>>>(
             stages[i].tiles.get(),
-            count,
-            image_size_px / tile_size_px,
-            mat, z,
-            reinterpret_cast<Interval*>(values.get()));
+            impl->tile_counts.get() + i,
+            impl->tile_counts.get() + next,
+            i ? 1 : 64,
+            capacity);
 
-        // Do the actual tape evaluation, which is the expensive step
-        eval_tiles_i<2><<<num_blocks, NUM_THREADS>>>(
-            tape_data.get(),
-            tape_index.get(),
-            stages[i].filled.get(),
-            image_size_px / tile_size_px,
+        if (device_sizing) {
+            count = capacity;
+        } else {
+            // Read back the number of tiles in the next stage, which have
+            // been accumulated through repeated calls to assign_next_nodes.
+            // This is the only point where the host waits on the stream,
+            // since it needs the count to size the next stage's buffers.
+            CUDA_CHECK(cudaMemcpyAsync(&impl->tile_counts_host[next],
+                                       impl->tile_counts.get() + next,
+                                       sizeof(int32_t),
+                                       cudaMemcpyDeviceToHost, stream));
+            CUDA_CHECK(cudaStreamSynchronize(stream));
+            count = impl->tile_counts_host[next];
+
+            // Make sure that the subtiles buffer has enough room
+            // This wastes a small amount of data for the per-pixel
+            // evaluation, where the `next` indexes aren't used, but it's
+            // relatively small.
+            reserve_scratch<TileNode>(*this, stages[next].tiles,
+                                      stages[next].tile_array_size, count);
+        }
 
-            stages[i].tiles.get(),
-            count,
+        if (i < 2) {
+            // Build the new tile list from active tiles in the previous list
+            subdivide_active_tiles_2d<<<num_blocks*64, NUM_THREADS,
+                                        0, stream>>>(
+                stages[i].tiles.get(),
+                impl->tile_counts.get() + i,
+                image_size_px / tile_size_px,
+                viewport_tiles(*this, tile_size_px / 8),
+                stages[next].tiles.get());
+        } else {
+            // Special case for per-pixel evaluation, which
+            // doesn't unpack every single pixel (since that would take up
+            // 64x extra space).
+            copy_active_tiles<<<num_blocks, NUM_THREADS, 0, stream>>>(
+                stages[i].tiles.get(),
+                impl->tile_counts.get() + i,
+                stages[next].tiles.get());
+        }
+
+        {   // Copy filled tiles into the next level's image (expanding them
+            // by 64x).  This is cleaner that accumulating all of the levels
+            // in a single pass, and could (possibly?) help with skipping
+            // fully occluded tiles.
+            const unsigned next_tile_size = tile_size_px / 8;
+            const uint32_t u = ((image_size_px / next_tile_size) / 32);
+            copy_filled_2d<<<dim3(u + 1, u + 1), dim3(32, 32), 0, stream>>>(
+                    stages[i].filled.get(),
+                    stages[next].filled.get(),
+                    image_size_px / next_tile_size);
+        }
+        end_stage_stats(*this, i, stream);
+
+        // Stage 1 isn't used in 2D, so its events all mark the same time
+        if (i == 0) {
+            for (unsigned j=0; j < 3; ++j) {
+                record_stats(*this, STATS_STAGE + 3 + j, stream);
+            }
+        }
+    }
+
+    // Time to render individual pixels!
+    begin_stage_stats(*this, 3, stream);
+    num_blocks = (count + NUM_TILES - 1) / NUM_TILES;
+    const size_t num_values = num_blocks * NUM_TILES * 32 * 3;
+    reserve_values<float2>(*this, num_values);
+    calculate_pixels<<<num_blocks, NUM_TILES * 32, 0, stream>>>(
+        stages[3].tiles.get(),
+        impl->tile_counts.get() + 3,
+        image_size_px / 8,
+        mat, z,
+        reinterpret_cast<float2*>(impl->scratch->values.get()));
+    launch_eval_voxels<2>(*this, num_blocks, slots, stream);
+
+    // There are no normals in 2D, so that part of the stage only packs the
+    // compact image (if requested)
+    record_stats(*this, STATS_STAGE + 3 * 3 + 1, stream);
+    if (compact_images) {
+        const int32_t pixels = pow(image_size_px, 2);
+        pack_occupancy<<<(pixels + NUM_THREADS - 1) / NUM_THREADS,
+                         NUM_THREADS, 0, stream>>>(
+            stages[3].filled.get(), occupancy.get(), pixels);
+    }
+    end_stage_stats(*this, 3, stream);
+    read_stats(*this, stream);
+
+    // In device-sizing mode, read back every stage's tile count, which is
+    // used to grow the stage buffers before the next frame.
+    if (device_sizing) {
+        CUDA_CHECK(cudaMemcpyAsync(impl->tile_counts_host.get(),
+                                   impl->tile_counts.get(), sizeof(int32_t) * 4,
+                                   cudaMemcpyDeviceToHost, stream));
+    }
+
+    // Read back the number of failed subtape pushes, which is used to grow
+    // the subtape pool before the next frame.
+    CUDA_CHECK(cudaMemcpyAsync(impl->tape_overflows_host.get(),
+                               impl->tape_overflows.get(), sizeof(int32_t),
+                               cudaMemcpyDeviceToHost, stream));
+    CUDA_CHECK(cudaEventRecord(impl->frame_done.get(), stream));
+    NVTX_POP();
+    return impl->frame_done.get();
+}
+
+void Context::render2DSlices(const Tape& tape, const Eigen::Matrix3f& mat,
+                             const float* zs, int32_t n)
+{
+    require_cuda(*this, "render2DSlices");
+    release_retired(*this);
+    reserve_subtapes(*this);
+    if (!impl->slice_state) {
+        impl->slice_state.reset(alloc<int32_t>(*this, 4));
+    }
+
+    // Every stage after the first holds at most one layer of tiles at a
+    // time, which the stage buffers always have room for, so the stages
+    // run with device-side counts and the host never waits on a layer.
+    reserve_stages(*this, TILE_SIZES_2D);
+    const size_t words = pow(image_size_px, 2) / 32;
+    reserve_scratch<uint32_t>(*this, slice_bits, impl->slice_bits_size,
+                              words * n);
+
+    CUDA_CHECK(cudaMemcpyAsync(impl->scratch->tape_data.get(), tape.data.get(),
+                               sizeof(uint64_t) * tape.length,
+                               cudaMemcpyDeviceToDevice));
+    drop_tile_cache(*this, 0);
+    const int32_t slots = slot_tier(*this, tape.num_slots);
+    const int32_t capacity[4] = {0, 0, block_capacity(stages[2]),
+                                 block_capacity(stages[3])};
+    const int32_t group = std::max(slice_group, 1);
+
+    for (int32_t g=0; g < n; g += group) {
+        const int32_t end = std::min(n, g + group);
+        float z_lower = zs[g];
+        float z_upper = zs[g];
+        for (int32_t k=g + 1; k < end; ++k) {
+            z_lower = std::min(z_lower, zs[k]);
+            z_upper = std::max(z_upper, zs[k]);
+        }
+
+        // Evaluate the 64^2 tiles once for the whole group of layers, over
+        // its full range of Z values.  The first group clears the subtape
+        // pool's overflow counters, and later groups point preload_tiles at
+        // spare counters instead, so that failed pushes add up over the
+        // whole stack.
+        CUDA_CHECK(cudaMemsetAsync(stages[0].filled.get(), 0, sizeof(int32_t) *
+                                   pow(image_size_px / 64, 2)));
+        CUDA_CHECK(cudaMemsetAsync(impl->tile_counts.get(), 0,
+                                   sizeof(int32_t) * 4));
+        reset_subtape_table(*this, 0);
+        unsigned count = pow(image_size_px / 64, 2);
+        unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
+        preload_tiles<<<num_blocks, NUM_THREADS>>>(
+            stages[0].tiles.get(), count, impl->tile_counts.get(),
+            impl->tape_index.get(), tape.length,
+            g ? impl->slice_state.get() + 1 : impl->tape_overflows.get(),
+            image_size_px / 64, partition_index, partition_count,
+            viewport_tiles(*this, 64), nullptr);
+        if (!(skip_stages & 1)) {
+            reserve_values<Interval>(*this, num_blocks * NUM_THREADS * 3);
+            calculate_intervals_2d<<<num_blocks, NUM_THREADS>>>(
+                stages[0].tiles.get(),
+                impl->tile_counts.get(),
+                image_size_px / 64,
+                mat, z_lower, z_upper,
+                reinterpret_cast<Interval*>(impl->scratch->values.get()));
+            if (!jit || !launch_jit_tiles<2>(*this, tape, num_blocks, 0)) {
+                launch_eval_tiles<2>(*this, 0, 64, count, slots, 0);
+            }
+        }
+        assign_next_nodes<<<num_blocks, NUM_THREADS>>>(
+            stages[0].tiles.get(),
+            impl->tile_counts.get(),
+            impl->tile_counts.get() + 2,
+            64,
+            capacity[2]);
+
+        // Each layer pushes its subtapes after the group's, and then
+        // rewinds the pool back to this point for the next layer
+        CUDA_CHECK(cudaMemcpyAsync(impl->slice_state.get(),
+                                   impl->tape_index.get(), sizeof(int32_t),
+                                   cudaMemcpyDeviceToDevice));
+
+        for (int32_t k=g; k < end; ++k) {
+            if (k > g) {
+                CUDA_CHECK(cudaMemcpyAsync(impl->tape_index.get(),
+                                           impl->slice_state.get(),
+                                           sizeof(int32_t),
+                                           cudaMemcpyDeviceToDevice));
+                reset_subtape_table(*this, 0);
+            }
+            CUDA_CHECK(cudaMemsetAsync(impl->tile_counts.get() + 3, 0,
+                                       sizeof(int32_t)));
+            CUDA_CHECK(cudaMemsetAsync(stages[2].filled.get(), 0,
+                                       sizeof(int32_t) *
+                                       pow(image_size_px / 8, 2)));
+            CUDA_CHECK(cudaMemsetAsync(stages[3].filled.get(), 0,
+                                       sizeof(int32_t) *
+                                       pow(image_size_px, 2)));
+
+            // Rebuild the layer's 8^2 tiles from the shared first stage,
+            // which also restores their tapes to the group's subtapes
+            num_blocks = (pow(image_size_px / 64, 2) + NUM_THREADS - 1) /
+                         NUM_THREADS;
+            subdivide_active_tiles_2d<<<num_blocks*64, NUM_THREADS>>>(
+                stages[0].tiles.get(),
+                impl->tile_counts.get(),
+                image_size_px / 64,
+                viewport_tiles(*this, 8),
+                stages[2].tiles.get());
+            {
+                const uint32_t u = ((image_size_px / 8) / 32);
+                copy_filled_2d<<<dim3(u + 1, u + 1), dim3(32, 32)>>>(
+                        stages[0].filled.get(),
+                        stages[2].filled.get(),
+                        image_size_px / 8);
+            }
+
+            count = capacity[2];
+            num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
+            if (!(skip_stages & 4)) {
+                reserve_values<Interval>(*this, num_blocks * NUM_THREADS * 3);
+                calculate_intervals_2d<<<num_blocks, NUM_THREADS>>>(
+                    stages[2].tiles.get(),
+                    impl->tile_counts.get() + 2,
+                    image_size_px / 8,
+                    mat, zs[k], zs[k],
+                    reinterpret_cast<Interval*>(impl->scratch->values.get()));
+                launch_eval_tiles<2>(*this, 2, 8, count, slots, 0);
+            }
+            assign_next_nodes<<<num_blocks, NUM_THREADS>>>(
+                stages[2].tiles.get(),
+                impl->tile_counts.get() + 2,
+                impl->tile_counts.get() + 3,
+                1,
+                capacity[3]);
+            copy_active_tiles<<<num_blocks, NUM_THREADS>>>(
+                stages[2].tiles.get(),
+                impl->tile_counts.get() + 2,
+                stages[3].tiles.get());
+            {
+                const uint32_t u = (image_size_px / 32);
+                copy_filled_2d<<<dim3(u + 1, u + 1), dim3(32, 32)>>>(
+                        stages[2].filled.get(),
+                        stages[3].filled.get(),
+                        image_size_px);
+            }
+
+            // Then evaluate individual pixels, and pack the layer's image
+            // into its slice of the output
+            count = capacity[3];
+            num_blocks = (count + NUM_TILES - 1) / NUM_TILES;
+            reserve_values<float2>(*this, num_blocks * NUM_TILES * 32 * 3);
+            calculate_pixels<<<num_blocks, NUM_TILES * 32>>>(
+                stages[3].tiles.get(),
+                impl->tile_counts.get() + 3,
+                image_size_px / 8,
+                mat, zs[k],
+                reinterpret_cast<float2*>(impl->scratch->values.get()));
+            launch_eval_voxels<2>(*this, num_blocks, slots, 0);
+
+            const int32_t pixels = pow(image_size_px, 2);
+            pack_occupancy<<<(pixels + NUM_THREADS - 1) / NUM_THREADS,
+                             NUM_THREADS>>>(
+                stages[3].filled.get(), slice_bits.get() + words * k,
+                pixels);
+        }
+    }
+
+    CUDA_CHECK(cudaMemcpyAsync(impl->tape_overflows_host.get(),
+                               impl->tape_overflows.get(), sizeof(int32_t),
+                               cudaMemcpyDeviceToHost));
+    CUDA_CHECK(cudaEventRecord(impl->frame_done.get()));
+    CUDA_CHECK(cudaEventSynchronize(impl->frame_done.get()));
+}
+
+/*  Enqueues every kernel of a 3D frame on `stream`, reading one matrix
+ *  per tape from the matrix buffer.  This is shared by render3DAsync,
+ *  render3DBatch, and graph capture in renderCached.  begin_frame_3d and
+ *  enqueue_stage_3d enqueue the same frame one stage at a time (see
+ *  Frame3D), which is used by beginRender3D. */
+static void enqueue_3d(Context& ctx, const std::vector<const Tape*>& tapes,
+                       cudaStream_t stream);
+static Frame3D begin_frame_3d(Context& ctx,
+                              const std::vector<const Tape*>& tapes,
+                              cudaStream_t stream);
+static void enqueue_stage_3d(Context& ctx, Frame3D& frame,
+                             cudaStream_t stream);
 
-            reinterpret_cast<Interval*>(values.get()));
+void Context::render3D(const Tape& tape, const Eigen::Matrix4f& mat) {
+    if (backend == BACKEND_CPU) {
+        render_cpu(*this, tape, &mat, nullptr, 0.0f);
+        return;
+    }
+    do {
+        render3DAsync(tape, mat, 0);
+        CUDA_CHECK(cudaDeviceSynchronize());
+    } while (device_sizing && overflowed());
+}
 
-        // Mark the total number of active tiles (from this stage) to 0
-        cudaMemsetAsync(num_active_tiles.get(), 0, sizeof(int32_t));
+cudaEvent_t Context::render3DAsync(const Tape& tape, const Eigen::Matrix4f& mat,
+                                   cudaStream_t stream)
+{
+    if (backend == BACKEND_CPU) {
+        render_cpu(*this, tape, &mat, nullptr, 0.0f);
+        return nullptr;
+    }
+    release_retired(*this);
+    reserve_subtapes(*this);
+    reserve_normals(*this);
+    reserve_compact(*this);
+
+    if (device_sizing) {
+        reserve_stages(*this, TILE_SIZES_3D);
+    }
+
+    NVTX_PUSH("render3D");
+    store_matrix<<<1, 1, 0, stream>>>(impl->mat_buffer.get(), mat);
+    enqueue_3d(*this, {&tape}, stream);
+    CUDA_CHECK(cudaEventRecord(impl->frame_done.get(), stream));
+    NVTX_POP();
+    return impl->frame_done.get();
+}
+
+void Context::beginRender3D(const Tape& tape, const Eigen::Matrix4f& mat,
+                            int32_t preview_stage)
+{
+    require_cuda(*this, "beginRender3D");
+    assert(preview_stage >= 0 && preview_stage < 3);
+    release_retired(*this);
+    reserve_subtapes(*this);
+    reserve_normals(*this);
+    reserve_compact(*this);
+
+    if (device_sizing) {
+        reserve_stages(*this, TILE_SIZES_3D);
+    }
+
+    store_matrix<<<1, 1>>>(impl->mat_buffer.get(), mat);
+    impl->progressive = begin_frame_3d(*this, {&tape}, 0);
+    while (impl->progressive.stage <= preview_stage) {
+        enqueue_stage_3d(*this, impl->progressive, 0);
+    }
+    CUDA_CHECK(cudaStreamSynchronize(0));
+}
+
+bool Context::refineRender3D(double budget_ms) {
+    require_cuda(*this, "refineRender3D");
+    using namespace std::chrono;
+    const auto start = high_resolution_clock::now();
+    while (impl->progressive.stage < 4) {
+        enqueue_stage_3d(*this, impl->progressive, 0);
+        CUDA_CHECK(cudaStreamSynchronize(0));
+        if (impl->progressive.stage < 4 &&
+            duration<double, std::milli>(high_resolution_clock::now() -
+                                         start).count() >= budget_ms)
+        {
+            return false;
+        }
+    }
+    CUDA_CHECK(cudaEventRecord(impl->frame_done.get(), 0));
+    return true;
+}
+
+int32_t Context::previewStage() const {
+    return std::min(impl->progressive.stage, 3);
+}
+
+void Context::render3DViews(const Tape& tape, const Views& mats) {
+    require_cuda(*this, "render3DViews");
+    Batch shapes;
+    for (const auto& m : mats) {
+        shapes.push_back(BatchShape(&tape, m));
+    }
+    render3DBatch(shapes);
+}
+
+void Context::render3DTiled(const Tape& tape, const Eigen::Matrix4f& mat,
+                            const int32_t tiles, const TileCallback& callback)
+{
+    require_cuda(*this, "render3DTiled");
+    const size_t pixels = pow(image_size_px, 2);
+    HostPtr<int32_t[]> slab_depth(CUDA_MALLOC_HOST(int32_t, pixels));
+    HostPtr<uint32_t[]> slab_normals(CUDA_MALLOC_HOST(uint32_t, pixels));
+    std::fill(slab_normals.get(), slab_normals.get() + pixels, 0);  // depth-only
+    std::vector<int32_t> depth(pixels);
+    std::vector<uint32_t> norm(pixels);
+
+    // Each sub-frustum is rendered by mapping the usual +/-1 render volume
+    // onto its region of the full-size volume, before applying `mat`.
+    const float scale = 1.0f / tiles;
+    Eigen::Matrix4f sub = Eigen::Matrix4f::Identity();
+    sub(0, 0) = scale;
+    sub(1, 1) = scale;
+    sub(2, 2) = scale;
+
+    for (int32_t ty=0; ty < tiles; ++ty) {
+        for (int32_t tx=0; tx < tiles; ++tx) {
+            std::fill(depth.begin(), depth.end(), 0);
+            std::fill(norm.begin(), norm.end(), 0);
+            size_t remaining = pixels;
+
+            for (int32_t tz=tiles - 1; tz >= 0 && remaining; --tz) {
+                sub(0, 3) = scale * (2 * tx + 1) - 1;
+                sub(1, 3) = scale * (2 * ty + 1) - 1;
+                sub(2, 3) = scale * (2 * tz + 1) - 1;
+                render3D(tape, mat * sub);
+
+                CUDA_CHECK(cudaMemcpy(slab_depth.get(),
+                                      stages[3].filled.get(),
+                                      sizeof(int32_t) * pixels,
+                                      cudaMemcpyDefault));
+                if (render_flags & RENDER_NORMALS) {
+                    CUDA_CHECK(cudaMemcpy(slab_normals.get(), normals.get(),
+                                          sizeof(uint32_t) * pixels,
+                                          cudaMemcpyDefault));
+                }
+
+                // Higher slabs have already been rendered, so we only fill
+                // pixels which are still empty.
+                for (size_t i=0; i < pixels; ++i) {
+                    if (!depth[i] && slab_depth[i]) {
+                        depth[i] = slab_depth[i] + tz * image_size_px;
+                        norm[i] = slab_normals[i];
+                        remaining--;
+                    }
+                }
+            }
+            callback(tx, ty, depth.data(), norm.data());
+        }
+    }
+}
 
-        // Count up active tiles, to figure out how much memory needs to be
-        // allocated in the next stage.
-        assign_next_nodes<<<num_blocks, NUM_THREADS>>>(
-            stages[i].tiles.get(),
-            count,
-            num_active_tiles.get());
+void Context::render3DBatch(const Batch& shapes) {
+    require_cuda(*this, "render3DBatch");
+    const size_t num_shapes = shapes.size();
+    if (num_shapes == 0) {
+        return;
+    }
 
-        // Count the number of active tiles, which have been accumulated
-        // through repeated calls to assign_next_nodes
-        int32_t active_tile_count;
-        cudaMemcpy(&active_tile_count, num_active_tiles.get(), sizeof(int32_t),
-                   cudaMemcpyDeviceToHost);
-        if (i == 0) {
-            active_tile_count *= 64;
+    release_retired(*this);
+    reserve_subtapes(*this);
+    reserve_images(*this, num_shapes);
+    reserve_normals(*this);
+    reserve_compact(*this);
+    if (num_shapes > impl->batch_size) {
+        impl->retired.emplace_back(impl->mat_buffer.release());
+        if (impl->tape_starts) {
+            impl->retired.emplace_back(impl->tape_starts.release());
         }
+        impl->mat_buffer.reset(alloc<Eigen::Matrix4f>(*this, num_shapes));
+        impl->tape_starts.reset(alloc<int32_t>(*this, num_shapes));
+        impl->batch_size = num_shapes;
+    }
 
-        // Make sure that the subtiles buffer has enough room
-        // This wastes a small amount of data for the per-pixel evaluation,
-        // where the `next` indexes aren't used, but it's relatively small.
-        const int next = i ? 3 : 2;
-        if (active_tile_count > stages[next].tile_array_size) {
-            stages[next].tile_array_size = active_tile_count;
-            stages[next].tiles.reset(CUDA_MALLOC(TileNode, active_tile_count));
-        }
+    std::vector<const Tape*> tapes;
+    for (unsigned i=0; i < num_shapes; ++i) {
+        tapes.push_back(shapes[i].first);
+        store_matrix<<<1, 1>>>(impl->mat_buffer.get() + i, shapes[i].second);
+    }
 
-        if (i < 2) {
-            // Build the new tile list from active tiles in the previous list
-            subdivide_active_tiles_2d<<<num_blocks*64, NUM_THREADS>>>(
-                stages[i].tiles.get(),
-                count,
-                image_size_px / tile_size_px,
-                stages[next].tiles.get());
-        } else {
-            // Special case for per-pixel evaluation, which
-            // doesn't unpack every single pixel (since that would take up
-            // 64x extra space).
-            copy_active_tiles<<<num_blocks, NUM_THREADS>>>(
-                stages[i].tiles.get(),
-                count,
-                stages[next].tiles.get());
+    do {
+        if (device_sizing) {
+            reserve_stages(*this, TILE_SIZES_3D, num_shapes);
         }
+        enqueue_3d(*this, tapes, 0);
+        CUDA_CHECK(cudaEventRecord(impl->frame_done.get(), 0));
+        CUDA_CHECK(cudaDeviceSynchronize());
+    } while (device_sizing && overflowed());
+}
 
-        {   // Copy filled tiles into the next level's image (expanding them
-            // by 64x).  This is cleaner that accumulating all of the levels
-            // in a single pass, and could (possibly?) help with skipping
-            // fully occluded tiles.
-            const unsigned next_tile_size = tile_size_px / 8;
-            const uint32_t u = ((image_size_px / next_tile_size) / 32);
-            copy_filled_2d<<<dim3(u + 1, u + 1), dim3(32, 32)>>>(
-                    stages[i].filled.get(),
-                    stages[next].filled.get(),
-                    image_size_px / next_tile_size);
-        }
+void Context::prepare(const Tape& tape) {
+    require_cuda(*this, "prepare");
+    impl->cached_tape = &tape;
+    impl->graph.reset();
 
-        // Assign the next number of tiles to evaluate
-        count = active_tile_count;
+    // Compile the tape now, rather than in the middle of graph capture
+    if (jit) {
+        jitEvalTiles(tape, 3);
     }
+}
 
-    // Time to render individual pixels!
-    num_blocks = (count + NUM_TILES - 1) / NUM_TILES;
-    const size_t num_values = num_blocks * NUM_TILES * 32 * 3;
-    if (values_size < num_values) {
-        values.reset(CUDA_MALLOC(float2, num_values));
-        values_size = num_values;
+cudaEvent_t Context::renderCached(const Eigen::Matrix4f& mat,
+                                  cudaStream_t stream)
+{
+    require_cuda(*this, "renderCached");
+    release_retired(*this);
+    reserve_subtapes(*this);
+    reserve_normals(*this);
+    reserve_compact(*this);
+
+    // The impl->graph can't contain any host synchronization, so it's always
+    // recorded in device-sizing mode.  The caller's setting is restored
+    // afterwards, since it only affects how frames are enqueued.
+    const bool sizing = device_sizing;
+    device_sizing = true;
+    reserve_stages(*this, TILE_SIZES_3D);
+
+    // The graph records buffer addresses, so it must be captured again if
+    // any buffer has been reallocated (by this or any other render call).
+    const bool stale = !impl->graph ||
+                       graph_inputs(*this) != impl->graph_buffers;
+
+    if (stale) {
+        // Make sure that the values array is large enough for every stage,
+        // since nothing can be allocated while the stream is being captured.
+        size_t num_values = round_to_blocks(pow(image_size_px / 64, 3)) * 3;
+        for (unsigned i=1; i < 3; ++i) {
+            num_values = std::max(num_values,
+                                  size_t(block_capacity(stages[i])) * 3);
+        }
+        num_values = std::max(num_values,
+                              size_t(block_capacity(stages[3])) * 32 * 3);
+        reserve_values<Interval>(*this, num_values);
+
+        // The legacy default stream can't be captured, so we use our own
+        if (!impl->capture_stream) {
+            impl->capture_stream = makeStream();
+        }
+        cudaGraph_t g;
+        CUDA_CHECK(cudaStreamBeginCapture(impl->capture_stream.get(),
+                                          cudaStreamCaptureModeThreadLocal));
+        enqueue_3d(*this, {impl->cached_tape}, impl->capture_stream.get());
+        CUDA_CHECK(cudaStreamEndCapture(impl->capture_stream.get(), &g));
+
+        cudaGraphExec_t exec;
+        CUDA_CHECK(cudaGraphInstantiateWithFlags(&exec, g, 0));
+        CUDA_CHECK(cudaGraphDestroy(g));
+        impl->graph.reset(exec);
+        impl->graph_buffers = graph_inputs(*this);
     }
-    calculate_pixels<<<num_blocks, NUM_TILES * 32>>>(
-        stages[3].tiles.get(),
-        count,
-        image_size_px / 8,
-        mat, z,
-        reinterpret_cast<float2*>(values.get()));
-    eval_voxels_f<2><<<num_blocks, NUM_TILES * 32>>>(
-        tape_data.get(),
-        stages[3].filled.get(),
-        image_size_px / 8,
+    device_sizing = sizing;
 
-        stages[3].tiles.get(),
-        count,
+    store_matrix<<<1, 1, 0, stream>>>(impl->mat_buffer.get(), mat);
+    CUDA_CHECK(cudaGraphLaunch(impl->graph.get(), stream));
+    CUDA_CHECK(cudaEventRecord(impl->frame_done.get(), stream));
+    return impl->frame_done.get();
+}
 
-        reinterpret_cast<float2*>(values.get()));
-    CUDA_CHECK(cudaDeviceSynchronize());
+static void enqueue_3d(Context& ctx, const std::vector<const Tape*>& tapes,
+                       cudaStream_t stream)
+{
+    Frame3D frame = begin_frame_3d(ctx, tapes, stream);
+    while (frame.stage < 4) {
+        enqueue_stage_3d(ctx, frame, stream);
+    }
 }
 
-void Context::render3D(const Tape& tape, const Eigen::Matrix4f& mat) {
-    // Reset the tape index and copy the tape to the beginning of the
-    // context's tape buffer area.
-    *tape_index = tape.length;
-    cudaMemcpyAsync(tape_data.get(), tape.data.get(),
-                    sizeof(uint64_t) * tape.length,
-                    cudaMemcpyDeviceToDevice);
+static Frame3D begin_frame_3d(Context& ctx,
+                              const std::vector<const Tape*>& tapes,
+                              cudaStream_t stream)
+{
+    const int32_t num_shapes = tapes.size();
+    assert(num_shapes <= ctx.image_count);
+    assert(size_t(num_shapes) * mpr::pow(ctx.image_size_px / 4, 3)
+           <= INT32_MAX);
+
+    NVTX_PUSH("setup");
+    record_stats(ctx, STATS_BEGIN, stream);
+
+    // Copy the tapes to the beginning of the context's tape buffer area, one
+    // after the other.  A tape which appears more than once (e.g. when
+    // rendering several views) is only copied once, and its shapes share the
+    // same tape.  The tape index is reset to the end of the last tape by
+    // preload_tiles.
+    std::vector<int32_t> starts;
+    int32_t tape_length = 0;
+    int32_t num_slots = 0;
+    bool shared = true;
+    for (unsigned i=0; i < tapes.size(); ++i) {
+        num_slots = std::max(num_slots, tapes[i]->num_slots);
+        const auto prev = std::find(tapes.begin(), tapes.begin() + i, tapes[i]);
+        if (prev != tapes.begin() + i) {
+            starts.push_back(starts[prev - tapes.begin()]);
+            continue;
+        }
+        CUDA_CHECK(cudaMemcpyAsync(ctx.impl->scratch->tape_data.get() +
+                                   tape_length, tapes[i]->data.get(),
+                                   sizeof(uint64_t) * tapes[i]->length,
+                                   cudaMemcpyDeviceToDevice, stream));
+        starts.push_back(tape_length);
+        shared &= (tape_length == 0);
+        tape_length += tapes[i]->length;
+    }
+    assert(tape_length < ctx.tape_capacity());
+
+    // Every kernel in this frame uses a slot array big enough for every tape
+    const int32_t slots = slot_tier(ctx, num_slots);
+
+    // If every shape uses the tape at 0, then preload_tiles doesn't need the
+    // list of tape starts (so there's no host-to-device copy, which couldn't
+    // be captured in a graph)
+    if (!shared) {
+        CUDA_CHECK(cudaMemcpyAsync(ctx.impl->tape_starts.get(), starts.data(),
+                                   sizeof(int32_t) * num_shapes,
+                                   cudaMemcpyHostToDevice, stream));
+    }
 
     ////////////////////////////////////////////////////////////////////////////
     // Evaluation of 64x64x64 tiles
     ////////////////////////////////////////////////////////////////////////////
 
-    // Reset all of the data arrays
+    // Reset all of the data arrays (with one image per shape)
     for (unsigned i=0; i < 4; ++i) {
         const unsigned tile_size_px = 64 / (1 << (i * 2));
-        CUDA_CHECK(cudaMemsetAsync(stages[i].filled.get(), 0, sizeof(int32_t) *
-                                   pow(image_size_px / tile_size_px, 2)));
+        CUDA_CHECK(cudaMemsetAsync(ctx.stages[i].filled.get(), 0,
+                                   sizeof(int32_t) * num_shapes *
+                                   pow(ctx.image_size_px / tile_size_px, 2),
+                                   stream));
     }
-    CUDA_CHECK(cudaMemsetAsync(normals.get(), 0, sizeof(uint32_t) *
-                               pow(image_size_px, 2)));
+    if (ctx.render_flags & RENDER_NORMALS) {
+        CUDA_CHECK(cudaMemsetAsync(ctx.normals.get(), 0, sizeof(uint32_t) *
+                                   size_t(num_shapes) *
+                                   mpr::pow(ctx.image_size_px, 2), stream));
+    }
+    CUDA_CHECK(cudaMemsetAsync(ctx.impl->tile_counts.get(), 0,
+                               sizeof(int32_t) * 4, stream));
+    CUDA_CHECK(cudaMemsetAsync(ctx.impl->cull_counts.get(), 0,
+                               sizeof(int32_t) * 4, stream));
+    reset_subtape_table(ctx, stream);
 
     // Go the whole list of first-stage tiles, assigning each to
-    // be [position, tape = 0, next = -1]
-    unsigned count = pow(image_size_px / 64, 3);
+    // be [position, tape = shape's tape, next = -1]
+    //
+    // As in render2DAsync, `count` is the number of tiles covered by each
+    // launch, which is either exact or the stage's buffer size.
+    unsigned count = num_shapes * mpr::pow(ctx.image_size_px / 64, 3);
     unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
-    preload_tiles<<<num_blocks, NUM_THREADS>>>(stages[0].tiles.get(), count);
+    preload_tiles<<<num_blocks, NUM_THREADS, 0, stream>>>(
+        ctx.stages[0].tiles.get(), count, ctx.impl->tile_counts.get(),
+        ctx.impl->tape_index.get(), tape_length, ctx.impl->tape_overflows.get(),
+        ctx.image_size_px / 64, ctx.partition_index, ctx.partition_count,
+        viewport_tiles(ctx, 64),
+        shared ? nullptr : ctx.impl->tape_starts.get());
+
+    // Then drop first-stage tiles which are outside of the bounding box
+    if (!ctx.bounds.isEmpty()) {
+        cull_tiles_3d<<<num_blocks, NUM_THREADS, 0, stream>>>(
+            ctx.stages[0].tiles.get(), ctx.impl->tile_counts.get(),
+            ctx.image_size_px / 64, ctx.impl->mat_buffer.get(),
+            make_float3(ctx.bounds.min().x(), ctx.bounds.min().y(),
+                        ctx.bounds.min().z()),
+            make_float3(ctx.bounds.max().x(), ctx.bounds.max().y(),
+                        ctx.bounds.max().z()));
+    }
+    record_stats(ctx, STATS_SETUP, stream);
+    NVTX_POP();
+
+    Frame3D frame;
+    frame.tapes = tapes;
+    frame.num_shapes = num_shapes;
+    frame.slots = slots;
+    frame.shared = shared;
+    frame.count = count;
+    return frame;
+}
 
-    // Iterate over 64^3, 16^3, 4^3 tiles
-    for (unsigned i=0; i < 3; ++i) {
-        //printf("BEGINNING STAGE %u\n", i);
+static void enqueue_stage_3d(Context& ctx, Frame3D& frame,
+                             cudaStream_t stream)
+{
+    const int32_t num_shapes = frame.num_shapes;
+    const int32_t slots = frame.slots;
+    unsigned& count = frame.count;
+    begin_stage_stats(ctx, frame.stage, stream);
+
+    // Stages 0-2 evaluate 64^3, 16^3, 4^3 tiles
+    if (frame.stage < 3) {
+        const unsigned i = frame.stage;
         const unsigned tile_size_px = 64 / (1 << (i * 2));
         const unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
 
-        if (values_size < num_blocks * NUM_THREADS * 3) {
-            values.reset(CUDA_MALLOC(Interval, num_blocks * NUM_THREADS * 3));
-            values_size = num_blocks * NUM_THREADS * 3;
+        // Stages in `skip_stages` aren't evaluated, so every tile which
+        // isn't masked is subdivided (and its subtiles keep its tape)
+        const bool evaluate = !(ctx.skip_stages & (1 << i));
+
+        if (evaluate) {
+            reserve_values<Interval>(ctx, num_blocks * NUM_THREADS * 3);
+
+            // Unpack position values into interval X/Y/Z in the values array
+            // This is done in a separate kernel to avoid bloating the
+            // eval_tiles_i kernel with more registers, which is detrimental
+            // to occupancy.
+            calculate_intervals_3d<<<num_blocks, NUM_THREADS, 0, stream>>>(
+                ctx.stages[i].tiles.get(),
+                ctx.impl->tile_counts.get() + i,
+                ctx.image_size_px / tile_size_px,
+                ctx.impl->mat_buffer.get(),
+                reinterpret_cast<Interval*>(ctx.impl->scratch->values.get()));
         }
 
-        // Unpack position values into interval X/Y/Z in the values array
-        // This is done in a separate kernel to avoid bloating the
-        // eval_tiles_i kernel with more registers, which is detrimental
-        // to occupancy.
-        calculate_intervals_3d<<<num_blocks, NUM_THREADS>>>(
-            stages[i].tiles.get(),
-            count,
-            image_size_px / tile_size_px,
-            mat,
-            reinterpret_cast<Interval*>(values.get()));
+        // In incremental mode, first-stage tiles may reuse an earlier
+        // frame's results (and start from its subtapes)
+        if (i == 0) {
+            frame.cached = use_tile_cache(ctx, *frame.tapes[0], num_shapes,
+                                          count, stream);
+        }
 
         // Mark every tile which is covered in the image as masked,
         // which means it will be skipped later on.  We do this again below,
         // but it's basically free, so we should do it here and simplify
         // the logic in eval_tiles_i.
-        mask_filled_tiles<<<num_blocks, NUM_THREADS>>>(
-            stages[i].filled.get(),
-            image_size_px / tile_size_px,
-            stages[i].tiles.get(),
-            count);
-
-        // Do the actual tape evaluation, which is the expensive step
-        eval_tiles_i<3><<<num_blocks, NUM_THREADS>>>(
-            tape_data.get(),
-            tape_index.get(),
-            stages[i].filled.get(),
-            image_size_px / tile_size_px,
-
-            stages[i].tiles.get(),
-            count,
-
-            reinterpret_cast<Interval*>(values.get()));
-
-        // Mark the total number of active tiles (from this stage) to 0
-        cudaMemsetAsync(num_active_tiles.get(), 0, sizeof(int32_t));
+        mask_filled_tiles<<<num_blocks, NUM_THREADS, 0, stream>>>(
+            ctx.stages[i].filled.get(),
+            ctx.image_size_px / tile_size_px,
+            ctx.stages[i].tiles.get(),
+            ctx.impl->tile_counts.get() + i,
+            ctx.impl->cull_counts.get() + i);
+
+        // Do the actual tape evaluation, which is the expensive step.  When
+        // every shape uses the same tape, the first stage may be compiled
+        // (unless tiles start from cached subtapes, which the compiled
+        // kernel doesn't read).
+        //
+        // In slab mode, the stage is instead evaluated one slab of Z layers
+        // at a time, front to back, culling tiles against the image between
+        // slabs.  Every launch covers the whole stage, but tiles outside of
+        // the slab exit right away.
+        const int32_t tiles_per_side = ctx.image_size_px / tile_size_px;
+        const int32_t slabs = std::min(std::max(ctx.z_slabs, 1),
+                                       tiles_per_side);
+        if (evaluate && slabs > 1) {
+            hide_tiles<<<num_blocks, NUM_THREADS, 0, stream>>>(
+                ctx.stages[i].tiles.get(), ctx.impl->tile_counts.get() + i);
+            for (int32_t j=0; j < slabs; ++j) {
+                reveal_z_slab<<<num_blocks, NUM_THREADS, 0, stream>>>(
+                    ctx.stages[i].filled.get(), tiles_per_side,
+                    ctx.stages[i].tiles.get(), ctx.impl->tile_counts.get() + i,
+                    tiles_per_side - (j + 1) * tiles_per_side / slabs,
+                    tiles_per_side - j * tiles_per_side / slabs,
+                    ctx.impl->cull_counts.get() + i);
+                launch_eval_tiles<3>(ctx, i, tile_size_px, count, slots,
+                                      stream);
+            }
+        } else if (evaluate) {
+            const Tape& tape = *frame.tapes[0];
+            if (i || !ctx.jit || !frame.shared || frame.cached ||
+                !launch_jit_tiles<3>(ctx, tape, num_blocks, stream))
+            {
+                launch_eval_tiles<3>(ctx, i, tile_size_px, count, slots,
+                                      stream);
+            }
+        }
+        if (i == 0 && frame.cached) {
+            store_tile_cache(ctx, *frame.tapes[0], count, stream);
+        }
+        record_stats(ctx, STATS_STAGE + i * 3 + 1, stream);
 
         // Now that we have evaluated every tile at this level, we do one more
         // round of occlusion culling before accumulating tiles to render at
         // the next phase.
-        mask_filled_tiles<<<num_blocks, NUM_THREADS>>>(
-            stages[i].filled.get(),
-            image_size_px / tile_size_px,
-            stages[i].tiles.get(),
-            count);
+        mask_filled_tiles<<<num_blocks, NUM_THREADS, 0, stream>>>(
+            ctx.stages[i].filled.get(),
+            ctx.image_size_px / tile_size_px,
+            ctx.stages[i].tiles.get(),
+            ctx.impl->tile_counts.get() + i,
+            nullptr);
 
         // Count up active tiles, to figure out how much memory needs to be
         // allocated in the next stage.
-        assign_next_nodes<<<num_blocks, NUM_THREADS>>>(
-            stages[i].tiles.get(),
-            count,
-            num_active_tiles.get());
-
-        // Count the number of active tiles, which have been accumulated
-        // through repeated calls to assign_next_nodes
-        int32_t active_tile_count;
-        cudaMemcpy(&active_tile_count, num_active_tiles.get(), sizeof(int32_t),
-                   cudaMemcpyDeviceToHost);
-        if (i < 2) {
-            active_tile_count *= 64;
-        }
-
-        // Make sure that the subtiles buffer has enough room
-        // This wastes a small amount of data for the per-pixel evaluation,
-        // where the `next` indexes aren't used, but it's relatively small.
-        if (active_tile_count > stages[i + 1].tile_array_size) {
-            stages[i + 1].tile_array_size = active_tile_count;
-            stages[i + 1].tiles.reset(CUDA_MALLOC(TileNode, active_tile_count));
+        //
+        // In device-sizing mode, the next stage's buffer is already
+        // allocated, and later kernels are launched over all of it (rounded
+        // down to whole blocks, in case the host-sized path allocated it).
+        const int32_t capacity = ctx.device_sizing
+            ? block_capacity(ctx.stages[i + 1]) : INT32_MAX;
+        assign_next_nodes<<<num_blocks, NUM_THREADS, 0, stream>>>(
+            ctx.stages[i].tiles.get(),
+            ctx.impl->tile_counts.get() + i,
+            ctx.impl->tile_counts.get() + i + 1,
+            i < 2 ? 64 : 1,
+            capacity);
+
+        if (ctx.device_sizing) {
+            count = capacity;
+        } else {
+            // Read back the number of tiles in the next stage, which have
+            // been accumulated through repeated calls to assign_next_nodes.
+            // This is the only point where the host waits on the stream,
+            // since it needs the count to size the next stage's buffers.
+            CUDA_CHECK(cudaMemcpyAsync(&ctx.impl->tile_counts_host[i + 1],
+                                       ctx.impl->tile_counts.get() + i + 1,
+                                       sizeof(int32_t),
+                                       cudaMemcpyDeviceToHost, stream));
+            CUDA_CHECK(cudaStreamSynchronize(stream));
+            count = ctx.impl->tile_counts_host[i + 1];
+
+            // Make sure that the subtiles buffer has enough room
+            // This wastes a small amount of data for the per-pixel
+            // evaluation, where the `next` indexes aren't used, but it's
+            // relatively small.
+            reserve_scratch<TileNode>(ctx, ctx.stages[i + 1].tiles,
+                                      ctx.stages[i + 1].tile_array_size, count);
         }
 
         if (i < 2) {
             // Build the new tile list from active tiles in the previous list
-            subdivide_active_tiles_3d<<<num_blocks*64, NUM_THREADS>>>(
-                stages[i].tiles.get(),
-                count,
-                image_size_px / tile_size_px,
-                stages[i + 1].tiles.get());
+            subdivide_active_tiles_3d<<<num_blocks*64, NUM_THREADS,
+                                        0, stream>>>(
+                ctx.stages[i].tiles.get(),
+                ctx.impl->tile_counts.get() + i,
+                ctx.image_size_px / tile_size_px,
+                viewport_tiles(ctx, tile_size_px / 4),
+                ctx.stages[i + 1].tiles.get());
         } else {
             // Special case for per-pixel evaluation, which
             // doesn't unpack every single pixel (since that would take up
             // 64x extra space).
-            copy_active_tiles<<<num_blocks, NUM_THREADS>>>(
-                stages[i].tiles.get(),
-                count,
-                stages[i + 1].tiles.get());
+            copy_active_tiles<<<num_blocks, NUM_THREADS, 0, stream>>>(
+                ctx.stages[i].tiles.get(),
+                ctx.impl->tile_counts.get() + i,
+                ctx.stages[i + 1].tiles.get());
         }
 
         {   // Copy filled tiles into the next level's image (expanding them
@@ -1408,64 +3782,380 @@ void Context::render3D(const Tape& tape, const Eigen::Matrix4f& mat) {
             // in a single pass, and could (possibly?) help with skipping
             // fully occluded tiles.
             const unsigned next_tile_size = tile_size_px / 4;
-            const uint32_t u = ((image_size_px / next_tile_size) / 32);
-            copy_filled_3d<<<dim3(u + 1, u + 1), dim3(32, 32)>>>(
-                    stages[i].filled.get(),
-                    stages[i + 1].filled.get(),
-                    image_size_px / next_tile_size);
+            const uint32_t u = ((ctx.image_size_px / next_tile_size) / 32);
+            copy_filled_3d<<<dim3(u + 1, u + 1, num_shapes), dim3(32, 32),
+                             0, stream>>>(
+                    ctx.stages[i].filled.get(),
+                    ctx.stages[i + 1].filled.get(),
+                    ctx.image_size_px / next_tile_size);
+        }
+    } else {
+        // Time to render individual pixels!
+        const unsigned num_blocks = (count + NUM_TILES - 1) / NUM_TILES;
+        const size_t num_values = num_blocks * NUM_TILES * 32 * 3;
+        reserve_values<float2>(ctx, num_values);
+        calculate_voxels<<<num_blocks, NUM_TILES * 32, 0, stream>>>(
+            ctx.stages[3].tiles.get(),
+            ctx.impl->tile_counts.get() + 3,
+            ctx.image_size_px / 4,
+            ctx.impl->mat_buffer.get(),
+            reinterpret_cast<float2*>(ctx.impl->scratch->values.get()));
+        launch_eval_voxels<3>(ctx, num_blocks, slots, stream);
+        record_stats(ctx, STATS_STAGE + 3 * 3 + 1, stream);
+
+        // Then render normals into those pixels, unless we only want depth
+        if (ctx.render_flags & RENDER_NORMALS) {
+            launch_eval_pixels(ctx, num_shapes, slots, stream);
+        }
+        if (ctx.compact_images && ctx.depth16) {
+            const int32_t pixels = num_shapes * mpr::pow(ctx.image_size_px, 2);
+            pack_depth16<<<(pixels + NUM_THREADS - 1) / NUM_THREADS,
+                           NUM_THREADS, 0, stream>>>(
+                ctx.stages[3].filled.get(), ctx.depth16.get(), pixels);
+        }
+        end_stage_stats(ctx, 3, stream);
+        read_stats(ctx, stream);
+
+        // In device-sizing mode, read back every stage's tile count, which is
+        // used to grow the stage buffers before the next frame.
+        if (ctx.device_sizing) {
+            CUDA_CHECK(cudaMemcpyAsync(ctx.impl->tile_counts_host.get(),
+                                       ctx.impl->tile_counts.get(),
+                                       sizeof(int32_t) * 4,
+                                       cudaMemcpyDeviceToHost, stream));
         }
 
-        // Assign the next number of tiles to evaluate
-        count = active_tile_count;
+        // Read back the number of failed subtape pushes, which is used to grow
+        // the subtape pool before the next frame, and the number of culled
+        // tiles in each stage.
+        CUDA_CHECK(cudaMemcpyAsync(ctx.impl->tape_overflows_host.get(),
+                                   ctx.impl->tape_overflows.get(),
+                                   sizeof(int32_t),
+                                   cudaMemcpyDeviceToHost, stream));
+        CUDA_CHECK(cudaMemcpyAsync(ctx.impl->cull_counts_host.get(),
+                                   ctx.impl->cull_counts.get(),
+                                   sizeof(int32_t) * 4,
+                                   cudaMemcpyDeviceToHost, stream));
     }
+    if (frame.stage < 3) {
+        end_stage_stats(ctx, frame.stage, stream);
+    }
+    ++frame.stage;
+}
 
-    // Time to render individual pixels!
-    num_blocks = (count + NUM_TILES - 1) / NUM_TILES;
-    const size_t num_values = num_blocks * NUM_TILES * 32 * 3;
-    if (values_size < num_values) {
-        values.reset(CUDA_MALLOC(float2, num_values));
-        values_size = num_values;
+void mpr::setParameters(const float* values, int32_t count, int32_t first,
+                        cudaStream_t stream)
+{
+    assert(first >= 0 && first + count <= MAX_PARAMETERS);
+    CUDA_CHECK(cudaMemcpyToSymbolAsync(tape_parameters, values,
+                                       sizeof(float) * count,
+                                       sizeof(float) * first,
+                                       cudaMemcpyHostToDevice, stream));
+    setCpuParameters(values, count, first);
+    ++parameter_generation;
+}
+
+void mpr::setParameter(const Tape& tape, const std::string& name,
+                       float value, cudaStream_t stream)
+{
+    const int32_t i = tape.parameter(name);
+    if (i == -1) {
+        throw std::runtime_error("Unknown parameter " + name);
     }
-    calculate_voxels<<<num_blocks, NUM_TILES * 32>>>(
-        stages[3].tiles.get(),
-        count,
-        image_size_px / 4,
-        mat,
-        reinterpret_cast<float2*>(values.get()));
-    eval_voxels_f<3><<<num_blocks, NUM_TILES * 32>>>(
-        tape_data.get(),
-        stages[3].filled.get(),
-        image_size_px / 4,
+    setParameters(&value, 1, i, stream);
+}
 
-        stages[3].tiles.get(),
-        count,
+/*
+ *  Returns true if kernels can use `ptr` directly: device and managed
+ *  memory, and pinned host memory (through unified addressing).
+ */
+static bool device_accessible(const void* ptr) {
+    cudaPointerAttributes attrs;
+    if (cudaPointerGetAttributes(&attrs, ptr) != cudaSuccess) {
+        cudaGetLastError(); // Older runtimes fail on unregistered memory
+        return false;
+    }
+    return attrs.type != cudaMemoryTypeUnregistered;
+}
 
-        reinterpret_cast<float2*>(values.get()));
+void Context::evalPoints(const Tape& tape, const float3* pts, size_t n,
+                         float* out, float3* grad)
+{
+    require_cuda(*this, "evalPoints");
+    evalPointsAsync(tape, pts, n, out, grad, 0);
+    CUDA_CHECK(cudaEventSynchronize(impl->frame_done.get()));
+}
 
-    {   // Then render normals into those pixels
-        const uint32_t u = ((image_size_px + 15) / 16);
-        eval_pixels_d<<<dim3(u, u), dim3(16, 16)>>>(
-                tape_data.get(),
-                stages[3].filled.get(),
-                normals.get(),
-                image_size_px,
-                mat,
-                stages[0].tiles.get(),
-                stages[1].tiles.get(),
-                stages[2].tiles.get());
+cudaEvent_t Context::evalPointsAsync(const Tape& tape, const float3* pts,
+                                     size_t n, float* out, float3* grad,
+                                     cudaStream_t stream)
+{
+    require_cuda(*this, "evalPointsAsync");
+    assert(n <= INT32_MAX);
+    release_retired(*this);
+    reserve_subtapes(*this);
+    if (n == 0) {
+        CUDA_CHECK(cudaEventRecord(impl->frame_done.get(), stream));
+        return impl->frame_done.get();
     }
-    CUDA_CHECK(cudaDeviceSynchronize());
+
+    // Inputs and outputs in ordinary host memory are staged through one
+    // device buffer, with the points first.
+    const size_t pts_bytes = device_accessible(pts) ? 0 : sizeof(float3) * n;
+    const size_t out_bytes = device_accessible(out) ? 0 : sizeof(float) * n;
+    const size_t grad_bytes = (!grad || device_accessible(grad))
+        ? 0 : sizeof(float3) * n;
+    reserve_scratch<uint8_t>(*this, impl->point_staging,
+                             impl->point_staging_size,
+                             pts_bytes + out_bytes + grad_bytes);
+    uint8_t* const staging = static_cast<uint8_t*>(impl->point_staging.get());
+    const float3* const d_pts = pts_bytes
+        ? reinterpret_cast<const float3*>(staging) : pts;
+    float* const d_out = out_bytes
+        ? reinterpret_cast<float*>(staging + pts_bytes) : out;
+    float3* const d_grad = grad_bytes
+        ? reinterpret_cast<float3*>(staging + pts_bytes + out_bytes) : grad;
+    if (pts_bytes) {
+        CUDA_CHECK(cudaMemcpyAsync(staging, pts, pts_bytes,
+                                   cudaMemcpyHostToDevice, stream));
+    }
+
+    // Copy the tape to the beginning of the context's tape buffer area,
+    // where clusters of points push their subtapes after it.
+    CUDA_CHECK(cudaMemcpyAsync(impl->scratch->tape_data.get(), tape.data.get(),
+                               sizeof(uint64_t) * tape.length,
+                               cudaMemcpyDeviceToDevice, stream));
+    const int32_t slots = slot_tier(*this, tape.num_slots);
+
+    const TileNode* blocks = nullptr;
+    if (point_block_size > 0) {
+        const int32_t count = (n + point_block_size - 1) / point_block_size;
+        if (!impl->point_block_count) {
+            impl->point_block_count.reset(alloc<int32_t>(*this, 1));
+        }
+        reserve_scratch<TileNode>(*this, impl->point_blocks,
+                                  impl->point_blocks_size, count);
+        reserve_values<Interval>(*this, count * 3);
+        calculate_point_blocks<<<(count + NUM_THREADS - 1) / NUM_THREADS,
+                                 NUM_THREADS, 0, stream>>>(
+            d_pts, n, point_block_size,
+            impl->point_blocks.get(), impl->point_block_count.get(),
+            impl->tape_index.get(), tape.length, impl->tape_overflows.get(),
+            reinterpret_cast<Interval*>(impl->scratch->values.get()));
+#define LAUNCH(S) launch_eval_point_blocks<S>(*this, count, stream)
+        DISPATCH_SLOTS(slots, LAUNCH)
+#undef LAUNCH
+        blocks = impl->point_blocks.get();
+
+        // Read back failed pushes, so that the pool grows before next time
+        CUDA_CHECK(cudaMemcpyAsync(impl->tape_overflows_host.get(),
+                                   impl->tape_overflows.get(), sizeof(int32_t),
+                                   cudaMemcpyDeviceToHost, stream));
+    }
+
+#define LAUNCH(S) launch_eval_points<S>(*this, blocks, d_pts, n, d_out, \
+                                        d_grad, stream)
+    DISPATCH_SLOTS(slots, LAUNCH)
+#undef LAUNCH
+
+    if (out_bytes) {
+        CUDA_CHECK(cudaMemcpyAsync(out, d_out, out_bytes,
+                                   cudaMemcpyDeviceToHost, stream));
+    }
+    if (grad_bytes) {
+        CUDA_CHECK(cudaMemcpyAsync(grad, d_grad, grad_bytes,
+                                   cudaMemcpyDeviceToHost, stream));
+    }
+    CUDA_CHECK(cudaEventRecord(impl->frame_done.get(), stream));
+    return impl->frame_done.get();
+}
+
+/*
+ *  Runs the tile stages of renderVolume: the hierarchy is evaluated
+ *  without occlusion culling, filled tiles are recorded at each stage,
+ *  and only ambiguous tiles are subdivided.  Returns the number of
+ *  ambiguous 4^3 tiles, which are left in `stages[3].tiles` with their
+ *  shortened tapes.  The tape is copied into the tape buffer first;
+ *  the caller is responsible for reserving subtapes and volume_counts.
+ */
+static unsigned build_volume_tiles(Context& ctx, const Tape& tape,
+                                   const Eigen::Matrix4f& mat)
+{
+    // Store the matrix, then copy the tape to the beginning of the
+    // context's tape buffer area.  The tape index is reset to the end of
+    // this tape by preload_tiles.
+    store_matrix<<<1, 1>>>(ctx.impl->mat_buffer.get(), mat);
+    CUDA_CHECK(cudaMemcpyAsync(ctx.impl->scratch->tape_data.get(),
+                               tape.data.get(), sizeof(uint64_t) * tape.length,
+                               cudaMemcpyDeviceToDevice));
+    CUDA_CHECK(cudaMemsetAsync(ctx.impl->tile_counts.get(), 0,
+                               sizeof(int32_t) * 4));
+    CUDA_CHECK(cudaMemsetAsync(ctx.impl->volume_counts.get(), 0,
+                               sizeof(int32_t) * 3));
+    reset_subtape_table(ctx, 0);
+    drop_tile_cache(ctx, 0);
+
+    const unsigned tiles_per_side = ctx.image_size_px / 64;
+    unsigned count = tiles_per_side * tiles_per_side * tiles_per_side;
+    unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
+    preload_tiles<<<num_blocks, NUM_THREADS>>>(
+        ctx.stages[0].tiles.get(), count, ctx.impl->tile_counts.get(),
+        ctx.impl->tape_index.get(), tape.length, ctx.impl->tape_overflows.get(),
+        ctx.image_size_px / 64, ctx.partition_index, ctx.partition_count,
+        viewport_tiles(ctx, 64), nullptr);
+    const int32_t slots = slot_tier(ctx, tape.num_slots);
+
+    // Evaluate 64^3, 16^3, 4^3 tiles, as in enqueue_stage_3d
+    for (unsigned i=0; i < 3; ++i) {
+        const unsigned tile_size_px = 64 / (1 << (i * 2));
+        num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
+
+        reserve_values<Interval>(ctx, num_blocks * NUM_THREADS * 3);
+        calculate_intervals_3d<<<num_blocks, NUM_THREADS>>>(
+            ctx.stages[i].tiles.get(),
+            ctx.impl->tile_counts.get() + i,
+            ctx.image_size_px / tile_size_px,
+            ctx.impl->mat_buffer.get(),
+            reinterpret_cast<Interval*>(ctx.impl->scratch->values.get()));
+        launch_eval_tiles<3>(ctx, i, tile_size_px, count, slots, 0, true);
+
+        reserve_scratch<int32_t>(ctx, ctx.impl->volume_filled[i],
+                                 ctx.impl->volume_filled_size[i], count);
+        collect_filled_tiles<<<num_blocks, NUM_THREADS>>>(
+            ctx.stages[i].tiles.get(),
+            ctx.impl->tile_counts.get() + i,
+            ctx.impl->volume_filled[i].get(),
+            ctx.impl->volume_counts.get() + i);
+
+        assign_next_nodes<<<num_blocks, NUM_THREADS>>>(
+            ctx.stages[i].tiles.get(),
+            ctx.impl->tile_counts.get() + i,
+            ctx.impl->tile_counts.get() + i + 1,
+            i < 2 ? 64 : 1,
+            INT32_MAX);
+        CUDA_CHECK(cudaMemcpy(&ctx.impl->tile_counts_host[i + 1],
+                              ctx.impl->tile_counts.get() + i + 1,
+                              sizeof(int32_t), cudaMemcpyDeviceToHost));
+        count = ctx.impl->tile_counts_host[i + 1];
+        reserve_scratch<TileNode>(ctx, ctx.stages[i + 1].tiles,
+                                  ctx.stages[i + 1].tile_array_size, count);
+
+        if (i < 2) {
+            subdivide_active_tiles_3d<<<num_blocks*64, NUM_THREADS>>>(
+                ctx.stages[i].tiles.get(),
+                ctx.impl->tile_counts.get() + i,
+                ctx.image_size_px / tile_size_px,
+                viewport_tiles(ctx, tile_size_px / 4),
+                ctx.stages[i + 1].tiles.get());
+        } else {
+            copy_active_tiles<<<num_blocks, NUM_THREADS>>>(
+                ctx.stages[i].tiles.get(),
+                ctx.impl->tile_counts.get() + i,
+                ctx.stages[i + 1].tiles.get());
+        }
+    }
+    return count;
+}
+
+void Context::renderVolume(const Tape& tape, const Eigen::Matrix4f& mat) {
+    require_cuda(*this, "renderVolume");
+    release_retired(*this);
+    reserve_subtapes(*this);
+    if (!impl->volume_counts) {
+        impl->volume_counts.reset(alloc<int32_t>(*this, 3));
+        volume_counts_host.reset(CUDA_MALLOC_HOST(int32_t, 4));
+    }
+    const unsigned count = build_volume_tiles(*this, tape, mat);
+    const int32_t slots = slot_tier(*this, tape.num_slots);
+
+    // Then evaluate every voxel of the remaining (ambiguous) 4^3 tiles,
+    // building one occupancy mask per tile
+    const unsigned num_blocks = (count + NUM_TILES - 1) / NUM_TILES;
+    reserve_values<float2>(*this, num_blocks * NUM_TILES * 32 * 3);
+    reserve_scratch<uint64_t>(*this, volume_masks, impl->volume_masks_size,
+                              count);
+    calculate_voxels<<<num_blocks, NUM_TILES * 32>>>(
+        stages[3].tiles.get(),
+        impl->tile_counts.get() + 3,
+        image_size_px / 4,
+        impl->mat_buffer.get(),
+        reinterpret_cast<float2*>(impl->scratch->values.get()));
+    launch_eval_voxels<3>(*this, num_blocks, slots, 0, volume_masks.get());
+
+    CUDA_CHECK(cudaMemcpy(volume_counts_host.get(), impl->volume_counts.get(),
+                          sizeof(int32_t) * 3, cudaMemcpyDeviceToHost));
+    volume_counts_host[3] = count;
+    CUDA_CHECK(cudaMemcpy(impl->tape_overflows_host.get(),
+                          impl->tape_overflows.get(), sizeof(int32_t),
+                          cudaMemcpyDeviceToHost));
+    CUDA_CHECK(cudaEventRecord(impl->frame_done.get()));
 }
 
+void Context::renderMesh(const Tape& tape, const Eigen::Matrix4f& mat) {
+    require_cuda(*this, "renderMesh");
+    release_retired(*this);
+    reserve_subtapes(*this);
+    if (!impl->volume_counts) {
+        impl->volume_counts.reset(alloc<int32_t>(*this, 3));
+        volume_counts_host.reset(CUDA_MALLOC_HOST(int32_t, 4));
+    }
+    if (!impl->mesh_counts) {
+        impl->mesh_counts.reset(alloc<int32_t>(*this, 2));
+        mesh_counts_host.reset(CUDA_MALLOC_HOST(int32_t, 2));
+    }
+    const unsigned count = build_volume_tiles(*this, tape, mat);
+    const int32_t slots = slot_tier(*this, tape.num_slots);
+
+    // Start with room for a typical number of vertices and triangles per
+    // tile.  If that's not enough, the kernel still reports how much room
+    // it needed, so it's run again after growing the buffers.
+    size_t num_vertices = count * 32;
+    size_t num_triangles = count * 64;
+    while (true) {
+        reserve_scratch<float3>(*this, mesh_vertices, impl->mesh_vertices_size,
+                                num_vertices);
+        reserve_scratch<float3>(*this, mesh_normals, impl->mesh_normals_size,
+                                num_vertices);
+        reserve_scratch<uint32_t>(*this, mesh_indices, impl->mesh_indices_size,
+                                  num_triangles * 3);
+        CUDA_CHECK(cudaMemsetAsync(impl->mesh_counts.get(), 0,
+                                   sizeof(int32_t) * 2));
+        if (count) {
+#define LAUNCH(S) launch_mesh_tiles<S>(*this, count, 0)
+            DISPATCH_SLOTS(slots, LAUNCH)
+#undef LAUNCH
+        }
+        CUDA_CHECK(cudaMemcpy(mesh_counts_host.get(), impl->mesh_counts.get(),
+                              sizeof(int32_t) * 2, cudaMemcpyDeviceToHost));
+        num_vertices = mesh_counts_host[0];
+        num_triangles = mesh_counts_host[1];
+        if (num_vertices <= impl->mesh_vertices_size &&
+            num_triangles * 3 <= impl->mesh_indices_size)
+        {
+            break;
+        }
+    }
+
+    CUDA_CHECK(cudaMemcpy(volume_counts_host.get(), impl->volume_counts.get(),
+                          sizeof(int32_t) * 3, cudaMemcpyDeviceToHost));
+    volume_counts_host[3] = count;
+    CUDA_CHECK(cudaMemcpy(impl->tape_overflows_host.get(),
+                          impl->tape_overflows.get(), sizeof(int32_t),
+                          cudaMemcpyDeviceToHost));
+    CUDA_CHECK(cudaEventRecord(impl->frame_done.get()));
+}
 
 void Context::render2D_brute(const Tape& tape,
                              const Eigen::Matrix3f& mat,
                              const float z)
 {
-    // Reset the tape index and copy the tape to the beginning of the
-    // context's tape buffer area.
-    *tape_index = tape.length;
-    cudaMemcpyAsync(tape_data.get(), tape.data.get(),
+    require_cuda(*this, "render2D_brute");
+    release_retired(*this);
+    reserve_subtapes(*this);
+
+    // Copy the tape to the beginning of the context's tape buffer area.
+    // The tape index is reset to the end of this tape by preload_tiles.
+    cudaMemcpyAsync(impl->scratch->tape_data.get(), tape.data.get(),
                     sizeof(uint64_t) * tape.length,
                     cudaMemcpyDeviceToDevice);
 
@@ -1475,35 +4165,28 @@ void Context::render2D_brute(const Tape& tape,
 
     // We'll only be evaluating 8x8 tiles, so preload all of them
     unsigned count = pow(image_size_px / 8, 2);
-    if (count > stages[3].tile_array_size) {
-        stages[3].tile_array_size = count;
-        stages[3].tiles.reset(CUDA_MALLOC(TileNode, count));
-    }
+    reserve_scratch<TileNode>(*this, stages[3].tiles, stages[3].tile_array_size,
+                              count);
     unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
-    preload_tiles<<<num_blocks, NUM_THREADS>>>(stages[3].tiles.get(), count);
+    drop_tile_cache(*this, 0);
+    preload_tiles<<<num_blocks, NUM_THREADS>>>(
+        stages[3].tiles.get(), count, impl->tile_counts.get() + 3,
+        impl->tape_index.get(), tape.length, impl->tape_overflows.get(),
+        image_size_px / 8, 0, 1,
+        make_int4(0, 0, image_size_px / 8, image_size_px / 8), nullptr);
 
     // Time to render individual pixels!
     num_blocks = (count + NUM_TILES - 1) / NUM_TILES;
     const size_t num_values = num_blocks * NUM_TILES * 32 * 3;
-    if (values_size < num_values) {
-        values.reset(CUDA_MALLOC(float2, num_values));
-        values_size = num_values;
-    }
+    reserve_values<float2>(*this, num_values);
     calculate_pixels<<<num_blocks, NUM_TILES * 32>>>(
         stages[3].tiles.get(),
-        count,
+        impl->tile_counts.get() + 3,
         image_size_px / 8,
         mat, z,
-        reinterpret_cast<float2*>(values.get()));
-    eval_voxels_f<2><<<num_blocks, NUM_TILES * 32>>>(
-        tape_data.get(),
-        stages[3].filled.get(),
-        image_size_px / 8,
-
-        stages[3].tiles.get(),
-        count,
-
-        reinterpret_cast<float2*>(values.get()));
+        reinterpret_cast<float2*>(impl->scratch->values.get()));
+    launch_eval_voxels<2>(*this, num_blocks, slot_tier(*this, tape.num_slots),
+                          0);
     CUDA_CHECK(cudaDeviceSynchronize());
 }
 
@@ -1514,11 +4197,12 @@ template <int DIMENSION>
 __global__
 void eval_tiles_i_heatmap(uint64_t* const __restrict__ tape_data,
                           int32_t* const __restrict__ tape_index,
+                          const int32_t tape_capacity,
                           int32_t* const __restrict__ image,
                           const uint32_t tiles_per_side,
 
                           TileNode* const __restrict__ in_tiles,
-                          const int32_t in_tile_count,
+                          const int32_t* const __restrict__ in_tile_count,
 
                           const Interval* __restrict__ values,
 
@@ -1526,7 +4210,7 @@ void eval_tiles_i_heatmap(uint64_t* const __restrict__ tape_data,
                           float* __restrict__ const heatmap)
 {
     const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
-    if (tile_index >= in_tile_count) {
+    if (tile_index >= *in_tile_count) {
         return;
     }
 
@@ -1535,14 +4219,17 @@ void eval_tiles_i_heatmap(uint64_t* const __restrict__ tape_data,
         return;
     }
 
-    Interval slots[128];
-    slots[((const uint8_t*)tape_data)[1]] = values[tile_index * 3];
-    slots[((const uint8_t*)tape_data)[2]] = values[tile_index * 3 + 1];
-    slots[((const uint8_t*)tape_data)[3]] = values[tile_index * 3 + 2];
-
-    // Pick out the tape based on the pointer stored in the tiles list
+    // Pick out the tape based on the pointer stored in the tiles list.  Its
+    // first clause stores the X, Y, Z slots, which differ between the shapes
+    // of a batch (subtapes copy this clause from their parent).
     const uint64_t* __restrict__ data = &tape_data[in_tiles[tile_index].tape];
 
+    Interval slots[MAX_SLOTS];
+    Interval spills[MAX_SPILLS];
+    slots[((const uint8_t*)data)[1]] = values[tile_index * 3];
+    slots[((const uint8_t*)data)[2]] = values[tile_index * 3 + 1];
+    slots[((const uint8_t*)data)[3]] = values[tile_index * 3 + 2];
+
     constexpr static int CHOICE_ARRAY_SIZE = 256;
     uint32_t choices[CHOICE_ARRAY_SIZE] = {0};
     int choice_index = 0;
@@ -1561,6 +4248,7 @@ void eval_tiles_i_heatmap(uint64_t* const __restrict__ tape_data,
 #define lhs slots[I_LHS(&d)]
 #define rhs slots[I_RHS(&d)]
 #define imm IMM(&d)
+#define param tape_parameters[PARAM_INDEX(&d)]
 #define out slots[I_OUT(&d)]
 
             case GPU_OP_SQUARE_LHS: out = square(lhs); break;
@@ -1574,6 +4262,8 @@ void eval_tiles_i_heatmap(uint64_t* const __restrict__ tape_data,
             case GPU_OP_EXP_LHS:    out = exp(lhs); break;
             case GPU_OP_ABS_LHS:    out = abs(lhs); break;
             case GPU_OP_LOG_LHS:    out = log(lhs); break;
+            case GPU_OP_TAN_LHS:    out = tan(lhs); break;
+            case GPU_OP_RECIP_LHS:  out = recip(lhs); break;
 
             // Commutative opcodes
             case GPU_OP_ADD_LHS_IMM: out = lhs + imm; break;
@@ -1603,16 +4293,48 @@ void eval_tiles_i_heatmap(uint64_t* const __restrict__ tape_data,
             case GPU_OP_DIV_LHS_IMM: out = lhs / imm; break;
             case GPU_OP_DIV_IMM_RHS: out = imm / rhs; break;
             case GPU_OP_DIV_LHS_RHS: out = lhs / rhs; break;
+            case GPU_OP_ATAN2_LHS_IMM: out = atan2(lhs, imm); break;
+            case GPU_OP_ATAN2_IMM_RHS: out = atan2(imm, rhs); break;
+            case GPU_OP_ATAN2_LHS_RHS: out = atan2(lhs, rhs); break;
+            case GPU_OP_POW_LHS_IMM: out = pow(lhs, imm); break;
+            case GPU_OP_POW_IMM_RHS: out = pow(imm, rhs); break;
+            case GPU_OP_POW_LHS_RHS: out = pow(lhs, rhs); break;
+            case GPU_OP_NTH_ROOT_LHS_IMM: out = nth_root(lhs, imm); break;
+            case GPU_OP_NTH_ROOT_IMM_RHS: out = nth_root(imm, rhs); break;
+            case GPU_OP_NTH_ROOT_LHS_RHS: out = nth_root(lhs, rhs); break;
+            case GPU_OP_MOD_LHS_IMM: out = mod(lhs, imm); break;
+            case GPU_OP_MOD_IMM_RHS: out = mod(imm, rhs); break;
+            case GPU_OP_MOD_LHS_RHS: out = mod(lhs, rhs); break;
+            case GPU_OP_NANFILL_LHS_IMM: out = nanfill(lhs, imm); break;
+            case GPU_OP_NANFILL_IMM_RHS: out = nanfill(imm, rhs); break;
+            case GPU_OP_NANFILL_LHS_RHS: out = nanfill(lhs, rhs); break;
+            case GPU_OP_COMPARE_LHS_IMM: out = compare(lhs, imm); break;
+            case GPU_OP_COMPARE_IMM_RHS: out = compare(imm, rhs); break;
+            case GPU_OP_COMPARE_LHS_RHS: out = compare(lhs, rhs); break;
 
             case GPU_OP_COPY_IMM: out = Interval(imm); break;
             case GPU_OP_COPY_LHS: out = lhs; break;
             case GPU_OP_COPY_RHS: out = rhs; break;
+            case GPU_OP_PARAM: out = Interval(param); break;
+
+            // Compound opcodes
+            case GPU_OP_MUL_ADD_LHS_RHS_IMM: out = mul_add(lhs, rhs, imm); break;
+            case GPU_OP_MUL_ADD_LHS_IMM_RHS: out = mul_add(lhs, imm, rhs); break;
+            case GPU_OP_SQUARE_ADD_LHS_IMM: out = square_add(lhs, imm); break;
+            case GPU_OP_SQUARE_ADD_LHS_RHS: out = square_add(lhs, rhs); break;
+            case GPU_OP_SUB_SQUARE_LHS_IMM: out = sub_square(lhs, imm); break;
+            case GPU_OP_SUB_SQUARE_LHS_RHS: out = sub_square(lhs, rhs); break;
+            case GPU_OP_HYPOT_LHS_RHS: out = hypot(lhs, rhs); break;
+
+            case GPU_OP_SPILL: spills[SPILL_INDEX(&d)] = lhs; break;
+            case GPU_OP_RELOAD: out = spills[SPILL_INDEX(&d)]; break;
 
             default: assert(false);
         }
 #undef lhs
 #undef rhs
 #undef imm
+#undef param
 #undef out
     }
 
@@ -1667,16 +4389,18 @@ void eval_tiles_i_heatmap(uint64_t* const __restrict__ tape_data,
     // Tape pushing!
     // Use this array to track which slots are active
     int* const __restrict__ active = (int*)slots;
-    for (unsigned i=0; i < 128; ++i) {
+    for (unsigned i=0; i < MAX_SLOTS; ++i) {
         active[i] = false;
     }
     active[i_out] = true;
+    SpillMask<MAX_SLOTS> spill_mask;
+    spill_mask.clear();
 
     // Check to make sure the tape isn't full
     // This doesn't mean that we'll successfully claim a chunk, because
     // other threads could claim chunks before us, but it's a way to check
     // quickly (and prevents tape_index from getting absurdly large).
-    if (*tape_index >= NUM_SUBTAPES * SUBTAPE_CHUNK_SIZE) {
+    if (*tape_index >= tape_capacity) {
         return;
     }
 
@@ -1685,7 +4409,7 @@ void eval_tiles_i_heatmap(uint64_t* const __restrict__ tape_data,
     int32_t out_offset = SUBTAPE_CHUNK_SIZE;
 
     // If we've run out of tape, then immediately return
-    if (out_index + out_offset >= NUM_SUBTAPES * SUBTAPE_CHUNK_SIZE) {
+    if (out_index + out_offset >= tape_capacity) {
         return;
     }
 
@@ -1711,9 +4435,10 @@ void eval_tiles_i_heatmap(uint64_t* const __restrict__ tape_data,
         choice_index -= has_choice;
 
         const uint8_t i_out = I_OUT(&d);
-        if (!active[i_out]) {
+        if (!spill_mask.needed(d, active[i_out])) {
             continue;
         }
+        spill_mask.keep(d);
 
         assert(!has_choice || choice_index >= 0);
 
@@ -1730,7 +4455,7 @@ void eval_tiles_i_heatmap(uint64_t* const __restrict__ tape_data,
             const int32_t prev_index = out_index;
 
             // Early exit if we can't finish writing out this tape
-            if (*tape_index >= NUM_SUBTAPES * SUBTAPE_CHUNK_SIZE) {
+            if (*tape_index >= tape_capacity) {
                 const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
                 for (int x=0; x < tile_size_px; ++x) {
                     for (int y=0; y < tile_size_px; ++y) {
@@ -1746,7 +4471,7 @@ void eval_tiles_i_heatmap(uint64_t* const __restrict__ tape_data,
             out_offset = SUBTAPE_CHUNK_SIZE;
 
             // Later exit if we claimed a chunk that exceeds the tape array
-            if (out_index + out_offset >= NUM_SUBTAPES * SUBTAPE_CHUNK_SIZE) {
+            if (out_index + out_offset >= tape_capacity) {
                 const int4 pos = unpack(in_tiles[tile_index].position, tiles_per_side);
                 for (int x=0; x < tile_size_px; ++x) {
                     for (int y=0; y < tile_size_px; ++y) {
@@ -1839,7 +4564,7 @@ void eval_voxels_f_heatmap(const uint64_t* const __restrict__ tape_data,
                            const uint32_t tiles_per_side,
 
                            TileNode* const __restrict__ in_tiles,
-                           const int32_t in_tile_count,
+                           const int32_t* const __restrict__ in_tile_count,
 
                            const float2* const __restrict__ values,
 
@@ -1853,7 +4578,7 @@ void eval_voxels_f_heatmap(const uint64_t* const __restrict__ tape_data,
     // time they're stored in the in_tiles list.
     const int32_t voxel_index = threadIdx.x + blockIdx.x * blockDim.x;
     const int32_t tile_index = voxel_index / 32;
-    if (tile_index >= in_tile_count) {
+    if (tile_index >= *in_tile_count) {
         return;
     }
 
@@ -1872,7 +4597,8 @@ void eval_voxels_f_heatmap(const uint64_t* const __restrict__ tape_data,
         }
     }
 
-    float2 slots[128];
+    float2 slots[MAX_SLOTS];
+    float2 spills[MAX_SPILLS];
 
     // Pick out the tape based on the pointer stored in the tiles list
     const uint64_t* __restrict__ data = &tape_data[in_tiles[tile_index].tape];
@@ -1893,6 +4619,7 @@ void eval_voxels_f_heatmap(const uint64_t* const __restrict__ tape_data,
 #define lhs slots[I_LHS(&d)]
 #define rhs slots[I_RHS(&d)]
 #define imm IMM(&d)
+#define param tape_parameters[PARAM_INDEX(&d)]
 #define out slots[I_OUT(&d)]
 
             case GPU_OP_SQUARE_LHS: out = make_float2(lhs.x * lhs.x, lhs.y * lhs.y); break;
@@ -1906,6 +4633,8 @@ void eval_voxels_f_heatmap(const uint64_t* const __restrict__ tape_data,
             case GPU_OP_EXP_LHS: out = make_float2(expf(lhs.x), expf(lhs.y)); break;
             case GPU_OP_ABS_LHS: out = make_float2(fabsf(lhs.x), fabsf(lhs.y)); break;
             case GPU_OP_LOG_LHS: out = make_float2(logf(lhs.x), logf(lhs.y)); break;
+            case GPU_OP_TAN_LHS: out = make_float2(tanf(lhs.x), tanf(lhs.y)); break;
+            case GPU_OP_RECIP_LHS: out = make_float2(recip(lhs.x), recip(lhs.y)); break;
 
             // Commutative opcodes
             case GPU_OP_ADD_LHS_IMM: out = make_float2(lhs.x + imm, lhs.y + imm); break;
@@ -1925,14 +4654,46 @@ void eval_voxels_f_heatmap(const uint64_t* const __restrict__ tape_data,
             case GPU_OP_DIV_LHS_IMM: out = make_float2(lhs.x / imm, lhs.y / imm); break;
             case GPU_OP_DIV_IMM_RHS: out = make_float2(imm / rhs.x, imm / rhs.y); break;
             case GPU_OP_DIV_LHS_RHS: out = make_float2(lhs.x / rhs.x, lhs.y / rhs.y); break;
+            case GPU_OP_ATAN2_LHS_IMM: out = make_float2(atan2f(lhs.x, imm), atan2f(lhs.y, imm)); break;
+            case GPU_OP_ATAN2_IMM_RHS: out = make_float2(atan2f(imm, rhs.x), atan2f(imm, rhs.y)); break;
+            case GPU_OP_ATAN2_LHS_RHS: out = make_float2(atan2f(lhs.x, rhs.x), atan2f(lhs.y, rhs.y)); break;
+            case GPU_OP_POW_LHS_IMM: out = make_float2(powf(lhs.x, imm), powf(lhs.y, imm)); break;
+            case GPU_OP_POW_IMM_RHS: out = make_float2(powf(imm, rhs.x), powf(imm, rhs.y)); break;
+            case GPU_OP_POW_LHS_RHS: out = make_float2(powf(lhs.x, rhs.x), powf(lhs.y, rhs.y)); break;
+            case GPU_OP_NTH_ROOT_LHS_IMM: out = make_float2(nth_root(lhs.x, imm), nth_root(lhs.y, imm)); break;
+            case GPU_OP_NTH_ROOT_IMM_RHS: out = make_float2(nth_root(imm, rhs.x), nth_root(imm, rhs.y)); break;
+            case GPU_OP_NTH_ROOT_LHS_RHS: out = make_float2(nth_root(lhs.x, rhs.x), nth_root(lhs.y, rhs.y)); break;
+            case GPU_OP_MOD_LHS_IMM: out = make_float2(mod(lhs.x, imm), mod(lhs.y, imm)); break;
+            case GPU_OP_MOD_IMM_RHS: out = make_float2(mod(imm, rhs.x), mod(imm, rhs.y)); break;
+            case GPU_OP_MOD_LHS_RHS: out = make_float2(mod(lhs.x, rhs.x), mod(lhs.y, rhs.y)); break;
+            case GPU_OP_NANFILL_LHS_IMM: out = make_float2(nanfill(lhs.x, imm), nanfill(lhs.y, imm)); break;
+            case GPU_OP_NANFILL_IMM_RHS: out = make_float2(nanfill(imm, rhs.x), nanfill(imm, rhs.y)); break;
+            case GPU_OP_NANFILL_LHS_RHS: out = make_float2(nanfill(lhs.x, rhs.x), nanfill(lhs.y, rhs.y)); break;
+            case GPU_OP_COMPARE_LHS_IMM: out = make_float2(compare(lhs.x, imm), compare(lhs.y, imm)); break;
+            case GPU_OP_COMPARE_IMM_RHS: out = make_float2(compare(imm, rhs.x), compare(imm, rhs.y)); break;
+            case GPU_OP_COMPARE_LHS_RHS: out = make_float2(compare(lhs.x, rhs.x), compare(lhs.y, rhs.y)); break;
 
             case GPU_OP_COPY_IMM: out = make_float2(imm, imm); break;
             case GPU_OP_COPY_LHS: out = make_float2(lhs.x, lhs.y); break;
             case GPU_OP_COPY_RHS: out = make_float2(rhs.x, rhs.y); break;
+            case GPU_OP_PARAM: out = make_float2(param, param); break;
+
+            // Compound opcodes
+            case GPU_OP_MUL_ADD_LHS_RHS_IMM: out = make_float2(fmaf(lhs.x, rhs.x, imm), fmaf(lhs.y, rhs.y, imm)); break;
+            case GPU_OP_MUL_ADD_LHS_IMM_RHS: out = make_float2(fmaf(lhs.x, imm, rhs.x), fmaf(lhs.y, imm, rhs.y)); break;
+            case GPU_OP_SQUARE_ADD_LHS_IMM: out = make_float2(fmaf(lhs.x, lhs.x, imm), fmaf(lhs.y, lhs.y, imm)); break;
+            case GPU_OP_SQUARE_ADD_LHS_RHS: out = make_float2(fmaf(lhs.x, lhs.x, rhs.x), fmaf(lhs.y, lhs.y, rhs.y)); break;
+            case GPU_OP_SUB_SQUARE_LHS_IMM: out = make_float2((lhs.x - imm) * (lhs.x - imm), (lhs.y - imm) * (lhs.y - imm)); break;
+            case GPU_OP_SUB_SQUARE_LHS_RHS: out = make_float2((lhs.x - rhs.x) * (lhs.x - rhs.x), (lhs.y - rhs.y) * (lhs.y - rhs.y)); break;
+            case GPU_OP_HYPOT_LHS_RHS: out = make_float2(hypotf(lhs.x, rhs.x), hypotf(lhs.y, rhs.y)); break;
+
+            case GPU_OP_SPILL: spills[SPILL_INDEX(&d)] = lhs; break;
+            case GPU_OP_RELOAD: out = spills[SPILL_INDEX(&d)]; break;
 
 #undef lhs
 #undef rhs
 #undef imm
+#undef param
 #undef out
         }
     }
@@ -1985,14 +4746,17 @@ Ptr<float[]> Context::render2D_heatmap(const Tape& tape,
                                        const Eigen::Matrix3f& mat,
                                        const float z)
 {
+    require_cuda(*this, "render2D_heatmap");
+    release_retired(*this);
+    reserve_subtapes(*this);
+
     // Build the heatmap for this render
     Ptr<float[]> heatmap(CUDA_MALLOC(float, pow(image_size_px, 2)));
     cudaMemset(heatmap.get(), 0, sizeof(float) * pow(image_size_px, 2));
 
-    // Reset the tape index and copy the tape to the beginning of the
-    // context's tape buffer area.
-    *tape_index = tape.length;
-    cudaMemcpyAsync(tape_data.get(), tape.data.get(),
+    // Copy the tape to the beginning of the context's tape buffer area.
+    // The tape index is reset to the end of this tape by preload_tiles.
+    cudaMemcpyAsync(impl->scratch->tape_data.get(), tape.data.get(),
                     sizeof(uint64_t) * tape.length,
                     cudaMemcpyDeviceToDevice);
 
@@ -2009,21 +4773,26 @@ Ptr<float[]> Context::render2D_heatmap(const Tape& tape,
     // Evaluation of 64x64 tiles
     ////////////////////////////////////////////////////////////////////////////
 
+    CUDA_CHECK(cudaMemsetAsync(impl->tile_counts.get(), 0,
+                               sizeof(int32_t) * 4));
+
     // Go the whole list of first-stage tiles, assigning each to
     // be [position, tape = 0, next = -1]
     unsigned count = pow(image_size_px / 64, 2);
     unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
-    preload_tiles<<<num_blocks, NUM_THREADS>>>(stages[0].tiles.get(), count);
+    drop_tile_cache(*this, 0);
+    preload_tiles<<<num_blocks, NUM_THREADS>>>(
+        stages[0].tiles.get(), count, impl->tile_counts.get(),
+        impl->tape_index.get(), tape.length, impl->tape_overflows.get(),
+        image_size_px / 64, 0, 1,
+        make_int4(0, 0, image_size_px / 64, image_size_px / 64), nullptr);
 
     // Iterate over 64^2, 8^2 tiles
     for (unsigned i=0; i < 3; i += 2) {
         const unsigned tile_size_px = i ? 8 : 64;
         const unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
 
-        if (values_size < num_blocks * NUM_THREADS * 3) {
-            values.reset(CUDA_MALLOC(Interval, num_blocks * NUM_THREADS * 3));
-            values_size = num_blocks * NUM_THREADS * 3;
-        }
+        reserve_values<Interval>(*this, num_blocks * NUM_THREADS * 3);
 
         // Unpack position values into interval X/Y/Z in the values array
         // This is done in a separate kernel to avoid bloating the
@@ -2031,60 +4800,58 @@ Ptr<float[]> Context::render2D_heatmap(const Tape& tape,
         // to occupancy.
         calculate_intervals_2d<<<num_blocks, NUM_THREADS>>>(
             stages[i].tiles.get(),
-            count,
+            impl->tile_counts.get() + i,
             image_size_px / tile_size_px,
-            mat, z,
-            reinterpret_cast<Interval*>(values.get()));
+            mat, z, z,
+            reinterpret_cast<Interval*>(impl->scratch->values.get()));
 
         // Do the actual tape evaluation, which is the expensive step
         eval_tiles_i_heatmap<2><<<num_blocks, NUM_THREADS>>>(
-            tape_data.get(),
-            tape_index.get(),
+            impl->scratch->tape_data.get(),
+            impl->tape_index.get(),
+            tape_capacity(),
             stages[i].filled.get(),
             image_size_px / tile_size_px,
 
             stages[i].tiles.get(),
-            count,
+            impl->tile_counts.get() + i,
 
-            reinterpret_cast<Interval*>(values.get()),
+            reinterpret_cast<Interval*>(impl->scratch->values.get()),
 
             tile_size_px,
             heatmap.get());
 
-        // Mark the total number of active tiles (from this stage) to 0
-        cudaMemsetAsync(num_active_tiles.get(), 0, sizeof(int32_t));
-
         // Count up active tiles, to figure out how much memory needs to be
         // allocated in the next stage.
+        const int next = i ? 3 : 2;
         assign_next_nodes<<<num_blocks, NUM_THREADS>>>(
             stages[i].tiles.get(),
-            count,
-            num_active_tiles.get());
+            impl->tile_counts.get() + i,
+            impl->tile_counts.get() + next,
+            i ? 1 : 64,
+            INT32_MAX);
 
         // Count the number of active tiles, which have been accumulated
         // through repeated calls to assign_next_nodes
         int32_t active_tile_count;
-        cudaMemcpy(&active_tile_count, num_active_tiles.get(), sizeof(int32_t),
-                   cudaMemcpyDeviceToHost);
-        if (i == 0) {
-            active_tile_count *= 64;
-        }
+        cudaMemcpy(&active_tile_count, impl->tile_counts.get() + next,
+                   sizeof(int32_t), cudaMemcpyDeviceToHost);
 
         // Make sure that the subtiles buffer has enough room
         // This wastes a small amount of data for the per-pixel evaluation,
         // where the `next` indexes aren't used, but it's relatively small.
-        const int next = i ? 3 : 2;
-        if (active_tile_count > stages[next].tile_array_size) {
-            stages[next].tile_array_size = active_tile_count;
-            stages[next].tiles.reset(CUDA_MALLOC(TileNode, active_tile_count));
-        }
+        reserve_scratch<TileNode>(*this, stages[next].tiles,
+                                  stages[next].tile_array_size,
+                                  active_tile_count);
 
         if (i < 2) {
             // Build the new tile list from active tiles in the previous list
             subdivide_active_tiles_2d<<<num_blocks*64, NUM_THREADS>>>(
                 stages[i].tiles.get(),
-                count,
+                impl->tile_counts.get() + i,
                 image_size_px / tile_size_px,
+                make_int4(0, 0, image_size_px / (tile_size_px / 8),
+                          image_size_px / (tile_size_px / 8)),
                 stages[next].tiles.get());
         } else {
             // Special case for per-pixel evaluation, which
@@ -2092,7 +4859,7 @@ Ptr<float[]> Context::render2D_heatmap(const Tape& tape,
             // 64x extra space).
             copy_active_tiles<<<num_blocks, NUM_THREADS>>>(
                 stages[i].tiles.get(),
-                count,
+                impl->tile_counts.get() + i,
                 stages[next].tiles.get());
         }
 
@@ -2115,25 +4882,22 @@ Ptr<float[]> Context::render2D_heatmap(const Tape& tape,
     // Time to render individual pixels!
     num_blocks = (count + NUM_TILES - 1) / NUM_TILES;
     const size_t num_values = num_blocks * NUM_TILES * 32 * 3;
-    if (values_size < num_values) {
-        values.reset(CUDA_MALLOC(float2, num_values));
-        values_size = num_values;
-    }
+    reserve_values<float2>(*this, num_values);
     calculate_pixels<<<num_blocks, NUM_TILES * 32>>>(
         stages[3].tiles.get(),
-        count,
+        impl->tile_counts.get() + 3,
         image_size_px / 8,
         mat, z,
-        reinterpret_cast<float2*>(values.get()));
+        reinterpret_cast<float2*>(impl->scratch->values.get()));
     eval_voxels_f_heatmap<2><<<num_blocks, NUM_TILES * 32>>>(
-        tape_data.get(),
+        impl->scratch->tape_data.get(),
         stages[3].filled.get(),
         image_size_px / 8,
 
         stages[3].tiles.get(),
-        count,
+        impl->tile_counts.get() + 3,
 
-        reinterpret_cast<float2*>(values.get()),
+        reinterpret_cast<float2*>(impl->scratch->values.get()),
         heatmap.get());
     CUDA_CHECK(cudaDeviceSynchronize());
 
@@ -2148,14 +4912,18 @@ Ptr<float[]> Context::render2D_heatmap(const Tape& tape,
 Ptr<float[]> Context::render3D_heatmap(const Tape& tape,
                                        const Eigen::Matrix4f& mat)
 {
+    require_cuda(*this, "render3D_heatmap");
+    release_retired(*this);
+    reserve_subtapes(*this);
+    alloc_normals(*this);
+
     // Build the heatmap for this render
     Ptr<float[]> heatmap(CUDA_MALLOC(float, pow(image_size_px, 2)));
     cudaMemset(heatmap.get(), 0, sizeof(float) * pow(image_size_px, 2));
 
-    // Reset the tape index and copy the tape to the beginning of the
-    // context's tape buffer area.
-    *tape_index = tape.length;
-    cudaMemcpyAsync(tape_data.get(), tape.data.get(),
+    // Copy the tape to the beginning of the context's tape buffer area.
+    // The tape index is reset to the end of this tape by preload_tiles.
+    cudaMemcpyAsync(impl->scratch->tape_data.get(), tape.data.get(),
                     sizeof(uint64_t) * tape.length,
                     cudaMemcpyDeviceToDevice);
 
@@ -2172,11 +4940,21 @@ Ptr<float[]> Context::render3D_heatmap(const Tape& tape,
     CUDA_CHECK(cudaMemsetAsync(normals.get(), 0, sizeof(uint32_t) *
                                pow(image_size_px, 2)));
 
+    CUDA_CHECK(cudaMemsetAsync(impl->tile_counts.get(), 0,
+                               sizeof(int32_t) * 4));
+
+    store_matrix<<<1, 1>>>(impl->mat_buffer.get(), mat);
+
     // Go the whole list of first-stage tiles, assigning each to
     // be [position, tape = 0, next = -1]
     unsigned count = pow(image_size_px / 64, 3);
     unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
-    preload_tiles<<<num_blocks, NUM_THREADS>>>(stages[0].tiles.get(), count);
+    drop_tile_cache(*this, 0);
+    preload_tiles<<<num_blocks, NUM_THREADS>>>(
+        stages[0].tiles.get(), count, impl->tile_counts.get(),
+        impl->tape_index.get(), tape.length, impl->tape_overflows.get(),
+        image_size_px / 64, 0, 1,
+        make_int4(0, 0, image_size_px / 64, image_size_px / 64), nullptr);
 
     // Iterate over 64^3, 16^3, 4^3 tiles
     for (unsigned i=0; i < 3; ++i) {
@@ -2184,10 +4962,7 @@ Ptr<float[]> Context::render3D_heatmap(const Tape& tape,
         const unsigned tile_size_px = 64 / (1 << (i * 2));
         const unsigned num_blocks = (count + NUM_THREADS - 1) / NUM_THREADS;
 
-        if (values_size < num_blocks * NUM_THREADS * 3) {
-            values.reset(CUDA_MALLOC(Interval, num_blocks * NUM_THREADS * 3));
-            values_size = num_blocks * NUM_THREADS * 3;
-        }
+        reserve_values<Interval>(*this, num_blocks * NUM_THREADS * 3);
 
         // Unpack position values into interval X/Y/Z in the values array
         // This is done in a separate kernel to avoid bloating the
@@ -2195,10 +4970,10 @@ Ptr<float[]> Context::render3D_heatmap(const Tape& tape,
         // to occupancy.
         calculate_intervals_3d<<<num_blocks, NUM_THREADS>>>(
             stages[i].tiles.get(),
-            count,
+            impl->tile_counts.get() + i,
             image_size_px / tile_size_px,
-            mat,
-            reinterpret_cast<Interval*>(values.get()));
+            impl->mat_buffer.get(),
+            reinterpret_cast<Interval*>(impl->scratch->values.get()));
 
         // Mark every tile which is covered in the image as masked,
         // which means it will be skipped later on.  We do this again below,
@@ -2208,25 +4983,24 @@ Ptr<float[]> Context::render3D_heatmap(const Tape& tape,
             stages[i].filled.get(),
             image_size_px / tile_size_px,
             stages[i].tiles.get(),
-            count);
+            impl->tile_counts.get() + i,
+            nullptr);
 
         // Do the actual tape evaluation, which is the expensive step
         eval_tiles_i_heatmap<3><<<num_blocks, NUM_THREADS>>>(
-            tape_data.get(),
-            tape_index.get(),
+            impl->scratch->tape_data.get(),
+            impl->tape_index.get(),
+            tape_capacity(),
             stages[i].filled.get(),
             image_size_px / tile_size_px,
 
             stages[i].tiles.get(),
-            count,
+            impl->tile_counts.get() + i,
 
-            reinterpret_cast<Interval*>(values.get()),
+            reinterpret_cast<Interval*>(impl->scratch->values.get()),
             tile_size_px,
             heatmap.get());
 
-        // Mark the total number of active tiles (from this stage) to 0
-        cudaMemsetAsync(num_active_tiles.get(), 0, sizeof(int32_t));
-
         // Now that we have evaluated every tile at this level, we do one more
         // round of occlusion culling before accumulating tiles to render at
         // the next phase.
@@ -2234,38 +5008,39 @@ Ptr<float[]> Context::render3D_heatmap(const Tape& tape,
             stages[i].filled.get(),
             image_size_px / tile_size_px,
             stages[i].tiles.get(),
-            count);
+            impl->tile_counts.get() + i,
+            nullptr);
 
         // Count up active tiles, to figure out how much memory needs to be
         // allocated in the next stage.
         assign_next_nodes<<<num_blocks, NUM_THREADS>>>(
             stages[i].tiles.get(),
-            count,
-            num_active_tiles.get());
+            impl->tile_counts.get() + i,
+            impl->tile_counts.get() + i + 1,
+            i < 2 ? 64 : 1,
+            INT32_MAX);
 
         // Count the number of active tiles, which have been accumulated
         // through repeated calls to assign_next_nodes
         int32_t active_tile_count;
-        cudaMemcpy(&active_tile_count, num_active_tiles.get(), sizeof(int32_t),
-                   cudaMemcpyDeviceToHost);
-        if (i < 2) {
-            active_tile_count *= 64;
-        }
+        cudaMemcpy(&active_tile_count, impl->tile_counts.get() + i + 1,
+                   sizeof(int32_t), cudaMemcpyDeviceToHost);
 
         // Make sure that the subtiles buffer has enough room
         // This wastes a small amount of data for the per-pixel evaluation,
         // where the `next` indexes aren't used, but it's relatively small.
-        if (active_tile_count > stages[i + 1].tile_array_size) {
-            stages[i + 1].tile_array_size = active_tile_count;
-            stages[i + 1].tiles.reset(CUDA_MALLOC(TileNode, active_tile_count));
-        }
+        reserve_scratch<TileNode>(*this, stages[i + 1].tiles,
+                                  stages[i + 1].tile_array_size,
+                                  active_tile_count);
 
         if (i < 2) {
             // Build the new tile list from active tiles in the previous list
             subdivide_active_tiles_3d<<<num_blocks*64, NUM_THREADS>>>(
                 stages[i].tiles.get(),
-                count,
+                impl->tile_counts.get() + i,
                 image_size_px / tile_size_px,
+                make_int4(0, 0, image_size_px / (tile_size_px / 4),
+                          image_size_px / (tile_size_px / 4)),
                 stages[i + 1].tiles.get());
         } else {
             // Special case for per-pixel evaluation, which
@@ -2273,7 +5048,7 @@ Ptr<float[]> Context::render3D_heatmap(const Tape& tape,
             // 64x extra space).
             copy_active_tiles<<<num_blocks, NUM_THREADS>>>(
                 stages[i].tiles.get(),
-                count,
+                impl->tile_counts.get() + i,
                 stages[i + 1].tiles.get());
         }
 
@@ -2296,35 +5071,32 @@ Ptr<float[]> Context::render3D_heatmap(const Tape& tape,
     // Time to render individual pixels!
     num_blocks = (count + NUM_TILES - 1) / NUM_TILES;
     const size_t num_values = num_blocks * NUM_TILES * 32 * 3;
-    if (values_size < num_values) {
-        values.reset(CUDA_MALLOC(float2, num_values));
-        values_size = num_values;
-    }
+    reserve_values<float2>(*this, num_values);
     calculate_voxels<<<num_blocks, NUM_TILES * 32>>>(
         stages[3].tiles.get(),
-        count,
+        impl->tile_counts.get() + 3,
         image_size_px / 4,
-        mat,
-        reinterpret_cast<float2*>(values.get()));
+        impl->mat_buffer.get(),
+        reinterpret_cast<float2*>(impl->scratch->values.get()));
     eval_voxels_f_heatmap<3><<<num_blocks, NUM_TILES * 32>>>(
-        tape_data.get(),
+        impl->scratch->tape_data.get(),
         stages[3].filled.get(),
         image_size_px / 4,
 
         stages[3].tiles.get(),
-        count,
+        impl->tile_counts.get() + 3,
 
-        reinterpret_cast<float2*>(values.get()),
+        reinterpret_cast<float2*>(impl->scratch->values.get()),
         heatmap.get());
 
     {   // Then render normals into those pixels
         const uint32_t u = ((image_size_px + 15) / 16);
-        eval_pixels_d<<<dim3(u, u), dim3(16, 16)>>>(
-                tape_data.get(),
+        eval_pixels_d<MAX_SLOTS><<<dim3(u, u), dim3(16, 16)>>>(
+                impl->scratch->tape_data.get(),
                 stages[3].filled.get(),
                 normals.get(),
                 image_size_px,
-                mat,
+                impl->mat_buffer.get(),
                 stages[0].tiles.get(),
                 stages[1].tiles.get(),
                 stages[2].tiles.get());
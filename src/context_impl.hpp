@@ -0,0 +1,160 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#pragma once
+#include <memory>
+#include <vector>
+
+#include "context.hpp"
+
+namespace mpr {
+
+struct CpuPool;
+
+/*  Scratch space which is rebuilt from scratch by every frame: the subtape
+ *  pool (`tape_data`, with `num_subtapes` chunks of SUBTAPE_CHUNK_SIZE
+ *  clauses) and the `values` buffer which passes data between kernels.
+ *  Since nothing in it outlives a frame, it can be shared between contexts
+ *  whose frames never overlap (see Context::shareScratch). */
+struct ScratchPool {
+    Ptr<uint64_t[]> tape_data;    // original tape is copied to index 0
+    size_t num_subtapes=0;
+    Ptr<void> values;
+    size_t values_size=0;
+};
+
+/*  A 3D frame which is enqueued one stage at a time.  begin_frame_3d does
+ *  the per-frame setup, then each call to enqueue_stage_3d enqueues `stage`
+ *  (0-2 are the interval stages, 3 is voxels and normals) and advances it;
+ *  the frame is finished once `stage` reaches 4. */
+struct Frame3D {
+    std::vector<const Tape*> tapes;
+    int32_t num_shapes=0;
+    int32_t slots=0;        // Slot array size for every kernel
+    bool shared=true;       // Every shape uses the tape at 0
+    bool cached=false;      // The first stage used the tile cache
+    unsigned count=0;       // Tiles covered by the next stage's launches
+    int32_t stage=0;
+};
+
+/*  Buffers and bookkeeping which the renderer keeps between frames, but
+ *  which aren't part of a Context's options or outputs */
+struct Context::Impl {
+    /*  The subtape pool and `values` buffer, which may be shared with other
+     *  contexts via shareScratch */
+    std::shared_ptr<ScratchPool> scratch;
+    Ptr<int32_t> tape_index;    // single value
+
+    Ptr<int32_t[]> tile_counts;             // Tile count per stage
+    HostPtr<int32_t[]> tile_counts_host;    // Pinned readback of tile_counts
+
+    // Tiles in each 3D stage which were masked before being evaluated
+    Ptr<int32_t[]> cull_counts;
+    HostPtr<int32_t[]> cull_counts_host;
+
+    Ptr<int32_t> tape_overflows;            // Failed pushes in this frame,
+                                            // then pushes and their length
+    HostPtr<int32_t> tape_overflows_host;   // Pinned readback of failures
+
+    // Hash table for dedupe_subtapes
+    Ptr<void> subtape_table;
+    size_t subtape_table_size=0;    // In entries, always a power of two
+
+    // Tile cache for incremental mode
+    Ptr<void> tile_cache;       // One entry per first-stage tile
+    size_t tile_cache_size=0;
+    Ptr<void> tile_cache_state; // Tape key and end of the cached subtapes
+
+    size_t slice_bits_size=0;
+    Ptr<int32_t[]> slice_state;  // Saved pool index, then spare counters
+
+    Ptr<int32_t[]> volume_filled[3];    // See Context::volumeFilled
+    size_t volume_filled_size[3]={0, 0, 0};
+    size_t volume_masks_size=0;
+    Ptr<int32_t[]> volume_counts;   // Device copy of volume_counts_host
+
+    size_t mesh_vertices_size=0;
+    size_t mesh_normals_size=0;
+    size_t mesh_indices_size=0;
+    Ptr<int32_t[]> mesh_counts;     // Device copy of mesh_counts_host
+
+    Event frame_done;   // Recorded at the end of each async render
+
+    std::vector<Event> stats_events;
+    HostPtr<int32_t[]> stats_host;
+
+    std::vector<Ptr<void>> retired;
+    size_t retired_bytes=0;
+    size_t scratch_bytes=0;         // Live scratch buffers
+    size_t scratch_high_water=0;    // Peak of live + retired scratch bytes
+
+    // The 3D transform matrices (one per shape), which kernels read from
+    // device memory, and the start of each shape's tape in `tape_data`
+    // (which is only allocated once a batch has been rendered).
+    Ptr<Eigen::Matrix4f[]> mat_buffer;
+    Ptr<int32_t[]> tape_starts;
+    size_t batch_size=0;    // Capacity of mat_buffer and tape_starts
+
+    // Cached graph for renderCached, with the buffers that it was recorded
+    // against (stage tiles, then values and images), used to detect
+    // reallocations.
+    const Tape* cached_tape=nullptr;
+    GraphExec graph;
+    std::vector<const void*> graph_buffers;
+    Stream capture_stream;
+
+    Frame3D progressive;    // Frame in progress for beginRender3D
+
+    // Scratch space for evalPoints: one tile per cluster of points (and
+    // their count), then device copies of host inputs and outputs
+    Ptr<TileNode[]> point_blocks;
+    size_t point_blocks_size=0;
+    Ptr<int32_t> point_block_count;
+    Ptr<void> point_staging;
+    size_t point_staging_size=0;
+
+    // Host threads and stats for BACKEND_CPU
+    std::shared_ptr<CpuPool> cpu_pool;
+    RenderStats cpu_stats=RenderStats();
+};
+
+/*  Allocates a buffer which is only accessed from the GPU, following the
+ *  context's `memory_policy` */
+template <typename T>
+T* alloc(const Context& ctx, size_t count) {
+    return (ctx.memory_policy == MEMORY_DEVICE) ? CUDA_MALLOC_DEVICE(T, count)
+                                                : CUDA_MALLOC(T, count);
+}
+
+/*  Allocates an output image, which is managed memory (so that the host
+ *  can read it), or host memory with BACKEND_CPU */
+template <typename T>
+Ptr<T[]> alloc_image(const Context& ctx, size_t count) {
+    if (ctx.backend == BACKEND_CPU) {
+        return Ptr<T[]>(HOST_MALLOC(T, count), Deleter(true));
+    }
+    return Ptr<T[]>(CUDA_MALLOC(T, count));
+}
+
+/*  Throws std::runtime_error if `ctx` uses BACKEND_CPU, naming the entry
+ *  point (which only has a CUDA implementation) in the message */
+void require_cuda(const Context& ctx, const char* name);
+
+/*  Grows every stage's `filled` image, `normals`, and the first stage's
+ *  tile array to hold `count` shapes, retiring the old buffers */
+void reserve_images(Context& ctx, int32_t count);
+
+/*  Allocates `normals` for every image, if they haven't been allocated
+ *  yet.  This is called by the first frame which renders normals, so that
+ *  contexts which only render depth never pay for them. */
+void alloc_normals(Context& ctx);
+
+}   // namespace mpr
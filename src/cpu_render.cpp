@@ -0,0 +1,2162 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#if defined(__AVX512F__) || (defined(__AVX2__) && defined(__FMA__))
+#include <immintrin.h>
+#endif
+
+#include "cpu_render.hpp"
+#include "clause.hpp"
+#include "gpu_opcode.hpp"
+#include "parameters.hpp"
+#include "render_stats.hpp"
+#include "tape.hpp"
+
+namespace mpr {
+
+/*
+ *  A pool of worker threads with one task queue per worker.  Workers take
+ *  tasks from the back of their own queue (so the tasks that they spawned
+ *  most recently, whose data is still in cache, run first), and steal from
+ *  the front of other queues (taking the oldest, and usually largest,
+ *  tasks) when theirs is empty.
+ *
+ *  The pool belongs to one Context, so only one run is active at a time.
+ */
+struct CpuPool {
+    explicit CpuPool(int32_t threads);
+    ~CpuPool();
+
+    int32_t size() const { return threads.size(); }
+
+    /*  Runs every task in `tasks` (and everything that they spawn), then
+     *  returns once they've all finished.  The calling thread only waits. */
+    void run(std::vector<std::function<void()>>& tasks);
+
+    /*  Adds a task to the current run, from inside one of its tasks */
+    void spawn(std::function<void()> task);
+
+    /*  Returns the index of the calling worker, or -1 for other threads */
+    static int32_t worker();
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+    void push(int32_t i, std::function<void()> task);
+    bool pop(int32_t i, std::function<void()>& task);
+    void loop(int32_t i);
+
+    std::vector<std::unique_ptr<Queue>> queues;
+
+    std::mutex mutex;               // Guards sleeping and `stop`
+    std::condition_variable wake;   // Signalled when a task is queued
+    std::condition_variable done;   // Signalled when `pending` reaches 0
+    std::atomic<int64_t> queued;    // Tasks waiting in a queue
+    std::atomic<int64_t> pending;   // Tasks which haven't finished
+    bool stop=false;
+
+    // Declared last, so that workers start after everything else is built
+    std::vector<std::thread> threads;
+};
+
+static thread_local int32_t worker_index = -1;
+
+CpuPool::CpuPool(int32_t count)
+    : queued(0), pending(0)
+{
+    for (int32_t i=0; i < count; ++i) {
+        queues.emplace_back(new Queue);
+    }
+    for (int32_t i=0; i < count; ++i) {
+        threads.emplace_back([this, i]() { loop(i); });
+    }
+}
+
+CpuPool::~CpuPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    wake.notify_all();
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+int32_t CpuPool::worker() {
+    return worker_index;
+}
+
+void CpuPool::push(int32_t i, std::function<void()> task) {
+    ++pending;
+    ++queued;
+    {
+        std::lock_guard<std::mutex> lock(queues[i]->mutex);
+        queues[i]->tasks.push_back(std::move(task));
+    }
+    // Taking the lock makes sure that a worker which just found nothing to
+    // do is either already waiting (and is woken) or will see `queued`
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+    }
+    wake.notify_one();
+}
+
+bool CpuPool::pop(int32_t i, std::function<void()>& task) {
+    {
+        Queue& q = *queues[i];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (!q.tasks.empty()) {
+            task = std::move(q.tasks.back());
+            q.tasks.pop_back();
+            --queued;
+            return true;
+        }
+    }
+    const int32_t n = queues.size();
+    for (int32_t k=1; k < n; ++k) {
+        Queue& q = *queues[(i + k) % n];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (!q.tasks.empty()) {
+            task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+            --queued;
+            return true;
+        }
+    }
+    return false;
+}
+
+void CpuPool::loop(int32_t i) {
+    worker_index = i;
+    std::function<void()> task;
+    while (true) {
+        if (pop(i, task)) {
+            task();
+            task = nullptr;
+            if (--pending == 0) {
+                std::lock_guard<std::mutex> lock(mutex);
+                done.notify_all();
+            }
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [&]() { return stop || queued > 0; });
+        if (stop) {
+            return;
+        }
+    }
+}
+
+void CpuPool::run(std::vector<std::function<void()>>& tasks) {
+    for (size_t i=0; i < tasks.size(); ++i) {
+        push(i % queues.size(), std::move(tasks[i]));
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&]() { return pending == 0; });
+}
+
+void CpuPool::spawn(std::function<void()> task) {
+    const int32_t i = worker();
+    assert(i >= 0);
+    push(i, std::move(task));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+namespace cpu {
+
+#ifdef __AVX512F__
+static constexpr int LANES = 16;
+#else
+static constexpr int LANES = 8;
+#endif
+
+// Voxels are evaluated one 4x4 layer at a time
+static_assert(16 % LANES == 0, "Layers must be a whole number of batches");
+
+static const float INF = std::numeric_limits<float>::infinity();
+static const float NAN_F = std::numeric_limits<float>::quiet_NaN();
+static const double PI = 3.14159265358979323846;
+
+// Host copy of the GPU's tape_parameters (see setCpuParameters)
+static float parameters[MAX_PARAMETERS];
+
+////////////////////////////////////////////////////////////////////////////////
+// Scalar versions of the libfive opcodes which don't have a builtin, which
+// match gpu_float.hpp
+
+static inline float recip(const float& a) {
+    return 1.0f / a;
+}
+
+static inline double nth_root(const double& a, const double& n) {
+    return (a < 0.0 && std::fabs(std::fmod(n, 2.0)) == 1.0)
+        ? -std::pow(-a, 1.0 / n)
+        : std::pow(a, 1.0 / n);
+}
+
+static inline float nth_root(const float& a, const float& n) {
+    return (a < 0.0f && std::fabs(std::fmod(n, 2.0f)) == 1.0f)
+        ? -std::pow(-a, 1.0f / n)
+        : std::pow(a, 1.0f / n);
+}
+
+static inline float mod(const float& a, const float& b) {
+    const float r = std::fmod(a, b);
+    return (r < 0.0f) ? (r + b) : r;
+}
+
+static inline float nanfill(const float& a, const float& b) {
+    return std::isnan(a) ? b : a;
+}
+
+static inline float compare(const float& a, const float& b) {
+    return (a < b) ? -1.0f : ((a > b) ? 1.0f : 0.0f);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Arithmetic on a batch of LANES floats, for the opcodes in eval_lanes which
+// have a vector instruction.  We can't leave this to the auto-vectorizer:
+// GCC 12 (checked with -fopt-info-vec-missed) fully unrolls the equivalent
+// loops over slots into scalar code, since an output slot may alias an
+// input.  Slots are aligned to a cache line (see Scratch), so loads and
+// stores are aligned.  Without AVX2 (or AVX-512), these are plain loops.
+//
+// vmin and vmax follow std::fmin and std::fmax, which return the other
+// operand if one is NaN (the hardware instructions return their second
+// operand instead).  Like std::fmin, they may return either zero when
+// comparing 0 and -0.
+
+#if defined(__AVX512F__)
+typedef __m512 Lanes;
+static inline Lanes vload(const float* p) { return _mm512_load_ps(p); }
+static inline void vstore(float* p, Lanes a) { _mm512_store_ps(p, a); }
+static inline Lanes vsplat(float f) { return _mm512_set1_ps(f); }
+static inline Lanes vadd(Lanes a, Lanes b) { return _mm512_add_ps(a, b); }
+static inline Lanes vsub(Lanes a, Lanes b) { return _mm512_sub_ps(a, b); }
+static inline Lanes vmul(Lanes a, Lanes b) { return _mm512_mul_ps(a, b); }
+static inline Lanes vdiv(Lanes a, Lanes b) { return _mm512_div_ps(a, b); }
+static inline Lanes vfma(Lanes a, Lanes b, Lanes c) {
+    return _mm512_fmadd_ps(a, b, c);
+}
+static inline Lanes vsqrt(Lanes a) { return _mm512_sqrt_ps(a); }
+static inline Lanes vabs(Lanes a) { return _mm512_abs_ps(a); }
+static inline Lanes vneg(Lanes a) {
+    return _mm512_castsi512_ps(_mm512_xor_si512(
+        _mm512_castps_si512(a), _mm512_set1_epi32(0x80000000)));
+}
+static inline Lanes vmin(Lanes a, Lanes b) {
+    return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(a, a, _CMP_UNORD_Q),
+                                _mm512_min_ps(b, a), b);
+}
+static inline Lanes vmax(Lanes a, Lanes b) {
+    return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(a, a, _CMP_UNORD_Q),
+                                _mm512_max_ps(b, a), b);
+}
+#elif defined(__AVX2__) && defined(__FMA__)
+typedef __m256 Lanes;
+static inline Lanes vload(const float* p) { return _mm256_load_ps(p); }
+static inline void vstore(float* p, Lanes a) { _mm256_store_ps(p, a); }
+static inline Lanes vsplat(float f) { return _mm256_set1_ps(f); }
+static inline Lanes vadd(Lanes a, Lanes b) { return _mm256_add_ps(a, b); }
+static inline Lanes vsub(Lanes a, Lanes b) { return _mm256_sub_ps(a, b); }
+static inline Lanes vmul(Lanes a, Lanes b) { return _mm256_mul_ps(a, b); }
+static inline Lanes vdiv(Lanes a, Lanes b) { return _mm256_div_ps(a, b); }
+static inline Lanes vfma(Lanes a, Lanes b, Lanes c) {
+    return _mm256_fmadd_ps(a, b, c);
+}
+static inline Lanes vsqrt(Lanes a) { return _mm256_sqrt_ps(a); }
+static inline Lanes vabs(Lanes a) {
+    return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a);
+}
+static inline Lanes vneg(Lanes a) {
+    return _mm256_xor_ps(a, _mm256_set1_ps(-0.0f));
+}
+static inline Lanes vmin(Lanes a, Lanes b) {
+    return _mm256_blendv_ps(_mm256_min_ps(b, a), b,
+                            _mm256_cmp_ps(a, a, _CMP_UNORD_Q));
+}
+static inline Lanes vmax(Lanes a, Lanes b) {
+    return _mm256_blendv_ps(_mm256_max_ps(b, a), b,
+                            _mm256_cmp_ps(a, a, _CMP_UNORD_Q));
+}
+#else
+struct Lanes { float v[LANES]; };
+#define LANE_MAP(expr) Lanes out; \
+    for (int k=0; k < LANES; ++k) { out.v[k] = (expr); } return out
+static inline Lanes vload(const float* p) { LANE_MAP(p[k]); }
+static inline void vstore(float* p, Lanes a) {
+    std::copy(a.v, a.v + LANES, p);
+}
+static inline Lanes vsplat(float f) { LANE_MAP(f); }
+static inline Lanes vadd(Lanes a, Lanes b) { LANE_MAP(a.v[k] + b.v[k]); }
+static inline Lanes vsub(Lanes a, Lanes b) { LANE_MAP(a.v[k] - b.v[k]); }
+static inline Lanes vmul(Lanes a, Lanes b) { LANE_MAP(a.v[k] * b.v[k]); }
+static inline Lanes vdiv(Lanes a, Lanes b) { LANE_MAP(a.v[k] / b.v[k]); }
+static inline Lanes vfma(Lanes a, Lanes b, Lanes c) {
+    LANE_MAP(std::fma(a.v[k], b.v[k], c.v[k]));
+}
+static inline Lanes vsqrt(Lanes a) { LANE_MAP(std::sqrt(a.v[k])); }
+static inline Lanes vabs(Lanes a) { LANE_MAP(std::fabs(a.v[k])); }
+static inline Lanes vneg(Lanes a) { LANE_MAP(-a.v[k]); }
+static inline Lanes vmin(Lanes a, Lanes b) {
+    LANE_MAP(std::fmin(a.v[k], b.v[k]));
+}
+static inline Lanes vmax(Lanes a, Lanes b) {
+    LANE_MAP(std::fmax(a.v[k], b.v[k]));
+}
+#undef LANE_MAP
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Interval arithmetic, which follows gpu_interval.hpp.  The host doesn't
+// have float instructions with directed rounding, so bounds are computed in
+// double precision and then rounded outwards to float.
+
+/*  Rounds an exact value down or up to a float */
+static inline float down(double d) {
+    const float f = d;
+    return (f > d) ? std::nextafter(f, -INF) : f;
+}
+
+static inline float up(double d) {
+    const float f = d;
+    return (f < d) ? std::nextafter(f, INF) : f;
+}
+
+/*  Rounds a value which may have already been rounded (a quotient, or the
+ *  result of a libm function), so it's always moved outwards */
+static inline float down_inexact(double d) {
+    const float f = d;
+    return (f >= d) ? std::nextafter(f, -INF) : f;
+}
+
+static inline float up_inexact(double d) {
+    const float f = d;
+    return (f <= d) ? std::nextafter(f, INF) : f;
+}
+
+/*  Sums of two floats are exact in double precision unless their exponents
+ *  are very far apart, and the error term from TwoSum says which way the
+ *  sum was rounded in that case */
+static inline float add_down(float a, float b) {
+    const double s = double(a) + b;
+    const double bb = s - a;
+    const double e = (a - (s - bb)) + (b - bb);
+    const float f = s;
+    return (f > s || (f == s && e < 0.0)) ? std::nextafter(f, -INF) : f;
+}
+
+static inline float add_up(float a, float b) {
+    const double s = double(a) + b;
+    const double bb = s - a;
+    const double e = (a - (s - bb)) + (b - bb);
+    const float f = s;
+    return (f < s || (f == s && e > 0.0)) ? std::nextafter(f, INF) : f;
+}
+
+// Products of two floats are always exact in double precision
+static inline float mul_down(float a, float b) {
+    return down(double(a) * b);
+}
+
+static inline float mul_up(float a, float b) {
+    return up(double(a) * b);
+}
+
+static inline float div_down(float a, float b) {
+    return down_inexact(double(a) / b);
+}
+
+static inline float div_up(float a, float b) {
+    return up_inexact(double(a) / b);
+}
+
+struct Interval {
+    Interval() { /* YOLO */ }
+    explicit Interval(float f) : lo(f), hi(f) {}
+    Interval(float lo, float hi) : lo(lo), hi(hi) {}
+    float lower() const { return lo; }
+    float upper() const { return hi; }
+    float lo, hi;
+};
+
+// Mixed interval / constant arguments are handled by turning the constant
+// into an interval, which gives the same bounds as the GPU's overloads.
+
+static inline Interval operator-(const Interval& x) {
+    return {-x.upper(), -x.lower()};
+}
+
+static inline Interval operator+(const Interval& x, const Interval& y) {
+    return {add_down(x.lower(), y.lower()), add_up(x.upper(), y.upper())};
+}
+
+static inline Interval operator-(const Interval& x, const Interval& y) {
+    return {add_down(x.lower(), -y.upper()), add_up(x.upper(), -y.lower())};
+}
+
+static inline Interval operator*(const Interval& x, const Interval& y) {
+    if (x.lower() < 0.0f) {
+        if (x.upper() > 0.0f) {
+            if (y.lower() < 0.0f) {
+                if (y.upper() > 0.0f) { // M * M
+                    return {std::fmin(mul_down(x.lower(), y.upper()),
+                                      mul_down(x.upper(), y.lower())),
+                            std::fmax(mul_up(x.lower(), y.lower()),
+                                      mul_up(x.upper(), y.upper()))};
+                } else { // M * N
+                    return {mul_down(x.upper(), y.lower()),
+                            mul_up(x.lower(), y.lower())};
+                }
+            } else {
+                if (y.upper() > 0.0f) { // M * P
+                    return {mul_down(x.lower(), y.upper()),
+                            mul_up(x.upper(), y.upper())};
+                } else { // M * Z
+                    return {0.0f, 0.0f};
+                }
+            }
+        } else {
+            if (y.lower() < 0.0f) {
+                if (y.upper() > 0.0f) { // N * M
+                    return {mul_down(x.lower(), y.upper()),
+                            mul_up(x.lower(), y.lower())};
+                } else { // N * N
+                    return {mul_down(x.upper(), y.upper()),
+                            mul_up(x.lower(), y.lower())};
+                }
+            } else {
+                if (y.upper() > 0.0f) { // N * P
+                    return {mul_down(x.lower(), y.upper()),
+                            mul_up(x.upper(), y.lower())};
+                } else { // N * Z
+                    return {0.0f, 0.0f};
+                }
+            }
+        }
+    } else {
+        if (x.upper() > 0.0f) {
+            if (y.lower() < 0.0f) {
+                if (y.upper() > 0.0f) { // P * M
+                    return {mul_down(x.upper(), y.lower()),
+                            mul_up(x.upper(), y.upper())};
+                } else { // P * N
+                    return {mul_down(x.upper(), y.lower()),
+                            mul_up(x.lower(), y.upper())};
+                }
+            } else {
+                if (y.upper() > 0.0f) { // P * P
+                    return {mul_down(x.lower(), y.lower()),
+                            mul_up(x.upper(), y.upper())};
+                } else { // P * Z
+                    return {0.0f, 0.0f};
+                }
+            }
+        } else { // Z * ?
+            return {0.0f, 0.0f};
+        }
+    }
+}
+
+static inline Interval operator/(const Interval& x, const Interval& y) {
+    if (y.lower() <= 0.0f && y.upper() >= 0.0f) {
+        return {-INF, INF};
+    } else if (x.upper() < 0.0f) {
+        if (y.upper() < 0.0f) {
+            return {div_down(x.upper(), y.lower()),
+                    div_up(x.lower(), y.upper())};
+        } else {
+            return {div_down(x.lower(), y.lower()),
+                    div_up(x.upper(), y.upper())};
+        }
+    } else if (x.lower() < 0.0f) {
+        if (y.upper() < 0.0f) {
+            return {div_down(x.upper(), y.upper()),
+                    div_up(x.lower(), y.upper())};
+        } else {
+            return {div_down(x.lower(), y.lower()),
+                    div_up(x.upper(), y.lower())};
+        }
+    } else {
+        if (y.upper() < 0.0f) {
+            return {div_down(x.upper(), y.upper()),
+                    div_up(x.lower(), y.lower())};
+        } else {
+            return {div_down(x.lower(), y.upper()),
+                    div_up(x.upper(), y.lower())};
+        }
+    }
+}
+
+static inline Interval min(const Interval& x, const Interval& y, int& choice) {
+    if (x.upper() < y.lower()) {
+        choice = 1;
+        return x;
+    } else if (y.upper() < x.lower()) {
+        choice = 2;
+        return y;
+    }
+    return {std::fmin(x.lower(), y.lower()), std::fmin(x.upper(), y.upper())};
+}
+
+static inline Interval max(const Interval& x, const Interval& y, int& choice) {
+    if (x.lower() > y.upper()) {
+        choice = 1;
+        return x;
+    } else if (y.lower() > x.upper()) {
+        choice = 2;
+        return y;
+    }
+    return {std::fmax(x.lower(), y.lower()), std::fmax(x.upper(), y.upper())};
+}
+
+static inline Interval square(const Interval& x) {
+    if (x.upper() < 0.0f) {
+        return {mul_down(x.upper(), x.upper()), mul_up(x.lower(), x.lower())};
+    } else if (x.lower() > 0.0f) {
+        return {mul_down(x.lower(), x.lower()), mul_up(x.upper(), x.upper())};
+    } else if (-x.lower() > x.upper()) {
+        return {0.0f, mul_up(x.lower(), x.lower())};
+    } else {
+        return {0.0f, mul_up(x.upper(), x.upper())};
+    }
+}
+
+static inline Interval abs(const Interval& x) {
+    if (x.lower() >= 0.0f) {
+        return x;
+    } else if (x.upper() < 0.0f) {
+        return -x;
+    } else {
+        return {0.0f, std::fmax(-x.lower(), x.upper())};
+    }
+}
+
+static inline Interval sqrt(const Interval& x) {
+    if (x.upper() < 0.0f) {
+        return {NAN_F, NAN_F};
+    } else if (x.lower() <= 0.0f) {
+        return {0.0f, up_inexact(std::sqrt(double(x.upper())))};
+    } else {
+        return {down_inexact(std::sqrt(double(x.lower()))),
+                up_inexact(std::sqrt(double(x.upper())))};
+    }
+}
+
+static inline Interval acos(const Interval& x) {
+    if (x.upper() < -1.0f || x.lower() > 1.0f) {
+        return {NAN_F, NAN_F};
+    }
+    return {down_inexact(std::acos(double(x.upper()))),
+            up_inexact(std::acos(double(x.lower())))};
+}
+
+static inline Interval asin(const Interval& x) {
+    if (x.upper() < -1.0f || x.lower() > 1.0f) {
+        return {NAN_F, NAN_F};
+    }
+    return {down_inexact(std::asin(double(x.lower()))),
+            up_inexact(std::asin(double(x.upper())))};
+}
+
+static inline Interval atan(const Interval& x) {
+    return {down_inexact(std::atan(double(x.lower()))),
+            up_inexact(std::atan(double(x.upper())))};
+}
+
+static inline Interval exp(const Interval& x) {
+    return {down_inexact(std::exp(double(x.lower()))),
+            up_inexact(std::exp(double(x.upper())))};
+}
+
+// The GPU doesn't narrow trig functions either (see gpu_interval.hpp)
+static inline Interval cos(const Interval&) {
+    return {-1.0f, 1.0f};
+}
+
+static inline Interval sin(const Interval&) {
+    return {-1.0f, 1.0f};
+}
+
+static inline Interval log(const Interval& x) {
+    if (x.upper() < 0.0f) {
+        return {NAN_F, NAN_F};
+    } else if (x.lower() <= 0.0f) {
+        return {0.0f, up_inexact(std::log(double(x.upper())))};
+    } else {
+        return {down_inexact(std::log(double(x.lower()))),
+                up_inexact(std::log(double(x.upper())))};
+    }
+}
+
+static inline Interval tan(const Interval& x) {
+    const double k = std::floor((x.lower() + PI / 2) / PI);
+    if (x.upper() >= (k + 1) * PI - PI / 2) {
+        return {-INF, INF};
+    }
+    return {down_inexact(std::tan(double(x.lower()))),
+            up_inexact(std::tan(double(x.upper())))};
+}
+
+static inline Interval recip(const Interval& x) {
+    return Interval(1.0f) / x;
+}
+
+static inline Interval atan2(const Interval& y, const Interval& x) {
+    if (x.lower() <= 0.0f && y.lower() <= 0.0f && y.upper() >= 0.0f) {
+        return {-float(PI), float(PI)};
+    }
+    const double a = std::atan2(double(y.lower()), double(x.lower()));
+    const double b = std::atan2(double(y.lower()), double(x.upper()));
+    const double c = std::atan2(double(y.upper()), double(x.lower()));
+    const double d = std::atan2(double(y.upper()), double(x.upper()));
+    return {down_inexact(std::fmin(std::fmin(a, b), std::fmin(c, d))),
+            up_inexact(std::fmax(std::fmax(a, b), std::fmax(c, d)))};
+}
+
+static inline Interval pow(const Interval& x, const float& n) {
+    if (n < 0.0f) {
+        return Interval(1.0f) / pow(x, -n);
+    } else if (n == 0.0f) {
+        return Interval(1.0f);
+    }
+    if (n == std::floor(n)) {
+        const double l = std::pow(double(x.lower()), double(n));
+        const double u = std::pow(double(x.upper()), double(n));
+        if (std::fmod(n, 2.0f) != 0.0f || x.lower() >= 0.0f) {
+            return {down_inexact(l), up_inexact(u)};
+        } else if (x.upper() <= 0.0f) {
+            return {down_inexact(u), up_inexact(l)};
+        } else {
+            return {0.0f, up_inexact(std::fmax(l, u))};
+        }
+    } else if (x.upper() < 0.0f) {
+        return {NAN_F, NAN_F};
+    } else {
+        return {down_inexact(std::pow(std::fmax(double(x.lower()), 0.0),
+                                      double(n))),
+                up_inexact(std::pow(double(x.upper()), double(n)))};
+    }
+}
+
+static inline Interval pow(const Interval& x, const Interval& n) {
+    if (n.lower() == n.upper()) {
+        return pow(x, n.lower());
+    } else if (x.lower() > 0.0f) {
+        return exp(n * log(x));
+    } else {
+        return {-INF, INF};
+    }
+}
+
+static inline Interval nth_root(const Interval& x, const float& n) {
+    if (n < 0.0f) {
+        return Interval(1.0f) / nth_root(x, -n);
+    }
+    const bool odd = std::fabs(std::fmod(n, 2.0f)) == 1.0f;
+    if (!odd && x.upper() < 0.0f) {
+        return {NAN_F, NAN_F};
+    }
+    const double l = odd ? double(x.lower()) : std::fmax(x.lower(), 0.0);
+    return {down_inexact(nth_root(l, double(n))),
+            up_inexact(nth_root(double(x.upper()), double(n)))};
+}
+
+static inline Interval nth_root(const Interval& x, const Interval& n) {
+    if (n.lower() == n.upper()) {
+        return nth_root(x, n.lower());
+    }
+    return {-INF, INF};
+}
+
+static inline Interval mod(const Interval& x, const Interval& y) {
+    if (y.lower() <= 0.0f) {
+        return {-INF, INF};
+    }
+    if (y.lower() == y.upper()) {
+        const double b = y.lower();
+        const double k = std::floor(x.lower() / b);
+        if (x.upper() < (k + 1) * b) {
+            return {std::fmax(down_inexact(x.lower() - k * b), 0.0f),
+                    std::fmin(up_inexact(x.upper() - k * b), y.upper())};
+        }
+    }
+    return {0.0f, y.upper()};
+}
+
+static inline Interval nanfill(const Interval& x, const Interval& y) {
+    return (std::isnan(x.lower()) || std::isnan(x.upper())) ? y : x;
+}
+
+static inline Interval compare(const Interval& x, const Interval& y) {
+    return {compare(x.lower(), y.upper()), compare(x.upper(), y.lower())};
+}
+
+static inline Interval mul_add(const Interval& x, const Interval& y,
+                               const Interval& z) {
+    return x * y + z;
+}
+
+static inline Interval square_add(const Interval& x, const Interval& y) {
+    return square(x) + y;
+}
+
+static inline Interval sub_square(const Interval& x, const Interval& y) {
+    return square(x - y);
+}
+
+static inline Interval hypot(const Interval& x, const Interval& y) {
+    return sqrt(square(x) + square(y));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Automatic differentiation, which follows gpu_deriv.hpp
+
+struct Deriv {
+    Deriv() : v(0.0f), dx(0.0f), dy(0.0f), dz(0.0f) {}
+    explicit Deriv(float f) : v(f), dx(0.0f), dy(0.0f), dz(0.0f) {}
+    Deriv(float v, float dx, float dy, float dz)
+        : v(v), dx(dx), dy(dy), dz(dz) {}
+    float v, dx, dy, dz;
+};
+
+static inline Deriv operator-(const Deriv& a) {
+    return {-a.v, -a.dx, -a.dy, -a.dz};
+}
+
+static inline Deriv operator+(const Deriv& a, const Deriv& b) {
+    return {a.v + b.v, a.dx + b.dx, a.dy + b.dy, a.dz + b.dz};
+}
+
+static inline Deriv operator+(const Deriv& a, const float& b) {
+    return {a.v + b, a.dx, a.dy, a.dz};
+}
+
+static inline Deriv operator*(const Deriv& a, const Deriv& b) {
+    return {a.v * b.v,
+            a.dx * b.v + b.dx * a.v,
+            a.dy * b.v + b.dy * a.v,
+            a.dz * b.v + b.dz * a.v};
+}
+
+static inline Deriv operator*(const Deriv& a, const float& b) {
+    return {a.v * b, a.dx * b, a.dy * b, a.dz * b};
+}
+
+static inline Deriv operator/(const Deriv& a, const Deriv& b) {
+    const float d = b.v * b.v;
+    return {a.v / b.v,
+            (b.v * a.dx - a.v * b.dx) / d,
+            (b.v * a.dy - a.v * b.dy) / d,
+            (b.v * a.dz - a.v * b.dz) / d};
+}
+
+static inline Deriv operator/(const Deriv& a, const float& b) {
+    return {a.v / b, a.dx / b, a.dy / b, a.dz / b};
+}
+
+static inline Deriv operator/(const float& a, const Deriv& b) {
+    const float d = b.v * b.v;
+    return {a / b.v, -a * b.dx / d, -a * b.dy / d, -a * b.dz / d};
+}
+
+static inline Deriv operator-(const Deriv& a, const Deriv& b) {
+    return {a.v - b.v, a.dx - b.dx, a.dy - b.dy, a.dz - b.dz};
+}
+
+static inline Deriv operator-(const Deriv& a, const float& b) {
+    return {a.v - b, a.dx, a.dy, a.dz};
+}
+
+static inline Deriv operator-(const float& a, const Deriv& b) {
+    return {a - b.v, -b.dx, -b.dy, -b.dz};
+}
+
+static inline Deriv min(const Deriv& a, const Deriv& b) {
+    return (a.v < b.v) ? a : b;
+}
+
+static inline Deriv min(const Deriv& a, const float& b) {
+    return (a.v < b) ? a : Deriv(b);
+}
+
+static inline Deriv max(const Deriv& a, const Deriv& b) {
+    return (a.v >= b.v) ? a : b;
+}
+
+static inline Deriv max(const Deriv& a, const float& b) {
+    return (a.v >= b) ? a : Deriv(b);
+}
+
+static inline Deriv square(const Deriv& a) {
+    return {a.v * a.v, a.dx * a.v * 2, a.dy * a.v * 2, a.dz * a.v * 2};
+}
+
+static inline Deriv abs(const Deriv& a) {
+    return (a.v < 0.0f) ? -a : a;
+}
+
+/*  Scales the derivatives of `a` by `d`, with `v` as the new value */
+static inline Deriv chain(float v, float d, const Deriv& a) {
+    return {v, d * a.dx, d * a.dy, d * a.dz};
+}
+
+static inline Deriv sqrt(const Deriv& a) {
+    const float d = 2 * std::sqrt(a.v);
+    return {std::sqrt(a.v), a.dx / d, a.dy / d, a.dz / d};
+}
+
+static inline Deriv atan(const Deriv& a) {
+    const float d = a.v * a.v + 1;
+    return {std::atan(a.v), a.dx / d, a.dy / d, a.dz / d};
+}
+
+static inline Deriv acos(const Deriv& a) {
+    const float d = -std::sqrt(1 - a.v * a.v);
+    return {std::acos(a.v), a.dx / d, a.dy / d, a.dz / d};
+}
+
+static inline Deriv asin(const Deriv& a) {
+    const float d = std::sqrt(1 - a.v * a.v);
+    return {std::asin(a.v), a.dx / d, a.dy / d, a.dz / d};
+}
+
+static inline Deriv exp(const Deriv& a) {
+    const float v = std::exp(a.v);
+    return chain(v, v, a);
+}
+
+static inline Deriv cos(const Deriv& a) {
+    return chain(std::cos(a.v), -std::sin(a.v), a);
+}
+
+static inline Deriv sin(const Deriv& a) {
+    return chain(std::sin(a.v), std::cos(a.v), a);
+}
+
+static inline Deriv log(const Deriv& a) {
+    return {std::log(a.v), a.dx / a.v, a.dy / a.v, a.dz / a.v};
+}
+
+static inline Deriv tan(const Deriv& a) {
+    const float t = std::tan(a.v);
+    return chain(t, 1 + t * t, a);
+}
+
+static inline Deriv recip(const Deriv& a) {
+    return 1.0f / a;
+}
+
+static inline Deriv atan2(const Deriv& y, const Deriv& x) {
+    const float d = x.v * x.v + y.v * y.v;
+    return {std::atan2(y.v, x.v),
+            (x.v * y.dx - y.v * x.dx) / d,
+            (x.v * y.dy - y.v * x.dy) / d,
+            (x.v * y.dz - y.v * x.dz) / d};
+}
+
+static inline Deriv pow(const Deriv& a, const float& b) {
+    return chain(std::pow(a.v, b), b * std::pow(a.v, b - 1), a);
+}
+
+static inline Deriv pow(const float& a, const Deriv& b) {
+    const float v = std::pow(a, b.v);
+    return chain(v, v * std::log(a), b);
+}
+
+static inline Deriv pow(const Deriv& a, const Deriv& b) {
+    if (b.dx == 0.0f && b.dy == 0.0f && b.dz == 0.0f) {
+        return pow(a, b.v);
+    }
+    const float v = std::pow(a.v, b.v);
+    const float da = b.v * std::pow(a.v, b.v - 1);
+    const float db = v * std::log(a.v);
+    return {v,
+            da * a.dx + db * b.dx,
+            da * a.dy + db * b.dy,
+            da * a.dz + db * b.dz};
+}
+
+static inline Deriv nth_root(const Deriv& a, const float& n) {
+    const float v = nth_root(a.v, n);
+    return chain(v, v / (n * a.v), a);
+}
+
+static inline Deriv nth_root(const Deriv& a, const Deriv& n) {
+    if (n.dx == 0.0f && n.dy == 0.0f && n.dz == 0.0f) {
+        return nth_root(a, n.v);
+    }
+    const float v = nth_root(a.v, n.v);
+    const float da = v / (n.v * a.v);
+    const float dn = -v * std::log(std::fabs(a.v)) / (n.v * n.v);
+    return {v,
+            da * a.dx + dn * n.dx,
+            da * a.dy + dn * n.dy,
+            da * a.dz + dn * n.dz};
+}
+
+static inline Deriv mod(const Deriv& a, const float& b) {
+    return {mod(a.v, b), a.dx, a.dy, a.dz};
+}
+
+static inline Deriv mod(const Deriv& a, const Deriv& b) {
+    const float v = mod(a.v, b.v);
+    const float k = std::round((a.v - v) / b.v);
+    return {v, a.dx - k * b.dx, a.dy - k * b.dy, a.dz - k * b.dz};
+}
+
+static inline Deriv nanfill(const Deriv& a, const Deriv& b) {
+    return std::isnan(a.v) ? b : a;
+}
+
+static inline Deriv compare(const Deriv& a, const Deriv& b) {
+    return Deriv(compare(a.v, b.v));
+}
+
+static inline Deriv mul_add(const Deriv& a, const Deriv& b, const float& c) {
+    return a * b + c;
+}
+
+static inline Deriv mul_add(const Deriv& a, const float& b, const Deriv& c) {
+    return a * b + c;
+}
+
+static inline Deriv square_add(const Deriv& a, const Deriv& b) {
+    return square(a) + b;
+}
+
+static inline Deriv square_add(const Deriv& a, const float& b) {
+    return square(a) + b;
+}
+
+static inline Deriv sub_square(const Deriv& a, const Deriv& b) {
+    return square(a - b);
+}
+
+static inline Deriv sub_square(const Deriv& a, const float& b) {
+    return square(a - b);
+}
+
+static inline Deriv hypot(const Deriv& a, const Deriv& b) {
+    return sqrt(square(a) + square(b));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*  Per-worker state, which is only used by one thread at a time.  Each
+ *  frame has one of these for every worker in the pool. */
+struct Scratch {
+    Scratch() : lane_storage((256 + MAX_SPILLS) * LANES + 16) {
+        // Align each slot's lanes to a cache line
+        lanes = reinterpret_cast<float*>(
+            (reinterpret_cast<uintptr_t>(lane_storage.data()) + 63) &
+            ~uintptr_t(63));
+        lane_spills = lanes + 256 * LANES;
+    }
+
+    // Slot arrays for each evaluator, and the spill arrays which hold the
+    // values that GPU_OP_SPILL moves out of them
+    Interval slots[256];
+    Interval spills[MAX_SPILLS];
+    Deriv derivs[256];
+    Deriv deriv_spills[MAX_SPILLS];
+    std::vector<float> lane_storage;
+    float* lanes;           // LANES values per slot
+    float* lane_spills;     // LANES values per spill
+
+    // Min/max choices from interval evaluation, one per min/max clause
+    std::vector<uint8_t> choices;
+
+    // Scratch space for push_subtape, which marks the slots and spills
+    // whose values are needed by the clauses it has kept
+    bool active[256];
+    bool spilled[MAX_SPILLS];
+    std::vector<uint64_t> kept;
+
+    // Pushed subtapes are written into blocks, which live until the end of
+    // the frame (since the normal pass reads them)
+    std::vector<std::unique_ptr<uint64_t[]>> blocks;
+    uint64_t* block_next=nullptr;
+    size_t block_left=0;
+    int64_t block_clauses=0;
+
+    int64_t tiles[4]={0, 0, 0, 0};  // Tiles which were evaluated, by stage
+    int64_t pushes=0;
+    int64_t pushed_clauses=0;
+
+    uint64_t* alloc(size_t count) {
+        if (count > block_left) {
+            const size_t size = std::max<size_t>(count, 1 << 16);
+            blocks.emplace_back(new uint64_t[size]);
+            block_next = blocks.back().get();
+            block_left = size;
+            block_clauses += size;
+        }
+        uint64_t* out = block_next;
+        block_next += count;
+        block_left -= count;
+        return out;
+    }
+};
+
+/*
+ *  Evaluates a tape over one tile, with X, Y, Z intervals from `xyz`, and
+ *  returns the interval result.  The choice made by every min/max clause
+ *  is recorded in `s.choices`, and `has_any_choice` is set if any of them
+ *  picked a branch.  Afterwards, `data` points to the tape's final clause.
+ */
+static Interval eval_intervals(const uint64_t*& data,
+                               const Interval (&xyz)[3],
+                               Scratch& s, bool& has_any_choice)
+{
+    Interval* const slots = s.slots;
+    Interval* const spills = s.spills;
+    slots[((const uint8_t*)data)[1]] = xyz[0];
+    slots[((const uint8_t*)data)[2]] = xyz[1];
+    slots[((const uint8_t*)data)[3]] = xyz[2];
+
+    s.choices.clear();
+    has_any_choice = false;
+
+    while (1) {
+        const uint64_t d = *++data;
+        if (!OP(&d)) {
+            break;
+        }
+        switch (OP(&d)) {
+            case GPU_OP_JUMP: data += JUMP_TARGET(&d); continue;
+
+#define lhs slots[I_LHS(&d)]
+#define rhs slots[I_RHS(&d)]
+#define imm Interval(IMM(&d))
+#define param Interval(parameters[PARAM_INDEX(&d)])
+#define out slots[I_OUT(&d)]
+
+            case GPU_OP_SQUARE_LHS: out = square(lhs); break;
+            case GPU_OP_SQRT_LHS:   out = sqrt(lhs); break;
+            case GPU_OP_NEG_LHS:    out = -lhs; break;
+            case GPU_OP_SIN_LHS:    out = sin(lhs); break;
+            case GPU_OP_COS_LHS:    out = cos(lhs); break;
+            case GPU_OP_ASIN_LHS:   out = asin(lhs); break;
+            case GPU_OP_ACOS_LHS:   out = acos(lhs); break;
+            case GPU_OP_ATAN_LHS:   out = atan(lhs); break;
+            case GPU_OP_EXP_LHS:    out = exp(lhs); break;
+            case GPU_OP_ABS_LHS:    out = abs(lhs); break;
+            case GPU_OP_LOG_LHS:    out = log(lhs); break;
+            case GPU_OP_TAN_LHS:    out = tan(lhs); break;
+            case GPU_OP_RECIP_LHS:  out = recip(lhs); break;
+
+            // Commutative opcodes
+            case GPU_OP_ADD_LHS_IMM: out = lhs + imm; break;
+            case GPU_OP_ADD_LHS_RHS: out = lhs + rhs; break;
+            case GPU_OP_MUL_LHS_IMM: out = lhs * imm; break;
+            case GPU_OP_MUL_LHS_RHS: out = lhs * rhs; break;
+
+#define CHOICE(f, a, b) {                                       \
+    int c = 0;                                                  \
+    out = f(a, b, c);                                           \
+    s.choices.push_back(c);                                     \
+    has_any_choice |= (c != 0);                                 \
+    break;                                                      \
+}
+            case GPU_OP_MIN_LHS_IMM: CHOICE(min, lhs, imm);
+            case GPU_OP_MIN_LHS_RHS: CHOICE(min, lhs, rhs);
+            case GPU_OP_MAX_LHS_IMM: CHOICE(max, lhs, imm);
+            case GPU_OP_MAX_LHS_RHS: CHOICE(max, lhs, rhs);
+
+            // Non-commutative opcodes
+            case GPU_OP_SUB_LHS_IMM: out = lhs - imm; break;
+            case GPU_OP_SUB_IMM_RHS: out = imm - rhs; break;
+            case GPU_OP_SUB_LHS_RHS: out = lhs - rhs; break;
+            case GPU_OP_DIV_LHS_IMM: out = lhs / imm; break;
+            case GPU_OP_DIV_IMM_RHS: out = imm / rhs; break;
+            case GPU_OP_DIV_LHS_RHS: out = lhs / rhs; break;
+            case GPU_OP_ATAN2_LHS_IMM: out = atan2(lhs, imm); break;
+            case GPU_OP_ATAN2_IMM_RHS: out = atan2(imm, rhs); break;
+            case GPU_OP_ATAN2_LHS_RHS: out = atan2(lhs, rhs); break;
+            case GPU_OP_POW_LHS_IMM: out = pow(lhs, imm); break;
+            case GPU_OP_POW_IMM_RHS: out = pow(imm, rhs); break;
+            case GPU_OP_POW_LHS_RHS: out = pow(lhs, rhs); break;
+            case GPU_OP_NTH_ROOT_LHS_IMM: out = nth_root(lhs, imm); break;
+            case GPU_OP_NTH_ROOT_IMM_RHS: out = nth_root(imm, rhs); break;
+            case GPU_OP_NTH_ROOT_LHS_RHS: out = nth_root(lhs, rhs); break;
+            case GPU_OP_MOD_LHS_IMM: out = mod(lhs, imm); break;
+            case GPU_OP_MOD_IMM_RHS: out = mod(imm, rhs); break;
+            case GPU_OP_MOD_LHS_RHS: out = mod(lhs, rhs); break;
+            case GPU_OP_NANFILL_LHS_IMM: out = nanfill(lhs, imm); break;
+            case GPU_OP_NANFILL_IMM_RHS: out = nanfill(imm, rhs); break;
+            case GPU_OP_NANFILL_LHS_RHS: out = nanfill(lhs, rhs); break;
+            case GPU_OP_COMPARE_LHS_IMM: out = compare(lhs, imm); break;
+            case GPU_OP_COMPARE_IMM_RHS: out = compare(imm, rhs); break;
+            case GPU_OP_COMPARE_LHS_RHS: out = compare(lhs, rhs); break;
+
+            case GPU_OP_COPY_IMM: out = imm; break;
+            case GPU_OP_COPY_LHS: out = lhs; break;
+            case GPU_OP_COPY_RHS: out = rhs; break;
+            case GPU_OP_PARAM: out = param; break;
+
+            // Compound opcodes
+            case GPU_OP_MUL_ADD_LHS_RHS_IMM: out = mul_add(lhs, rhs, imm); break;
+            case GPU_OP_MUL_ADD_LHS_IMM_RHS: out = mul_add(lhs, imm, rhs); break;
+            case GPU_OP_SQUARE_ADD_LHS_IMM: out = square_add(lhs, imm); break;
+            case GPU_OP_SQUARE_ADD_LHS_RHS: out = square_add(lhs, rhs); break;
+            case GPU_OP_SUB_SQUARE_LHS_IMM: out = sub_square(lhs, imm); break;
+            case GPU_OP_SUB_SQUARE_LHS_RHS: out = sub_square(lhs, rhs); break;
+            case GPU_OP_HYPOT_LHS_RHS: out = hypot(lhs, rhs); break;
+
+            case GPU_OP_SPILL: spills[SPILL_INDEX(&d)] = lhs; break;
+            case GPU_OP_RELOAD: out = spills[SPILL_INDEX(&d)]; break;
+
+            default: assert(false);
+        }
+#undef lhs
+#undef rhs
+#undef imm
+#undef param
+#undef out
+#undef CHOICE
+    }
+    return slots[I_OUT(data)];
+}
+
+/*
+ *  Evaluates a tape at LANES points, whose X, Y, Z coordinates are in `x`,
+ *  `y`, and `z`.  Every slot holds LANES values (in `slots`), as does every
+ *  entry of the spill array (in `spills`).  Clauses with
+ *  a vector instruction run on the whole batch at once (see Lanes), and the
+ *  rest are a loop over the batch, calling the scalar function per lane.
+ *  Returns a pointer to the LANES results.
+ */
+static const float* eval_lanes(const uint64_t* data, const float* x,
+                               const float* y, const float* z,
+                               float* const slots, float* const spills)
+{
+    std::copy(x, x + LANES, slots + ((const uint8_t*)data)[1] * LANES);
+    std::copy(y, y + LANES, slots + ((const uint8_t*)data)[2] * LANES);
+    std::copy(z, z + LANES, slots + ((const uint8_t*)data)[3] * LANES);
+
+    while (1) {
+        const uint64_t d = *++data;
+        if (!OP(&d)) {
+            break;
+        }
+        if (OP(&d) == GPU_OP_JUMP) {
+            data += JUMP_TARGET(&d);
+            continue;
+        }
+        float* const o = slots + I_OUT(&d) * LANES;
+        const float* const l = slots + I_LHS(&d) * LANES;
+        const float* const r = slots + I_RHS(&d) * LANES;
+        const float imm = IMM(&d);
+
+#define LANE(expr) for (int k=0; k < LANES; ++k) { o[k] = (expr); } break
+#define VEC(expr) vstore(o, (expr)); break
+#define lhs vload(l)
+#define rhs vload(r)
+#define vimm vsplat(imm)
+        switch (OP(&d)) {
+            case GPU_OP_SQUARE_LHS: VEC(vmul(lhs, lhs));
+            case GPU_OP_SQRT_LHS:   VEC(vsqrt(lhs));
+            case GPU_OP_NEG_LHS:    VEC(vneg(lhs));
+            case GPU_OP_SIN_LHS:    LANE(std::sin(l[k]));
+            case GPU_OP_COS_LHS:    LANE(std::cos(l[k]));
+            case GPU_OP_ASIN_LHS:   LANE(std::asin(l[k]));
+            case GPU_OP_ACOS_LHS:   LANE(std::acos(l[k]));
+            case GPU_OP_ATAN_LHS:   LANE(std::atan(l[k]));
+            case GPU_OP_EXP_LHS:    LANE(std::exp(l[k]));
+            case GPU_OP_ABS_LHS:    VEC(vabs(lhs));
+            case GPU_OP_LOG_LHS:    LANE(std::log(l[k]));
+            case GPU_OP_TAN_LHS:    LANE(std::tan(l[k]));
+            case GPU_OP_RECIP_LHS:  VEC(vdiv(vsplat(1.0f), lhs));
+
+            // Commutative opcodes
+            case GPU_OP_ADD_LHS_IMM: VEC(vadd(lhs, vimm));
+            case GPU_OP_ADD_LHS_RHS: VEC(vadd(lhs, rhs));
+            case GPU_OP_MUL_LHS_IMM: VEC(vmul(lhs, vimm));
+            case GPU_OP_MUL_LHS_RHS: VEC(vmul(lhs, rhs));
+            case GPU_OP_MIN_LHS_IMM: VEC(vmin(lhs, vimm));
+            case GPU_OP_MIN_LHS_RHS: VEC(vmin(lhs, rhs));
+            case GPU_OP_MAX_LHS_IMM: VEC(vmax(lhs, vimm));
+            case GPU_OP_MAX_LHS_RHS: VEC(vmax(lhs, rhs));
+
+            // Non-commutative opcodes
+            case GPU_OP_SUB_LHS_IMM: VEC(vsub(lhs, vimm));
+            case GPU_OP_SUB_IMM_RHS: VEC(vsub(vimm, rhs));
+            case GPU_OP_SUB_LHS_RHS: VEC(vsub(lhs, rhs));
+            case GPU_OP_DIV_LHS_IMM: VEC(vdiv(lhs, vimm));
+            case GPU_OP_DIV_IMM_RHS: VEC(vdiv(vimm, rhs));
+            case GPU_OP_DIV_LHS_RHS: VEC(vdiv(lhs, rhs));
+            case GPU_OP_ATAN2_LHS_IMM: LANE(std::atan2(l[k], imm));
+            case GPU_OP_ATAN2_IMM_RHS: LANE(std::atan2(imm, r[k]));
+            case GPU_OP_ATAN2_LHS_RHS: LANE(std::atan2(l[k], r[k]));
+            case GPU_OP_POW_LHS_IMM: LANE(std::pow(l[k], imm));
+            case GPU_OP_POW_IMM_RHS: LANE(std::pow(imm, r[k]));
+            case GPU_OP_POW_LHS_RHS: LANE(std::pow(l[k], r[k]));
+            case GPU_OP_NTH_ROOT_LHS_IMM: LANE(nth_root(l[k], imm));
+            case GPU_OP_NTH_ROOT_IMM_RHS: LANE(nth_root(imm, r[k]));
+            case GPU_OP_NTH_ROOT_LHS_RHS: LANE(nth_root(l[k], r[k]));
+            case GPU_OP_MOD_LHS_IMM: LANE(mod(l[k], imm));
+            case GPU_OP_MOD_IMM_RHS: LANE(mod(imm, r[k]));
+            case GPU_OP_MOD_LHS_RHS: LANE(mod(l[k], r[k]));
+            case GPU_OP_NANFILL_LHS_IMM: LANE(nanfill(l[k], imm));
+            case GPU_OP_NANFILL_IMM_RHS: LANE(nanfill(imm, r[k]));
+            case GPU_OP_NANFILL_LHS_RHS: LANE(nanfill(l[k], r[k]));
+            case GPU_OP_COMPARE_LHS_IMM: LANE(compare(l[k], imm));
+            case GPU_OP_COMPARE_IMM_RHS: LANE(compare(imm, r[k]));
+            case GPU_OP_COMPARE_LHS_RHS: LANE(compare(l[k], r[k]));
+
+            case GPU_OP_COPY_IMM: VEC(vimm);
+            case GPU_OP_COPY_LHS: VEC(lhs);
+            case GPU_OP_COPY_RHS: VEC(rhs);
+            case GPU_OP_PARAM: VEC(vsplat(parameters[PARAM_INDEX(&d)]));
+
+            // Compound opcodes
+            case GPU_OP_MUL_ADD_LHS_RHS_IMM: VEC(vfma(lhs, rhs, vimm));
+            case GPU_OP_MUL_ADD_LHS_IMM_RHS: VEC(vfma(lhs, vimm, rhs));
+            case GPU_OP_SQUARE_ADD_LHS_IMM: VEC(vfma(lhs, lhs, vimm));
+            case GPU_OP_SQUARE_ADD_LHS_RHS: VEC(vfma(lhs, lhs, rhs));
+            case GPU_OP_SUB_SQUARE_LHS_IMM: {
+                const Lanes t = vsub(lhs, vimm);
+                VEC(vmul(t, t));
+            }
+            case GPU_OP_SUB_SQUARE_LHS_RHS: {
+                const Lanes t = vsub(lhs, rhs);
+                VEC(vmul(t, t));
+            }
+            case GPU_OP_HYPOT_LHS_RHS: LANE(std::hypot(l[k], r[k]));
+
+            case GPU_OP_SPILL:
+                vstore(spills + SPILL_INDEX(&d) * LANES, lhs); break;
+            case GPU_OP_RELOAD: VEC(vload(spills + SPILL_INDEX(&d) * LANES));
+
+            default: assert(false);
+        }
+#undef LANE
+#undef VEC
+#undef lhs
+#undef rhs
+#undef vimm
+    }
+    return slots + I_OUT(data) * LANES;
+}
+
+/*  Evaluates a tape with automatic differentiation, where the X, Y, Z
+ *  slots have already been loaded into `slots` */
+static Deriv eval_derivs(const uint64_t* data, Deriv* const slots,
+                         Deriv* const spills)
+{
+    while (1) {
+        const uint64_t d = *++data;
+        if (!OP(&d)) {
+            break;
+        }
+        switch (OP(&d)) {
+            case GPU_OP_JUMP: data += JUMP_TARGET(&d); continue;
+
+#define lhs slots[I_LHS(&d)]
+#define rhs slots[I_RHS(&d)]
+#define imm IMM(&d)
+#define param parameters[PARAM_INDEX(&d)]
+#define out slots[I_OUT(&d)]
+
+            case GPU_OP_SQUARE_LHS: out = lhs * lhs; break;
+            case GPU_OP_SQRT_LHS: out = sqrt(lhs); break;
+            case GPU_OP_NEG_LHS: out = -lhs; break;
+            case GPU_OP_SIN_LHS: out = sin(lhs); break;
+            case GPU_OP_COS_LHS: out = cos(lhs); break;
+            case GPU_OP_ASIN_LHS: out = asin(lhs); break;
+            case GPU_OP_ACOS_LHS: out = acos(lhs); break;
+            case GPU_OP_ATAN_LHS: out = atan(lhs); break;
+            case GPU_OP_EXP_LHS: out = exp(lhs); break;
+            case GPU_OP_ABS_LHS: out = abs(lhs); break;
+            case GPU_OP_LOG_LHS: out = log(lhs); break;
+            case GPU_OP_TAN_LHS: out = tan(lhs); break;
+            case GPU_OP_RECIP_LHS: out = recip(lhs); break;
+
+            // Commutative opcodes
+            case GPU_OP_ADD_LHS_IMM: out = lhs + imm; break;
+            case GPU_OP_ADD_LHS_RHS: out = lhs + rhs; break;
+            case GPU_OP_MUL_LHS_IMM: out = lhs * imm; break;
+            case GPU_OP_MUL_LHS_RHS: out = lhs * rhs; break;
+            case GPU_OP_MIN_LHS_IMM: out = min(lhs, imm); break;
+            case GPU_OP_MIN_LHS_RHS: out = min(lhs, rhs); break;
+            case GPU_OP_MAX_LHS_IMM: out = max(lhs, imm); break;
+            case GPU_OP_MAX_LHS_RHS: out = max(lhs, rhs); break;
+
+            // Non-commutative opcodes
+            case GPU_OP_SUB_LHS_IMM: out = lhs - imm; break;
+            case GPU_OP_SUB_IMM_RHS: out = imm - rhs; break;
+            case GPU_OP_SUB_LHS_RHS: out = lhs - rhs; break;
+
+            case GPU_OP_DIV_LHS_IMM: out = lhs / imm; break;
+            case GPU_OP_DIV_IMM_RHS: out = imm / rhs; break;
+            case GPU_OP_DIV_LHS_RHS: out = lhs / rhs; break;
+            case GPU_OP_ATAN2_LHS_IMM: out = atan2(lhs, Deriv(imm)); break;
+            case GPU_OP_ATAN2_IMM_RHS: out = atan2(Deriv(imm), rhs); break;
+            case GPU_OP_ATAN2_LHS_RHS: out = atan2(lhs, rhs); break;
+            case GPU_OP_POW_LHS_IMM: out = pow(lhs, imm); break;
+            case GPU_OP_POW_IMM_RHS: out = pow(imm, rhs); break;
+            case GPU_OP_POW_LHS_RHS: out = pow(lhs, rhs); break;
+            case GPU_OP_NTH_ROOT_LHS_IMM: out = nth_root(lhs, imm); break;
+            case GPU_OP_NTH_ROOT_IMM_RHS: out = nth_root(Deriv(imm), rhs); break;
+            case GPU_OP_NTH_ROOT_LHS_RHS: out = nth_root(lhs, rhs); break;
+            case GPU_OP_MOD_LHS_IMM: out = mod(lhs, imm); break;
+            case GPU_OP_MOD_IMM_RHS: out = mod(Deriv(imm), rhs); break;
+            case GPU_OP_MOD_LHS_RHS: out = mod(lhs, rhs); break;
+            case GPU_OP_NANFILL_LHS_IMM: out = nanfill(lhs, Deriv(imm)); break;
+            case GPU_OP_NANFILL_IMM_RHS: out = nanfill(Deriv(imm), rhs); break;
+            case GPU_OP_NANFILL_LHS_RHS: out = nanfill(lhs, rhs); break;
+            case GPU_OP_COMPARE_LHS_IMM: out = compare(lhs, Deriv(imm)); break;
+            case GPU_OP_COMPARE_IMM_RHS: out = compare(Deriv(imm), rhs); break;
+            case GPU_OP_COMPARE_LHS_RHS: out = compare(lhs, rhs); break;
+
+            case GPU_OP_COPY_IMM: out = Deriv(imm); break;
+            case GPU_OP_COPY_LHS: out = lhs; break;
+            case GPU_OP_COPY_RHS: out = rhs; break;
+            case GPU_OP_PARAM: out = Deriv(param); break;
+
+            // Compound opcodes
+            case GPU_OP_MUL_ADD_LHS_RHS_IMM: out = mul_add(lhs, rhs, imm); break;
+            case GPU_OP_MUL_ADD_LHS_IMM_RHS: out = mul_add(lhs, imm, rhs); break;
+            case GPU_OP_SQUARE_ADD_LHS_IMM: out = square_add(lhs, imm); break;
+            case GPU_OP_SQUARE_ADD_LHS_RHS: out = square_add(lhs, rhs); break;
+            case GPU_OP_SUB_SQUARE_LHS_IMM: out = sub_square(lhs, imm); break;
+            case GPU_OP_SUB_SQUARE_LHS_RHS: out = sub_square(lhs, rhs); break;
+            case GPU_OP_HYPOT_LHS_RHS: out = hypot(lhs, rhs); break;
+
+            case GPU_OP_SPILL: spills[SPILL_INDEX(&d)] = lhs; break;
+            case GPU_OP_RELOAD: out = spills[SPILL_INDEX(&d)]; break;
+
+            default: assert(false);
+#undef lhs
+#undef rhs
+#undef imm
+#undef param
+#undef out
+        }
+    }
+    return slots[I_OUT(data)];
+}
+
+/*
+ *  Builds the tape which is active given the choices from eval_intervals,
+ *  where `data` points to the final clause of the tile's current tape.
+ *  This is the same backwards walk as shorten_tape (see gpu_tape.hpp), and
+ *  the new tape is written contiguously into the worker's scratch blocks,
+ *  which never run out of room.
+ */
+static const uint64_t* push_subtape(const uint64_t* data, Scratch& s) {
+    const uint64_t* const end = data;
+    bool* const active = s.active;
+    std::fill(active, active + 256, false);
+    active[I_OUT(data)] = true;
+    std::fill(s.spilled, s.spilled + MAX_SPILLS, false);
+
+    int choice_index = s.choices.size();
+    s.kept.clear();
+    while (1) {
+        uint64_t d = *--data;
+        if (!OP(&d)) {
+            break;
+        }
+        const uint8_t op = OP(&d);
+        if (op == GPU_OP_JUMP) {
+            data += JUMP_TARGET(&d);
+            continue;
+        }
+
+        const bool has_choice = op >= GPU_OP_MIN_LHS_IMM &&
+                                op <= GPU_OP_MAX_LHS_RHS;
+        choice_index -= has_choice;
+
+        // A spill is needed if a kept clause reloads it, and a reload
+        // marks its spill as needed (as if it were a slot)
+        const uint8_t i_out = I_OUT(&d);
+        if (op == GPU_OP_SPILL) {
+            if (!s.spilled[SPILL_INDEX(&d)]) {
+                continue;
+            }
+            s.spilled[SPILL_INDEX(&d)] = false;
+        } else if (!active[i_out]) {
+            continue;
+        } else if (op == GPU_OP_RELOAD) {
+            s.spilled[SPILL_INDEX(&d)] = true;
+        }
+
+        assert(!has_choice || choice_index >= 0);
+        const int choice = has_choice ? s.choices[choice_index] : 0;
+
+        active[i_out] = false;
+        if (choice == 0) {
+            const uint8_t i_lhs = I_LHS(&d);
+            if (i_lhs) {
+                active[i_lhs] = true;
+            }
+            const uint8_t i_rhs = I_RHS(&d);
+            if (i_rhs) {
+                active[i_rhs] = true;
+            }
+        } else if (choice == 1 /* LHS */) {
+            const uint8_t i_lhs = I_LHS(&d);
+            active[i_lhs] = true;
+            if (i_lhs == i_out) {
+                continue;
+            }
+            OP(&d) = GPU_OP_COPY_LHS;
+        } else if (choice == 2 /* RHS */) {
+            const uint8_t i_rhs = I_RHS(&d);
+            if (i_rhs) {
+                active[i_rhs] = true;
+                if (i_rhs == i_out) {
+                    continue;
+                }
+                OP(&d) = GPU_OP_COPY_RHS;
+            } else {
+                OP(&d) = GPU_OP_COPY_IMM;
+            }
+        }
+        s.kept.push_back(d);
+    }
+
+    // The first and last clauses are copied from the parent tape
+    const size_t length = s.kept.size() + 2;
+    uint64_t* const tape = s.alloc(length);
+    tape[0] = *data;
+    std::reverse_copy(s.kept.begin(), s.kept.end(), tape + 1);
+    tape[length - 1] = *end;
+
+    s.pushes++;
+    s.pushed_clauses += length;
+    return tape;
+}
+
+enum TileResult {
+    TILE_EMPTY,
+    TILE_FILLED,
+    TILE_AMBIGUOUS,
+};
+
+/*  Evaluates `tape` over a tile, as in eval_tiles_i and finish_tile.  If the
+ *  tile is ambiguous and any min/max clause made a choice, `tape` is
+ *  replaced with a shorter tape for its subtiles. */
+static TileResult eval_tile(const uint64_t*& tape, const Interval (&xyz)[3],
+                            Scratch& s)
+{
+    const uint64_t* data = tape;
+    bool has_any_choice;
+    const Interval result = eval_intervals(data, xyz, s, has_any_choice);
+    if (result.lower() > 0.0f) {
+        return TILE_EMPTY;
+    } else if (result.upper() < 0.0f) {
+        return TILE_FILLED;
+    }
+    if (has_any_choice) {
+        tape = push_subtape(data, s);
+    }
+    return TILE_AMBIGUOUS;
+}
+
+/*  A 3D tile's tape, and its subtiles if it was subdivided.  The normal
+ *  pass walks these to find the shortest tape for each pixel, as
+ *  eval_pixels_d does with the GPU's tile lists. */
+struct Node {
+    const uint64_t* tape=nullptr;
+    std::unique_ptr<Node[]> children;
+
+    void subdivide() {
+        children.reset(new Node[64]);
+        for (unsigned i=0; i < 64; ++i) {
+            children[i].tape = tape;
+        }
+    }
+};
+
+/*  Builds (or rebuilds) the frame's pool, if it doesn't have the requested
+ *  number of threads */
+static CpuPool& get_pool(const CpuFrame& f) {
+    const int32_t threads = (f.threads > 0)
+        ? f.threads
+        : std::max<int32_t>(std::thread::hardware_concurrency(), 1);
+    std::shared_ptr<CpuPool>& pool = *f.pool;
+    if (!pool || pool->size() != threads) {
+        pool = std::make_shared<CpuPool>(threads);
+    }
+    return *pool;
+}
+
+/*  State which is shared by 2D and 3D frames */
+struct Frame {
+    explicit Frame(const CpuFrame& f)
+        : f(f), n(f.image_size_px), pool(get_pool(f))
+    {
+        for (int32_t i=0; i < pool.size(); ++i) {
+            scratch.emplace_back(new Scratch);
+        }
+    }
+
+    Scratch& local() {
+        return *scratch[CpuPool::worker()];
+    }
+
+    /*  Checks whether the tile at (x, y), with `size` pixels on a side, is
+     *  in the viewport (see viewport_tiles) */
+    bool in_viewport(int32_t x, int32_t y, int32_t size) const {
+        return x >= f.viewport[0] / size && y >= f.viewport[1] / size &&
+               x < (f.viewport[2] + size - 1) / size &&
+               y < (f.viewport[3] + size - 1) / size;
+    }
+
+    /*  Checks whether the first-stage column (or tile) at (x, y) belongs
+     *  to this partition and overlaps the viewport (see preload_tiles) */
+    bool owned(int32_t x, int32_t y) const {
+        return (x + y) % f.partition_count == f.partition_index &&
+               in_viewport(x, y, 64);
+    }
+
+    void clear(int32_t i, int32_t tile_size_px) {
+        const size_t side = n / tile_size_px;
+        memset(f.filled[i], 0, sizeof(int32_t) * side * side);
+    }
+
+    void stats(double setup_ms, double eval_ms, double normals_ms,
+               double total_ms) const
+    {
+        if (!f.stats) {
+            return;
+        }
+        RenderStats& out = *f.stats;
+        out = RenderStats();
+        out.setup_ms = setup_ms;
+        out.eval_ms[0] = eval_ms;
+        out.normals_ms = normals_ms;
+        out.total_ms = total_ms;
+
+        int64_t tiles[4] = {0, 0, 0, 0};
+        int64_t capacity = 0, pushes = 0, clauses = 0;
+        for (auto& s : scratch) {
+            for (unsigned i=0; i < 4; ++i) {
+                tiles[i] += s->tiles[i];
+            }
+            capacity += s->block_clauses;
+            pushes += s->pushes;
+            clauses += s->pushed_clauses;
+        }
+        for (unsigned i=0; i < 4; ++i) {
+            out.tile_counts[i] = std::min<int64_t>(tiles[i], INT32_MAX);
+        }
+        out.tape_used = std::min<int64_t>(clauses, INT32_MAX);
+        out.tape_capacity = std::min<int64_t>(capacity, INT32_MAX);
+        out.subtape_pushes = std::min<int64_t>(pushes, INT32_MAX);
+        out.subtape_overflows = 0;
+        out.mean_subtape_length = pushes ? float(clauses) / pushes : 0.0f;
+    }
+
+    const CpuFrame& f;
+    const int32_t n;
+    CpuPool& pool;
+    std::vector<std::unique_ptr<Scratch>> scratch;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ *  A 3D render.  Each first-stage column (64 x 64 pixels) is a task, which
+ *  evaluates its 64^3 tiles from front to back, stopping at the first
+ *  filled tile.  Its ambiguous tiles are split into 16 sub-columns of
+ *  16 x 16 pixels, which are new tasks; each of those walks its 16^3 tiles
+ *  from front to back as well, going all the way down to voxels for each
+ *  ambiguous tile before moving on to the next one.
+ *
+ *  Tasks never share pixels: every stage's image is written by exactly one
+ *  task per pixel, so the images don't need atomics.  Each column's images
+ *  are then merged (as copy_filled_3d does between stages) and its normals
+ *  are computed by a second round of tasks.
+ */
+struct Frame3D : public Frame {
+    Frame3D(const CpuFrame& f, const Eigen::Matrix4f& mat)
+        : Frame(f), mat(mat), t0(n / 64),
+          nodes(new Node[size_t(t0) * t0 * t0])
+    {
+        for (size_t i=0; i < size_t(t0) * t0 * t0; ++i) {
+            nodes[i].tape = f.tape;
+        }
+    }
+
+    /*  Bounds of the tile at (x, y, z), as in tile_bounds_3d */
+    void bounds(int32_t x, int32_t y, int32_t z, int32_t tiles_per_side,
+                Interval (&out)[3]) const
+    {
+        const float s = tiles_per_side;
+        const Interval ix = {(x / s - 0.5f) * 2.0f, ((x + 1) / s - 0.5f) * 2.0f};
+        const Interval iy = {(y / s - 0.5f) * 2.0f, ((y + 1) / s - 0.5f) * 2.0f};
+        const Interval iz = {(z / s - 0.5f) * 2.0f, ((z + 1) / s - 0.5f) * 2.0f};
+        auto row = [&](int i) {
+            return Interval(mat(i, 0)) * ix + Interval(mat(i, 1)) * iy +
+                   Interval(mat(i, 2)) * iz + Interval(mat(i, 3));
+        };
+        const Interval iw = row(3);
+        for (unsigned i=0; i < 3; ++i) {
+            out[i] = row(i) / iw;
+        }
+    }
+
+    /*  Returns the depth of pixel (px, py) found so far, combining every
+     *  stage's image (as copy_filled_3d would) */
+    int32_t depth(int32_t px, int32_t py) const {
+        int32_t d = f.filled[3][px + py * n];
+        const int32_t v2 = f.filled[2][px / 4 + py / 4 * (n / 4)];
+        if (v2) {
+            d = std::max(d, v2 * 4 + 3);
+        }
+        const int32_t v1 = f.filled[1][px / 16 + py / 16 * (n / 16)];
+        if (v1) {
+            d = std::max(d, v1 * 16 + 15);
+        }
+        const int32_t v0 = f.filled[0][px / 64 + py / 64 * t0];
+        if (v0) {
+            d = std::max(d, v0 * 64 + 63);
+        }
+        return d;
+    }
+
+    /*  Checks whether every pixel of the `size` x `size` square at (x, y)
+     *  already has a depth of at least `top`, in which case a tile whose
+     *  highest voxel is at `top` can't change the image */
+    bool occluded(int32_t x, int32_t y, int32_t size, int32_t top) const {
+        for (int32_t py=y; py < y + size; ++py) {
+            for (int32_t px=x; px < x + size; ++px) {
+                if (depth(px, py) < top) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    void column(int32_t tx, int32_t ty) {
+        Scratch& s = local();
+        std::shared_ptr<std::vector<int32_t>> zs =
+            std::make_shared<std::vector<int32_t>>();
+        for (int32_t tz=t0 - 1; tz >= 0; --tz) {
+            Node& node = nodes[tx + ty * t0 + tz * t0 * t0];
+            Interval v[3];
+            bounds(tx, ty, tz, t0, v);
+            s.tiles[0]++;
+            const TileResult r = eval_tile(node.tape, v, s);
+            if (r == TILE_FILLED) {
+                // Every tile behind this one is masked
+                f.filled[0][tx + ty * t0] = tz;
+                break;
+            } else if (r == TILE_AMBIGUOUS) {
+                node.subdivide();
+                zs->push_back(tz);
+            }
+        }
+        if (zs->empty()) {
+            return;
+        }
+        for (int32_t sy=0; sy < 4; ++sy) {
+            for (int32_t sx=0; sx < 4; ++sx) {
+                if (in_viewport(tx * 4 + sx, ty * 4 + sy, 16)) {
+                    pool.spawn([this, tx, ty, sx, sy, zs]() {
+                        subcolumn(tx, ty, sx, sy, *zs);
+                    });
+                }
+            }
+        }
+    }
+
+    /*  Evaluates the 16^3 tiles at (sx, sy) within each of the ambiguous
+     *  64^3 tiles in `zs` (from front to back) of the column (tx, ty) */
+    void subcolumn(int32_t tx, int32_t ty, int32_t sx, int32_t sy,
+                   const std::vector<int32_t>& zs)
+    {
+        Scratch& s = local();
+        const int32_t t1 = n / 16;
+        const int32_t x1 = tx * 4 + sx;
+        const int32_t y1 = ty * 4 + sy;
+
+        // Set once a later stage has filled part of this sub-column, so
+        // that tiles behind it need a check against the full-size image
+        bool dirty = false;
+        for (const int32_t tz : zs) {
+            Node& parent = nodes[tx + ty * t0 + tz * t0 * t0];
+            for (int32_t sz=3; sz >= 0; --sz) {
+                const int32_t z1 = tz * 4 + sz;
+                if (dirty && occluded(x1 * 16, y1 * 16, 16, z1 * 16 + 15)) {
+                    return;
+                }
+                Node& node = parent.children[sx + sy * 4 + sz * 16];
+                Interval v[3];
+                bounds(x1, y1, z1, t1, v);
+                s.tiles[1]++;
+                const TileResult r = eval_tile(node.tape, v, s);
+                if (r == TILE_FILLED) {
+                    f.filled[1][x1 + y1 * t1] = z1;
+                    return;
+                } else if (r == TILE_AMBIGUOUS) {
+                    node.subdivide();
+                    microtiles(node, x1, y1, z1, dirty);
+                }
+            }
+        }
+    }
+
+    /*  Evaluates the 4^3 tiles of the ambiguous 16^3 tile at (x1, y1, z1) */
+    void microtiles(Node& parent, int32_t x1, int32_t y1, int32_t z1,
+                    bool& dirty)
+    {
+        Scratch& s = local();
+        const int32_t t2 = n / 4;
+        for (int32_t uz=3; uz >= 0; --uz) {
+            for (int32_t uy=0; uy < 4; ++uy) {
+                for (int32_t ux=0; ux < 4; ++ux) {
+                    const int32_t x2 = x1 * 4 + ux;
+                    const int32_t y2 = y1 * 4 + uy;
+                    const int32_t z2 = z1 * 4 + uz;
+                    if (!in_viewport(x2, y2, 4) ||
+                        occluded(x2 * 4, y2 * 4, 4, z2 * 4 + 3))
+                    {
+                        continue;
+                    }
+                    Node& node = parent.children[ux + uy * 4 + uz * 16];
+                    Interval v[3];
+                    bounds(x2, y2, z2, t2, v);
+                    s.tiles[2]++;
+                    const TileResult r = eval_tile(node.tape, v, s);
+                    if (r == TILE_FILLED) {
+                        f.filled[2][x2 + y2 * t2] = z2;
+                        dirty = true;
+                    } else if (r == TILE_AMBIGUOUS) {
+                        dirty |= voxels(node.tape, x2, y2, z2);
+                    }
+                }
+            }
+        }
+    }
+
+    /*  Evaluates the voxels of the 4^3 tile at (x2, y2, z2) one layer at a
+     *  time, from front to back, stopping once every column is filled.
+     *  Returns true if any voxel was filled. */
+    bool voxels(const uint64_t* tape, int32_t x2, int32_t y2, int32_t z2) {
+        Scratch& s = local();
+        s.tiles[3]++;
+
+        int32_t depths[16];
+        for (int32_t c=0; c < 16; ++c) {
+            depths[c] = depth(x2 * 4 + c % 4, y2 * 4 + c / 4);
+        }
+
+        const float size_recip = 1.0f / n;
+        bool filled = false;
+        for (int32_t vz=3; vz >= 0; --vz) {
+            const int32_t pz = z2 * 4 + vz;
+            if (*std::min_element(depths, depths + 16) >= pz) {
+                break;
+            }
+            const float fz = ((pz + 0.5f) * size_recip - 0.5f) * 2.0f;
+            for (int32_t c0=0; c0 < 16; c0 += LANES) {
+                alignas(64) float in[3][LANES];
+                for (int32_t k=0; k < LANES; ++k) {
+                    const int32_t c = c0 + k;
+                    const float fx = ((x2 * 4 + c % 4 + 0.5f) * size_recip
+                                      - 0.5f) * 2.0f;
+                    const float fy = ((y2 * 4 + c / 4 + 0.5f) * size_recip
+                                      - 0.5f) * 2.0f;
+                    const float fw = mat(3, 0) * fx + mat(3, 1) * fy +
+                                     mat(3, 2) * fz + mat(3, 3);
+                    for (unsigned i=0; i < 3; ++i) {
+                        in[i][k] = (mat(i, 0) * fx + mat(i, 1) * fy +
+                                    mat(i, 2) * fz + mat(i, 3)) / fw;
+                    }
+                }
+                const float* out = eval_lanes(tape, in[0], in[1], in[2],
+                                              s.lanes, s.lane_spills);
+                for (int32_t k=0; k < LANES; ++k) {
+                    const int32_t c = c0 + k;
+                    if (out[k] < 0.0f && depths[c] < pz) {
+                        depths[c] = pz;
+                        f.filled[3][x2 * 4 + c % 4 + (y2 * 4 + c / 4) * n] = pz;
+                        filled = true;
+                    }
+                }
+            }
+        }
+        return filled;
+    }
+
+    /*  Merges the column's images into the later stages' images (as
+     *  copy_filled_3d does), then renders its normals */
+    void finish(int32_t tx, int32_t ty) {
+        for (unsigned i=1; i < 4; ++i) {
+            const int32_t size = 64 >> (2 * i);     // Tile size at stage i
+            const int32_t side = n / size;
+            const int32_t prev_side = side / 4;
+            for (int32_t y=ty * 64 / size; y < (ty + 1) * 64 / size; ++y) {
+                for (int32_t x=tx * 64 / size; x < (tx + 1) * 64 / size; ++x) {
+                    const int32_t t = f.filled[i - 1][x / 4 + y / 4 * prev_side];
+                    int32_t& v = f.filled[i][x + y * side];
+                    if (t) {
+                        v = std::max(v, t * 4 + 3);
+                    }
+                }
+            }
+        }
+        if (f.normals) {
+            Scratch& s = local();
+            for (int32_t py=ty * 64; py < (ty + 1) * 64; ++py) {
+                for (int32_t px=tx * 64; px < (tx + 1) * 64; ++px) {
+                    normal(px, py, s);
+                }
+            }
+        }
+    }
+
+    /*  Renders the normal of one pixel, as in eval_pixels_d */
+    void normal(int32_t px, int32_t py, Scratch& s) {
+        int32_t pz = f.filled[3][px + py * n];
+        if (pz == 0) {
+            return;
+        }
+        if (pz < n - 1) {
+            pz += 1;
+        }
+
+        const Node* node = &nodes[px / 64 + py / 64 * t0 + pz / 64 * t0 * t0];
+        if (node->children) {
+            node = &node->children[(px % 64) / 16 + (py % 64) / 16 * 4 +
+                                   (pz % 64) / 16 * 16];
+            if (node->children) {
+                node = &node->children[(px % 16) / 4 + (py % 16) / 4 * 4 +
+                                       (pz % 16) / 4 * 16];
+            }
+        }
+        const uint64_t* data = node->tape;
+
+        Deriv* const slots = s.derivs;
+        const float size_recip = 1.0f / n;
+        const float fx = ((px + 0.5f) * size_recip - 0.5f) * 2.0f;
+        const float fy = ((py + 0.5f) * size_recip - 0.5f) * 2.0f;
+        const float fz = ((pz + 0.5f) * size_recip - 0.5f) * 2.0f;
+        const float fw = mat(3, 0) * fx + mat(3, 1) * fy +
+                         mat(3, 2) * fz + mat(3, 3);
+        for (unsigned i=0; i < 3; ++i) {
+            slots[((const uint8_t*)data)[i + 1]] = Deriv(
+                (mat(i, 0) * fx + mat(i, 1) * fy +
+                 mat(i, 2) * fz + mat(i, 3)) / fw);
+        }
+        slots[((const uint8_t*)data)[1]].dx = 1.0f;
+        slots[((const uint8_t*)data)[2]].dy = 1.0f;
+        slots[((const uint8_t*)data)[3]].dz = 1.0f;
+
+        const Deriv result = eval_derivs(data, slots, s.deriv_spills);
+        const float norm = std::sqrt(result.dx * result.dx +
+                                     result.dy * result.dy +
+                                     result.dz * result.dz);
+        // Converted the way the GPU does, which clamps (and turns NaN to 0)
+        auto pack = [&](float d) -> uint32_t {
+            const float v = (d / norm) * 127 + 128;
+            return (v >= 0.0f) ? std::min<uint32_t>(v, 255) : 0;
+        };
+        f.normals[px + py * n] = (0xFF << 24) | (pack(result.dz) << 16) |
+                                 (pack(result.dy) << 8) | pack(result.dx);
+    }
+
+    const Eigen::Matrix4f mat;
+    const int32_t t0;   // First-stage tiles per side
+    std::unique_ptr<Node[]> nodes;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ *  A 2D render, which has 64^2 tiles, then 8^2 tiles, then pixels (as on
+ *  the GPU).  Each first-stage tile is a task, and each row of the 8^2
+ *  tiles within an ambiguous tile is another task.
+ */
+struct Frame2D : public Frame {
+    Frame2D(const CpuFrame& f, const Eigen::Matrix3f& mat, float z)
+        : Frame(f), mat(mat), z(z), t0(n / 64)
+    {
+        // Nothing to do here
+    }
+
+    /*  Bounds of the tile at (x, y), as in calculate_intervals_2d */
+    void bounds(int32_t x, int32_t y, int32_t tiles_per_side,
+                Interval (&out)[3]) const
+    {
+        const float s = tiles_per_side;
+        const Interval ix = {(x / s - 0.5f) * 2.0f, ((x + 1) / s - 0.5f) * 2.0f};
+        const Interval iy = {(y / s - 0.5f) * 2.0f, ((y + 1) / s - 0.5f) * 2.0f};
+        auto row = [&](int i) {
+            return Interval(mat(i, 0)) * ix + Interval(mat(i, 1)) * iy +
+                   Interval(mat(i, 2));
+        };
+        const Interval iw = row(2);
+        out[0] = row(0) / iw;
+        out[1] = row(1) / iw;
+        out[2] = Interval(z);
+    }
+
+    void tile(int32_t tx, int32_t ty) {
+        Scratch& s = local();
+        const uint64_t* tape = f.tape;
+        Interval v[3];
+        bounds(tx, ty, t0, v);
+        s.tiles[0]++;
+        const TileResult r = eval_tile(tape, v, s);
+        if (r == TILE_FILLED) {
+            f.filled[0][tx + ty * t0] = 1;
+        } else if (r == TILE_AMBIGUOUS) {
+            for (int32_t sy=0; sy < 8; ++sy) {
+                pool.spawn([this, tx, ty, sy, tape]() {
+                    row(tx, ty * 8 + sy, tape);
+                });
+            }
+        }
+    }
+
+    /*  Evaluates the row of eight 8^2 tiles at y (in the second stage's
+     *  tiles) within the first-stage tile in column tx */
+    void row(int32_t tx, int32_t y, const uint64_t* parent) {
+        Scratch& s = local();
+        const int32_t t2 = n / 8;
+        for (int32_t x=tx * 8; x < (tx + 1) * 8; ++x) {
+            if (!in_viewport(x, y, 8)) {
+                continue;
+            }
+            const uint64_t* tape = parent;
+            Interval v[3];
+            bounds(x, y, t2, v);
+            s.tiles[2]++;
+            const TileResult r = eval_tile(tape, v, s);
+            if (r == TILE_FILLED) {
+                f.filled[2][x + y * t2] = 1;
+            } else if (r == TILE_AMBIGUOUS) {
+                pixels(tape, x, y);
+            }
+        }
+    }
+
+    /*  Evaluates the pixels of the 8^2 tile at (x, y) */
+    void pixels(const uint64_t* tape, int32_t x, int32_t y) {
+        Scratch& s = local();
+        s.tiles[3]++;
+        const float size_recip = 1.0f / n;
+        for (int32_t c0=0; c0 < 64; c0 += LANES) {
+            alignas(64) float in[3][LANES];
+            for (int32_t k=0; k < LANES; ++k) {
+                const int32_t c = c0 + k;
+                const float fx = ((x * 8 + c % 8 + 0.5f) * size_recip
+                                  - 0.5f) * 2.0f;
+                const float fy = ((y * 8 + c / 8 + 0.5f) * size_recip
+                                  - 0.5f) * 2.0f;
+                const float fw = mat(2, 0) * fx + mat(2, 1) * fy + mat(2, 2);
+                for (unsigned i=0; i < 2; ++i) {
+                    in[i][k] = (mat(i, 0) * fx + mat(i, 1) * fy + mat(i, 2))
+                             / fw;
+                }
+                in[2][k] = z;
+            }
+            const float* out = eval_lanes(tape, in[0], in[1], in[2],
+                                          s.lanes, s.lane_spills);
+            for (int32_t k=0; k < LANES; ++k) {
+                const int32_t c = c0 + k;
+                if (out[k] < 0.0f) {
+                    f.filled[3][x * 8 + c % 8 + (y * 8 + c / 8) * n] = 1;
+                }
+            }
+        }
+    }
+
+    /*  Merges the tile's images into the later stages (as copy_filled_2d) */
+    void finish(int32_t tx, int32_t ty) {
+        const int32_t t2 = n / 8;
+        for (int32_t y=ty * 8; y < (ty + 1) * 8; ++y) {
+            for (int32_t x=tx * 8; x < (tx + 1) * 8; ++x) {
+                if (f.filled[0][x / 8 + y / 8 * t0]) {
+                    f.filled[2][x + y * t2] = 1;
+                }
+            }
+        }
+        for (int32_t y=ty * 64; y < (ty + 1) * 64; ++y) {
+            for (int32_t x=tx * 64; x < (tx + 1) * 64; ++x) {
+                if (f.filled[2][x / 8 + y / 8 * t2]) {
+                    f.filled[3][x + y * n] = 1;
+                }
+            }
+        }
+    }
+
+    const Eigen::Matrix3f mat;
+    const float z;
+    const int32_t t0;   // First-stage tiles per side
+};
+
+static double elapsed_ms(std::chrono::high_resolution_clock::time_point a,
+                         std::chrono::high_resolution_clock::time_point b)
+{
+    return std::chrono::duration<double, std::milli>(b - a).count();
+}
+
+}   // namespace cpu
+
+////////////////////////////////////////////////////////////////////////////////
+
+void renderCpu3D(const CpuFrame& f, const Eigen::Matrix4f& mat) {
+    using namespace std::chrono;
+    const auto start = high_resolution_clock::now();
+    cpu::Frame3D frame(f, mat);
+    for (unsigned i=0; i < 4; ++i) {
+        frame.clear(i, 64 >> (2 * i));
+    }
+    const auto setup = high_resolution_clock::now();
+
+    // Each task carries a reference to the frame, which outlives the run
+    std::vector<std::function<void()>> tasks;
+    for (int32_t ty=0; ty < frame.t0; ++ty) {
+        for (int32_t tx=0; tx < frame.t0; ++tx) {
+            if (frame.owned(tx, ty)) {
+                tasks.push_back([&frame, tx, ty]() { frame.column(tx, ty); });
+            }
+        }
+    }
+    frame.pool.run(tasks);
+    const auto eval = high_resolution_clock::now();
+
+    tasks.clear();
+    for (int32_t ty=0; ty < frame.t0; ++ty) {
+        for (int32_t tx=0; tx < frame.t0; ++tx) {
+            if (frame.owned(tx, ty)) {
+                tasks.push_back([&frame, tx, ty]() { frame.finish(tx, ty); });
+            }
+        }
+    }
+    frame.pool.run(tasks);
+    const auto end = high_resolution_clock::now();
+
+    frame.stats(cpu::elapsed_ms(start, setup), cpu::elapsed_ms(setup, eval),
+                cpu::elapsed_ms(eval, end), cpu::elapsed_ms(start, end));
+}
+
+void renderCpu2D(const CpuFrame& f, const Eigen::Matrix3f& mat,
+                 const float z)
+{
+    using namespace std::chrono;
+    const auto start = high_resolution_clock::now();
+    cpu::Frame2D frame(f, mat, z);
+
+    // As on the GPU, 2D renders only use stages 0, 2, and 3
+    frame.clear(0, 64);
+    frame.clear(2, 8);
+    frame.clear(3, 1);
+    const auto setup = high_resolution_clock::now();
+
+    std::vector<std::function<void()>> tasks;
+    for (int32_t ty=0; ty < frame.t0; ++ty) {
+        for (int32_t tx=0; tx < frame.t0; ++tx) {
+            if (frame.owned(tx, ty)) {
+                tasks.push_back([&frame, tx, ty]() { frame.tile(tx, ty); });
+            }
+        }
+    }
+    frame.pool.run(tasks);
+
+    tasks.clear();
+    for (int32_t ty=0; ty < frame.t0; ++ty) {
+        for (int32_t tx=0; tx < frame.t0; ++tx) {
+            if (frame.owned(tx, ty)) {
+                tasks.push_back([&frame, tx, ty]() { frame.finish(tx, ty); });
+            }
+        }
+    }
+    frame.pool.run(tasks);
+    const auto end = high_resolution_clock::now();
+
+    frame.stats(cpu::elapsed_ms(start, setup), cpu::elapsed_ms(setup, end),
+                0.0, cpu::elapsed_ms(start, end));
+}
+
+void setCpuParameters(const float* values, int32_t count, int32_t first) {
+    assert(first >= 0 && first + count <= MAX_PARAMETERS);
+    std::copy(values, values + count, cpu::parameters + first);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+CpuContext::CpuContext(int32_t image_size_px)
+    : image_size_px(image_size_px),
+      normals(size_t(image_size_px) * image_size_px)
+{
+    if (image_size_px <= 0 || image_size_px % 64) {
+        throw std::runtime_error("image_size_px must be a positive "
+                                 "multiple of 64");
+    }
+    for (unsigned i=0; i < 4; ++i) {
+        const size_t side = image_size_px / (64 >> (2 * i));
+        filled[i].resize(side * side);
+    }
+}
+
+// This is defined here, where CpuPool is a complete type
+CpuContext::~CpuContext() = default;
+
+CpuFrame CpuContext::frame(const Tape& tape) {
+    CpuFrame f;
+    f.tape = tape.clauses.data();
+    f.image_size_px = image_size_px;
+    for (unsigned i=0; i < 4; ++i) {
+        f.filled[i] = filled[i].data();
+    }
+    f.normals = render_normals ? normals.data() : nullptr;
+    f.viewport[0] = 0;
+    f.viewport[1] = 0;
+    f.viewport[2] = image_size_px;
+    f.viewport[3] = image_size_px;
+    f.partition_index = 0;
+    f.partition_count = 1;
+    f.pool = &pool;
+    f.threads = cpu_threads;
+    f.stats = collect_stats ? &stats : nullptr;
+    return f;
+}
+
+void CpuContext::render3D(const Tape& tape, const Eigen::Matrix4f& mat) {
+    renderCpu3D(frame(tape), mat);
+}
+
+void CpuContext::render2D(const Tape& tape, const Eigen::Matrix3f& mat,
+                          const float z)
+{
+    renderCpu2D(frame(tape), mat, z);
+}
+
+}   // namespace mpr
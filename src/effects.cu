@@ -9,34 +9,36 @@ You can obtain one at http://mozilla.org/MPL/2.0/.
 
 Copyright (C) 2019-2020  Matt Keeter
 */
+#include <algorithm>
+
 #include "context.hpp"
 #include "effects.hpp"
 
 namespace mpr {
 
-__global__
-void draw_ssao(const int32_t* const __restrict__ depth,
-               const uint32_t* const __restrict__ norm,
+// Radius of SSAO sampling, in render space (+/-1 across the image)
+#define SSAO_RADIUS 0.1f
 
-               const Eigen::Matrix<float, 64, 3> ssao_kernel,
-               const Eigen::Matrix<float, 16*16, 3> ssao_rvecs,
-               const int image_size_px,
+// Size of the square blocks of threads used by the SSAO kernels
+#define SSAO_BLOCK 16
 
-               int32_t* const __restrict__ output)
+/*
+ *  Returns the ambient occlusion (as 0-255, where 255 is unoccluded) of
+ *  pixel (x, y) with height h and packed normal n.  `depth_at(px, py)`
+ *  returns the height of the image at any pixel, or 0 if it's empty or out
+ *  of bounds; samples are never more than SSAO_RADIUS away from the pixel.
+ *
+ *  `rx` and `ry` pick the random rotation vector, which is tiled across the
+ *  image in 16x16 blocks.
+ */
+template <typename F>
+__device__ uint8_t ssao_at(const int x, const int y, const int h,
+                           const uint32_t n, const int rx, const int ry,
+                           const Eigen::Matrix<float, 64, 3>& ssao_kernel,
+                           const Eigen::Matrix<float, 16*16, 3>& ssao_rvecs,
+                           const int image_size_px, F depth_at)
 {
-    const int x = threadIdx.x + blockIdx.x * blockDim.x;
-    const int y = threadIdx.y + blockIdx.y * blockDim.y;
-
-    constexpr float RADIUS = 0.1f;
-
-    if (x >= image_size_px && y >= image_size_px) {
-        return;
-    }
-
-    const int h = depth[x + y * image_size_px];
-    if (!h) {
-        return;
-    }
+    constexpr float RADIUS = SSAO_RADIUS;
 
     const float3 pos = make_float3(
         2.0f * ((x + 0.5f) / image_size_px - 0.5f),
@@ -44,7 +46,6 @@ void draw_ssao(const int32_t* const __restrict__ depth,
         2.0f * ((h + 0.5f) / image_size_px - 0.5f));
 
     // Based on http://john-chapman-graphics.blogspot.com/2013/01/ssao-tutorial.html
-    const uint32_t n = norm[x + y * image_size_px];
 
     // Get normal from image
     const float dx = (float)(n & 0xFF) - 128.0f;
@@ -52,7 +53,7 @@ void draw_ssao(const int32_t* const __restrict__ depth,
     const float dz = (float)((n >> 16) & 0xFF) - 128.0f;
     Eigen::Vector3f normal = Eigen::Vector3f{dx, dy, dz}.normalized();
 
-    Eigen::Vector3f rvec = ssao_rvecs.row((threadIdx.x % 16) * 16 + (threadIdx.y % 16));
+    Eigen::Vector3f rvec = ssao_rvecs.row((rx % 16) * 16 + (ry % 16));
     Eigen::Vector3f tangent = (rvec - normal * rvec.dot(normal)).normalized();
     Eigen::Vector3f bitangent = normal.cross(tangent);
     Eigen::Matrix3f tbn;
@@ -70,7 +71,7 @@ void draw_ssao(const int32_t* const __restrict__ depth,
         const unsigned py = (sample_pos.y() / 2.0f + 0.5f) * image_size_px;
         const unsigned actual_h =
             (px < image_size_px && py < image_size_px)
-            ? depth[px + py * image_size_px]
+            ? depth_at(px, py)
             : 0;
         const float actual_z = 2.0f * ((actual_h + 0.5f) / image_size_px - 0.5f);
 
@@ -84,25 +85,172 @@ void draw_ssao(const int32_t* const __restrict__ depth,
         }
     }
     occlusion = 1.0 - (occlusion / ssao_kernel.rows());
-    const uint8_t o = occlusion * 255;
-    output[x + y * image_size_px] = o;
+    return occlusion * 255;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-
 __global__
-void blur_ssao(const int32_t* const __restrict__ image,
-               const int32_t* const __restrict__ ssao,
+void draw_ssao(const int32_t* const __restrict__ depth,
+               const uint32_t* const __restrict__ norm,
+
+               const Eigen::Matrix<float, 64, 3> ssao_kernel,
+               const Eigen::Matrix<float, 16*16, 3> ssao_rvecs,
                const int image_size_px,
+
                int32_t* const __restrict__ output)
 {
-    unsigned x = threadIdx.x + blockIdx.x * blockDim.x;
-    unsigned y = threadIdx.y + blockIdx.y * blockDim.y;
+    const int x = threadIdx.x + blockIdx.x * blockDim.x;
+    const int y = threadIdx.y + blockIdx.y * blockDim.y;
+
+    if (x >= image_size_px && y >= image_size_px) {
+        return;
+    }
 
+    const int h = depth[x + y * image_size_px];
+    if (!h) {
+        return;
+    }
+
+    output[x + y * image_size_px] = ssao_at(
+        x, y, h, norm[x + y * image_size_px], threadIdx.x, threadIdx.y,
+        ssao_kernel, ssao_rvecs, image_size_px,
+        [&](unsigned px, unsigned py) {
+            return depth[px + py * image_size_px];
+        });
+}
+
+/*
+ *  draw_ssao_tiled
+ *
+ *  A faster version of draw_ssao, which evaluates every `scale`'th pixel on
+ *  each axis (1 for full resolution, 2 for half) and writes the results into
+ *  an `out_size`-square image.
+ *
+ *  Each block first loads the neighborhood of depth values that its samples
+ *  can reach into shared memory, then samples from there rather than with
+ *  scattered reads from global memory.  At high resolutions, the sampling
+ *  radius covers many pixels, so the neighborhood is loaded at every
+ *  `step`'th pixel, i.e. with a coarser depth image.  The neighborhood is
+ *  `width` values on a side, starting at value (`x0`, `y0`) relative to the
+ *  block's first pixel (in units of `step` pixels).
+ */
+__global__
+void draw_ssao_tiled(const int32_t* const __restrict__ depth,
+                     const uint32_t* const __restrict__ norm,
+
+                     const Eigen::Matrix<float, 64, 3> ssao_kernel,
+                     const Eigen::Matrix<float, 16*16, 3> ssao_rvecs,
+                     const int image_size_px,
+                     const int scale, const int step,
+                     const int offset, const int width,
+
+                     const int out_size,
+                     int32_t* const __restrict__ output)
+{
+    extern __shared__ int32_t local_depth[];
+
+    // Origin of the neighborhood, in units of `step` pixels
+    const int bx = (int)(blockIdx.x * blockDim.x * scale) / step - offset;
+    const int by = (int)(blockIdx.y * blockDim.y * scale) / step - offset;
+    for (int i=threadIdx.x + threadIdx.y * blockDim.x; i < width * width;
+         i += blockDim.x * blockDim.y)
+    {
+        const int px = (bx + i % width) * step;
+        const int py = (by + i / width) * step;
+        local_depth[i] = (px >= 0 && px < image_size_px &&
+                          py >= 0 && py < image_size_px)
+            ? depth[px + py * image_size_px] : 0;
+    }
+    __syncthreads();
+
+    const int ox = threadIdx.x + blockIdx.x * blockDim.x;
+    const int oy = threadIdx.y + blockIdx.y * blockDim.y;
+    if (ox >= out_size || oy >= out_size) {
+        return;
+    }
+    const int x = ox * scale;
+    const int y = oy * scale;
+
+    const int h = depth[x + y * image_size_px];
+    if (!h) {
+        return;
+    }
+
+    output[ox + oy * out_size] = ssao_at(
+        x, y, h, norm[x + y * image_size_px], threadIdx.x, threadIdx.y,
+        ssao_kernel, ssao_rvecs, image_size_px,
+        [&](unsigned px, unsigned py) {
+            const int lx = (int)px / step - bx;
+            const int ly = (int)py / step - by;
+            // The neighborhood covers the sampling radius, but fall back
+            // to global memory in case rounding puts a sample outside of it
+            return (lx >= 0 && lx < width && ly >= 0 && ly < width)
+                ? local_depth[lx + ly * width]
+                : depth[px + py * image_size_px];
+        });
+}
+
+/*
+ *  upsample_ssao
+ *
+ *  Expands a half-resolution SSAO image (from draw_ssao_tiled) to full
+ *  resolution.  Each pixel blends the four nearest half-resolution samples,
+ *  weighted by distance and by how close their depth is to its own, so that
+ *  occlusion doesn't bleed across depth discontinuities.
+ */
+__global__
+void upsample_ssao(const int32_t* const __restrict__ depth,
+                   const int32_t* const __restrict__ half,
+                   const int image_size_px,
+                   int32_t* const __restrict__ output)
+{
+    const int x = threadIdx.x + blockIdx.x * blockDim.x;
+    const int y = threadIdx.y + blockIdx.y * blockDim.y;
     if (x >= image_size_px || y >= image_size_px) {
         return;
     }
 
+    const int h = depth[x + y * image_size_px];
+    if (!h) {
+        return;
+    }
+
+    const int half_size = image_size_px / 2;
+    const int hx = x / 2;
+    const int hy = y / 2;
+    float sum = 0.0f;
+    float weight = 0.0f;
+    int nearest = half[min(hx, half_size - 1) + min(hy, half_size - 1) * half_size];
+    for (int j=0; j < 2; ++j) {
+        for (int i=0; i < 2; ++i) {
+            const int sx = min(hx + i, half_size - 1);
+            const int sy = min(hy + j, half_size - 1);
+            const int sh = depth[sx * 2 + sy * 2 * image_size_px];
+            if (!sh) {
+                continue;
+            }
+            // Bilinear weight (samples sit at even pixels), then depth
+            const float wx = i ? (x - hx * 2) * 0.5f : 1.0f - (x - hx * 2) * 0.5f;
+            const float wy = j ? (y - hy * 2) * 0.5f : 1.0f - (y - hy * 2) * 0.5f;
+            const float w = wx * wy / (1.0f + fabsf((float)(sh - h)));
+            sum += w * half[sx + sy * half_size];
+            weight += w;
+        }
+    }
+    output[x + y * image_size_px] = (weight > 0.0f) ? (sum / weight) : nearest;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ *  Returns the blurred SSAO value at pixel (x, y), which must be in bounds.
+ *  This picks the quadrant around the pixel whose filled pixels have the
+ *  least variance, then returns their mean.
+ */
+__device__ float blur_at(const int32_t* const __restrict__ image,
+                         const int32_t* const __restrict__ ssao,
+                         const int image_size_px,
+                         const unsigned x, const unsigned y)
+{
     const int BLUR_RADIUS = 2;
 
     float best = 1000000.0f;
@@ -152,35 +300,36 @@ void blur_ssao(const int32_t* const __restrict__ image,
         run((i & 1) ? 0 : -BLUR_RADIUS,
             (i & 2) ? 0 : -BLUR_RADIUS);
     }
-    output[x + y * image_size_px] = value;
+    return value;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-
-__global__ void draw_shaded(const int32_t* const __restrict__ depth,
-                            const uint32_t* const __restrict__ norm,
-                            const int32_t* const __restrict__ ssao,
-
-                            const int image_size_px,
-
-                            int32_t* const __restrict__ output)
+__global__
+void blur_ssao(const int32_t* const __restrict__ image,
+               const int32_t* const __restrict__ ssao,
+               const int image_size_px,
+               int32_t* const __restrict__ output)
 {
     unsigned x = threadIdx.x + blockIdx.x * blockDim.x;
     unsigned y = threadIdx.y + blockIdx.y * blockDim.y;
 
-    if (x >= image_size_px && y >= image_size_px) {
+    if (x >= image_size_px || y >= image_size_px) {
         return;
     }
 
-    const auto h = depth[x + y * image_size_px];
-    if (!h) {
-        return;
-    }
+    output[x + y * image_size_px] = blur_at(image, ssao, image_size_px, x, y);
+}
 
-    const uint8_t s = ssao[x + y * image_size_px];
+////////////////////////////////////////////////////////////////////////////////
 
+/*
+ *  Returns the packed RGBA color of pixel (x, y), with height h, packed
+ *  normal n, and SSAO value s, lit by a single point light plus ambient.
+ */
+__device__ uint32_t shade_at(const unsigned x, const unsigned y,
+                             const int32_t h, const uint32_t n,
+                             const uint8_t s, const int image_size_px)
+{
     // Get normal from image
-    const auto n = norm[x + y * image_size_px];
     float dx = (float)(n & 0xFF) - 128.0f;
     float dy = (float)((n >> 8) & 0xFF) - 128.0f;
     float dz = (float)((n >> 16) & 0xFF) - 128.0f;
@@ -214,10 +363,77 @@ __global__ void draw_shaded(const int32_t* const __restrict__ depth,
 
     uint8_t color = light * 255.0f;
 
-    output[x + y * image_size_px] = (0xFF << 24) |
-                                    (color << 16) |
-                                    (color << 8) |
-                                    (color << 0);
+    return (0xFF << 24) | (color << 16) | (color << 8) | (color << 0);
+}
+
+__global__ void draw_shaded(const int32_t* const __restrict__ depth,
+                            const uint32_t* const __restrict__ norm,
+                            const int32_t* const __restrict__ ssao,
+
+                            const int image_size_px,
+
+                            int32_t* const __restrict__ output)
+{
+    unsigned x = threadIdx.x + blockIdx.x * blockDim.x;
+    unsigned y = threadIdx.y + blockIdx.y * blockDim.y;
+
+    if (x >= image_size_px && y >= image_size_px) {
+        return;
+    }
+
+    const auto h = depth[x + y * image_size_px];
+    if (!h) {
+        return;
+    }
+
+    output[x + y * image_size_px] = shade_at(
+            x, y, h, norm[x + y * image_size_px],
+            ssao[x + y * image_size_px], image_size_px);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ *  Writes one pixel of a texture_size_px x texture_size_px surface, picking
+ *  the nearest pixel of the image.  If `ssao` is null, the image is shaded
+ *  without occlusion; otherwise, it's the unblurred SSAO (as drawn by
+ *  drawRawSSAO), which is blurred here, only at the pixels which are read.
+ *  If `shaded` is false, the (blurred) SSAO is written as grayscale.
+ *
+ *  With `append`, empty pixels are left alone, so that several renders can
+ *  be drawn into the same surface.
+ */
+__global__
+void shade_to_surface(const int32_t* const __restrict__ depth,
+                      const uint32_t* const __restrict__ norm,
+                      const int32_t* const __restrict__ ssao,
+                      const int image_size_px, const bool shaded,
+                      cudaSurfaceObject_t surf,
+                      const int texture_size_px, const bool append)
+{
+    const int x = threadIdx.x + blockIdx.x * blockDim.x;
+    const int y = threadIdx.y + blockIdx.y * blockDim.y;
+    if (x >= texture_size_px || y >= texture_size_px) {
+        return;
+    }
+
+    const uint32_t px = x * image_size_px / texture_size_px;
+    const uint32_t py = y * image_size_px / texture_size_px;
+    const auto h = depth[px + py * image_size_px];
+    if (!h) {
+        if (!append) {
+            surf2Dwrite(0, surf, x*4, y);
+        }
+        return;
+    }
+
+    const uint8_t s = ssao
+        ? (int32_t)blur_at(depth, ssao, image_size_px, px, py)
+        : 255;
+    const uint32_t color = shaded
+        ? shade_at(px, py, h, norm[px + py * image_size_px], s, image_size_px)
+        : (0xFF000000 | s | (s << 8) | (s << 16));
+    surf2Dwrite(color, surf, x*4, y);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -254,10 +470,54 @@ void Effects::resizeTo(const Context& ctx) {
         image_size_px = ctx.image_size_px;
         tmp.reset(CUDA_MALLOC(int32_t, pow(image_size_px, 2)));
         image.reset(CUDA_MALLOC(int32_t, pow(image_size_px, 2)));
+        half.reset(CUDA_MALLOC(int32_t, pow(image_size_px / 2, 2)));
     }
 }
 
-void Effects::drawSSAO(const Context& ctx)
+void Effects::drawRawSSAO(const Context& ctx, SSAOQuality quality,
+                          int32_t* out, cudaStream_t stream)
+{
+    const unsigned u = (image_size_px + SSAO_BLOCK - 1) / SSAO_BLOCK;
+    const dim3 block(SSAO_BLOCK, SSAO_BLOCK);
+    if (quality == SSAO_REFERENCE) {
+        draw_ssao<<<dim3(u, u), block, 0, stream>>>(
+                ctx.stages[3].filled.get(), ctx.normals.get(),
+                ssao_kernel, ssao_rvecs, image_size_px,
+                out);
+        return;
+    }
+
+    // The neighborhood which a block's samples can reach is its own pixels,
+    // plus the sampling radius on every side (which is scaled down to fit
+    // in at most this many values).  One extra value on each side covers
+    // rounding of the block's origin.
+    const int MAX_APRON = 16;
+    const int scale = (quality == SSAO_HALF) ? 2 : 1;
+    const int radius = SSAO_RADIUS / 2.0f * image_size_px + 1;
+    const int step = std::max(1, (radius + MAX_APRON - 1) / MAX_APRON);
+    const int offset = (radius + step - 1) / step + 1;
+    const int width = (SSAO_BLOCK * scale + step - 1) / step + 2 * offset;
+
+    const int out_size = image_size_px / scale;
+    const unsigned v = (out_size + SSAO_BLOCK - 1) / SSAO_BLOCK;
+    int32_t* const target = (scale == 1) ? out : half.get();
+    if (scale != 1) {
+        CUDA_CHECK(cudaMemsetAsync(half.get(), 0,
+                                   sizeof(int32_t) * pow(out_size, 2),
+                                   stream));
+    }
+    draw_ssao_tiled<<<dim3(v, v), block,
+                      sizeof(int32_t) * width * width, stream>>>(
+            ctx.stages[3].filled.get(), ctx.normals.get(),
+            ssao_kernel, ssao_rvecs, image_size_px,
+            scale, step, offset, width, out_size, target);
+    if (scale != 1) {
+        upsample_ssao<<<dim3(u, u), block, 0, stream>>>(
+                ctx.stages[3].filled.get(), half.get(), image_size_px, out);
+    }
+}
+
+void Effects::drawSSAO(const Context& ctx, SSAOQuality quality)
 {
     resizeTo(ctx);
 
@@ -266,16 +526,13 @@ void Effects::drawSSAO(const Context& ctx)
     CUDA_CHECK(cudaMemsetAsync(image.get(), 0, bytes));
 
     const unsigned u = (image_size_px + 15) / 16;
-    draw_ssao<<<dim3(u, u), dim3(16, 16)>>>(
-            ctx.stages[3].filled.get(), ctx.normals.get(),
-            ssao_kernel, ssao_rvecs, image_size_px,
-            tmp.get());
+    drawRawSSAO(ctx, quality, tmp.get(), 0);
     blur_ssao<<<dim3(u, u), dim3(16, 16)>>>(
             ctx.stages[3].filled.get(), tmp.get(), image_size_px, image.get());
     CUDA_CHECK(cudaDeviceSynchronize());
 }
 
-void Effects::drawShaded(const Context& ctx)
+void Effects::drawShaded(const Context& ctx, SSAOQuality quality)
 {
     resizeTo(ctx);
 
@@ -284,10 +541,7 @@ void Effects::drawShaded(const Context& ctx)
     CUDA_CHECK(cudaMemsetAsync(image.get(), 0, bytes));
 
     const unsigned u = (image_size_px + 15) / 16;
-    draw_ssao<<<dim3(u, u), dim3(16, 16)>>>(
-            ctx.stages[3].filled.get(), ctx.normals.get(),
-            ssao_kernel, ssao_rvecs, image_size_px,
-            image.get());
+    drawRawSSAO(ctx, quality, image.get(), 0);
     blur_ssao<<<dim3(u, u), dim3(16, 16)>>>(
             ctx.stages[3].filled.get(), image.get(), image_size_px, tmp.get());
     draw_shaded<<<dim3(u, u), dim3(16, 16)>>>(
@@ -296,5 +550,28 @@ void Effects::drawShaded(const Context& ctx)
     CUDA_CHECK(cudaDeviceSynchronize());
 }
 
+void Effects::drawToSurface(const Context& ctx, cudaSurfaceObject_t surf,
+                            int texture_size_px, bool append,
+                            EffectsMode mode, SSAOQuality quality,
+                            cudaStream_t stream)
+{
+    resizeTo(ctx);
+
+    const int32_t* ssao = nullptr;
+    if (mode != EFFECTS_LIGHT) {
+        CUDA_CHECK(cudaMemsetAsync(tmp.get(), 0,
+                                   sizeof(int32_t) * pow(image_size_px, 2),
+                                   stream));
+        drawRawSSAO(ctx, quality, tmp.get(), stream);
+        ssao = tmp.get();
+    }
+
+    const unsigned u = (texture_size_px + 15) / 16;
+    shade_to_surface<<<dim3(u, u), dim3(16, 16), 0, stream>>>(
+            ctx.stages[3].filled.get(), ctx.normals.get(), ssao,
+            image_size_px, mode != EFFECTS_SSAO,
+            surf, texture_size_px, append);
+    CUDA_CHECK(cudaGetLastError());
+}
 
 }   // namespace mpr
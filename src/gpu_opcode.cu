@@ -30,6 +30,8 @@ const char* gpu_op_str(uint8_t op) {
         case GPU_OP_EXP_LHS: return "EXP_LHS";
         case GPU_OP_ABS_LHS: return "ABS_LHS";
         case GPU_OP_LOG_LHS: return "LOG_LHS";
+        case GPU_OP_TAN_LHS: return "TAN_LHS";
+        case GPU_OP_RECIP_LHS: return "RECIP_LHS";
 
         // Commutative opcodes
         case GPU_OP_ADD_LHS_IMM: return "ADD_LHS_IMM";
@@ -48,11 +50,43 @@ const char* gpu_op_str(uint8_t op) {
         case GPU_OP_DIV_LHS_IMM: return "DIV_LHS_IMM";
         case GPU_OP_DIV_IMM_RHS: return "DIV_IMM_RHS";
         case GPU_OP_DIV_LHS_RHS: return "DIV_LHS_RHS";
+        case GPU_OP_ATAN2_LHS_IMM: return "ATAN2_LHS_IMM";
+        case GPU_OP_ATAN2_IMM_RHS: return "ATAN2_IMM_RHS";
+        case GPU_OP_ATAN2_LHS_RHS: return "ATAN2_LHS_RHS";
+        case GPU_OP_POW_LHS_IMM: return "POW_LHS_IMM";
+        case GPU_OP_POW_IMM_RHS: return "POW_IMM_RHS";
+        case GPU_OP_POW_LHS_RHS: return "POW_LHS_RHS";
+        case GPU_OP_NTH_ROOT_LHS_IMM: return "NTH_ROOT_LHS_IMM";
+        case GPU_OP_NTH_ROOT_IMM_RHS: return "NTH_ROOT_IMM_RHS";
+        case GPU_OP_NTH_ROOT_LHS_RHS: return "NTH_ROOT_LHS_RHS";
+        case GPU_OP_MOD_LHS_IMM: return "MOD_LHS_IMM";
+        case GPU_OP_MOD_IMM_RHS: return "MOD_IMM_RHS";
+        case GPU_OP_MOD_LHS_RHS: return "MOD_LHS_RHS";
+        case GPU_OP_NANFILL_LHS_IMM: return "NANFILL_LHS_IMM";
+        case GPU_OP_NANFILL_IMM_RHS: return "NANFILL_IMM_RHS";
+        case GPU_OP_NANFILL_LHS_RHS: return "NANFILL_LHS_RHS";
+        case GPU_OP_COMPARE_LHS_IMM: return "COMPARE_LHS_IMM";
+        case GPU_OP_COMPARE_IMM_RHS: return "COMPARE_IMM_RHS";
+        case GPU_OP_COMPARE_LHS_RHS: return "COMPARE_LHS_RHS";
 
         // Copy-only opcodes (used after pushing)
         case GPU_OP_COPY_IMM: return "COPY_IMM";
         case GPU_OP_COPY_LHS: return "COPY_LHS";
         case GPU_OP_COPY_RHS: return "COPY_RHS";
+
+        case GPU_OP_PARAM: return "PARAM";
+
+        // Compound opcodes
+        case GPU_OP_MUL_ADD_LHS_RHS_IMM: return "MUL_ADD_LHS_RHS_IMM";
+        case GPU_OP_MUL_ADD_LHS_IMM_RHS: return "MUL_ADD_LHS_IMM_RHS";
+        case GPU_OP_SQUARE_ADD_LHS_IMM: return "SQUARE_ADD_LHS_IMM";
+        case GPU_OP_SQUARE_ADD_LHS_RHS: return "SQUARE_ADD_LHS_RHS";
+        case GPU_OP_SUB_SQUARE_LHS_IMM: return "SUB_SQUARE_LHS_IMM";
+        case GPU_OP_SUB_SQUARE_LHS_RHS: return "SUB_SQUARE_LHS_RHS";
+        case GPU_OP_HYPOT_LHS_RHS: return "HYPOT_LHS_RHS";
+
+        case GPU_OP_SPILL: return "SPILL";
+        case GPU_OP_RELOAD: return "RELOAD";
         default: return "UNKNOWN";
     }
 }
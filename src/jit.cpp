@@ -0,0 +1,387 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+
+#include <nvrtc.h>
+
+#include "clause.hpp"
+#include "context.hpp"
+#include "gpu_opcode.hpp"
+#include "jit.hpp"
+#include "tape.hpp"
+
+namespace mpr {
+
+/*  Tapes longer than this are left to the interpreter, since compile time
+ *  grows with the tape and a huge kernel would spill its slots anyways */
+static const int32_t JIT_MAX_CLAUSES = 8192;
+
+/*  Must match the choice array in eval_tiles_i */
+static const int JIT_CHOICE_ARRAY_SIZE = 256;
+
+// The generated kernel indexes tiles as raw integers, since TileNode is
+// declared alongside host-only code (in context.hpp)
+static_assert(sizeof(TileNode) == 3 * sizeof(int32_t),
+              "TileNode must be three packed integers");
+
+static std::string slot(uint8_t i) {
+    return "s" + std::to_string(i);
+}
+
+/*  Entries of the spill array are variables as well */
+static std::string spill(int32_t i) {
+    return "p" + std::to_string(i);
+}
+
+/*  Immediates are written bit-for-bit, so that the compiled kernel sees
+ *  exactly the same values as the interpreter. */
+static std::string imm(const uint64_t& d) {
+    uint32_t bits;
+    memcpy(&bits, &IMM(&d), sizeof(bits));
+    std::stringstream ss;
+    ss << "__int_as_float(0x" << std::hex << bits << ")";
+    return ss.str();
+}
+
+/*  Writes one clause as a statement, using the same Interval functions as
+ *  the interpreter.  Returns false if the opcode isn't supported. */
+static bool write_clause(std::ostream& out, const uint64_t& d) {
+    const std::string lhs = slot(I_LHS(&d));
+    const std::string rhs = slot(I_RHS(&d));
+    const std::string k = imm(d);
+
+    out << "    ";
+    if (OP(&d) == GPU_OP_SPILL) {
+        out << spill(SPILL_INDEX(&d)) << " = " << lhs << ";\n";
+        return true;
+    }
+    const auto choice = [&](const char* f, const std::string& b) {
+        out << "{ int c = 0; " << slot(I_OUT(&d)) << " = " << f << "("
+            << lhs << ", " << b << ", c); "
+            << "record_choice(choices, choice_index, has_any_choice, c); }\n";
+    };
+    switch (OP(&d)) {
+        case GPU_OP_MIN_LHS_IMM: choice("min", k); return true;
+        case GPU_OP_MIN_LHS_RHS: choice("min", rhs); return true;
+        case GPU_OP_MAX_LHS_IMM: choice("max", k); return true;
+        case GPU_OP_MAX_LHS_RHS: choice("max", rhs); return true;
+        default: break;
+    }
+
+    out << slot(I_OUT(&d)) << " = ";
+    switch (OP(&d)) {
+        case GPU_OP_SQUARE_LHS: out << "square(" << lhs << ")"; break;
+        case GPU_OP_SQRT_LHS:   out << "sqrt(" << lhs << ")"; break;
+        case GPU_OP_NEG_LHS:    out << "-" << lhs; break;
+        case GPU_OP_SIN_LHS:    out << "sin(" << lhs << ")"; break;
+        case GPU_OP_COS_LHS:    out << "cos(" << lhs << ")"; break;
+        case GPU_OP_ASIN_LHS:   out << "asin(" << lhs << ")"; break;
+        case GPU_OP_ACOS_LHS:   out << "acos(" << lhs << ")"; break;
+        case GPU_OP_ATAN_LHS:   out << "atan(" << lhs << ")"; break;
+        case GPU_OP_EXP_LHS:    out << "exp(" << lhs << ")"; break;
+        case GPU_OP_ABS_LHS:    out << "abs(" << lhs << ")"; break;
+        case GPU_OP_LOG_LHS:    out << "log(" << lhs << ")"; break;
+        case GPU_OP_TAN_LHS:    out << "tan(" << lhs << ")"; break;
+        case GPU_OP_RECIP_LHS:  out << "recip(" << lhs << ")"; break;
+
+        case GPU_OP_ADD_LHS_IMM: out << lhs << " + " << k; break;
+        case GPU_OP_ADD_LHS_RHS: out << lhs << " + " << rhs; break;
+        case GPU_OP_MUL_LHS_IMM: out << lhs << " * " << k; break;
+        case GPU_OP_MUL_LHS_RHS: out << lhs << " * " << rhs; break;
+
+        case GPU_OP_SUB_LHS_IMM: out << lhs << " - " << k; break;
+        case GPU_OP_SUB_IMM_RHS: out << k << " - " << rhs; break;
+        case GPU_OP_SUB_LHS_RHS: out << lhs << " - " << rhs; break;
+        case GPU_OP_DIV_LHS_IMM: out << lhs << " / " << k; break;
+        case GPU_OP_DIV_IMM_RHS: out << k << " / " << rhs; break;
+        case GPU_OP_DIV_LHS_RHS: out << lhs << " / " << rhs; break;
+        case GPU_OP_ATAN2_LHS_IMM:
+            out << "atan2(" << lhs << ", " << k << ")"; break;
+        case GPU_OP_ATAN2_IMM_RHS:
+            out << "atan2(" << k << ", " << rhs << ")"; break;
+        case GPU_OP_ATAN2_LHS_RHS:
+            out << "atan2(" << lhs << ", " << rhs << ")"; break;
+        case GPU_OP_POW_LHS_IMM:
+            out << "pow(" << lhs << ", " << k << ")"; break;
+        case GPU_OP_POW_IMM_RHS:
+            out << "pow(" << k << ", " << rhs << ")"; break;
+        case GPU_OP_POW_LHS_RHS:
+            out << "pow(" << lhs << ", " << rhs << ")"; break;
+        case GPU_OP_NTH_ROOT_LHS_IMM:
+            out << "nth_root(" << lhs << ", " << k << ")"; break;
+        case GPU_OP_NTH_ROOT_IMM_RHS:
+            out << "nth_root(" << k << ", " << rhs << ")"; break;
+        case GPU_OP_NTH_ROOT_LHS_RHS:
+            out << "nth_root(" << lhs << ", " << rhs << ")"; break;
+        case GPU_OP_MOD_LHS_IMM:
+            out << "mod(" << lhs << ", " << k << ")"; break;
+        case GPU_OP_MOD_IMM_RHS:
+            out << "mod(" << k << ", " << rhs << ")"; break;
+        case GPU_OP_MOD_LHS_RHS:
+            out << "mod(" << lhs << ", " << rhs << ")"; break;
+        case GPU_OP_NANFILL_LHS_IMM:
+            out << "nanfill(" << lhs << ", " << k << ")"; break;
+        case GPU_OP_NANFILL_IMM_RHS:
+            out << "nanfill(" << k << ", " << rhs << ")"; break;
+        case GPU_OP_NANFILL_LHS_RHS:
+            out << "nanfill(" << lhs << ", " << rhs << ")"; break;
+        case GPU_OP_COMPARE_LHS_IMM:
+            out << "compare(" << lhs << ", " << k << ")"; break;
+        case GPU_OP_COMPARE_IMM_RHS:
+            out << "compare(" << k << ", " << rhs << ")"; break;
+        case GPU_OP_COMPARE_LHS_RHS:
+            out << "compare(" << lhs << ", " << rhs << ")"; break;
+
+        case GPU_OP_COPY_IMM: out << "Interval(" << k << ")"; break;
+        case GPU_OP_COPY_LHS: out << lhs; break;
+        case GPU_OP_COPY_RHS: out << rhs; break;
+
+        case GPU_OP_MUL_ADD_LHS_RHS_IMM:
+            out << "mul_add(" << lhs << ", " << rhs << ", " << k << ")"; break;
+        case GPU_OP_MUL_ADD_LHS_IMM_RHS:
+            out << "mul_add(" << lhs << ", " << k << ", " << rhs << ")"; break;
+        case GPU_OP_SQUARE_ADD_LHS_IMM:
+            out << "square_add(" << lhs << ", " << k << ")"; break;
+        case GPU_OP_SQUARE_ADD_LHS_RHS:
+            out << "square_add(" << lhs << ", " << rhs << ")"; break;
+        case GPU_OP_SUB_SQUARE_LHS_IMM:
+            out << "sub_square(" << lhs << ", " << k << ")"; break;
+        case GPU_OP_SUB_SQUARE_LHS_RHS:
+            out << "sub_square(" << lhs << ", " << rhs << ")"; break;
+        case GPU_OP_HYPOT_LHS_RHS:
+            out << "hypot(" << lhs << ", " << rhs << ")"; break;
+
+        case GPU_OP_RELOAD: out << spill(SPILL_INDEX(&d)); break;
+
+        default: return false;
+    }
+    out << ";\n";
+    return true;
+}
+
+std::string jitTilesSource(const Tape& tape, int dimension) {
+    const std::vector<uint64_t>& flat = tape.clauses;
+    const int32_t num_slots = std::max(tape.num_slots, 1);
+
+    std::stringstream out;
+    out << R"(// Generated by mpr::jitTilesSource
+typedef unsigned char uint8_t;
+typedef int int32_t;
+typedef unsigned int uint32_t;
+typedef unsigned long long uint64_t;
+#define assert(x)
+
+#include "gpu_tape.hpp"
+using namespace mpr;
+
+extern "C" __global__
+void eval_tiles_jit(uint64_t* const __restrict__ tape_data,
+                    int32_t* const __restrict__ tape_index,
+                    const int32_t tape_capacity,
+                    int32_t* const __restrict__ tape_overflows,
+                    const bool contiguous,
+                    SubtapeEntry* const __restrict__ subtape_table,
+                    const int32_t subtape_table_size,
+                    int32_t* const __restrict__ image,
+                    const uint32_t tiles_per_side,
+
+                    int32_t* const __restrict__ in_tiles,
+                    const int32_t* const __restrict__ in_tile_count,
+
+                    const Interval* __restrict__ values)
+{
+    const int32_t tile_index = threadIdx.x + blockIdx.x * blockDim.x;
+    if (tile_index >= *in_tile_count) {
+        return;
+    }
+)";
+    out << "    int32_t& position = in_tiles[tile_index * 3 + "
+        << offsetof(TileNode, position) / sizeof(int32_t) << "];\n"
+        << "    int32_t& tape = in_tiles[tile_index * 3 + "
+        << offsetof(TileNode, tape) / sizeof(int32_t) << "];\n"
+        << "    if (position < 0) {\n"
+        << "        return;\n"
+        << "    }\n\n";
+
+    out << "    Interval";
+    for (int32_t i=0; i < num_slots; ++i) {
+        out << (i ? ", " : " ") << slot(i);
+    }
+    out << ";\n";
+    int32_t num_spills = 0;
+    for (int32_t i=1; i < tape.length - 1; ++i) {
+        if (OP(&flat[i]) == GPU_OP_SPILL) {
+            num_spills = std::max(num_spills, SPILL_INDEX(&flat[i]) + 1);
+        }
+    }
+    for (int32_t i=0; i < num_spills; ++i) {
+        out << (i ? ", " : "    Interval ") << spill(i);
+    }
+    out << (num_spills ? ";\n" : "");
+    const uint8_t* axes = reinterpret_cast<const uint8_t*>(&flat[0]);
+    for (unsigned i=0; i < 3; ++i) {
+        out << "    " << slot(axes[i + 1]) << " = values[tile_index * 3 + "
+            << i << "];\n";
+    }
+    out << "\n    uint32_t choices[" << JIT_CHOICE_ARRAY_SIZE << "] = {0};\n"
+        << "    int choice_index = 0;\n"
+        << "    bool has_any_choice = false;\n\n";
+
+    // The first clause holds the X, Y, Z slots, and the last clause only
+    // names the output slot, so every clause in between is real work.
+    for (int32_t i=1; i < tape.length - 1; ++i) {
+        if (!write_clause(out, flat[i])) {
+            return "";
+        }
+    }
+
+    const uint8_t i_out = I_OUT(&flat[tape.length - 1]);
+    out << "\n    int active[" << num_slots << "];\n"
+        << "    finish_tile<" << dimension << ", " << num_slots << ">(\n"
+        << "        " << slot(i_out) << ", &tape_data[tape + "
+        << tape.length - 1 << "],\n"
+        << "        choices, " << JIT_CHOICE_ARRAY_SIZE
+        << ", choice_index, has_any_choice, active,\n"
+        << "        tape_data, tape_index, tape_capacity, tape_overflows, "
+        << "contiguous,\n"
+        << "        subtape_table, subtape_table_size,\n"
+        << "        image, tiles_per_side, position, tape);\n"
+        << "}\n";
+    return out.str();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*  Compiles `src` for the current device, returning its PTX (or an empty
+ *  string, after printing the compiler log) */
+static std::string compile(const std::string& src) {
+    int device;
+    cudaDeviceProp prop;
+    if (cudaGetDevice(&device) != cudaSuccess ||
+        cudaGetDeviceProperties(&prop, device) != cudaSuccess)
+    {
+        return "";
+    }
+
+    nvrtcProgram prog;
+    if (nvrtcCreateProgram(&prog, src.c_str(), "eval_tiles_jit.cu",
+                           0, nullptr, nullptr) != NVRTC_SUCCESS)
+    {
+        return "";
+    }
+
+    const std::string arch = "--gpu-architecture=compute_" +
+        std::to_string(prop.major) + std::to_string(prop.minor);
+    std::vector<const char*> opts = {
+        arch.c_str(), "--std=c++11",
+        "-I" MPR_JIT_INCLUDE_DIR,
+        "-I" MPR_JIT_CUDA_INCLUDE_DIR,
+#ifdef BIG_SERVER
+        "-DBIG_SERVER",
+#endif
+    };
+    const nvrtcResult result = nvrtcCompileProgram(prog, opts.size(),
+                                                   opts.data());
+
+    std::string ptx;
+    if (result == NVRTC_SUCCESS) {
+        size_t size;
+        nvrtcGetPTXSize(prog, &size);
+        ptx.resize(size);
+        nvrtcGetPTX(prog, &ptx[0]);
+    } else {
+        size_t size;
+        nvrtcGetProgramLogSize(prog, &size);
+        std::string log(size, '\0');
+        nvrtcGetProgramLog(prog, &log[0]);
+        fprintf(stderr, "Could not compile tape: %s\n%s\n",
+                nvrtcGetErrorString(result), log.c_str());
+    }
+    nvrtcDestroyProgram(&prog);
+    return ptx;
+}
+
+namespace {
+struct JitKey {
+    uint64_t hash;
+    int32_t length;
+    int dimension;
+    int device;
+    bool operator==(const JitKey& other) const {
+        return hash == other.hash && length == other.length &&
+               dimension == other.dimension && device == other.device;
+    }
+};
+struct JitKeyHash {
+    size_t operator()(const JitKey& k) const {
+        return k.hash ^ (size_t(k.length) << 8) ^ (k.dimension << 4) ^ k.device;
+    }
+};
+struct JitKernel {
+    Module module;
+    CUfunction function=nullptr;   // null if compilation failed
+};
+}   // anonymous namespace
+
+CUfunction jitEvalTiles(const Tape& tape, int dimension) {
+    if (tape.length > JIT_MAX_CLAUSES) {
+        return nullptr;
+    }
+    int device;
+    if (cudaGetDevice(&device) != cudaSuccess) {
+        return nullptr;
+    }
+
+    // Modules are never unloaded, because they may outlive the CUDA context
+    // when the process exits, so the cache itself is deliberately leaked.
+    static std::mutex mutex;
+    static auto& cache =
+        *new std::unordered_map<JitKey, JitKernel, JitKeyHash>;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    const JitKey key = {tape.hash, tape.length, dimension, device};
+    auto itr = cache.find(key);
+    if (itr != cache.end()) {
+        return itr->second.function;
+    }
+
+    // Failures are cached too, so that a bad tape is only compiled once
+    JitKernel& k = cache[key];
+    const std::string src = jitTilesSource(tape, dimension);
+    const std::string ptx = src.empty() ? "" : compile(src);
+    if (ptx.empty()) {
+        return nullptr;
+    }
+
+    CUmodule m;
+    if (cuModuleLoadData(&m, ptx.c_str()) != CUDA_SUCCESS) {
+        fprintf(stderr, "Could not load compiled tape\n");
+        return nullptr;
+    }
+    k.module.reset(m);
+    if (cuModuleGetFunction(&k.function, m, "eval_tiles_jit")
+            != CUDA_SUCCESS)
+    {
+        fprintf(stderr, "Could not find compiled tape kernel\n");
+        k.function = nullptr;
+    }
+    return k.function;
+}
+
+}   // namespace mpr
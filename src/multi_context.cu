@@ -0,0 +1,124 @@
+/*
+Reference implementation for
+"Massively Parallel Rendering of Complex Closed-Form Implicit Surfaces"
+(SIGGRAPH 2020)
+
+This Source Code Form is subject to the terms of the Mozilla Public
+License, v. 2.0. If a copy of the MPL was not distributed with this file,
+You can obtain one at http://mozilla.org/MPL/2.0/.
+
+Copyright (C) 2019-2020  Matt Keeter
+*/
+#include "context_impl.hpp"
+#include "multi_context.hpp"
+#include "parameters.hpp"
+
+using namespace mpr;
+
+/*
+ *  composite_max_z
+ *
+ *  Merges one device's depth and normal images into the output, keeping
+ *  whichever pixel is closer to the viewer (i.e. has the larger Z value).
+ */
+__global__
+void composite_max_z(int32_t* const __restrict__ depth,
+                     uint32_t* const __restrict__ normals,
+                     const int32_t* const __restrict__ other_depth,
+                     const uint32_t* const __restrict__ other_normals,
+                     const int32_t num_pixels)
+{
+    const int32_t i = threadIdx.x + blockIdx.x * blockDim.x;
+    if (i >= num_pixels) {
+        return;
+    }
+    if (other_depth[i] > depth[i]) {
+        depth[i] = other_depth[i];
+        normals[i] = other_normals[i];
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+MultiContext::MultiContext(int32_t image_size_px,
+                           const std::vector<int>& devices)
+    : image_size_px(image_size_px), devices(devices)
+{
+    for (unsigned i=0; i < devices.size(); ++i) {
+        CUDA_CHECK(cudaSetDevice(devices[i]));
+        contexts.emplace_back(image_size_px);
+        contexts.back().partition_index = i;
+        contexts.back().partition_count = devices.size();
+
+        // Device-side sizing means that enqueueing a frame never blocks the
+        // host, so every device can be started before any of them finish.
+        contexts.back().device_sizing = true;
+
+        // Compositing always reads normals, even from depth-only frames
+        alloc_normals(contexts.back());
+        streams.push_back(makeStream());
+    }
+
+    // Let the first device read directly from the others, if possible
+    CUDA_CHECK(cudaSetDevice(devices[0]));
+    for (unsigned i=1; i < devices.size(); ++i) {
+        int can_access;
+        CUDA_CHECK(cudaDeviceCanAccessPeer(&can_access, devices[0],
+                                           devices[i]));
+        if (can_access) {
+            CUDA_CHECK(cudaDeviceEnablePeerAccess(devices[i], 0));
+        }
+    }
+    const size_t num_pixels = image_size_px * image_size_px;
+    peer_depth.reset(CUDA_MALLOC_DEVICE(int32_t, num_pixels));
+    peer_normals.reset(CUDA_MALLOC_DEVICE(uint32_t, num_pixels));
+}
+
+void MultiContext::render3D(const Tape& tape, const Eigen::Matrix4f& mat) {
+    // Give each device its own copy of the tape, then start rendering
+    tapes.clear();
+    for (unsigned i=0; i < devices.size(); ++i) {
+        CUDA_CHECK(cudaSetDevice(devices[i]));
+        tapes.emplace_back(tape);
+    }
+
+    // If any device ran out of room, then it has grown its buffers and we
+    // render again (exactly like Context::render3D in device-sizing mode).
+    bool overflowed;
+    do {
+        std::vector<cudaEvent_t> done;
+        for (unsigned i=0; i < devices.size(); ++i) {
+            CUDA_CHECK(cudaSetDevice(devices[i]));
+            done.push_back(contexts[i].render3DAsync(tapes[i], mat,
+                                                     streams[i].get()));
+        }
+
+        // Composite every other device's image into the first device's
+        CUDA_CHECK(cudaSetDevice(devices[0]));
+        const size_t num_pixels = image_size_px * image_size_px;
+        cudaStream_t stream = streams[0].get();
+        for (unsigned i=1; i < devices.size(); ++i) {
+            CUDA_CHECK(cudaStreamWaitEvent(stream, done[i], 0));
+            CUDA_CHECK(cudaMemcpyPeerAsync(
+                    peer_depth.get(), devices[0],
+                    contexts[i].stages[3].filled.get(), devices[i],
+                    sizeof(int32_t) * num_pixels, stream));
+            CUDA_CHECK(cudaMemcpyPeerAsync(
+                    peer_normals.get(), devices[0],
+                    contexts[i].normals.get(), devices[i],
+                    sizeof(uint32_t) * num_pixels, stream));
+            composite_max_z<<<(num_pixels + NUM_THREADS - 1) / NUM_THREADS,
+                              NUM_THREADS, 0, stream>>>(
+                    contexts[0].stages[3].filled.get(),
+                    contexts[0].normals.get(),
+                    peer_depth.get(), peer_normals.get(),
+                    num_pixels);
+        }
+        CUDA_CHECK(cudaStreamSynchronize(stream));
+
+        overflowed = false;
+        for (auto& c : contexts) {
+            overflowed |= c.overflowed();
+        }
+    } while (overflowed);
+}
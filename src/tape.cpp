@@ -12,105 +12,976 @@ Copyright (C) 2019-2020  Matt Keeter
 #include "libfive/tree/tree.hpp"
 #include "libfive/tree/cache.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <functional>
+#include <queue>
+#include <stdexcept>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "clause.hpp"
 #include "tape.hpp"
 #include "gpu_opcode.hpp"
+#include "parameters.hpp"
 
 namespace mpr {
 
-Tape::Tape(const libfive::Tree& tree) {
-    // Hold a single cache lock to avoid needing mutex locks everywhere
-    auto lock = libfive::Cache::instance();
+struct TapeBuilder::Impl {
+    /*  Adds every node in the tree to the cache (stopping at nodes which are
+     *  already there), returning the root's index. */
+    int32_t intern(const libfive::Tree& tree);
+
+    /*  Schedules, allocates slots for, and flattens the tree at `root`,
+     *  optionally fusing common patterns into compound opcodes. */
+    Tape flatten(int32_t root, bool fuse);
+
+    /*  Finds clauses in the schedule which can be merged with their
+     *  children into a single compound opcode (e.g. x^2 + y), storing them
+     *  in `fused` and marking the children in `absorbed`. */
+    void fuse(const std::vector<int32_t>& ordered, uint32_t gen);
+
+    /*  A compound clause, which replaces a node's own (libfive) opcode */
+    struct Fused {
+        uint8_t op;         // GPU opcode, or GPU_OP_INVALID if not fused
+        int32_t lhs;        // Indices of nodes in the LHS and RHS slots,
+        int32_t rhs;        // or -1
+        float imm;
+    };
+
+    /*  Returns a version of the tree at `root` with min / max clauses that
+     *  are one-sided within the given bounds replaced by the relevant side,
+     *  plus other rewrites that only hold within the bounds. */
+    int32_t prune(int32_t root, const float lower[3], const float upper[3]);
+
+    struct Node {
+        libfive::Opcode::Opcode op;
+        float value;        // Constant value, or parameter index
+        int32_t lhs;        // Index of children, or -1
+        int32_t rhs;
+        int32_t need;       // Sethi-Ullman number, for scheduling
+        bool clause;        // Whether this node becomes a clause in the tape
+        int32_t simple;     // Index of the simplified version of this node
+    };
+
+    /*  Returns the index of a node with the given opcode and children,
+     *  adding it if there isn't one already. */
+    int32_t insert(libfive::Opcode::Opcode op, int32_t lhs, int32_t rhs,
+                   float value=0.0f);
+    int32_t constant(float value) {
+        return insert(libfive::Opcode::CONSTANT, -1, -1, value);
+    }
+
+    /*  Returns a node which is equivalent to applying the clause opcode `op`
+     *  to `lhs` and `rhs` (which must already be simplified), after constant
+     *  folding and algebraic simplification. */
+    int32_t simplify(libfive::Opcode::Opcode op, int32_t lhs, int32_t rhs);
+
+    /*  Returns the parameter index of a free variable, numbering it (with
+     *  an empty name) if it hasn't been seen before. */
+    int32_t parameter(libfive::Tree::Id var);
+
+    // Every node seen since the last clear, with a map from libfive's IDs
+    // to their index.  Nodes from the tree are added in post-order (children
+    // before their parents); nodes made by simplification are added as
+    // needed, and are only reachable through `simple` or from each other.
+    std::vector<Node> nodes;
+    std::unordered_map<libfive::Tree::Id, int32_t> index;
+
+    // Every node by opcode, children, and value, so that simplification
+    // doesn't create duplicates.
+    struct Key {
+        int32_t op;
+        int32_t lhs;
+        int32_t rhs;
+        float value;
+        bool operator==(const Key& other) const {
+            return op == other.op && lhs == other.lhs && rhs == other.rhs &&
+                   !memcmp(&value, &other.value, sizeof(value));
+        }
+    };
+    struct KeyHash {
+        size_t operator()(const Key& k) const {
+            uint32_t v;
+            memcpy(&v, &k.value, sizeof(v));
+            size_t h = k.op;
+            for (uint32_t i : {uint32_t(k.lhs), uint32_t(k.rhs), v}) {
+                h = h * 31 + i;
+            }
+            return h;
+        }
+    };
+    std::unordered_map<Key, int32_t, KeyHash> by_key;
+
+    // Trees that have been built, which keep every cached ID alive
+    std::vector<libfive::Tree> roots;
+
+    // Parameter index of every free variable, and the name of each index,
+    // with trees that keep the variables alive.  These survive the builder
+    // clearing its cache in build(), so that numbering stays consistent.
+    std::unordered_map<libfive::Tree::Id, int32_t> parameters;
+    std::vector<std::string> parameter_names;
+    std::vector<libfive::Tree> parameter_roots;
+
+    // Per-build scratch arrays, indexed like `nodes`.  Rather than clearing
+    // these on every build, `visited` and `bound` store the build number
+    // when they are set; `last_used`, `next_use`, and `slot` are always
+    // written before they are read in a given build.
+    std::vector<uint32_t> visited;
+    std::vector<uint32_t> bound;        // Whether the value is in its slot
+    std::vector<int32_t> last_used;
+    std::vector<int32_t> next_use;      // Next position that reads the value
+    std::vector<uint8_t> slot;
+    std::vector<int32_t> uses;          // Number of uses in the schedule
+    std::vector<uint32_t> absorbed;     // Merged into a compound clause
+    std::vector<Fused> fused;           // Indexed by position in schedule
+    uint32_t generation=0;
+
+    // Scratch arrays for prune, which store the node that each visited node
+    // is replaced with, and its bounds.
+    std::vector<uint32_t> pruned_at;
+    std::vector<int32_t> pruned;
+    std::vector<float> pruned_lower;
+    std::vector<float> pruned_upper;
+    std::vector<uint8_t> pruned_nan;  // Whether the node could be NaN
+};
+
+static bool is_clause(libfive::Opcode::Opcode op) {
+    using namespace libfive::Opcode;
+    switch (op) {
+        case OP_ADD:
+        case OP_MUL:
+        case OP_MIN:
+        case OP_MAX:
+        case OP_SUB:
+        case OP_DIV:
+        case OP_SQUARE:
+        case OP_SQRT:
+        case OP_NEG:
+        case OP_SIN:
+        case OP_COS:
+        case OP_ASIN:
+        case OP_ACOS:
+        case OP_ATAN:
+        case OP_EXP:
+        case OP_ABS:
+        case OP_LOG:
+        case OP_TAN:
+        case OP_RECIP:
+        case OP_ATAN2:
+        case OP_POW:
+        case OP_NTH_ROOT:
+        case OP_MOD:
+        case OP_NANFILL:
+        case OP_COMPARE: return true;
+        default:        return false;
+    }
+}
+
+int32_t TapeBuilder::Impl::insert(libfive::Opcode::Opcode op,
+                                  int32_t lhs, int32_t rhs, float value)
+{
+    const Key key = {op, lhs, rhs, value};
+    auto itr = by_key.find(key);
+    if (itr != by_key.end()) {
+        return itr->second;
+    }
 
-    auto ordered = tree.orderedDfs();
-    std::vector<libfive::Tree::Id> ordered_fast;
-    ordered_fast.reserve(ordered.size());
+    Node n;
+    n.op = op;
+    n.value = value;
+    n.lhs = lhs;
+    n.rhs = rhs;
+    // Free variables have no children, but become clauses which load the
+    // parameter into a slot
+    n.clause = is_clause(op) || op == libfive::Opcode::VAR_FREE;
+    n.simple = nodes.size();
 
-    std::map<libfive::Tree::Id, libfive::Tree::Id> last_used;
-    libfive::Tree::Id axes_used[3] = {nullptr};
-    for (auto& c : ordered) {
+    // Estimate how many slots each clause's subtree needs (its Sethi-Ullman
+    // number).  Shared subexpressions make this approximate, but it's a
+    // good guide for which child to schedule first.
+    n.need = 0;
+    if (n.clause) {
+        const int32_t a = (lhs != -1) ? nodes[lhs].need : 0;
+        const int32_t b = (rhs != -1 && rhs != lhs) ? nodes[rhs].need : 0;
+        n.need = std::max(1, (a == b) ? a + 1 : std::max(a, b));
+    }
+
+    by_key[key] = nodes.size();
+    nodes.push_back(n);
+    return nodes.size() - 1;
+}
+
+/*  Evaluates a clause whose arguments are both constant */
+static float fold(libfive::Opcode::Opcode op, float a, float b) {
+    using namespace libfive::Opcode;
+    switch (op) {
+        case OP_ADD:    return a + b;
+        case OP_MUL:    return a * b;
+        case OP_MIN:    return std::fmin(a, b);
+        case OP_MAX:    return std::fmax(a, b);
+        case OP_SUB:    return a - b;
+        case OP_DIV:    return a / b;
+        case OP_SQUARE: return a * a;
+        case OP_SQRT:   return std::sqrt(a);
+        case OP_NEG:    return -a;
+        case OP_SIN:    return std::sin(a);
+        case OP_COS:    return std::cos(a);
+        case OP_ASIN:   return std::asin(a);
+        case OP_ACOS:   return std::acos(a);
+        case OP_ATAN:   return std::atan(a);
+        case OP_EXP:    return std::exp(a);
+        case OP_ABS:    return std::fabs(a);
+        case OP_LOG:    return std::log(a);
+        case OP_TAN:    return std::tan(a);
+        case OP_RECIP:  return 1.0f / a;
+        case OP_ATAN2:  return std::atan2(a, b);
+        case OP_POW:    return std::pow(a, b);
+        case OP_NTH_ROOT:
+            return (a < 0.0f && std::fabs(std::fmod(b, 2.0f)) == 1.0f)
+                ? -std::pow(-a, 1.0f / b)
+                : std::pow(a, 1.0f / b);
+        case OP_MOD: {
+            const float r = std::fmod(a, b);
+            return (r < 0.0f) ? (r + b) : r;
+        }
+        case OP_NANFILL: return std::isnan(a) ? b : a;
+        case OP_COMPARE: return (a < b) ? -1.0f : ((a > b) ? 1.0f : 0.0f);
+        default:        return std::nanf("");
+    }
+}
+
+int32_t TapeBuilder::Impl::simplify(libfive::Opcode::Opcode op,
+                                    int32_t lhs, int32_t rhs)
+{
+    using namespace libfive::Opcode;
+    auto is_constant = [&](int32_t i) {
+        return i != -1 && nodes[i].op == CONSTANT;
+    };
+    auto is_value = [&](int32_t i, float v) {
+        return is_constant(i) && nodes[i].value == v;
+    };
+    // Opcode of the LHS, or INVALID
+    const libfive::Opcode::Opcode a = (lhs != -1) ? nodes[lhs].op : INVALID;
+
+    // Constant folding
+    if (is_constant(lhs) && (rhs == -1 || is_constant(rhs))) {
+        return constant(fold(op, nodes[lhs].value,
+                             (rhs == -1) ? 0.0f : nodes[rhs].value));
+    }
+
+    switch (op) {
+        // x + 0, 0 + x, x * 1, 1 * x
+        case OP_ADD:    if (is_value(lhs, 0.0f)) return rhs;
+                        if (is_value(rhs, 0.0f)) return lhs;
+                        break;
+        case OP_MUL:    if (is_value(lhs, 1.0f)) return rhs;
+                        if (is_value(rhs, 1.0f)) return lhs;
+                        break;
+        // x - 0, 0 - x, x / 1
+        case OP_SUB:    if (is_value(rhs, 0.0f)) return lhs;
+                        if (is_value(lhs, 0.0f)) {
+                            return simplify(OP_NEG, rhs, -1);
+                        }
+                        break;
+        case OP_DIV:    if (is_value(rhs, 1.0f)) return lhs;
+                        break;
+        // min(x, x), max(x, x)
+        case OP_MIN:
+        case OP_MAX:    if (lhs == rhs) return lhs;
+                        break;
+        // -(-x)
+        case OP_NEG:    if (a == OP_NEG) return nodes[lhs].lhs;
+                        break;
+        // abs(abs(x)), abs(x^2)
+        case OP_ABS:    if (a == OP_ABS || a == OP_SQUARE) return lhs;
+                        break;
+        // sqrt(x^2) = abs(x); note that the reverse (sqrt(x)^2 = x) only
+        // holds when x >= 0, so it's left to prune.
+        case OP_SQRT:   if (a == OP_SQUARE) {
+                            return simplify(OP_ABS, nodes[lhs].lhs, -1);
+                        }
+                        break;
+        // (-x)^2, abs(x)^2
+        case OP_SQUARE: if (a == OP_NEG || a == OP_ABS) {
+                            return simplify(OP_SQUARE, nodes[lhs].lhs, -1);
+                        }
+                        break;
+        default:        break;
+    }
+    const int32_t out = insert(op, lhs, rhs);
+    return nodes[out].simple;
+}
+
+int32_t TapeBuilder::Impl::parameter(libfive::Tree::Id var) {
+    auto itr = parameters.find(var);
+    if (itr != parameters.end()) {
+        return itr->second;
+    }
+    const int32_t i = parameter_names.size();
+    if (i == MAX_PARAMETERS) {
+        // Evaluators read parameters from fixed-size arrays, so a larger
+        // index would read past their end
+        throw std::runtime_error("Tree uses more than " +
+                                 std::to_string(MAX_PARAMETERS) +
+                                 " parameters");
+    }
+    parameters[var] = i;
+    parameter_names.push_back("");
+    parameter_roots.push_back(roots.back());
+    return i;
+}
+
+int32_t TapeBuilder::Impl::intern(const libfive::Tree& tree) {
+    {
+        auto itr = index.find(tree.id());
+        if (itr != index.end()) {
+            return itr->second;
+        }
+    }
+    roots.push_back(tree);
+
+    // Iterative post-order walk, since trees can be very deep
+    std::vector<std::pair<libfive::Tree::Id, bool>> todo;
+    todo.push_back({tree.id(), false});
+    while (todo.size()) {
+        const auto t = todo.back();
+        todo.pop_back();
+        if (index.count(t.first)) {
+            continue;
+        }
+        const libfive::Tree::Id lhs = t.first->lhs.get();
+        const libfive::Tree::Id rhs = t.first->rhs.get();
+        if (!t.second) {
+            todo.push_back({t.first, true});
+            for (auto& c : {rhs, lhs}) {
+                if (c != nullptr && !index.count(c)) {
+                    todo.push_back({c, false});
+                }
+            }
+            continue;
+        }
+
+        const auto op = t.first->op;
         using namespace libfive::Opcode;
-        // Very simple tracking of active spans, without clause reordering
-        // or any other cleverness.
-        switch (c->op) {
-            case CONSTANT: continue;
-            case VAR_X: axes_used[0] = c.id(); break;
-            case VAR_Y: axes_used[1] = c.id(); break;
-            case VAR_Z: axes_used[2] = c.id(); break;
-
-            // Opcodes which take two arguments store their RHS
-            case OP_ADD:
-            case OP_MUL:
-            case OP_MIN:
-            case OP_MAX:
-            case OP_SUB:
-            case OP_DIV:    last_used[c.rhs().id()] = c.id();
-                            // FALLTHROUGH
-
-            // Unary opcodes (and fallthrough) store their LHS)
-            case OP_SQUARE:
-            case OP_SQRT:
-            case OP_NEG:
-            case OP_SIN:
-            case OP_COS:
-            case OP_ASIN:
-            case OP_ACOS:
-            case OP_ATAN:
-            case OP_EXP:
-            case OP_ABS:
-            case OP_LOG:    last_used[c.lhs().id()] = c.id();
-                            ordered_fast.push_back(c.id());
+        if (op != CONSTANT && op != VAR_X && op != VAR_Y && op != VAR_Z &&
+            op != VAR_FREE && op != CONST_VAR && !is_clause(op))
+        {
+            throw std::runtime_error("Unimplemented opcode " +
+                                     libfive::Opcode::toString(op));
+        }
+
+        // CONST_VAR only hides its argument from libfive's solver for free
+        // variables, so it evaluates to the argument itself
+        const int32_t i_lhs = lhs ? index.at(lhs) : -1;
+        if (op == CONST_VAR) {
+            index[t.first] = i_lhs;
+            continue;
+        }
+        const int32_t i_rhs = rhs ? index.at(rhs) : -1;
+        const float value = (op == CONSTANT) ? t.first->value
+                          : (op == VAR_FREE) ? parameter(t.first)
+                          : 0.0f;
+        const int32_t i = insert(op, i_lhs, i_rhs, value);
+        index[t.first] = i;
+
+        // Simplify the node in terms of its (simplified) children, which is
+        // cached alongside the node, so that it only happens once.
+        if (is_clause(op) && nodes[i].simple == i) {
+            const int32_t s = simplify(
+                    op, (i_lhs != -1) ? nodes[i_lhs].simple : -1,
+                        (i_rhs != -1) ? nodes[i_rhs].simple : -1);
+            nodes[i].simple = s;
+        }
+    }
+    return index.at(tree.id());
+}
+
+/*  Interval arithmetic for prune.  Returns true if the result could be NaN
+ *  even when the arguments aren't (e.g. the square root of a negative
+ *  number), in which case the bounds only apply to non-NaN results. */
+static bool interval_bounds(libfive::Opcode::Opcode op,
+                            float la, float ua, float lb, float ub,
+                            float& lower, float& upper)
+{
+    using namespace libfive::Opcode;
+    const float inf = std::numeric_limits<float>::infinity();
+    bool nan = false;
+    switch (op) {
+        case OP_ADD:    lower = la + lb; upper = ua + ub;
+                        nan = (la == -inf && ub == inf) ||
+                              (ua == inf && lb == -inf);
+                        break;
+        case OP_SUB:    lower = la - ub; upper = ua - lb;
+                        nan = (la == -inf && lb == -inf) ||
+                              (ua == inf && ub == inf);
+                        break;
+        case OP_MUL: {
+            const float p[4] = {la * lb, la * ub, ua * lb, ua * ub};
+            lower = *std::min_element(p, p + 4);
+            upper = *std::max_element(p, p + 4);
+            nan = std::isnan(p[0]) || std::isnan(p[1]) ||
+                  std::isnan(p[2]) || std::isnan(p[3]);
+            break;
+        }
+        case OP_DIV:
+            if (lb <= 0.0f && ub >= 0.0f) {
+                lower = -inf;
+                upper = inf;
+                nan = true;
+            } else {
+                nan = interval_bounds(OP_MUL, la, ua, 1.0f / ub, 1.0f / lb,
+                                      lower, upper);
+            }
+            break;
+        case OP_MIN:    lower = std::min(la, lb); upper = std::min(ua, ub); break;
+        case OP_MAX:    lower = std::max(la, lb); upper = std::max(ua, ub); break;
+        case OP_SQUARE:
+            if (la >= 0.0f) {
+                lower = la * la; upper = ua * ua;
+            } else if (ua <= 0.0f) {
+                lower = ua * ua; upper = la * la;
+            } else {
+                lower = 0.0f; upper = std::max(la * la, ua * ua);
+            }
+            break;
+        case OP_SQRT:
+            lower = std::sqrt(std::max(la, 0.0f));
+            upper = std::sqrt(std::max(ua, 0.0f));
+            nan = la < 0.0f;
+            break;
+        case OP_NEG:    lower = -ua; upper = -la; break;
+        case OP_ABS:
+            if (la >= 0.0f) {
+                lower = la; upper = ua;
+            } else if (ua <= 0.0f) {
+                lower = -ua; upper = -la;
+            } else {
+                lower = 0.0f; upper = std::max(-la, ua);
+            }
+            break;
+        case OP_SIN:
+        case OP_COS:    lower = -1.0f; upper = 1.0f;
+                        nan = (la == -inf || ua == inf);
+                        break;
+        case OP_ASIN:   lower = -M_PI / 2; upper = M_PI / 2;
+                        nan = (la < -1.0f || ua > 1.0f);
+                        break;
+        case OP_ACOS:   lower = 0.0f; upper = M_PI;
+                        nan = (la < -1.0f || ua > 1.0f);
+                        break;
+        case OP_ATAN:   lower = std::atan(la); upper = std::atan(ua); break;
+        case OP_EXP:    lower = std::exp(la); upper = std::exp(ua); break;
+        case OP_LOG:
+            lower = (la > 0.0f) ? std::log(la) : -inf;
+            upper = (ua > 0.0f) ? std::log(ua) : -inf;
+            nan = la < 0.0f;
+            break;
+        case OP_RECIP:
+            nan = interval_bounds(OP_DIV, 1.0f, 1.0f, la, ua, lower, upper);
+            break;
+        case OP_ATAN2:  lower = -M_PI; upper = M_PI; break;
+        case OP_MOD:
+            // Results wrap into [0, b), so only positive moduli are bounded
+            if (lb > 0.0f && ub != inf) {
+                lower = 0.0f; upper = ub;
+                nan = (la == -inf || ua == inf);
+            } else {
+                lower = -inf; upper = inf; nan = true;
+            }
+            break;
+        case OP_COMPARE: lower = -1.0f; upper = 1.0f; break;
+        default:        lower = -inf; upper = inf; nan = true; break;
+    }
+    if (std::isnan(lower) || std::isnan(upper)) {
+        lower = -inf;
+        upper = inf;
+        nan = true;
+    }
+    return nan;
+}
+
+int32_t TapeBuilder::Impl::prune(int32_t root,
+                                 const float lower[3], const float upper[3])
+{
+    pruned_at.resize(nodes.size(), 0);
+    pruned.resize(nodes.size());
+    pruned_lower.resize(nodes.size());
+    pruned_upper.resize(nodes.size());
+    pruned_nan.resize(nodes.size());
+    const uint32_t gen = ++generation;
+
+    // Post-order walk, as in intern.  Simplification may add nodes, but
+    // they're never visited here, so the scratch arrays don't need to grow.
+    std::vector<std::pair<int32_t, bool>> todo;
+    todo.push_back({root, false});
+    while (todo.size()) {
+        const auto t = todo.back();
+        todo.pop_back();
+        const int32_t i = t.first;
+        if (pruned_at[i] == gen) {
+            continue;
+        }
+        const Node n = nodes[i];
+        if (!t.second) {
+            todo.push_back({i, true});
+            for (auto& c : {n.rhs, n.lhs}) {
+                if (c != -1 && pruned_at[c] != gen) {
+                    todo.push_back({c, false});
+                }
+            }
+            continue;
+        }
+        pruned_at[i] = gen;
+
+        // Bounds are stored by the index of the original node, so these
+        // are the bounds of whatever its children were replaced with.
+        const float inf = std::numeric_limits<float>::infinity();
+        float la = -inf, ua = inf, lb = -inf, ub = inf;
+        bool na = false, nb = false;
+        if (n.lhs != -1) {
+            la = pruned_lower[n.lhs];
+            ua = pruned_upper[n.lhs];
+            na = pruned_nan[n.lhs];
+        }
+        if (n.rhs != -1) {
+            lb = pruned_lower[n.rhs];
+            ub = pruned_upper[n.rhs];
+            nb = pruned_nan[n.rhs];
+        }
+
+        using namespace libfive::Opcode;
+        int32_t replace = -1;   // Replace with this node's child
+        switch (n.op) {
+            case CONSTANT:  pruned_lower[i] = n.value;
+                            pruned_upper[i] = n.value;
+                            pruned_nan[i] = std::isnan(n.value);
+                            pruned[i] = i;
+                            continue;
+            case VAR_X:
+            case VAR_Y:
+            case VAR_Z:     pruned_lower[i] = lower[n.op - VAR_X];
+                            pruned_upper[i] = upper[n.op - VAR_X];
+                            pruned_nan[i] = false;
+                            pruned[i] = i;
+                            continue;
+
+            // One-sided min and max only need the relevant side.  A NaN
+            // argument is ignored by min and max, so it blocks pruning.
+            case OP_MIN:    if (na || nb) break;
+                            else if (ua <= lb) replace = n.lhs;
+                            else if (ub <= la) replace = n.rhs;
+                            break;
+            case OP_MAX:    if (na || nb) break;
+                            else if (la >= ub) replace = n.lhs;
+                            else if (lb >= ua) replace = n.rhs;
+                            break;
+            // abs(x) = x when x >= 0
+            case OP_ABS:    if (la >= 0.0f) replace = n.lhs;
+                            break;
+            // sqrt(x)^2 = x when x >= 0
+            case OP_SQUARE: if (nodes[n.lhs].op == OP_SQRT &&
+                                pruned_lower[nodes[n.lhs].lhs] >= 0.0f)
+                            {
+                                replace = nodes[n.lhs].lhs;
+                            }
                             break;
-            default:    break;
+            default:        break;
+        }
+
+        if (replace != -1) {
+            pruned[i] = pruned[replace];
+            pruned_lower[i] = pruned_lower[replace];
+            pruned_upper[i] = pruned_upper[replace];
+            pruned_nan[i] = pruned_nan[replace];
+        } else {
+            const int32_t a = (n.lhs != -1) ? pruned[n.lhs] : -1;
+            const int32_t b = (n.rhs != -1) ? pruned[n.rhs] : -1;
+            pruned[i] = (!n.clause || (a == n.lhs && b == n.rhs))
+                ? i : simplify(n.op, a, b);
+            float& lo = pruned_lower[i];
+            float& hi = pruned_upper[i];
+            const bool nan = interval_bounds(n.op, la, ua, lb, ub, lo, hi);
+            if (n.op == OP_MIN || n.op == OP_MAX) {
+                // If one side is NaN, then the result is the other side
+                if (na) {
+                    lo = std::min(lo, lb);
+                    hi = std::max(hi, ub);
+                }
+                if (nb) {
+                    lo = std::min(lo, la);
+                    hi = std::max(hi, ua);
+                }
+                pruned_nan[i] = na && nb;
+            } else {
+                pruned_nan[i] = nan || na || nb;
+            }
+        }
+    }
+    return pruned[root];
+}
+
+void TapeBuilder::Impl::fuse(const std::vector<int32_t>& ordered,
+                             uint32_t gen)
+{
+    using namespace libfive::Opcode;
+
+    // A child can only be merged into its parent if nothing else uses it
+    for (auto& i : ordered) {
+        for (auto& h : {nodes[i].lhs, nodes[i].rhs}) {
+            if (h != -1) {
+                uses[h] = 0;
+            }
         }
     }
+    for (auto& i : ordered) {
+        for (auto& h : {nodes[i].lhs, nodes[i].rhs}) {
+            if (h != -1) {
+                uses[h]++;
+            }
+        }
+    }
+    auto single = [&](int32_t i, libfive::Opcode::Opcode op) {
+        return i != -1 && nodes[i].op == op && uses[i] == 1 &&
+               absorbed[i] != gen;
+    };
+    auto is_constant = [&](int32_t i) {
+        return nodes[i].op == CONSTANT;
+    };
 
-    std::vector<uint8_t> free_slots;
-    std::map<libfive::Tree::Id, uint8_t> bound_slots;
-    uint8_t num_slots = 1;
+    // Walk from the root down, so that parents absorb their children before
+    // the children have a chance to absorb their own.
+    for (int32_t p=ordered.size() - 1; p >= 0; --p) {
+        const int32_t i = ordered[p];
+        if (absorbed[i] == gen) {
+            continue;
+        }
+        const Node c = nodes[i];
+        Fused& f = fused[p];
+        switch (c.op) {
+            // sqrt(u^2 + w^2)
+            case OP_SQRT: {
+                if (!single(c.lhs, OP_ADD)) {
+                    break;
+                }
+                const Node a = nodes[c.lhs];
+                if (a.lhs != a.rhs && single(a.lhs, OP_SQUARE) &&
+                                      single(a.rhs, OP_SQUARE) &&
+                    !is_constant(nodes[a.lhs].lhs) &&
+                    !is_constant(nodes[a.rhs].lhs))
+                {
+                    f = {GPU_OP_HYPOT_LHS_RHS,
+                         nodes[a.lhs].lhs, nodes[a.rhs].lhs, 0.0f};
+                    absorbed[c.lhs] = gen;
+                    absorbed[a.lhs] = gen;
+                    absorbed[a.rhs] = gen;
+                }
+                break;
+            }
+            // u^2 + v, and u * v + w (where one of v or w is constant)
+            case OP_ADD: {
+                const int32_t sides[2][2] = {{c.lhs, c.rhs}, {c.rhs, c.lhs}};
+                for (auto& side : sides) {
+                    const int32_t a = side[0];
+                    const int32_t b = side[1];
+                    if (!single(a, OP_SQUARE) || is_constant(nodes[a].lhs)) {
+                        continue;
+                    }
+                    f = is_constant(b)
+                        ? Fused {GPU_OP_SQUARE_ADD_LHS_IMM,
+                                 nodes[a].lhs, -1, nodes[b].value}
+                        : Fused {GPU_OP_SQUARE_ADD_LHS_RHS,
+                                 nodes[a].lhs, b, 0.0f};
+                    absorbed[a] = gen;
+                    break;
+                }
+                for (auto& side : sides) {
+                    const int32_t a = side[0];
+                    const int32_t b = side[1];
+                    if (f.op != GPU_OP_INVALID || !single(a, OP_MUL)) {
+                        continue;
+                    }
+                    const int32_t u = nodes[a].lhs;
+                    const int32_t v = nodes[a].rhs;
+                    if (!is_constant(u) && !is_constant(v) && is_constant(b)) {
+                        f = {GPU_OP_MUL_ADD_LHS_RHS_IMM, u, v, nodes[b].value};
+                    } else if (is_constant(b)) {
+                        continue;
+                    } else if (!is_constant(u) && is_constant(v)) {
+                        f = {GPU_OP_MUL_ADD_LHS_IMM_RHS, u, b, nodes[v].value};
+                    } else if (is_constant(u) && !is_constant(v)) {
+                        f = {GPU_OP_MUL_ADD_LHS_IMM_RHS, v, b, nodes[u].value};
+                    } else {
+                        continue;
+                    }
+                    absorbed[a] = gen;
+                }
+                break;
+            }
+            // (u - v)^2, which is the same as (v - u)^2
+            case OP_SQUARE: {
+                if (!single(c.lhs, OP_SUB)) {
+                    break;
+                }
+                const int32_t u = nodes[c.lhs].lhs;
+                const int32_t v = nodes[c.lhs].rhs;
+                if (!is_constant(u) && is_constant(v)) {
+                    f = {GPU_OP_SUB_SQUARE_LHS_IMM, u, -1, nodes[v].value};
+                } else if (is_constant(u) && !is_constant(v)) {
+                    f = {GPU_OP_SUB_SQUARE_LHS_IMM, v, -1, nodes[u].value};
+                } else if (!is_constant(u) && !is_constant(v)) {
+                    f = {GPU_OP_SUB_SQUARE_LHS_RHS, u, v, 0.0f};
+                } else {
+                    break;
+                }
+                absorbed[c.lhs] = gen;
+                break;
+            }
+            default: break;
+        }
+    }
+}
 
-    auto getSlot = [&](libfive::Tree::Id id) {
-        // Pick a slot for the output of this opcode
+Tape TapeBuilder::Impl::flatten(int32_t root, bool fuse_clauses) {
+    visited.resize(nodes.size(), 0);
+    bound.resize(nodes.size(), 0);
+    last_used.resize(nodes.size());
+    next_use.resize(nodes.size());
+    slot.resize(nodes.size());
+    uses.resize(nodes.size());
+    absorbed.resize(nodes.size(), 0);
+    const uint32_t gen = ++generation;
+
+    // Schedule clauses with a post-order walk from the root, visiting the
+    // child that needs more slots first: its result is then the only value
+    // held while the other child is evaluated, which keeps live ranges short.
+    // When both children need the same number of slots, a child which
+    // continues a chain of min (or max) clauses is visited second, so that
+    // the chain's clauses (and the choices they record) are grouped together
+    // at the end of its subtree rather than interleaved with other work.
+    std::vector<int32_t> ordered;
+    int32_t axes_used[3] = {-1, -1, -1};
+    {
+        std::vector<std::pair<int32_t, bool>> todo;
+        todo.push_back({root, false});
+        while (todo.size()) {
+            const auto t = todo.back();
+            todo.pop_back();
+            const Node& n = nodes[t.first];
+            if (t.second) {
+                ordered.push_back(t.first);
+                continue;
+            } else if (visited[t.first] == gen) {
+                continue;
+            }
+            visited[t.first] = gen;
+
+            using namespace libfive::Opcode;
+            switch (n.op) {
+                case VAR_X: axes_used[0] = t.first; break;
+                case VAR_Y: axes_used[1] = t.first; break;
+                case VAR_Z: axes_used[2] = t.first; break;
+                default:    break;
+            }
+            if (!n.clause) {
+                continue;
+            }
+            todo.push_back({t.first, true});
+
+            int32_t first = n.lhs;
+            int32_t second = (n.rhs == n.lhs) ? -1 : n.rhs;
+            const bool choice = (n.op == OP_MIN || n.op == OP_MAX);
+            if (first != -1 && second != -1 &&
+                (nodes[second].need > nodes[first].need ||
+                 (nodes[second].need == nodes[first].need && choice &&
+                  nodes[first].op == n.op && nodes[second].op != n.op)))
+            {
+                std::swap(first, second);
+            }
+            // Pushed in reverse, so that `first` is scheduled first
+            for (auto& c : {second, first}) {
+                if (c != -1) {
+                    todo.push_back({c, false});
+                }
+            }
+        }
+    }
+
+    // Merge clauses into compound opcodes, where possible
+    fused.assign(ordered.size(), Fused {GPU_OP_INVALID, -1, -1, 0.0f});
+    if (fuse_clauses) {
+        fuse(ordered, gen);
+    }
+    // Returns the nodes read by the clause at position i in the schedule
+    auto operands = [&](unsigned i) {
+        const Node& n = nodes[ordered[i]];
+        return (fused[i].op != GPU_OP_INVALID)
+            ? std::make_pair(fused[i].lhs, fused[i].rhs)
+            : std::make_pair(n.lhs, n.rhs);
+    };
+
+    // Find the last use of each value in the schedule, so that its slot can
+    // be released as soon as possible.
+    for (unsigned i=0; i < ordered.size(); ++i) {
+        if (absorbed[ordered[i]] == gen) {
+            continue;
+        }
+        const auto args = operands(i);
+        for (auto& h : {args.first, args.second}) {
+            if (h != -1) {
+                last_used[h] = i;
+                next_use[h] = std::numeric_limits<int32_t>::max();
+            }
+        }
+    }
+
+    // Then walk backwards to find, for every clause, the next position at
+    // which each of its operands is read again.  When the slots run out, the
+    // value which is read furthest in the future is spilled.  Afterwards,
+    // next_use holds the first read of each value.
+    std::vector<std::pair<int32_t, int32_t>> reads_after(ordered.size());
+    for (int32_t i=ordered.size() - 1; i >= 0; --i) {
+        if (absorbed[ordered[i]] == gen) {
+            continue;
+        }
+        const auto args = operands(i);
+        reads_after[i].first = (args.first != -1) ? next_use[args.first] : 0;
+        reads_after[i].second = (args.second != -1) ? next_use[args.second]
+                                                    : 0;
+        for (auto& h : {args.first, args.second}) {
+            if (h != -1) {
+                next_use[h] = i;
+            }
+        }
+    }
+
+    // Free slots are kept in a min-heap, so the lowest slot is always reused
+    // first; this keeps the values that are live clustered at the bottom of
+    // the slot array.  Spill array entries are reused the same way.
+    std::priority_queue<uint8_t, std::vector<uint8_t>,
+                        std::greater<uint8_t>> free_slots;
+    int32_t num_slots = 1;
+    std::vector<int32_t> owner(MAX_SLOTS, -1);  // Node in each slot
+
+    std::priority_queue<int32_t, std::vector<int32_t>,
+                        std::greater<int32_t>> free_spills;
+    int32_t num_spills = 0;
+    std::unordered_map<int32_t, int32_t> spilled;   // Node to spill index
+
+    std::vector<uint64_t> flat;
+    flat.reserve(ordered.size() + 2);
+
+    // Picks a slot for the value `id`.  If every slot is in use, the value
+    // which is read furthest in the future (other than `keep`) is spilled,
+    // which writes a GPU_OP_SPILL clause unless it was spilled before; its
+    // spill entry stays valid until its last use, since values never change.
+    auto getSlot = [&](int32_t id, int32_t keep) {
         uint8_t out = 0;
         if (free_slots.size()) {
-            out = free_slots.back();
-            free_slots.pop_back();
+            out = free_slots.top();
+            free_slots.pop();
+        } else if (num_slots < MAX_SLOTS) {
+            out = num_slots++;
         } else {
-            if (num_slots == UINT8_MAX) {
-                fprintf(stderr, "Ran out of slots!\n");
-            } else {
-                out = num_slots++;
+            for (int32_t i=1; i < MAX_SLOTS; ++i) {
+                if (owner[i] != keep && (!out ||
+                    next_use[owner[i]] > next_use[owner[out]]))
+                {
+                    out = i;
+                }
             }
+            const int32_t victim = owner[out];
+            if (!spilled.count(victim)) {
+                int32_t index;
+                if (free_spills.size()) {
+                    index = free_spills.top();
+                    free_spills.pop();
+                } else if (num_spills == MAX_SPILLS) {
+                    throw std::runtime_error(
+                            "Tape needs more than " +
+                            std::to_string(MAX_SLOTS - 1 + MAX_SPILLS) +
+                            " live values");
+                } else {
+                    index = num_spills++;
+                }
+                uint64_t clause = 0;
+                OP(&clause) = GPU_OP_SPILL;
+                I_LHS(&clause) = out;
+                SPILL_INDEX(&clause) = index;
+                flat.push_back(clause);
+                spilled[victim] = index;
+            }
+            bound[victim] = 0;
         }
-        bound_slots[id] = out;
+        owner[out] = id;
+        slot[id] = out;
+        bound[id] = gen;
         return out;
     };
 
+    // Moves a spilled value back into a slot, without spilling `keep`
+    auto reload = [&](int32_t id, int32_t keep) {
+        uint64_t clause = 0;
+        const uint8_t out = getSlot(id, keep);
+        OP(&clause) = GPU_OP_RELOAD;
+        I_OUT(&clause) = out;
+        SPILL_INDEX(&clause) = spilled.at(id);
+        flat.push_back(clause);
+    };
+
     // Bind the axes to known slots, so that we can store their values
     // before beginning an evaluation.
     uint64_t start = 0;
     for (unsigned i=0; i < 3; ++i) {
-        if (axes_used[i] != nullptr) {
-            ((uint8_t*)&start)[i + 1] = getSlot(axes_used[i]);
+        if (axes_used[i] != -1) {
+            ((uint8_t*)&start)[i + 1] = getSlot(axes_used[i], -1);
         }
     }
-    std::vector<uint64_t> flat;
-    flat.reserve(ordered.size());
     flat.push_back(start);
 
-    auto get_reg = [&](const std::shared_ptr<libfive::Tree::Tree_>& tree) {
-        auto itr = bound_slots.find(tree.get());
-        if (itr != bound_slots.end()) {
-            return itr->second;
+    auto get_reg = [&](int32_t id) {
+        if (bound[id] == gen) {
+            return slot[id];
         } else {
-            fprintf(stderr, "Could not find bound slots %i\n", tree->op);
+            fprintf(stderr, "Could not find bound slots %i\n", nodes[id].op);
             return static_cast<uint8_t>(0);
         }
     };
 
-    for (auto& c : ordered_fast) {
+    for (unsigned i=0; i < ordered.size(); ++i) {
+        if (absorbed[ordered[i]] == gen) {
+            continue;
+        }
+        // Reload any operands which were spilled, keeping both in slots
+        const auto args = operands(i);
+        for (auto& h : {args.first, args.second}) {
+            if (h != -1 && nodes[h].op != libfive::Opcode::CONSTANT &&
+                bound[h] != gen)
+            {
+                reload(h, (h == args.first) ? args.second : args.first);
+            }
+        }
+
+        const Node& c = nodes[ordered[i]];
         uint64_t clause = 0;
-        switch (c->op) {
+        const Fused& f = fused[i];
+        if (f.op != GPU_OP_INVALID) {
+            OP(&clause) = f.op;
+            if (f.lhs != -1) {
+                I_LHS(&clause) = get_reg(f.lhs);
+            }
+            if (f.rhs != -1) {
+                I_RHS(&clause) = get_reg(f.rhs);
+            }
+            IMM(&clause) = f.imm;
+        } else switch (c.op) {
             using namespace libfive::Opcode;
 
             case CONSTANT:
@@ -122,7 +993,7 @@ Tape::Tape(const libfive::Tree& tree) {
 #define OP_UNARY(p) \
             case OP_##p: { \
                 OP(&clause) = GPU_OP_##p##_LHS;      \
-                I_LHS(&clause) = get_reg(c->lhs);    \
+                I_LHS(&clause) = get_reg(c.lhs);     \
                 break;                              \
             }
             OP_UNARY(SQUARE)
@@ -136,21 +1007,23 @@ Tape::Tape(const libfive::Tree& tree) {
             OP_UNARY(EXP);
             OP_UNARY(ABS);
             OP_UNARY(LOG);
+            OP_UNARY(TAN);
+            OP_UNARY(RECIP);
 
 #define OP_COMMUTATIVE(p) \
             case OP_##p: { \
-                if (c->lhs->op == CONSTANT) {                   \
+                if (nodes[c.lhs].op == CONSTANT) {              \
                     OP(&clause) = GPU_OP_##p##_LHS_IMM;         \
-                    I_LHS(&clause) = get_reg(c->rhs);           \
-                    IMM(&clause) = c->lhs->value;               \
-                } else if (c->rhs->op == CONSTANT) {            \
+                    I_LHS(&clause) = get_reg(c.rhs);            \
+                    IMM(&clause) = nodes[c.lhs].value;          \
+                } else if (nodes[c.rhs].op == CONSTANT) {       \
                     OP(&clause) = GPU_OP_##p##_LHS_IMM;         \
-                    I_LHS(&clause) = get_reg(c->lhs);           \
-                    IMM(&clause) = c->rhs->value;               \
+                    I_LHS(&clause) = get_reg(c.lhs);            \
+                    IMM(&clause) = nodes[c.rhs].value;          \
                 } else {                                        \
                     OP(&clause) = GPU_OP_##p##_LHS_RHS;         \
-                    I_LHS(&clause) = get_reg(c->lhs);           \
-                    I_RHS(&clause) = get_reg(c->rhs);           \
+                    I_LHS(&clause) = get_reg(c.lhs);            \
+                    I_RHS(&clause) = get_reg(c.rhs);            \
                 }                                               \
                 break;                                          \
             }
@@ -161,71 +1034,344 @@ Tape::Tape(const libfive::Tree& tree) {
 
 #define OP_NONCOMMUTATIVE(p) \
             case OP_##p: { \
-                if (c->lhs->op == CONSTANT) {                   \
+                if (nodes[c.lhs].op == CONSTANT) {              \
                     OP(&clause) = GPU_OP_##p##_IMM_RHS;         \
-                    I_RHS(&clause) = get_reg(c->rhs);           \
-                    IMM(&clause) = c->lhs->value;               \
-                } else if (c->rhs->op == CONSTANT) {            \
+                    I_RHS(&clause) = get_reg(c.rhs);            \
+                    IMM(&clause) = nodes[c.lhs].value;          \
+                } else if (nodes[c.rhs].op == CONSTANT) {       \
                     OP(&clause) = GPU_OP_##p##_LHS_IMM;         \
-                    I_LHS(&clause) = get_reg(c->lhs);           \
-                    IMM(&clause) = c->rhs->value;               \
+                    I_LHS(&clause) = get_reg(c.lhs);            \
+                    IMM(&clause) = nodes[c.rhs].value;          \
                 } else {                                        \
                     OP(&clause) = GPU_OP_##p##_LHS_RHS;         \
-                    I_LHS(&clause) = get_reg(c->lhs);           \
-                    I_RHS(&clause) = get_reg(c->rhs);           \
+                    I_LHS(&clause) = get_reg(c.lhs);            \
+                    I_RHS(&clause) = get_reg(c.rhs);            \
                 }                                               \
                 break;                                          \
             }
             OP_NONCOMMUTATIVE(SUB)
             OP_NONCOMMUTATIVE(DIV)
+            OP_NONCOMMUTATIVE(ATAN2)
+            OP_NONCOMMUTATIVE(POW)
+            OP_NONCOMMUTATIVE(NTH_ROOT)
+            OP_NONCOMMUTATIVE(MOD)
+            OP_NONCOMMUTATIVE(NANFILL)
+            OP_NONCOMMUTATIVE(COMPARE)
 
-            case INVALID:
-            case OP_TAN:
-            case OP_RECIP:
-            case OP_ATAN2:
-            case OP_POW:
-            case OP_NTH_ROOT:
-            case OP_MOD:
-            case OP_NANFILL:
-            case OP_COMPARE:
             case VAR_FREE:
+                OP(&clause) = GPU_OP_PARAM;
+                PARAM_INDEX(&clause) = c.value;
+                break;
+
+            // intern rejects these, and resolves CONST_VAR to its argument
+            case INVALID:
             case CONST_VAR:
             case ORACLE:
             case LAST_OP:
-                fprintf(stderr, "Unimplemented opcode");
-                break;
+                throw std::runtime_error("Unimplemented opcode " +
+                                         libfive::Opcode::toString(c.op));
         }
 
-        // Release slots if this was their last use.  We do this now so
-        // that one of them can be reused for the output slots below.
-        for (auto& h : {c->lhs.get(), c->rhs.get()}) {
-            if (h != nullptr &&
-                h->op != libfive::Opcode::CONSTANT &&
-                last_used[h] == c)
+        // Release slots (and spill entries) if this was their last use.  We
+        // do this now so that one of them can be reused for the output slots
+        // below.  (A clause like x * x uses the same value twice, so it is
+        // only released once.)
+        if (args.first != -1) {
+            next_use[args.first] = reads_after[i].first;
+        }
+        if (args.second != -1) {
+            next_use[args.second] = reads_after[i].second;
+        }
+        for (auto& h : {args.first, args.second}) {
+            if (h != -1 &&
+                nodes[h].op != libfive::Opcode::CONSTANT &&
+                last_used[h] == int32_t(i) &&
+                bound[h] == gen)
             {
-                auto itr = bound_slots.find(h);
-                free_slots.push_back(itr->second);
-                bound_slots.erase(itr);
+                free_slots.push(slot[h]);
+                owner[slot[h]] = -1;
+                bound[h] = 0;
+                auto itr = spilled.find(h);
+                if (itr != spilled.end()) {
+                    free_spills.push(itr->second);
+                    spilled.erase(itr);
+                }
             }
         }
 
-        I_OUT(&clause) = getSlot(c);
+        I_OUT(&clause) = getSlot(ordered[i], -1);
+        flat.push_back(clause);
+    }
+
+    // If the whole tree folded into a constant, then copy it into a slot,
+    // since the end of the tape has to point to one.
+    if (nodes[root].op == libfive::Opcode::CONSTANT) {
+        uint64_t clause = 0;
+        OP(&clause) = GPU_OP_COPY_IMM;
+        IMM(&clause) = nodes[root].value;
+        I_OUT(&clause) = getSlot(root, -1);
         flat.push_back(clause);
     }
 
     {   // Push the end of the tape, which points to the final clauses's
         // output slot so that we know where to read the result.
         uint64_t end = 0;
-        I_OUT(&end) = get_reg(ordered.back().operator->());
+        I_OUT(&end) = get_reg(root);
         flat.push_back(end);
     }
 
-    data.reset(CUDA_MALLOC(uint64_t, flat.size()));
-    CUDA_CHECK(cudaMemcpy(data.get(), flat.data(),
-                          sizeof(uint64_t) * flat.size(),
+    Tape out(flat.data(), flat.size(), num_slots);
+    out.parameters = parameter_names;
+    return out;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+TapeBuilder::TapeBuilder()
+    : impl(new Impl)
+{
+    // Nothing to do here
+}
+
+TapeBuilder::~TapeBuilder() {
+    // Nothing to do here (but Impl is only complete in this file)
+}
+
+Tape TapeBuilder::build(const libfive::Tree& tree) {
+    // Hold a single cache lock to avoid needing mutex locks everywhere
+    auto lock = libfive::Cache::instance();
+
+    if (impl->nodes.size() > max_nodes) {
+        std::unique_ptr<Impl> fresh(new Impl);
+        fresh->parameters.swap(impl->parameters);
+        fresh->parameter_names.swap(impl->parameter_names);
+        fresh->parameter_roots.swap(impl->parameter_roots);
+        impl.swap(fresh);
+    }
+    int32_t root = impl->intern(tree);
+    if (simplify) {
+        root = impl->nodes[root].simple;
+    }
+    if (prune) {
+        root = impl->prune(root, lower, upper);
+    }
+    return impl->flatten(root, fuse);
+}
+
+void TapeBuilder::clear() {
+    impl.reset(new Impl);
+}
+
+size_t TapeBuilder::cachedNodes() const {
+    return impl->nodes.size();
+}
+
+int32_t TapeBuilder::parameter(const libfive::Tree& var,
+                               const std::string& name)
+{
+    impl->roots.push_back(var);
+    const int32_t i = impl->parameter(var.id());
+    impl->parameter_names[i] = name;
+    return i;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+Tape::Tape(const libfive::Tree& tree)
+    : Tape(TapeBuilder().build(tree))
+{
+    // Nothing to do here
+}
+
+/*  FNV-1a hash of a flat clause array */
+static uint64_t hash_clauses(const uint64_t* flat, int32_t length) {
+    uint64_t h = 14695981039346656037ULL;
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(flat);
+    for (size_t i=0; i < sizeof(uint64_t) * length; ++i) {
+        h = (h ^ bytes[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+Tape::Tape(const uint64_t* flat, int32_t length, int32_t num_slots)
+    : clauses(flat, flat + length),
+#ifndef MPR_CPU_ONLY
+      data(CUDA_MALLOC(uint64_t, length)),
+#endif
+      length(length), num_slots(num_slots), hash(hash_clauses(flat, length))
+{
+#ifndef MPR_CPU_ONLY
+    CUDA_CHECK(cudaMemcpy(data.get(), flat, sizeof(uint64_t) * length,
                           cudaMemcpyHostToDevice));
-    length = flat.size();
+#endif
 }
 
-} // namespace mpr
+Tape::Tape(const Tape& other)
+    : clauses(other.clauses),
+#ifndef MPR_CPU_ONLY
+      data(CUDA_MALLOC(uint64_t, other.length)),
+#endif
+      length(other.length), num_slots(other.num_slots), hash(other.hash),
+      parameters(other.parameters)
+{
+#ifndef MPR_CPU_ONLY
+    CUDA_CHECK(cudaMemcpy(data.get(), clauses.data(),
+                          sizeof(uint64_t) * length,
+                          cudaMemcpyHostToDevice));
+#endif
+}
+
+int32_t Tape::parameter(const std::string& name) const {
+    for (unsigned i=0; i < parameters.size(); ++i) {
+        if (parameters[i] == name) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/*  Header for a saved tape, which is followed by `length` clauses, then
+ *  `parameter_count` names (each a uint32_t length and its characters) */
+struct TapeFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t opcode_count;  // GPU_OP_COUNT when the file was saved
+    int32_t length;
+    int32_t num_slots;
+    uint32_t parameter_count;
+};
+
+static const char TAPE_FILE_MAGIC[4] = {'M', 'P', 'R', 'T'};
+static const uint32_t TAPE_FILE_VERSION = 2;
+
+void Tape::save(const std::string& path) const {
+    TapeFileHeader header;
+    memcpy(header.magic, TAPE_FILE_MAGIC, sizeof(header.magic));
+    header.version = TAPE_FILE_VERSION;
+    header.opcode_count = GPU_OP_COUNT;
+    header.length = length;
+    header.num_slots = num_slots;
+    header.parameter_count = parameters.size();
+
+    FILE* f = fopen(path.c_str(), "wb");
+    if (f == nullptr) {
+        throw std::runtime_error("Could not open " + path + " for writing");
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+              fwrite(clauses.data(), sizeof(uint64_t), length, f) ==
+                  size_t(length);
+    for (auto& name : parameters) {
+        const uint32_t n = name.size();
+        ok = ok && fwrite(&n, sizeof(n), 1, f) == 1 &&
+                   fwrite(name.data(), 1, n, f) == n;
+    }
+    if (fclose(f) != 0 || !ok) {
+        throw std::runtime_error("Could not write " + path);
+    }
+}
+
+Tape Tape::load(const std::string& path) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        throw std::runtime_error("Could not open " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(TapeFileHeader)) {
+        close(fd);
+        throw std::runtime_error(path + " is too short to be a tape");
+    }
 
+    // Map the whole file, so that the clauses can be copied (to the host
+    // copy and the GPU) without an intermediate buffer.
+    const size_t size = st.st_size;
+    void* const mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        throw std::runtime_error("Could not map " + path);
+    }
+
+    TapeFileHeader header;
+    memcpy(&header, mapped, sizeof(header));
+    const char* err = nullptr;
+    if (memcmp(header.magic, TAPE_FILE_MAGIC, sizeof(header.magic))) {
+        err = " is not a tape file";
+    } else if (header.version != TAPE_FILE_VERSION ||
+               header.opcode_count != GPU_OP_COUNT)
+    {
+        err = " was saved by an incompatible version";
+    } else if (header.length < 2 || size < sizeof(header) +
+                                           sizeof(uint64_t) * header.length)
+    {
+        err = " is truncated";
+    } else if (header.num_slots < 1 || header.num_slots > MAX_SLOTS) {
+        err = " uses more slots than the evaluators have";
+    } else if (header.parameter_count > MAX_PARAMETERS) {
+        err = " uses more parameters than the evaluators have";
+    }
+
+    // Check every clause before it reaches the evaluators, which trust
+    // opcodes, slots, and parameter indices to be in range.  Built tapes
+    // don't contain jumps (which only appear in pushed subtapes).
+    const uint64_t* const flat = reinterpret_cast<const uint64_t*>(
+            static_cast<const char*>(mapped) + sizeof(header));
+    for (int32_t i=0; !err && i < header.length; ++i) {
+        const uint64_t& c = flat[i];
+        const bool last = (i == header.length - 1);
+        if ((i == 0 || last) ? (OP(&c) != GPU_OP_INVALID)
+                             : (OP(&c) <= GPU_OP_JUMP ||
+                                OP(&c) >= GPU_OP_COUNT))
+        {
+            err = " contains an invalid opcode";
+        } else if (I_OUT(&c) >= header.num_slots ||
+                   I_LHS(&c) >= header.num_slots ||
+                   I_RHS(&c) >= header.num_slots)
+        {
+            err = " refers to a slot past num_slots";
+        } else if (OP(&c) == GPU_OP_PARAM &&
+                   (PARAM_INDEX(&c) < 0 ||
+                    PARAM_INDEX(&c) >= MAX_PARAMETERS))
+        {
+            err = " refers to a parameter past MAX_PARAMETERS";
+        } else if ((OP(&c) == GPU_OP_SPILL || OP(&c) == GPU_OP_RELOAD) &&
+                   (header.num_slots != MAX_SLOTS ||
+                    SPILL_INDEX(&c) < 0 || SPILL_INDEX(&c) >= MAX_SPILLS))
+        {
+            // Only the MAX_SLOTS evaluators have a spill array
+            err = " refers to a spill that the evaluators don't have";
+        }
+    }
+
+    // Read parameter names, which follow the clauses
+    std::vector<std::string> names;
+    const char* ptr = static_cast<const char*>(mapped) + sizeof(header) +
+                      sizeof(uint64_t) * header.length;
+    const char* const end = static_cast<const char*>(mapped) + size;
+    for (uint32_t i=0; !err && i < header.parameter_count; ++i) {
+        uint32_t n;
+        if (size_t(end - ptr) < sizeof(n)) {
+            err = " is truncated";
+            break;
+        }
+        memcpy(&n, ptr, sizeof(n));
+        ptr += sizeof(n);
+        if (size_t(end - ptr) < n) {
+            err = " is truncated";
+            break;
+        }
+        names.push_back(std::string(ptr, n));
+        ptr += n;
+    }
+    if (err) {
+        munmap(mapped, size);
+        throw std::runtime_error(path + err);
+    }
+
+    Tape out(flat, header.length, header.num_slots);
+    out.parameters.swap(names);
+    munmap(mapped, size);
+    return out;
+}
+
+} // namespace mpr